@@ -0,0 +1,365 @@
+#include "apps.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNIFF_MAX (16 << 20)       /* bytes of a binary searched for its type */
+
+static const char *const kAppDirs[] = { "guests", "/zip/apps" };
+
+static void PutLe32(unsigned char *p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void PutLe64(unsigned char *p, uint64_t v) {
+    PutLe32(p, (uint32_t)v);
+    PutLe32(p + 4, (uint32_t)(v >> 32));
+}
+
+const char *AppTypeName(int type) {
+    switch (type) {
+        case APP_GFX: return "gfx";
+        case APP_WEB: return "web";
+        default: return "console";
+    }
+}
+
+/* The Portator call (the xx of 0x70xx) an instruction at p loads, or
+   -1. The wrappers load the number with `mov $0x70xx,%eax` (b8, or
+   48 c7 c0), while TCC and -O0 builds pass it to portator_syscall()
+   with `mov $0x70xx,%edi` (bf, or 48 c7 c7). n bytes follow p. */
+static int CallAt(const unsigned char *p, size_t n) {
+    if (n >= 7 && p[0] == 0x48 && p[1] == 0xc7 &&
+        (p[2] == 0xc0 || p[2] == 0xc7))
+        p += 2;
+    else if (n < 5 || (p[0] != 0xb8 && p[0] != 0xbf))
+        return -1;
+    return p[2] == 0x70 && !p[3] && !p[4] ? p[1] : -1;
+}
+
+/* The type an app declares with PORTATOR_APP(), or else a guess from
+   the Portator calls its binary makes. */
+static int SniffType(const char *path) {
+    static const char kDeclared[] = "portator-app-type=";
+    enum { kAhead = 32 };          /* bytes a match may look at */
+    unsigned char buf[65536 + kAhead];
+    size_t have = 0, total = 0;
+    int gfx = 0, web = 0, declared = -1;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return APP_CONSOLE;
+    for (;;) {
+        ssize_t n = total < SNIFF_MAX
+                        ? read(fd, buf + have, sizeof(buf) - kAhead - have)
+                        : 0;
+        int eof = n <= 0;
+        if (!eof) {
+            have += n;
+            total += n;
+        }
+        /* look at each offset once, with kAhead bytes after it (zeros at
+           the end of the file) */
+        size_t end = eof ? have : have > kAhead ? have - kAhead : 0;
+        if (eof) memset(buf + have, 0, kAhead);
+        for (size_t i = 0; i < end && declared < 0; i++) {
+            if (buf[i] == 'p' &&
+                !memcmp(buf + i, kDeclared, sizeof(kDeclared) - 1)) {
+                const char *t = (const char *)buf + i + sizeof(kDeclared) - 1;
+                if (!strncmp(t, "CONSOLE", 7)) declared = APP_CONSOLE;
+                else if (!strncmp(t, "GFX", 3)) declared = APP_GFX;
+                else if (!strncmp(t, "WEB", 3)) declared = APP_WEB;
+            }
+            switch (CallAt(buf + i, have - i)) {
+                case 0x00: gfx = 1; break;   /* present */
+                case 0x03:                   /* ws_send */
+                case 0x04: web = 1; break;   /* ws_recv */
+                default: break;
+            }
+        }
+        if (eof || declared >= 0) break;
+        memmove(buf, buf + end, have - end);
+        have -= end;
+    }
+    close(fd);
+    if (declared >= 0) return declared;
+    return web ? APP_WEB : gfx ? APP_GFX : APP_CONSOLE;
+}
+
+static int CompareApps(const void *a, const void *b) {
+    return strcmp(((const struct App *)a)->name, ((const struct App *)b)->name);
+}
+
+static int Listed(const struct AppList *list, const char *name) {
+    for (size_t i = 0; i < list->count; i++) {
+        if (!strcmp(list->apps[i].name, name)) return 1;
+    }
+    return 0;
+}
+
+/* The unchanged entry for name in a sorted list, or NULL */
+static const struct App *FindSame(const struct AppList *list,
+                                  const char *name, const struct stat *st) {
+    size_t lo = 0, hi = list ? list->count : 0;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int c = strcmp(name, list->apps[mid].name);
+        if (!c) {
+            const struct App *a = list->apps + mid;
+            return a->size == (uint64_t)st->st_size && a->mtime == st->st_mtime
+                       ? a : NULL;
+        }
+        if (c < 0) hi = mid; else lo = mid + 1;
+    }
+    return NULL;
+}
+
+int AppScan(struct AppList *list) {
+    return AppRescan(list, NULL);
+}
+
+int AppRescan(struct AppList *list, const struct AppList *prev) {
+    const struct App *same;
+    size_t cap = 0;
+    char path[4096];
+    struct stat st;
+    list->apps = NULL;
+    list->count = 0;
+    for (size_t i = 0; i < sizeof(kAppDirs) / sizeof(kAppDirs[0]); i++) {
+        DIR *d = opendir(kAppDirs[i]);
+        struct dirent *ent;
+        if (!d) continue;
+        while ((ent = readdir(d))) {
+            if (ent->d_name[0] == '.') continue;
+            if (strlen(ent->d_name) >= sizeof(list->apps->name)) continue;
+            snprintf(path, sizeof(path), "%s/%s/bin/%s", kAppDirs[i],
+                     ent->d_name, ent->d_name);
+            if (stat(path, &st) || !S_ISREG(st.st_mode)) continue;
+            if (Listed(list, ent->d_name)) continue;
+            if (list->count == cap) {
+                size_t n = cap ? cap * 2 : 16;
+                struct App *tmp =
+                    (struct App *)realloc(list->apps, n * sizeof(*tmp));
+                if (!tmp) {
+                    closedir(d);
+                    AppListFree(list);
+                    return -1;
+                }
+                list->apps = tmp;
+                cap = n;
+            }
+            struct App *a = list->apps + list->count++;
+            snprintf(a->name, sizeof(a->name), "%s", ent->d_name);
+            a->source = kAppDirs[i];
+            same = FindSame(prev, a->name, &st);
+            a->type = same && same->source == a->source ? same->type
+                                                        : SniffType(path);
+            a->size = st.st_size;
+            a->mtime = st.st_mtime;
+        }
+        closedir(d);
+    }
+    if (list->count)
+        qsort(list->apps, list->count, sizeof(*list->apps), CompareApps);
+    return 0;
+}
+
+void AppListFree(struct AppList *list) {
+    free(list->apps);
+    list->apps = NULL;
+    list->count = 0;
+}
+
+uint64_t AppGeneration(void) {
+    struct stat st;
+    uint64_t gen = 0;
+    for (size_t i = 0; i < sizeof(kAppDirs) / sizeof(kAppDirs[0]); i++) {
+        if (stat(kAppDirs[i], &st)) continue;
+        gen = gen * 31 + st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+        gen = gen * 31 + st.st_nlink;
+    }
+    return gen;
+}
+
+static int Matches(const struct App *a, const struct AppQuery *q) {
+    if (!q) return 1;
+    if (q->type >= 0 && a->type != q->type) return 0;
+    if (q->prefix && strncmp(a->name, q->prefix, strlen(q->prefix))) return 0;
+    return 1;
+}
+
+/* Calls fn for each app q selects after offset/limit, and returns how
+   many matched in all */
+static uint32_t Select(const struct AppList *list, const struct AppQuery *q,
+                       void (*fn)(void *, const struct App *), void *arg) {
+    uint32_t total = 0, taken = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        if (!Matches(list->apps + i, q)) continue;
+        if (total++ < (q ? q->offset : 0)) continue;
+        if (q && q->limit && taken == q->limit) continue;
+        taken++;
+        if (fn) fn(arg, list->apps + i);
+    }
+    return total;
+}
+
+struct JsonOut {
+    char *p;
+    size_t len, cap;
+    int oom;
+};
+
+static void AddJsonApp(void *arg, const struct App *a) {
+    struct JsonOut *j = (struct JsonOut *)arg;
+    size_t need = j->len + strlen(a->name) + strlen(a->source) + 128;
+    if (j->oom) return;
+    if (need > j->cap) {
+        char *tmp = (char *)realloc(j->p, need * 2);
+        if (!tmp) { j->oom = 1; return; }
+        j->p = tmp;
+        j->cap = need * 2;
+    }
+    j->len += snprintf(j->p + j->len, j->cap - j->len,
+                       "%s{\"name\":\"%s\",\"type\":\"%s\",\"size\":%llu,"
+                       "\"source\":\"%s\",\"mtime\":%lld}",
+                       j->p[j->len - 1] == '[' ? "" : ",", a->name,
+                       AppTypeName(a->type), (unsigned long long)a->size,
+                       a->source, (long long)a->mtime);
+}
+
+/* Append s, growing the buffer */
+static void AddJson(struct JsonOut *j, const char *s) {
+    size_t n = strlen(s);
+    if (j->oom) return;
+    if (j->len + n + 1 > j->cap) {
+        char *tmp = (char *)realloc(j->p, (j->len + n + 1) * 2);
+        if (!tmp) { j->oom = 1; return; }
+        j->p = tmp;
+        j->cap = (j->len + n + 1) * 2;
+    }
+    memcpy(j->p + j->len, s, n + 1);
+    j->len += n;
+}
+
+char *AppListJson(const struct AppList *list, const struct AppQuery *q) {
+    struct JsonOut j = { (char *)malloc(256), 0, 256, 0 };
+    if (!j.p) return NULL;
+    j.len = snprintf(j.p, j.cap, "{\"apps\":[");
+    Select(list, q, AddJsonApp, &j);
+    if (!j.oom && j.len + 3 > j.cap) {
+        char *tmp = (char *)realloc(j.p, j.len + 3);
+        if (!tmp) j.oom = 1; else j.p = tmp, j.cap = j.len + 3;
+    }
+    if (j.oom) {
+        free(j.p);
+        return NULL;
+    }
+    memcpy(j.p + j.len, "]}", 3);
+    return j.p;
+}
+
+static int SameApp(const struct App *a, const struct App *b) {
+    return a->type == b->type && a->size == b->size &&
+           a->mtime == b->mtime && a->source == b->source;
+}
+
+char *AppListDiffJson(const struct AppList *old, const struct AppList *cur) {
+    struct JsonOut j = { (char *)malloc(256), 0, 256, 0 };
+    size_t i, k;
+    int pass, changes = 0;
+    if (!j.p) return NULL;
+    j.p[0] = 0;
+    /* both lists are sorted by name: walk them together once per array */
+    for (pass = 0; pass < 3; pass++) {
+        AddJson(&j, pass == 0 ? "{\"added\":[" :
+                    pass == 1 ? "],\"changed\":[" : "],\"removed\":[");
+        for (i = k = 0; i < old->count || k < cur->count;) {
+            int c = i == old->count ? 1 : k == cur->count ? -1 :
+                    strcmp(old->apps[i].name, cur->apps[k].name);
+            if (c > 0) {
+                if (pass == 0) AddJsonApp(&j, cur->apps + k), changes++;
+                k++;
+            } else if (c < 0) {
+                if (pass == 2) {
+                    AddJson(&j, j.p[j.len - 1] == '[' ? "\"" : ",\"");
+                    AddJson(&j, old->apps[i].name);
+                    AddJson(&j, "\"");
+                    changes++;
+                }
+                i++;
+            } else {
+                if (pass == 1 && !SameApp(old->apps + i, cur->apps + k))
+                    AddJsonApp(&j, cur->apps + k), changes++;
+                i++, k++;
+            }
+        }
+    }
+    AddJson(&j, "]}");
+    if (j.oom || !changes) {
+        free(j.p);
+        return NULL;
+    }
+    return j.p;
+}
+
+struct BinaryOut {
+    unsigned char *p;
+    uint32_t count;
+    size_t rec;                    /* next record */
+    size_t str;                    /* next string, from string table */
+    size_t strings;                /* string table offset */
+    const char *last_source;
+    uint32_t last_source_off;
+};
+
+static uint32_t AddString(struct BinaryOut *b, const char *s) {
+    uint32_t off = (uint32_t)b->str;
+    size_t n = strlen(s) + 1;
+    memcpy(b->p + b->strings + b->str, s, n);
+    b->str += n;
+    return off;
+}
+
+static void AddBinaryApp(void *arg, const struct App *a) {
+    struct BinaryOut *b = (struct BinaryOut *)arg;
+    unsigned char *r = b->p + b->rec;
+    if (a->source != b->last_source) {
+        b->last_source = a->source;
+        b->last_source_off = AddString(b, a->source);
+    }
+    PutLe32(r, AddString(b, a->name));
+    PutLe32(r + 4, b->last_source_off);
+    PutLe32(r + 8, (uint32_t)a->type);
+    PutLe32(r + 12, 0);
+    PutLe64(r + 16, a->size);
+    PutLe64(r + 24, (uint64_t)a->mtime);
+    b->rec += 32;
+    b->count++;
+}
+
+static void CountApp(void *arg, const struct App *a) {
+    size_t *need = (size_t *)arg;
+    need[0]++;
+    need[1] += strlen(a->name) + 1 + strlen(a->source) + 1;
+}
+
+void *AppListBinary(const struct AppList *list, const struct AppQuery *q,
+                    size_t *len) {
+    struct BinaryOut b = { 0 };
+    size_t need[2] = { 0, 0 };     /* records, string bytes (worst case) */
+    uint32_t total = Select(list, q, CountApp, need);
+    b.strings = 16 + need[0] * 32;
+    if (!(b.p = (unsigned char *)calloc(1, b.strings + need[1] + 1)))
+        return NULL;
+    b.rec = 16;
+    Select(list, q, AddBinaryApp, &b);
+    PutLe32(b.p, APP_LIST_MAGIC);
+    PutLe32(b.p + 4, b.count);
+    PutLe32(b.p + 8, total);
+    PutLe32(b.p + 12, (uint32_t)b.strings);
+    *len = b.strings + b.str;
+    return b.p;
+}
@@ -0,0 +1,71 @@
+#ifndef APPS_H_
+#define APPS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The apps Portator can run: guests/<name>/bin/<name> in the current
+   directory, then /zip/apps/<name>/bin/<name> bundled in the binary.
+   A local app overrides a bundled one of the same name. */
+
+#define APP_CONSOLE 0              /* PORTATOR_APP_* */
+#define APP_GFX     1
+#define APP_WEB     2
+
+#define APP_LIST_MAGIC 0x54534c50  /* "PLST" */
+
+struct App {
+    char name[64];
+    const char *source;            /* directory it was found in */
+    int type;
+    uint64_t size;                 /* of the binary */
+    int64_t mtime;                 /* of the binary, in seconds */
+};
+
+struct AppList {
+    struct App *apps;              /* sorted by name */
+    size_t count;
+};
+
+/* Which apps a listing wants. prefix may be NULL; type -1 means any;
+   limit 0 means no limit. */
+struct AppQuery {
+    const char *prefix;
+    int type;
+    uint32_t offset;
+    uint32_t limit;
+};
+
+/* Scan for apps. Returns 0, or -1 if out of memory. */
+int AppScan(struct AppList *list);
+
+/* Scan again, taking the type of each app whose binary has the same size
+   and mtime as in prev from prev instead of reading the binary. */
+int AppRescan(struct AppList *list, const struct AppList *prev);
+void AppListFree(struct AppList *list);
+
+/* Changes whenever an app directory is added to or removed from one of
+   the scanned places, so a cached AppList is stale when this differs. */
+uint64_t AppGeneration(void);
+
+/* {"apps":[{"name":"snake","type":"console","size":123,
+   "source":"guests","mtime":1700000000},...]} for the apps matching q
+   (NULL for all). Caller must free() the result. */
+char *AppListJson(const struct AppList *list, const struct AppQuery *q);
+
+/* What changed from old to cur, as {"added":[...],"changed":[...],
+   "removed":["name",...]} with apps in the form AppListJson uses. Returns
+   NULL if both list the same apps (or out of memory). Caller must free()
+   the result. */
+char *AppListDiffJson(const struct AppList *old, const struct AppList *cur);
+
+/* The binary form of a listing, laid out as struct PortatorListHeader,
+   then one struct PortatorAppInfo per app, then a string table of
+   NUL-terminated strings the records point into. Stores the size in
+   *len. Caller must free() the result. */
+void *AppListBinary(const struct AppList *list, const struct AppQuery *q,
+                    size_t *len);
+
+const char *AppTypeName(int type);
+
+#endif /* APPS_H_ */
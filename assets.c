@@ -0,0 +1,311 @@
+#include "assets.h"
+#include "civetweb/civetweb.h"
+#include "zipstore.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define MAX_DEPTH 16
+#define FINGERPRINT_MIN 8              /* hex digits that make a hash */
+#define GZIP_HEADER 10
+#define GZIP_TRAILER 8
+
+static struct {
+    struct Asset *assets;              /* sorted by path */
+    size_t count, cap;
+    size_t total;
+    char prefix[256];                  /* "wwwroot" if loaded from the zip */
+} s_assets;
+
+/* Whether the file name carries a content hash, as in app.3f2a9c1b.js
+   or app-3f2a9c1b.css: such a file never changes under its name, so
+   browsers may keep it without asking again */
+static int Fingerprinted(const char *path) {
+    const char *name = strrchr(path, '/'), *p;
+    size_t run = 0;
+    for (p = name ? name + 1 : path; *p; p++) {
+        if (isxdigit((unsigned char)*p)) {
+            run++;
+        } else {
+            if (*p == '.' && run >= FINGERPRINT_MIN &&
+                (p - run == name + 1 || p[-run - 1] == '.' ||
+                 p[-run - 1] == '-'))
+                return 1;
+            run = 0;
+        }
+    }
+    return 0;
+}
+
+static char *ReadAll(const char *path, size_t size) {
+    FILE *f = fopen(path, "rb");
+    char *data;
+    if (!f) return NULL;
+    if ((data = (char *)malloc(size + 1)) && fread(data, 1, size, f) != size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+const char *AssetCacheControl(const char *path) {
+    return Fingerprinted(path) ? "public, max-age=31536000, immutable"
+                               : "no-cache";
+}
+
+/* Build b's headers. Files with a gzip form say Vary on both forms. */
+static int BuildHeads(const struct Asset *a, struct AssetBody *b, int gzip) {
+    const char *cache = AssetCacheControl(a->path);
+    const char *vary = a->gzip.data || gzip ? "Vary: Accept-Encoding\r\n" : "";
+    char buf[512];
+    int n;
+    snprintf(b->etag, sizeof(b->etag), "\"%08x-%zx%s\"", a->crc,
+             a->plain.size, gzip ? "-gz" : "");
+    n = snprintf(buf, sizeof(buf),
+                 "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n%s"
+                 "Content-Length: %zu\r\nETag: %s\r\nCache-Control: %s\r\n%s"
+                 "\r\n",
+                 mg_get_builtin_mime_type(a->path),
+                 gzip ? "Content-Encoding: gzip\r\n" : "", b->size, b->etag,
+                 cache, vary);
+    if (n <= 0 || n >= (int)sizeof(buf) || !(b->head = strdup(buf))) return -1;
+    b->head_len = n;
+    n = snprintf(buf, sizeof(buf),
+                 "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n"
+                 "Cache-Control: %s\r\n%s\r\n",
+                 b->etag, cache, vary);
+    if (!(b->head304 = strdup(buf))) return -1;
+    b->head304_len = n;
+    return 0;
+}
+
+/* Whether bytes more fit in the cache. Files that don't are left out,
+   for CivetWeb (or the zip store) to serve as it would without one. */
+static int Fits(size_t bytes) {
+    return s_assets.total + bytes <= ASSETS_TOTAL_MAX;
+}
+
+/* A new entry for path, taking bytes of the cache, or NULL if out of
+   memory */
+static struct Asset *Append(const char *path, size_t bytes) {
+    struct Asset *a;
+    if (s_assets.count == s_assets.cap) {
+        size_t n = s_assets.cap ? s_assets.cap * 2 : 32;
+        a = (struct Asset *)realloc(s_assets.assets, n * sizeof(*a));
+        if (!a) return NULL;
+        s_assets.assets = a;
+        s_assets.cap = n;
+    }
+    a = s_assets.assets + s_assets.count;
+    memset(a, 0, sizeof(*a));
+    if (!(a->path = strdup(path))) return NULL;
+    s_assets.count++;
+    s_assets.total += bytes;
+    return a;
+}
+
+static int Add(const char *file, const char *path, size_t size) {
+    struct Asset *a;
+    if (size > ASSETS_FILE_MAX || !Fits(size)) return 0;
+    if (!(a = Append(path, size))) return -1;
+    if (!(a->plain.data = ReadAll(file, size))) return -1;
+    a->plain.size = size;
+    a->crc = crc32(crc32(0, Z_NULL, 0), (const Bytef *)a->plain.data, size);
+    return BuildHeads(a, &a->plain, 0);
+}
+
+/* Load dir (the file system path) as URI path prefix */
+static int Walk(const char *dir, const char *prefix, int depth) {
+    char file[4096], path[4096];
+    struct dirent *ent;
+    struct stat st;
+    DIR *d;
+    int rc = 0;
+    if (depth > MAX_DEPTH || !(d = opendir(dir))) return depth ? 0 : -1;
+    while (!rc && (ent = readdir(d))) {
+        if (ent->d_name[0] == '.') continue;
+        if (snprintf(file, sizeof(file), "%s/%s", dir, ent->d_name) >=
+                (int)sizeof(file) ||
+            snprintf(path, sizeof(path), "%s/%s", prefix, ent->d_name) >=
+                (int)sizeof(path) ||
+            stat(file, &st))
+            continue;
+        if (S_ISDIR(st.st_mode))
+            rc = Walk(file, path, depth + 1);
+        else if (S_ISREG(st.st_mode))
+            rc = Add(file, path, st.st_size);
+    }
+    closedir(d);
+    return rc;
+}
+
+static void PutLe32(unsigned char *p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+/* Inflate a raw deflate stream of known output size */
+static char *InflateRaw(const unsigned char *in, size_t n, size_t size) {
+    z_stream z;
+    char *out = (char *)malloc(size + 1);
+    int rc;
+    if (!out) return NULL;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, -MAX_WBITS) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+    z.next_in = (Bytef *)in;
+    z.avail_in = n;
+    z.next_out = (Bytef *)out;
+    z.avail_out = size + 1;
+    rc = inflate(&z, Z_FINISH);
+    inflateEnd(&z);
+    if (rc != Z_STREAM_END || z.total_out != size) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/* Add a zip entry. A deflated one keeps its compressed bytes between a
+   gzip header and trailer as its gzip form, and is inflated once for
+   clients that don't take gzip. */
+static int AddZip(const struct ZipEntry *e, const char *path) {
+    int64_t off = ZipStoreDataOffset(e);
+    int deflated = e->method == ZIP_DEFLATED;
+    size_t raw = deflated ? e->csize : e->size;
+    size_t gz = deflated ? GZIP_HEADER + raw + GZIP_TRAILER : 0;
+    unsigned char *buf;
+    struct Asset *a;
+    if (e->size > ASSETS_FILE_MAX || raw > ASSETS_FILE_MAX ||
+        !Fits(e->size + gz))
+        return 0;
+    if (off < 0 || !(a = Append(path, e->size + gz))) return -1;
+    a->crc = e->crc;
+    if (!(buf = (unsigned char *)malloc((gz ? gz : raw) + 1))) return -1;
+    if (pread(ZipStoreFd(), buf + (gz ? GZIP_HEADER : 0), raw, off) !=
+        (ssize_t)raw) {
+        free(buf);
+        return -1;
+    }
+    if (!deflated) {
+        a->plain.data = (char *)buf;
+        a->plain.size = raw;
+        if (crc32(crc32(0, Z_NULL, 0), buf, raw) != e->crc) return -1;
+        return BuildHeads(a, &a->plain, 0);
+    }
+    /* gzip: magic, deflate, no flags, mtime, no extra flags, unix */
+    buf[0] = 0x1f, buf[1] = 0x8b, buf[2] = 8, buf[3] = 0;
+    PutLe32(buf + 4, e->mtime > 0 ? (uint32_t)e->mtime : 0);
+    buf[8] = 0, buf[9] = 3;
+    PutLe32(buf + GZIP_HEADER + raw, e->crc);
+    PutLe32(buf + GZIP_HEADER + raw + 4, (uint32_t)e->size);
+    a->gzip.data = (char *)buf;
+    a->gzip.size = gz;
+    if (!(a->plain.data = InflateRaw(buf + GZIP_HEADER, raw, e->size)))
+        return -1;
+    a->plain.size = e->size;
+    if (crc32(crc32(0, Z_NULL, 0), (const Bytef *)a->plain.data, e->size) !=
+        e->crc)
+        return -1;
+    /* no point sending a gzip form that isn't smaller */
+    if (gz >= e->size) {
+        free(a->gzip.data);
+        a->gzip.data = NULL;
+        a->gzip.size = 0;
+    }
+    if (a->gzip.data && BuildHeads(a, &a->gzip, 1)) return -1;
+    return BuildHeads(a, &a->plain, 0);
+}
+
+/* Load the zip store's entries under root ("/zip/wwwroot"). Returns the
+   count, 0 if the store has none there, or -1. */
+static int LoadZip(const char *root) {
+    char prefix[4096];
+    const struct ZipEntry *e;
+    size_t count, n;
+    int rc = 0;
+    if (strncmp(root, "/zip/", 5)) return 0;
+    n = snprintf(prefix, sizeof(prefix), "%s/", root + 5);
+    if (n >= sizeof(prefix)) return 0;
+    e = ZipStoreEntries(&count);
+    for (size_t i = 0; !rc && i < count; i++) {
+        size_t len = strlen(e[i].name);
+        if (strncmp(e[i].name, prefix, n) || e[i].name[len - 1] == '/')
+            continue;
+        rc = AddZip(e + i, e[i].name + n - 1);
+    }
+    if (!rc && s_assets.count && n - 1 < sizeof(s_assets.prefix))
+        memcpy(s_assets.prefix, prefix, n - 1);
+    return rc ? -1 : (int)s_assets.count;
+}
+
+static int CompareAssets(const void *a, const void *b) {
+    return strcmp(((const struct Asset *)a)->path,
+                  ((const struct Asset *)b)->path);
+}
+
+int AssetsLoad(const char *root) {
+    int rc;
+    AssetsFree();
+    if (!(rc = LoadZip(root))) rc = Walk(root, "", 0);
+    if (rc < 0) {
+        AssetsFree();
+        return -1;
+    }
+    if (s_assets.count)
+        qsort(s_assets.assets, s_assets.count, sizeof(*s_assets.assets),
+              CompareAssets);
+    return (int)s_assets.count;
+}
+
+const struct Asset *AssetFind(const char *path) {
+    char index[4096];
+    size_t lo = 0, hi = s_assets.count, n = strlen(path);
+    if (n && path[n - 1] == '/') {
+        if (n + 10 >= sizeof(index)) return NULL;
+        memcpy(index, path, n);
+        memcpy(index + n, "index.html", 11);
+        path = index;
+    }
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int c = strcmp(path, s_assets.assets[mid].path);
+        if (!c) return s_assets.assets + mid;
+        if (c < 0) hi = mid; else lo = mid + 1;
+    }
+    return NULL;
+}
+
+const struct ZipEntry *AssetZipEntry(const char *path) {
+    char name[4096];
+    size_t n = strlen(path);
+    if (!s_assets.prefix[0] || *path != '/') return NULL;
+    if (snprintf(name, sizeof(name), "%s%s%s", s_assets.prefix, path,
+                 path[n - 1] == '/' ? "index.html" : "") >= (int)sizeof(name))
+        return NULL;
+    return ZipStoreFind(name);
+}
+
+static void FreeBody(struct AssetBody *b) {
+    free(b->data);
+    free(b->head);
+    free(b->head304);
+}
+
+void AssetsFree(void) {
+    for (size_t i = 0; i < s_assets.count; i++) {
+        free(s_assets.assets[i].path);
+        FreeBody(&s_assets.assets[i].plain);
+        FreeBody(&s_assets.assets[i].gzip);
+    }
+    free(s_assets.assets);
+    memset(&s_assets, 0, sizeof(s_assets));
+}
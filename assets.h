@@ -0,0 +1,59 @@
+#ifndef ASSETS_H_
+#define ASSETS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ZipEntry;
+
+/* The web UI's static files, read once into memory when the server
+   starts so that requests don't go through the zip layer (and inflate
+   the file) every time. The set is fixed after loading: wwwroot lives
+   inside the binary. Each file's response headers are built up front,
+   for its plain form and, where the zip holds it deflated, for a gzip
+   form made from the zip's own compressed bytes. */
+
+#define ASSETS_FILE_MAX (8 << 20)      /* larger files are left to CivetWeb */
+#define ASSETS_TOTAL_MAX (64 << 20)     /* as are files past this in all */
+
+/* One representation of a file, with its headers built ahead */
+struct AssetBody {
+    char *data;                        /* NULL if there's no such form */
+    size_t size;
+    char etag[40];                     /* quotes included */
+    char *head;                        /* 200 status line and headers */
+    size_t head_len;
+    char *head304;                     /* for a matching If-None-Match */
+    size_t head304_len;
+};
+
+struct Asset {
+    char *path;                        /* URI path, e.g. "/index.html" */
+    uint32_t crc;                      /* of the plain contents */
+    struct AssetBody plain;
+    struct AssetBody gzip;             /* Content-Encoding: gzip */
+};
+
+/* Load every file under root. A root under /zip is read from the zip
+   store's index when ZipStoreOpen has been called: there a deflated
+   entry's compressed bytes become its gzip form as they are, framed with
+   a gzip header and a trailer made from the entry's CRC and size, so
+   nothing is ever recompressed. Files over ASSETS_FILE_MAX, or that
+   would take the cache past ASSETS_TOTAL_MAX, are left out. Returns how
+   many files were cached, or -1. */
+int AssetsLoad(const char *root);
+
+/* The asset for a URI path ("/" means "/index.html"), or NULL */
+const struct Asset *AssetFind(const char *path);
+
+/* The zip store entry for a URI path left out of the cache (for size),
+   to be sent from its descriptor, or NULL. Only when the root loaded was
+   under /zip. */
+const struct ZipEntry *AssetZipEntry(const char *path);
+
+/* The Cache-Control value for a URI path */
+const char *AssetCacheControl(const char *path);
+
+void AssetsFree(void);
+
+#endif /* ASSETS_H_ */
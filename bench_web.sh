@@ -0,0 +1,118 @@
+#!/bin/bash
+# Page-load time for a web app with many assets, over HTTP/1.1 and h2c.
+#
+#   ./bench_web.sh [portator] [assets] [rounds] [web options...]
+#
+# Adds a page with N scripts and stylesheets to a copy of the binary under
+# wwwroot/bench, runs "portator web" on it (with any further options, such
+# as --threads 8) and loads the page ROUNDS times
+# each way from fresh connections: HTTP/1.1 over six keep-alive
+# connections, as browsers do, and HTTP/2 over one multiplexed one.
+# Prints the median and best times. Needs zip and node (for its HTTP/2
+# client; curl 7.x can't multiplex h2c).
+
+set -e
+PORTATOR=${1:-publish/portator}
+ASSETS=${2:-100}
+ROUNDS=${3:-20}
+PORT=${PORT:-6799}
+shift 3 2>/dev/null || shift $#
+
+tmp=$(mktemp -d)
+trap 'exec 3>&-; kill $server 2>/dev/null; rm -rf "$tmp"' EXIT
+
+mkdir -p "$tmp/wwwroot/bench"
+{
+    echo '<!doctype html><html><head>'
+    for i in $(seq 1 "$ASSETS"); do
+        if [ $((i % 4)) = 0 ]; then
+            echo "<link rel=stylesheet href=\"a$i.css\">"
+        else
+            echo "<script src=\"a$i.js\"></script>"
+        fi
+    done
+    echo '</head><body></body></html>'
+} > "$tmp/wwwroot/bench/index.html"
+for i in $(seq 1 "$ASSETS"); do
+    ext=js
+    [ $((i % 4)) = 0 ] && ext=css
+    # 1 to 40 KB of text, compressible like real code
+    head -c $(( (i * 7919) % 40000 + 1000 )) /dev/urandom | base64 \
+        > "$tmp/wwwroot/bench/a$i.$ext"
+done
+
+cp "$PORTATOR" "$tmp/portator.zip"
+(cd "$tmp" && zip -qr portator.zip wwwroot && mv portator.zip portator)
+
+# "portator web" runs until its standard input ends: hold it open
+mkfifo "$tmp/stdin"
+"$tmp/portator" web "$PORT" "$@" < "$tmp/stdin" 2>/dev/null &
+server=$!
+exec 3> "$tmp/stdin"
+for _ in $(seq 1 50); do
+    (exec 3<>/dev/tcp/127.0.0.1/"$PORT") 2>/dev/null && break
+    sleep 0.1
+done
+
+node - "$PORT" "$ROUNDS" <<'EOF'
+const http = require('http'), http2 = require('http2'), zlib = require('zlib');
+const [port, rounds] = process.argv.slice(2).map(Number);
+const origin = `http://127.0.0.1:${port}`;
+const assetsOf = html => [...html.matchAll(/(?:src|href)="([^"]+)"/g)]
+                             .map(m => '/bench/' + m[1]);
+// the body as a browser would have it
+const decode = (chunks, encoding) => {
+  const body = Buffer.concat(chunks);
+  return (encoding === 'gzip' ? zlib.gunzipSync(body) : body).toString();
+};
+
+function get1(agent, path) {
+  return new Promise((resolve, reject) => {
+    http.get(origin + path, {agent, headers: {'accept-encoding': 'gzip'}},
+             res => {
+               const chunks = [];
+               res.on('data', d => chunks.push(d));
+               res.on('end', () => resolve(
+                   decode(chunks, res.headers['content-encoding'])));
+             }).on('error', reject);
+  });
+}
+
+function get2(session, path) {
+  return new Promise((resolve, reject) => {
+    const req = session.request({':path': path, 'accept-encoding': 'gzip'});
+    const chunks = [];
+    let encoding;
+    req.on('response', h => encoding = h['content-encoding']);
+    req.on('data', d => chunks.push(d));
+    req.on('end', () => resolve(decode(chunks, encoding)));
+    req.on('error', reject);
+  });
+}
+
+async function load(get, handle) {
+  const t0 = process.hrtime.bigint();
+  const paths = assetsOf(await get(handle, '/bench/'));
+  if (!paths.length) throw new Error('no assets at /bench/');
+  await Promise.all(paths.map(p => get(handle, p)));
+  return Number(process.hrtime.bigint() - t0) / 1e6;
+}
+
+async function main() {
+  const times = {'HTTP/1.1 x6': [], 'HTTP/2 (h2c)': []};
+  for (let i = 0; i < rounds; i++) {
+    const agent = new http.Agent({keepAlive: true, maxSockets: 6});
+    times['HTTP/1.1 x6'].push(await load(get1, agent));
+    agent.destroy();
+    const session = http2.connect(origin);
+    times['HTTP/2 (h2c)'].push(await load(get2, session));
+    session.close();
+  }
+  for (const [name, t] of Object.entries(times)) {
+    t.sort((a, b) => a - b);
+    console.log(`${name.padEnd(14)} median ${t[t.length >> 1].toFixed(1)} ms` +
+                `  best ${t[0].toFixed(1)} ms`);
+  }
+}
+main().catch(e => { console.error(e.message); process.exit(1); });
+EOF
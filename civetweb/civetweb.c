@@ -1939,6 +1939,10 @@ enum {
 #if defined(USE_WEBSOCKET)
 	WEBSOCKET_TIMEOUT,
 	ENABLE_WEBSOCKET_PING_PONG,
+#if defined(USE_ZLIB)
+	WEBSOCKET_DEFLATE_WINDOW_BITS,
+	WEBSOCKET_DEFLATE_MEM_LEVEL,
+#endif
 #endif
 	DECODE_URL,
 	DECODE_QUERY_STRING,
@@ -2083,6 +2087,11 @@ static const struct mg_option config_options[] = {
 #if defined(USE_WEBSOCKET)
     {"websocket_timeout_ms", MG_CONFIG_TYPE_NUMBER, NULL},
     {"enable_websocket_ping_pong", MG_CONFIG_TYPE_BOOLEAN, "no"},
+#if defined(USE_ZLIB)
+    /* permessage-deflate: 0 bits turns it off */
+    {"websocket_deflate_window_bits", MG_CONFIG_TYPE_NUMBER, "15"},
+    {"websocket_deflate_mem_level", MG_CONFIG_TYPE_NUMBER, "8"},
+#endif
 #endif
     {"decode_url", MG_CONFIG_TYPE_BOOLEAN, "yes"},
     {"decode_query_string", MG_CONFIG_TYPE_BOOLEAN, "no"},
@@ -2473,11 +2482,49 @@ enum {
 #if !defined(HTTP2_DYN_TABLE_SIZE)
 #define HTTP2_DYN_TABLE_SIZE (256)
 #endif
+#if !defined(HTTP2_PENDING_WINDOWS)
+#define HTTP2_PENDING_WINDOWS (128)
+#endif
+
+/* HPACK dynamic table, newest entry first. Sizes are counted as in
+ * RFC 7541 section 4.1: name + value + 32 per entry. */
+struct mg_hpack_table {
+	uint32_t count;
+	uint32_t bytes;
+	uint32_t max_bytes;
+	struct mg_header entries[HTTP2_DYN_TABLE_SIZE];
+};
 
 struct mg_http2_connection {
-	uint32_t stream_id;
-	uint32_t dyn_table_size;
-	struct mg_header dyn_table[HTTP2_DYN_TABLE_SIZE];
+	uint32_t stream_id;     /* stream being answered */
+	uint32_t last_stream;   /* highest stream id seen from the client */
+	struct mg_hpack_table dec; /* decoder table for request headers */
+	struct mg_hpack_table enc; /* encoder table for response headers */
+	uint32_t enc_size_update;  /* table size to announce, or UINT32_MAX */
+	uint32_t enc_size_low;     /* smallest size set since the last block */
+
+	/* Send side flow control (RFC 7540 section 6.9) */
+	int64_t conn_window;
+	int64_t stream_window;
+	uint32_t peer_initial_window;
+	int stream_reset; /* the stream being answered takes no more frames */
+	int goaway;       /* 1: the connection ends, 2: GOAWAY was sent */
+	struct {
+		uint32_t id;
+		int64_t delta;
+	} pending_window[HTTP2_PENDING_WINDOWS]; /* for streams not begun */
+
+	/* Frames read while waiting for window, handled afterwards */
+	uint8_t *backlog;
+	size_t backlog_len, backlog_pos, backlog_cap;
+
+	/* Input: the part of conn->buf not yet taken, then the socket */
+	int buf_pos;
+	uint8_t *frame; /* payload of the frame being handled */
+
+	/* Output: frames are collected and sent in one go */
+	uint8_t *out;
+	size_t out_len;
 };
 #endif
 
@@ -2539,17 +2586,22 @@ struct mg_connection {
 #if defined(USE_WEBSOCKET)
 	int in_websocket_handling; /* 1 if in read_websocket */
 #endif
-#if defined(USE_ZLIB) && defined(USE_WEBSOCKET)                                \
-    && defined(MG_EXPERIMENTAL_INTERFACES)
+#if defined(USE_ZLIB) && defined(USE_WEBSOCKET)
 	/* Parameters for websocket data compression according to rfc7692 */
+	int websocket_deflate_negotiated;
 	int websocket_deflate_server_max_windows_bits;
 	int websocket_deflate_client_max_windows_bits;
+	int websocket_deflate_client_bits_offered;
 	int websocket_deflate_server_no_context_takeover;
 	int websocket_deflate_client_no_context_takeover;
-	int websocket_deflate_initialized;
+	int websocket_deflate_mem_level;
+	int websocket_deflate_initialized; /* under the connection lock */
+	int websocket_inflate_initialized; /* reader thread only */
+	int websocket_inflating; /* the message being read is compressed */
 	int websocket_deflate_flush;
 	z_stream websocket_deflate_state;
 	z_stream websocket_inflate_state;
+	struct mg_websocket_deflate_stats websocket_deflate_stats;
 #endif
 	int handled_requests; /* Number of requests handled by this connection
 	                       */
@@ -6591,10 +6643,11 @@ handle_request_stat_log(struct mg_connection *conn)
 
 
 #if defined(USE_HTTP2)
-#if defined(NO_SSL)
-#error "HTTP2 requires ALPN, ALPN requires SSL/TLS"
-#endif
+/* Without TLS there is no ALPN: HTTP/2 is only offered in cleartext
+ * (h2c), by prior knowledge or by an Upgrade of an HTTP/1.1 request. */
+#if !defined(NO_SSL)
 #define USE_ALPN
+#endif
 #include "http2.inl"
 /* Not supported with HTTP/2 */
 #define HTTP1_only                                                             \
@@ -6792,7 +6845,8 @@ mg_write(struct mg_connection *conn, const void *buf, size_t len)
 	conn->request_state = 10;
 #if defined(USE_HTTP2)
 	if (conn->protocol_type == PROTOCOL_TYPE_HTTP2) {
-		http2_data_frame_head(conn, len, 0);
+		/* framed and flow controlled */
+		return http2_write_data(conn, (const char *)buf, len);
 	}
 #endif
 
@@ -6866,6 +6920,13 @@ mg_send_chunk(struct mg_connection *conn,
 	int ret;
 	int t;
 
+#if defined(USE_HTTP2)
+	if (conn->protocol_type == PROTOCOL_TYPE_HTTP2) {
+		/* No chunked encoding in HTTP/2: DATA frames carry the body */
+		return mg_write(conn, chunk, chunk_len);
+	}
+#endif
+
 	/* First store the length information in a text buffer. */
 	sprintf(lenbuf, "%x\r\n", chunk_len);
 	lenbuf_len = strlen(lenbuf);
@@ -10076,6 +10137,9 @@ send_file_data(struct mg_connection *conn,
 #if defined(__linux__)
 		/* sendfile is only available for Linux */
 		if ((conn->ssl == 0) && (conn->throttle == 0)
+#if defined(USE_HTTP2)
+		    && (conn->protocol_type != PROTOCOL_TYPE_HTTP2)
+#endif
 		    && (!mg_strcasecmp(conn->dom_ctx->config[ALLOW_SENDFILE_CALL],
 		                       "yes"))) {
 			off_t sf_offs = (off_t)offset;
@@ -10165,6 +10229,90 @@ send_file_data(struct mg_connection *conn,
 }
 
 
+/* Portator addition: send len bytes of an open descriptor from offset.
+ * Unlike send_file_data, a full socket buffer is waited out with poll
+ * instead of ending sendfile, so a large file never passes through user
+ * space. Plain HTTP/1 connections only; otherwise the data is copied. */
+CIVETWEB_API long long
+mg_send_fd(struct mg_connection *conn, int fd, long long offset, long long len)
+{
+	char buf[MG_BUF_LEN];
+	long long sent = 0;
+	ssize_t n;
+	uint64_t start;
+	double timeout;
+
+	if (!conn || fd < 0 || offset < 0 || len < 0) {
+		return -1;
+	}
+	conn->request_state = 10;
+	timeout = atof(conn->dom_ctx->config[REQUEST_TIMEOUT]
+	                   ? conn->dom_ctx->config[REQUEST_TIMEOUT]
+	                   : config_options[REQUEST_TIMEOUT].default_value)
+	          * 0.001;
+	start = mg_get_current_time_ns();
+
+#if defined(__linux__)
+	if ((conn->ssl == 0) && (conn->throttle == 0)
+#if defined(USE_HTTP2)
+	    && (conn->protocol_type != PROTOCOL_TYPE_HTTP2)
+#endif
+	    && (!mg_strcasecmp(conn->dom_ctx->config[ALLOW_SENDFILE_CALL],
+	                       "yes"))) {
+		while (sent < len) {
+			off_t sf_offs = (off_t)(offset + sent);
+			size_t sf_tosend = (size_t)((len - sent < 0x7FFFF000)
+			                                ? len - sent
+			                                : 0x7FFFF000);
+			n = sendfile(conn->client.sock, fd, &sf_offs, sf_tosend);
+			if (n > 0) {
+				sent += n;
+				conn->num_bytes_sent += n;
+				start = mg_get_current_time_ns();
+			} else if ((n < 0) && ERROR_TRY_AGAIN(ERRNO)) {
+				struct mg_pollfd pfd[1];
+				pfd[0].fd = conn->client.sock;
+				pfd[0].events = POLLOUT;
+				mg_poll(pfd,
+				        1,
+				        SOCKET_TIMEOUT_QUANTUM,
+				        &(conn->phys_ctx->stop_flag));
+				if (!STOP_FLAG_IS_ZERO(&conn->phys_ctx->stop_flag)
+				    || ((timeout > 0)
+				        && ((mg_get_current_time_ns() - start)
+				            > (uint64_t)(timeout * 1.0E9)))) {
+					return -1;
+				}
+			} else if ((n < 0) && (sent == 0) && (ERRNO == EINVAL)) {
+				/* descriptor sendfile can't read from: copy instead */
+				break;
+			} else {
+				return (n == 0) ? sent : -1;
+			}
+		}
+		if (sent == len) {
+			return sent;
+		}
+	}
+#endif
+
+	while (sent < len) {
+		size_t want =
+		    (size_t)((len - sent < (long long)sizeof(buf)) ? len - sent
+		                                                  : sizeof(buf));
+		n = pread(fd, buf, want, (off_t)(offset + sent));
+		if (n <= 0) {
+			return (n == 0) ? sent : -1;
+		}
+		if (mg_write(conn, buf, (size_t)n) != (int)n) {
+			return -1;
+		}
+		sent += n;
+	}
+	return sent;
+}
+
+
 static int
 parse_range_header(const char *header, int64_t *a, int64_t *b)
 {
@@ -13089,7 +13237,7 @@ send_websocket_handshake(struct mg_connection *conn, const char *websock_key)
 	          "Sec-WebSocket-Accept: %s\r\n",
 	          b64_sha);
 
-#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
+#if defined(USE_ZLIB)
 	// Send negotiated compression extension parameters
 	websocket_deflate_response(conn);
 #endif
@@ -13331,84 +13479,31 @@ read_websocket(struct mg_connection *conn,
 				/* Exit the loop if callback signals to exit (server side),
 				 * or "connection close" opcode received (client side). */
 				if (ws_data_handler != NULL) {
-#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
-					if (mop & 0x40) {
-						/* Inflate the data received if bit RSV1 is set. */
-						if (!conn->websocket_deflate_initialized) {
-							if (websocket_deflate_initialize(conn, 1) != Z_OK)
-								exit_by_callback = 1;
-						}
-						if (!exit_by_callback) {
-							size_t inflate_buf_size_old = 0;
-							size_t inflate_buf_size =
-							    data_len
-							    * 4; // Initial guess of the inflated message
-							         // size. We double the memory when needed.
-							Bytef *inflated = NULL;
-							Bytef *new_mem = NULL;
-							conn->websocket_inflate_state.avail_in =
-							    (uInt)(data_len + 4);
-							conn->websocket_inflate_state.next_in = data;
-							// Add trailing 0x00 0x00 0xff 0xff bytes
-							data[data_len] = '\x00';
-							data[data_len + 1] = '\x00';
-							data[data_len + 2] = '\xff';
-							data[data_len + 3] = '\xff';
-							do {
-								if (inflate_buf_size_old == 0) {
-									new_mem =
-									    (Bytef *)mg_calloc(inflate_buf_size,
-									                       sizeof(Bytef));
-								} else {
-									inflate_buf_size *= 2;
-									new_mem =
-									    (Bytef *)mg_realloc(inflated,
-									                        inflate_buf_size);
-								}
-								if (new_mem == NULL) {
-									mg_cry_internal(
-									    conn,
-									    "Out of memory: Cannot allocate "
-									    "inflate buffer of %lu bytes",
-									    (unsigned long)inflate_buf_size);
-									exit_by_callback = 1;
-									break;
-								}
-								inflated = new_mem;
-								conn->websocket_inflate_state.avail_out =
-								    (uInt)(inflate_buf_size
-								           - inflate_buf_size_old);
-								conn->websocket_inflate_state.next_out =
-								    inflated + inflate_buf_size_old;
-								ret = inflate(&conn->websocket_inflate_state,
-								              Z_SYNC_FLUSH);
-								if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR
-								    || ret == Z_MEM_ERROR) {
-									mg_cry_internal(
-									    conn,
-									    "ZLIB inflate error: %i %s",
-									    ret,
-									    (conn->websocket_inflate_state.msg
-									         ? conn->websocket_inflate_state.msg
-									         : "<no error message>"));
-									exit_by_callback = 1;
-									break;
-								}
-								inflate_buf_size_old = inflate_buf_size;
-
-							} while (conn->websocket_inflate_state.avail_out
-							         == 0);
-							inflate_buf_size -=
-							    conn->websocket_inflate_state.avail_out;
-							if (!ws_data_handler(conn,
-							                     mop,
-							                     (char *)inflated,
-							                     inflate_buf_size,
-							                     callback_data)) {
-								exit_by_callback = 1;
-							}
-							mg_free(inflated);
+#if defined(USE_ZLIB)
+					int compressed = websocket_frame_compressed(conn, mop);
+					if (compressed < 0) {
+						mg_cry_internal(conn,
+						                "%s",
+						                "Websocket frame with a stray RSV1 "
+						                "bit; closing connection");
+						exit_by_callback = 1;
+					} else if (compressed) {
+						size_t inflated_len = 0;
+						unsigned char *inflated =
+						    websocket_inflate(conn,
+						                      data,
+						                      (size_t)data_len,
+						                      mop & 0x80,
+						                      &inflated_len);
+						if ((inflated == NULL)
+						    || !ws_data_handler(conn,
+						                        mop & ~0x40,
+						                        (char *)inflated,
+						                        inflated_len,
+						                        callback_data)) {
+							exit_by_callback = 1;
 						}
+						mg_free(inflated);
 					} else
 #endif
 					    if (!ws_data_handler(conn,
@@ -13510,7 +13605,8 @@ mg_websocket_write_exec(struct mg_connection *conn,
                         int opcode,
                         const char *data,
                         size_t dataLen,
-                        uint32_t masking_key)
+                        uint32_t masking_key,
+                        int compress)
 {
 	unsigned char header[14];
 	size_t headerLen;
@@ -13535,37 +13631,28 @@ mg_websocket_write_exec(struct mg_connection *conn,
 	 * it is a websocket or regular connection. */
 	(void)mg_lock_connection(conn);
 
-#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
+#if defined(USE_ZLIB)
 	size_t deflated_size = 0;
-	Bytef *deflated = 0;
-	// Deflate websocket messages over 100kb
-	int use_deflate = dataLen > 100 * 1024 && conn->accept_gzip;
+	unsigned char *deflated = NULL;
+	/* Compress data messages, unless the caller knows they won't shrink
+	 * or they are too short to */
+	int use_deflate = compress && (masking_key == 0)
+	                  && conn->websocket_deflate_negotiated
+	                  && ((((unsigned)opcode & 0xf) == MG_WEBSOCKET_OPCODE_TEXT)
+	                      || (((unsigned)opcode & 0xf)
+	                          == MG_WEBSOCKET_OPCODE_BINARY))
+	                  && (dataLen >= WEBSOCKET_DEFLATE_MIN_SIZE)
+	                  && (dataLen <= 0x7FFF0000u);
 
 	if (use_deflate) {
-		if (!conn->websocket_deflate_initialized) {
-			if (websocket_deflate_initialize(conn, 1) != Z_OK)
-				return 0;
-		}
-
-		// Deflating the message
-		header[0] = 0xC0u | (unsigned char)((unsigned)opcode & 0xf);
-		conn->websocket_deflate_state.avail_in = (uInt)dataLen;
-		conn->websocket_deflate_state.next_in = (unsigned char *)data;
-		deflated_size = (size_t)compressBound((uLong)dataLen);
-		deflated = mg_calloc(deflated_size, sizeof(Bytef));
+		deflated = websocket_deflate(conn, data, dataLen, &deflated_size);
 		if (deflated == NULL) {
-			mg_cry_internal(
-			    conn,
-			    "Out of memory: Cannot allocate deflate buffer of %lu bytes",
-			    (unsigned long)deflated_size);
 			mg_unlock_connection(conn);
 			return -1;
 		}
-		conn->websocket_deflate_state.avail_out = (uInt)deflated_size;
-		conn->websocket_deflate_state.next_out = deflated;
-		deflate(&conn->websocket_deflate_state, conn->websocket_deflate_flush);
-		dataLen = deflated_size - conn->websocket_deflate_state.avail_out
-		          - 4; // Strip trailing 0x00 0x00 0xff 0xff bytes
+		header[0] = 0xC0u | (unsigned char)((unsigned)opcode & 0xf);
+		data = (const char *)deflated;
+		dataLen = deflated_size;
 	} else
 #endif
 		header[0] = 0x80u | (unsigned char)((unsigned)opcode & 0xf);
@@ -13608,16 +13695,13 @@ mg_websocket_write_exec(struct mg_connection *conn,
 		retval = -1;
 	} else {
 		if (dataLen > 0) {
-#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
-			if (use_deflate) {
-				retval = mg_write(conn, deflated, dataLen);
-				mg_free(deflated);
-			} else
-#endif
-				retval = mg_write(conn, data, dataLen);
+			retval = mg_write(conn, data, dataLen);
 		}
 		/* if dataLen == 0, the header length (2) is returned */
 	}
+#if defined(USE_ZLIB)
+	mg_free(deflated);
+#endif
 
 	/* TODO: Remove this unlock as well, when lock is removed. */
 	mg_unlock_connection(conn);
@@ -13632,7 +13716,39 @@ mg_websocket_write(struct mg_connection *conn,
                    const char *data,
                    size_t dataLen)
 {
-	return mg_websocket_write_exec(conn, opcode, data, dataLen, 0);
+	return mg_websocket_write_exec(conn, opcode, data, dataLen, 0, 1);
+}
+
+
+CIVETWEB_API int
+mg_websocket_write_uncompressed(struct mg_connection *conn,
+                                int opcode,
+                                const char *data,
+                                size_t dataLen)
+{
+	return mg_websocket_write_exec(conn, opcode, data, dataLen, 0, 0);
+}
+
+
+CIVETWEB_API int
+mg_websocket_get_deflate_stats(struct mg_connection *conn,
+                               struct mg_websocket_deflate_stats *stats)
+{
+	int ret = 0;
+#if defined(USE_ZLIB)
+	if ((conn != NULL) && (stats != NULL)) {
+		mg_lock_connection(conn);
+		if (conn->websocket_deflate_negotiated) {
+			*stats = conn->websocket_deflate_stats;
+			ret = 1;
+		}
+		mg_unlock_connection(conn);
+	}
+#else
+	(void)conn;
+	(void)stats;
+#endif
+	return ret;
 }
 
 
@@ -13690,7 +13806,7 @@ mg_websocket_client_write(struct mg_connection *conn,
 	mask_data(data, dataLen, masking_key, masked_data);
 
 	retval = mg_websocket_write_exec(
-	    conn, opcode, masked_data, dataLen, masking_key);
+	    conn, opcode, masked_data, dataLen, masking_key, 0);
 	mg_free(masked_data);
 
 	return retval;
@@ -13812,7 +13928,7 @@ handle_websocket_request(struct mg_connection *conn,
 			    acceptedWebSocketSubprotocol;
 		}
 
-#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
+#if defined(USE_ZLIB)
 		websocket_deflate_negotiate(conn);
 #endif
 
@@ -13886,12 +14002,9 @@ handle_websocket_request(struct mg_connection *conn,
 #endif
 	}
 
-#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
+#if defined(USE_ZLIB)
 	/* Step 8: Close the deflate & inflate buffers */
-	if (conn->websocket_deflate_initialized) {
-		deflateEnd(&conn->websocket_deflate_state);
-		inflateEnd(&conn->websocket_inflate_state);
-	}
+	websocket_deflate_free(conn);
 #endif
 
 	/* Step 9: Call the close handler */
@@ -15032,7 +15145,8 @@ handle_request(struct mg_connection *conn)
 
 	/* 7. check if there are request handlers for this uri */
 	if (is_callback_resource) {
-		HTTP1_only;
+		/* Handlers answer through the response header functions and
+		 * mg_write, which frame their output for HTTP/2 */
 		if (!is_websocket_request) {
 			i = callback_handler(conn, callback_data);
 
@@ -18653,6 +18767,16 @@ get_request(struct mg_connection *conn, char *ebuf, size_t ebuf_len, int *err)
 		return 0;
 	}
 
+#if defined(USE_HTTP2)
+	/* HTTP/2 with prior knowledge: the preface begins like a request */
+	if ((conn->request_len == 18) && !memcmp(conn->buf, http2_pri, 18)
+	    && !mg_strcasecmp(conn->dom_ctx->config[ENABLE_HTTP2], "yes")) {
+		conn->protocol_type = PROTOCOL_TYPE_HTTP2;
+		*err = 0;
+		return 0;
+	}
+#endif
+
 	if (parse_http_request(conn->buf, conn->buf_size, &conn->request_info)
 	    <= 0) {
 		mg_snprintf(conn,
@@ -19393,6 +19517,12 @@ process_new_connection(struct mg_connection *conn)
 #endif
 
 		if (!get_request(conn, ebuf, sizeof(ebuf), &reqerr)) {
+#if defined(USE_HTTP2)
+			if (conn->protocol_type == PROTOCOL_TYPE_HTTP2) {
+				process_h2c_connection(conn, 0);
+				break;
+			}
+#endif
 			/* The request sent by the client could not be understood by
 			 * the server, or it was incomplete or a timeout. Send an
 			 * error message and close the connection. */
@@ -19461,11 +19591,17 @@ process_new_connection(struct mg_connection *conn)
 			if (conn->protocol_type == PROTOCOL_TYPE_HTTP2) {
 				/* This will occur, if a HTTP/1.1 request should be upgraded
 				 * to HTTP/2 - but not if HTTP/2 is negotiated using ALPN.
-				 * Since most (all?) major browsers only support HTTP/2 using
-				 * ALPN, this is hard to test and very low priority.
-				 * Deactivate it (at least for now).
+				 * Browsers only use HTTP/2 over TLS; clients like curl
+				 * offer h2c. A request that can't be upgraded (with a
+				 * body, or HTTP/2 not enabled) is answered as HTTP/1.1.
 				 */
-				conn->protocol_type = PROTOCOL_TYPE_HTTP1;
+#if defined(USE_HTTP2)
+				uint8_t settings[64];
+				if (http2_upgrade_settings(conn, settings) < 0)
+#endif
+				{
+					conn->protocol_type = PROTOCOL_TYPE_HTTP1;
+				}
 			}
 		}
 
@@ -19474,6 +19610,14 @@ process_new_connection(struct mg_connection *conn)
 		            (ebuf[0] ? ebuf : "none"));
 
 		if (ebuf[0] == '\0') {
+#if defined(USE_HTTP2)
+			if (conn->request_info.local_uri
+			    && (conn->protocol_type == PROTOCOL_TYPE_HTTP2)) {
+				/* answered as stream 1 of the new connection */
+				process_h2c_connection(conn, 1);
+				break;
+			}
+#endif
 			if (conn->request_info.local_uri) {
 
 				/* handle request to local server */
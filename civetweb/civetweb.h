@@ -836,6 +836,39 @@ CIVETWEB_API int mg_websocket_client_write(struct mg_connection *conn,
                                            size_t data_len);
 
 
+/* Like mg_websocket_write, but never compresses the message, for data
+   that is already compressed such as images (Portator addition). */
+CIVETWEB_API int mg_websocket_write_uncompressed(struct mg_connection *conn,
+                                                 int opcode,
+                                                 const char *data,
+                                                 size_t data_len);
+
+
+/* What permessage-deflate settled on for a websocket connection, and the
+   payload bytes of its compressed messages before and after compression
+   (Portator addition). */
+struct mg_websocket_deflate_stats {
+	int window_bits;        /* the server's LZ77 window, 2^bits bytes */
+	int client_window_bits; /* the window the client compresses with */
+	int mem_level;          /* zlib memLevel of the server's compressor */
+	int context_takeover;   /* 0 if the server starts each message afresh */
+	unsigned long long sent_bytes;
+	unsigned long long sent_compressed;
+	unsigned long long received_bytes;
+	unsigned long long received_compressed;
+};
+
+/* Get a websocket connection's compression settings and counts.
+   Messages are compressed when civetweb is compiled with -DUSE_ZLIB and
+   the client offered permessage-deflate.
+   Return:
+     1   filled in
+     0   the connection is not compressed */
+CIVETWEB_API int
+mg_websocket_get_deflate_stats(struct mg_connection *conn,
+                               struct mg_websocket_deflate_stats *stats);
+
+
 /* Blocks until unique access is obtained to this connection. Intended for use
    with websockets only.
    Invoke this before mg_write or mg_printf when communicating with a
@@ -922,6 +955,20 @@ CIVETWEB_API int mg_send_file_body(struct mg_connection *conn,
                                    const char *path);
 
 
+/* Send len bytes of an open file descriptor, starting at offset, as the
+   response body (Portator addition). Uses sendfile on plain HTTP/1
+   connections, waiting for the socket rather than copying when its
+   buffer is full.
+   Return:
+     number of bytes sent, < len if the file ended early
+     < 0   Error
+*/
+CIVETWEB_API long long mg_send_fd(struct mg_connection *conn,
+                                  int fd,
+                                  long long offset,
+                                  long long len);
+
+
 /* Send HTTP error reply. */
 CIVETWEB_API int mg_send_http_error(struct mg_connection *conn,
                                     int status_code,
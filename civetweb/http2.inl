@@ -1,5 +1,6 @@
-/* Prototype implementation for HTTP2. Do not use in production.
- * There may be memory leaks, security vulnerabilities, ...
+/* HTTP/2 (RFC 7540) with HPACK (RFC 7541), for GET-like requests: a
+ * request with a body is refused with HTTP_1_1_REQUIRED, and streams are
+ * answered one after another on the connection's worker thread.
  */
 
 
@@ -27,7 +28,8 @@ static struct mg_header hpack_predefined[62] = {{NULL, NULL},
                                                 {":status", "404"},
                                                 {":status", "500"},
                                                 {"accept-charset", NULL},
-                                                {"accept-encoding", NULL},
+                                                {"accept-encoding",
+                                                 "gzip, deflate"},
                                                 {"accept-language", NULL},
                                                 {"accept-ranges", NULL},
                                                 {"accept", NULL},
@@ -37,8 +39,8 @@ static struct mg_header hpack_predefined[62] = {{NULL, NULL},
                                                 {"allow", NULL},
                                                 {"authorization", NULL},
                                                 {"cache-control", NULL},
-                                                {"content-encoding", NULL},
                                                 {"content-disposition", NULL},
+                                                {"content-encoding", NULL},
                                                 {"content-language", NULL},
                                                 {"content-length", NULL},
                                                 {"content-location", NULL},
@@ -616,30 +618,46 @@ uint8_t hpack_huff_start_index[] = {0,   10,  36,  68,  0,   74,  79, 82,  84,
                                     145, 174, 186, 190, 205, 224, 0,  253, 0};
 
 
+/* Limits and buffer sizes */
+#define HPACK_STRING_MAX (4096)         /* one name or value, as encoded */
+#define HPACK_TABLE_MAX (4096)          /* SETTINGS_HEADER_TABLE_SIZE */
+#define HTTP2_MAX_FRAME (16384)         /* SETTINGS_MAX_FRAME_SIZE, both ways */
+#define HTTP2_MAX_HEADER_BLOCK (65536)  /* HEADERS and CONTINUATION frames */
+#define HTTP2_OUT_SIZE (32768)          /* output collected before sending */
+#define HTTP2_BACKLOG_MAX (1024 * 1024) /* see http2_set_aside */
+
+
 /* Function to decode an integer from a HPACK encoded block */
 /* Integers have a variable size encoding, according to the RFC.
  * The integer starts at index *i, idx_mask masks the available bits in
  * the first byte. The index *i is advanced until the end of the
- * encoded integer.
+ * encoded integer. Returns UINT64_MAX if the integer does not end
+ * before max_i or does not fit in 32 bits.
  */
 static uint64_t
-hpack_getnum(const uint8_t *buf,
-             int *i,
-             uint8_t idx_mask,
-             struct mg_context *ctx)
+hpack_getnum(const uint8_t *buf, int *i, int max_i, uint8_t idx_mask)
 {
-	uint64_t num = (buf[*i] & idx_mask);
+	uint64_t num;
 
-	(void)ctx;
+	if (*i >= max_i) {
+		return UINT64_MAX;
+	}
+	num = (buf[*i] & idx_mask);
 
 	if (num == idx_mask) {
 		/* Algorithm from https://tools.ietf.org/html/rfc7541#section-5.1 */
 		uint32_t M = 0;
 		do {
 			(*i)++;
-			num = num + ((buf[*i] & 0x7F) << M);
+			if ((*i >= max_i) || (M > 28)) {
+				return UINT64_MAX;
+			}
+			num = num + ((uint64_t)(buf[*i] & 0x7F) << M);
 			M += 7;
 		} while ((buf[*i] & 0x80) == 0x80);
+		if (num > UINT32_MAX) {
+			return UINT64_MAX;
+		}
 	}
 
 	(*i)++;
@@ -651,7 +669,8 @@ hpack_getnum(const uint8_t *buf,
 /* Strings have a variable size and can be either encoded directly (8 bits
  * per char), or using huffman encoding (variable bits per char).
  * The string starts at index *i. This index is advanced until the end of
- * the encoded string.
+ * the encoded string. Returns NULL for a string that is too long, runs
+ * past max_i or holds an invalid code.
  */
 static char *
 hpack_decode(const uint8_t *buf, int *i, int max_i, struct mg_context *ctx)
@@ -659,12 +678,16 @@ hpack_decode(const uint8_t *buf, int *i, int max_i, struct mg_context *ctx)
 	uint64_t byte_len64;
 	int byte_len;
 	int bit_len;
-	uint8_t is_huff = ((buf[*i] & 0x80) == 0x80);
+	uint8_t is_huff;
+
+	if (*i >= max_i) {
+		return NULL;
+	}
+	is_huff = ((buf[*i] & 0x80) == 0x80);
 
 	/* Get length of string in bytes */
-	byte_len64 = hpack_getnum(buf, i, 0x7f, ctx);
-	if (byte_len64 > 1024) {
-		/* TODO */
+	byte_len64 = hpack_getnum(buf, i, max_i, 0x7f);
+	if (byte_len64 > HPACK_STRING_MAX) {
 		return NULL;
 	}
 	byte_len = (int)byte_len64;
@@ -687,12 +710,17 @@ hpack_decode(const uint8_t *buf, int *i, int max_i, struct mg_context *ctx)
 		return result;
 
 	} else {
-		/* Huffman encoded: need to decode bitwise */
+		/* Huffman encoded: need to decode bitwise. The shortest code has
+		 * 5 bits, which bounds the length of the result. */
 		const uint8_t *pData =
 		    buf + (*i);           /* begin pointer of bit input string */
 		int bitRead = 0;          /* number of encoded bits read */
 		uint32_t bytesStored = 0; /* number of decoded bytes stored */
-		uint8_t str[2048];        /* storage buffer for decoded string */
+		char *str = (char *)mg_malloc_ctx(bit_len / 5 + 1, ctx);
+
+		if (!str) {
+			return NULL;
+		}
 
 		for (;;) {
 			uint32_t accu = 0; /* accu register: collect bits */
@@ -702,124 +730,204 @@ hpack_decode(const uint8_t *buf, int *i, int max_i, struct mg_context *ctx)
 			/* Collect bits in this loop, until we have a valid huff code in
 			 * accu */
 			do {
+				if (bitRead == bit_len) {
+					/* We used all bits: what is left is padding, at most
+					 * 7 bits of the EOS code. Return the decoded string. */
+					if ((bc > 7) || (accu != (1u << bc) - 1)) {
+						mg_free(str);
+						return NULL;
+					}
+					str[bytesStored] = 0; /* Terminate string */
+					(*i) += byte_len;     /* Advance parsing index */
+					return str;
+				}
 				accu <<= 1;
 				accu |= (pData[bitRead / 8] >> (7 - (bitRead & 7))) & 1;
 				bitRead++;
 				bc++;
-				if (bitRead > bit_len) {
-					/* We used all bits. Return the decoded string. */
-					str[bytesStored] = 0; /* Terminate string */
-					(*i) += byte_len;     /* Advance parsing index */
-					return mg_strdup_ctx((char *)str,
-					                     ctx); /* Return a string copy */
-				}
 			} while ((bc < 5) || (accu > hpack_huff_end_code[bc - 5]));
 
+			if (bc > 30) {
+				/* EOS (or worse) inside the string */
+				mg_free(str);
+				return NULL;
+			}
+
 			/* Find matching code in huffman encoding table */
 			for (n = hpack_huff_start_index[bc - 5]; n < 256; n++) {
-				if (accu == hpack_huff_dec[n].encoded) {
-					str[bytesStored] = hpack_huff_dec[n].decoded;
+				if ((accu == hpack_huff_dec[n].encoded)
+				    && (bc == hpack_huff_dec[n].bitcount)) {
+					str[bytesStored] = (char)hpack_huff_dec[n].decoded;
 					bytesStored++;
 					break;
 				}
 			}
-			if (bytesStored == sizeof(str)) {
-				/* too long */
-				return 0;
+			if (n == 256) {
+				mg_free(str);
+				return NULL;
 			}
 		}
 	}
 }
 
 
-static void
-append_bits(uint8_t *target,
-            uint32_t offset,
-            uint32_t value,
-            uint8_t value_bits)
+/* Encode an integer with an n bit prefix (RFC 7541 section 5.1) into
+ * out[pos..max). first holds the bits above the prefix. Returns the new
+ * position, or -1 if it doesn't fit. */
+static int
+hpack_put_int(uint8_t *out, int pos, int max, uint8_t first, int n, uint32_t v)
 {
-	uint32_t offset_bytes = offset / 8;
-	uint32_t offset_bits = offset % 8;
-	uint32_t remaining_bits, ac;
-
-	value &= ~(0xFFFFFFFF << value_bits);
+	uint32_t limit = (1u << n) - 1;
 
-	remaining_bits = 8 - offset_bits;
-
-	if (value_bits <= remaining_bits) {
-		ac = value << (remaining_bits - value_bits);
-		target[offset_bytes] |= ac;
-		return;
+	if (pos >= max) {
+		return -1;
 	}
-
-	ac = value >> (value_bits - remaining_bits);
-	target[offset_bytes] |= ac;
-	append_bits(target,
-	            offset + remaining_bits,
-	            value,
-	            value_bits - remaining_bits);
+	if (v < limit) {
+		out[pos++] = first | (uint8_t)v;
+		return pos;
+	}
+	out[pos++] = first | (uint8_t)limit;
+	v -= limit;
+	while (v >= 128) {
+		if (pos >= max) {
+			return -1;
+		}
+		out[pos++] = (uint8_t)((v & 0x7F) | 0x80);
+		v >>= 7;
+	}
+	if (pos >= max) {
+		return -1;
+	}
+	out[pos++] = (uint8_t)v;
+	return pos;
 }
 
 
+/* Encode a string literal, without Huffman coding */
 static int
-hpack_encode(uint8_t *store, const char *load, int lower)
+hpack_put_string(uint8_t *out, int pos, int max, const char *s)
 {
-	uint32_t nohuff_len = strlen(load);
+	size_t len = strlen(s);
 
-	uint32_t len_bits = 0;
-	uint32_t len_bytes;
-	uint32_t spare_bits;
-	uint32_t i;
+	pos = hpack_put_int(out, pos, max, 0, 7, (uint32_t)len);
+	if ((pos < 0) || (len > (size_t)(max - pos))) {
+		return -1;
+	}
+	memcpy(out + pos, s, len);
+	return pos + (int)len;
+}
 
-	memset(store, 0, nohuff_len + 1);
 
-	for (i = 0; i < nohuff_len; i++) {
-		uint8_t b = (uint8_t)((char)(lower ? tolower(load[i]) : load[i]));
-		int idx;
+static uint32_t
+hpack_entry_size(const struct mg_header *e)
+{
+	return (uint32_t)(strlen(e->name) + strlen(e->value) + 32);
+}
+
 
-		for (idx = 0; idx <= 255; idx++) {
-			if (hpack_huff_dec[idx].decoded == b) {
-				append_bits((uint8_t *)store + 1,
-				            len_bits,
-				            hpack_huff_dec[idx].encoded,
-				            hpack_huff_dec[idx].bitcount);
-				len_bits += hpack_huff_dec[idx].bitcount;
-				break;
-			}
-		}
+/* Drop the oldest entries until the table holds at most max_bytes */
+static void
+hpack_table_evict(struct mg_hpack_table *t, uint32_t max_bytes)
+{
+	while ((t->count > 0) && (t->bytes > max_bytes)) {
+		struct mg_header *e = &t->entries[--t->count];
+		t->bytes -= hpack_entry_size(e);
+		mg_free((void *)e->name);
+		mg_free((void *)e->value);
+		e->name = e->value = NULL;
 	}
+}
+
 
-	len_bytes = (len_bits + 7) / 8;
-	spare_bits = len_bytes * 8 - len_bits;
-	if (spare_bits) {
-		append_bits((uint8_t *)store + 1, len_bits, 0xFFFFFFFF, spare_bits);
+/* Insert a new entry, taking over name and value (RFC 7541 section 4.4).
+ * An entry larger than the whole table just empties it. */
+static void
+hpack_table_add(struct mg_hpack_table *t, char *name, char *value)
+{
+	struct mg_header e;
+	uint32_t size;
+
+	e.name = name;
+	e.value = value;
+	size = hpack_entry_size(&e);
+	if (size > t->max_bytes) {
+		hpack_table_evict(t, 0);
+		mg_free(name);
+		mg_free(value);
+		return;
+	}
+	hpack_table_evict(t, t->max_bytes - size);
+	if (t->count == HTTP2_DYN_TABLE_SIZE) {
+		/* not reached with 32 bytes per entry and at most 4096 bytes */
+		hpack_table_evict(t, t->bytes - 1);
 	}
+	memmove(&t->entries[1], &t->entries[0], t->count * sizeof(e));
+	t->entries[0] = e;
+	t->count++;
+	t->bytes += size;
+}
 
-	if (len_bytes >= 127) {
-		// TODO: Shift string and encode len in more bytes
-		return 0;
+
+/* Look up an index in the static table, then the dynamic one. A static
+ * entry without a value has the empty value. */
+static int
+hpack_lookup(const struct mg_hpack_table *t,
+             uint64_t idx,
+             const char **name,
+             const char **value)
+{
+	if ((idx >= 1) && (idx <= 61)) {
+		*name = hpack_predefined[idx].name;
+		*value = hpack_predefined[idx].value ? hpack_predefined[idx].value : "";
+		return 1;
+	}
+	if ((idx >= 62) && (idx - 62 < t->count)) {
+		*name = t->entries[idx - 62].name;
+		*value = t->entries[idx - 62].value;
+		return 1;
 	}
-	*store = 0x80 + (uint8_t)len_bytes;
+	return 0;
+}
 
-	if ((len_bytes >= nohuff_len) && (0)) {
-		*store = (uint8_t)nohuff_len;
-		if (lower) {
-			for (i = 1; i <= nohuff_len; i++) {
-				store[i] = tolower(load[i]);
-			}
-		} else {
-			memcpy(store + 1, load, nohuff_len);
+
+/* Find a header field for the encoder: the index of an entry with the
+ * same name and value (*exact is set), else of one with the same name,
+ * else 0. */
+static uint32_t
+hpack_find(const struct mg_hpack_table *t,
+           const char *name,
+           const char *value,
+           int *exact)
+{
+	uint32_t i, by_name = 0;
+
+	*exact = 0;
+	for (i = 1; i <= 61; i++) {
+		if (strcmp(hpack_predefined[i].name, name)) {
+			continue;
+		}
+		if (hpack_predefined[i].value
+		    && !strcmp(hpack_predefined[i].value, value)) {
+			*exact = 1;
+			return i;
+		}
+		if (!by_name) {
+			by_name = i;
 		}
-		return nohuff_len + 1;
-	} else {
-		/*
-		int i = 0;
-		char *test = hpack_decode(store, &i, NULL);
-		i = i; // breakpoint for debugging / testing
-		*/
 	}
-
-	return len_bytes + 1;
+	for (i = 0; i < t->count; i++) {
+		if (strcmp(t->entries[i].name, name)) {
+			continue;
+		}
+		if (!strcmp(t->entries[i].value, value)) {
+			*exact = 1;
+			return 62 + i;
+		}
+		if (!by_name) {
+			by_name = 62 + i;
+		}
+	}
+	return by_name;
 }
 
 
@@ -832,29 +940,6 @@ static const char http2_pri[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
 static const unsigned char http2_pri_len = 24; /* = strlen(http2_pri) */
 
 
-/* Read and check the HTTP/2 primer/preface:
- * See https://tools.ietf.org/html/rfc7540#section-3.5 */
-static int
-is_valid_http2_primer(struct mg_connection *conn)
-{
-	size_t pri_len = http2_pri_len;
-	char buf[32]; /* Buffer must hold 24 bytes primer */
-
-	int read_pri_len = mg_read(conn, buf, pri_len);
-	if (read_pri_len != (int)pri_len) {
-		/* Size does not match.
-		 * This includes cases where mg_read returns error codes */
-		return 0;
-	}
-	if (0 != memcmp(buf, http2_pri, pri_len)) {
-		/* Primer does not match */
-		return 0;
-	}
-	/* Primer does match */
-	return 1;
-}
-
-
 #define mg_xwrite(conn, data, len)                                             \
 	push_all((conn)->phys_ctx,                                                 \
 	         NULL,                                                             \
@@ -864,16 +949,6 @@ is_valid_http2_primer(struct mg_connection *conn)
 	         (int)(len))
 
 
-static void
-http2_settings_acknowledge(struct mg_connection *conn)
-{
-	unsigned char http2_set_ackn_frame[9] = {0, 0, 0, 4, 1, 0, 0, 0, 0};
-
-	DEBUG_TRACE("%s", "Sending settings frame");
-	mg_xwrite(conn, http2_set_ackn_frame, 9);
-}
-
-
 struct http2_settings {
 	uint32_t settings_header_table_size;
 	uint32_t settings_enable_push;
@@ -884,11 +959,8 @@ struct http2_settings {
 };
 
 
-const struct http2_settings http2_default_settings =
-    {4096, 1, UINT32_MAX, 65535, 16384, UINT32_MAX};
-
-const struct http2_settings http2_civetweb_server_settings =
-    {4096, 0, 100, 65535, 16384, 65535};
+static const struct http2_settings http2_civetweb_server_settings =
+    {HPACK_TABLE_MAX, 0, 100, 65535, HTTP2_MAX_FRAME, HTTP2_MAX_HEADER_BLOCK};
 
 
 enum {
@@ -909,212 +981,220 @@ enum {
 };
 
 
-static void
-http2_send_settings(struct mg_connection *conn,
-                    const struct http2_settings *set)
+enum {
+	HTTP2_FRAME_DATA = 0,
+	HTTP2_FRAME_HEADERS,
+	HTTP2_FRAME_PRIORITY,
+	HTTP2_FRAME_RST_STREAM,
+	HTTP2_FRAME_SETTINGS,
+	HTTP2_FRAME_PUSH_PROMISE,
+	HTTP2_FRAME_PING,
+	HTTP2_FRAME_GOAWAY,
+	HTTP2_FRAME_WINDOW_UPDATE,
+	HTTP2_FRAME_CONTINUATION
+};
+
+#define HTTP2_FLAG_END_STREAM (0x1) /* ACK for SETTINGS and PING */
+#define HTTP2_FLAG_END_HEADERS (0x4)
+#define HTTP2_FLAG_PADDED (0x8)
+#define HTTP2_FLAG_PRIORITY (0x20)
+
+
+static uint32_t
+http2_get32(const uint8_t *p)
 {
-	uint16_t id;
-	uint32_t data;
-	uint8_t http2_settings_frame[9] = {0, 0, 36, 4, 0, 0, 0, 0, 0};
-	mg_xwrite(conn, http2_settings_frame, 9);
-
-	id = htons(1);
-	data = htonl(set->settings_header_table_size);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
-
-	id = htons(1);
-	data = htonl(set->settings_enable_push);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
-
-	id = htons(1);
-	data = htonl(set->settings_max_concurrent_streams);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
-
-	id = htons(1);
-	data = htonl(set->settings_initial_window_size);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
-
-	id = htons(1);
-	data = htonl(set->settings_max_frame_size);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
-
-	id = htons(1);
-	data = htonl(set->settings_max_header_list_size);
-	mg_xwrite(conn, &id, 2);
-	mg_xwrite(conn, &data, 4);
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+	       | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
 
-	DEBUG_TRACE("%s", "HTTP2 settings sent");
+
+static void
+http2_put32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t)(v >> 24);
+	p[1] = (uint8_t)(v >> 16);
+	p[2] = (uint8_t)(v >> 8);
+	p[3] = (uint8_t)v;
 }
 
 
+/* Input: first what conn->buf holds beyond the part read as HTTP/1,
+ * then the socket. Returns the number of bytes read. */
 static int
-http2_send_response_headers(struct mg_connection *conn)
+http2_read(struct mg_connection *conn, void *buf, int len)
 {
-	unsigned char http2_header_frame[9] = {0, 0, 0, 1, 4, 0, 0, 0, 0};
-	uint8_t header_bin[1024];
-	uint16_t header_len = 0;
-	int has_date = 0;
-	int has_connection_header = 0;
-	int i, ok;
+	int have = conn->data_len - conn->http2.buf_pos;
+	int n = 0;
 
-	if ((conn->status_code < 100) || (conn->status_code > 999)) {
-		/* Invalid status: Set status to "Internal Server Error" */
-		conn->status_code = 500;
+	if (have > 0) {
+		n = (have < len) ? have : len;
+		memcpy(buf, conn->buf + conn->http2.buf_pos, n);
+		conn->http2.buf_pos += n;
+	}
+	if (n < len) {
+		int r = pull_all(NULL, conn, (char *)buf + n, len - n);
+		if (r > 0) {
+			n += r;
+		}
 	}
+	return n;
+}
+
+
+/* Read one frame from the connection. Returns the payload length, -1
+ * if the connection failed or -2 if the frame is too large. */
+static int
+http2_read_frame(struct mg_connection *conn, uint8_t *head, uint8_t *payload)
+{
+	uint32_t len;
 
-	switch (conn->status_code) {
-	case 200:
-		header_bin[header_len++] = 0x88;
-		break;
-	case 204:
-		header_bin[header_len++] = 0x89;
-		break;
-	case 206:
-		header_bin[header_len++] = 0x8A;
-		break;
-	case 304:
-		header_bin[header_len++] = 0x8B;
-		break;
-	case 400:
-		header_bin[header_len++] = 0x8C;
-		break;
-	case 404:
-		header_bin[header_len++] = 0x8D;
-		break;
-	case 500:
-		header_bin[header_len++] = 0x8E;
-		break;
-	default:
-		header_bin[header_len++] = 0x48;
-		header_bin[header_len++] = 0x03;
-		header_bin[header_len++] = 0x30 + (conn->status_code / 100);
-		header_bin[header_len++] = 0x30 + ((conn->status_code / 10) % 10);
-		header_bin[header_len++] = 0x30 + (conn->status_code % 10);
-		break;
+	if (http2_read(conn, head, 9) != 9) {
+		return -1;
+	}
+	len = ((uint32_t)head[0] << 16) | ((uint32_t)head[1] << 8) | head[2];
+	if (len > HTTP2_MAX_FRAME) {
+		return -2;
 	}
+	if ((len > 0) && (http2_read(conn, payload, (int)len) != (int)len)) {
+		return -1;
+	}
+	return (int)len;
+}
 
-	/* Add all headers */
-	for (i = 0; i < conn->response_info.num_headers; i++) {
-		uint16_t predef = 0;
-		uint16_t j;
 
-		/* Filter headers not valid in HTTP/2 */
-		if (!mg_strcasecmp("Connection",
-		                   conn->response_info.http_headers[i].name)) {
-			has_connection_header = 1;
-			continue; /* do not send */
-		}
+/* The next frame to handle: one set aside while waiting for window, or
+ * a new one from the connection */
+static int
+http2_next_frame(struct mg_connection *conn, uint8_t *head, uint8_t *payload)
+{
+	struct mg_http2_connection *h2 = &conn->http2;
+	uint32_t len;
 
-		/* Check if this header is known in HPACK (static table index 15 to 61)
-		 * see https://tools.ietf.org/html/rfc7541#appendix-A */
-		for (j = 15; j <= 61; j++) {
-			if (!mg_strcasecmp(hpack_predefined[j].name,
-			                   conn->response_info.http_headers[i].name)) {
-				predef = j;
-				break;
-			}
-		}
+	if (h2->backlog_pos >= h2->backlog_len) {
+		return http2_read_frame(conn, head, payload);
+	}
+	memcpy(head, h2->backlog + h2->backlog_pos, 9);
+	len = ((uint32_t)head[0] << 16) | ((uint32_t)head[1] << 8) | head[2];
+	memcpy(payload, h2->backlog + h2->backlog_pos + 9, len);
+	h2->backlog_pos += 9 + len;
+	if (h2->backlog_pos == h2->backlog_len) {
+		h2->backlog_pos = h2->backlog_len = 0;
+	}
+	return (int)len;
+}
 
-		if (predef) {
-			/* Predefined header found */
-			header_bin[header_len++] = 0x40 + predef;
-		} else {
-			/* Rare header, do not index */
-			header_bin[header_len++] = 0x10;
-			j = hpack_encode(header_bin + header_len,
-			                 conn->response_info.http_headers[i].name,
-			                 1);
-			header_len += j;
-		}
 
-		j = hpack_encode(header_bin + header_len,
-		                 conn->response_info.http_headers[i].value,
-		                 0);
-		header_len += j;
+/* Keep a frame that arrived while a response waited for window. Returns
+ * 0, or an error code if the client sends too much meanwhile. */
+static int
+http2_set_aside(struct mg_connection *conn,
+                const uint8_t *head,
+                const uint8_t *payload,
+                uint32_t len)
+{
+	struct mg_http2_connection *h2 = &conn->http2;
+	size_t need = h2->backlog_len + 9 + len;
 
-		/* Mark required headers as sent */
-		if (!mg_strcasecmp("Date", conn->response_info.http_headers[i].name)) {
-			has_date = 1;
+	if (need > HTTP2_BACKLOG_MAX) {
+		return HTTP2_ERR_ENHANCE_YOUR_CALM;
+	}
+	if (need > h2->backlog_cap) {
+		size_t cap = h2->backlog_cap ? h2->backlog_cap : 16384;
+		uint8_t *p;
+		while (cap < need) {
+			cap *= 2;
 		}
+		p = (uint8_t *)mg_realloc_ctx(h2->backlog, cap, conn->phys_ctx);
+		if (!p) {
+			return HTTP2_ERR_INTERNAL_ERROR;
+		}
+		h2->backlog = p;
+		h2->backlog_cap = cap;
 	}
+	memcpy(h2->backlog + h2->backlog_len, head, 9);
+	memcpy(h2->backlog + h2->backlog_len + 9, payload, len);
+	h2->backlog_len = need;
+	return 0;
+}
 
-	/* Add required headers, if they have not been sent yet */
-	if (!has_date) {
-		/* Create header frame */
-		char date[64];
-		uint8_t date_len;
-		time_t curtime = time(NULL);
 
-		gmt_time_string(date, sizeof(date), &curtime);
-		date_len = (uint8_t)strlen(date);
+/* Output: frames are collected in conn->http2.out and sent when it is
+ * full, or when the connection is about to wait for the client. */
+static int
+http2_flush(struct mg_connection *conn)
+{
+	int ok = 1;
 
-		header_bin[header_len++] =
-		    0x61; /* "Date" predefined HPACK index 33 (0x21) + 0x40 */
-		header_bin[header_len++] = date_len;
-		memcpy(header_bin + header_len, date, date_len);
-		header_len += date_len;
+	if (conn->http2.out_len > 0) {
+		ok = (mg_xwrite(conn, conn->http2.out, conn->http2.out_len)
+		      == (int)conn->http2.out_len);
+		conn->http2.out_len = 0;
 	}
+	return ok;
+}
 
-	http2_header_frame[1] = (header_len & 0xFF00) >> 8;
-	http2_header_frame[2] = (header_len & 0xFF);
 
-	http2_header_frame[5] = (conn->http2.stream_id & 0xFF000000u) >> 24;
-	http2_header_frame[6] = (conn->http2.stream_id & 0xFF0000u) >> 16;
-	http2_header_frame[7] = (conn->http2.stream_id & 0xFF00u) >> 8;
-	http2_header_frame[8] = (conn->http2.stream_id & 0xFFu);
+static int
+http2_send(struct mg_connection *conn, const void *data, size_t len)
+{
+	struct mg_http2_connection *h2 = &conn->http2;
 
-	/* Send header frame */
-	ok = 1;
-	if (mg_xwrite(conn, http2_header_frame, 9) != 9) {
-		ok = 0;
-	} else if (mg_xwrite(conn, header_bin, header_len) != header_len) {
-		ok = 0;
+	if ((h2->out_len + len > HTTP2_OUT_SIZE) && !http2_flush(conn)) {
+		return 0;
 	}
-	if (ok) {
-		DEBUG_TRACE("HTTP2 response header sent: stream %u",
-		            conn->http2.stream_id);
-	} else {
-		DEBUG_TRACE("HTTP2 response header sending error: stream %u",
-		            conn->http2.stream_id);
+	if (len > HTTP2_OUT_SIZE) {
+		return mg_xwrite(conn, data, len) == (int)len;
 	}
+	memcpy(h2->out + h2->out_len, data, len);
+	h2->out_len += len;
+	return 1;
+}
 
-	(void)has_connection_header; /* ignore for the moment */
 
-	return ok;
+static int
+http2_send_frame(struct mg_connection *conn,
+                 uint8_t type,
+                 uint8_t flags,
+                 uint32_t stream_id,
+                 const void *payload,
+                 uint32_t len)
+{
+	uint8_t head[9];
+
+	head[0] = (uint8_t)(len >> 16);
+	head[1] = (uint8_t)(len >> 8);
+	head[2] = (uint8_t)len;
+	head[3] = type;
+	head[4] = flags;
+	http2_put32(head + 5, stream_id);
+	return http2_send(conn, head, 9)
+	       && ((len == 0) || http2_send(conn, payload, len));
 }
 
 
 static void
-http2_data_frame_head(struct mg_connection *conn,
-                      uint32_t frame_size,
-                      int is_final)
+http2_send_settings(struct mg_connection *conn,
+                    const struct http2_settings *set)
 {
-	unsigned char http2_data_frame[9];
-	uint32_t stream_id = conn->http2.stream_id;
-
-	http2_data_frame[0] = (frame_size & 0xFF0000) >> 16;
-	http2_data_frame[1] = (frame_size & 0xFF00) >> 8;
-	http2_data_frame[2] = (frame_size & 0xFF);
-
-	http2_data_frame[3] = 0; /* frame type "DATA" */
-	http2_data_frame[4] = (is_final ? 1 : 0);
-
-	http2_data_frame[5] = (stream_id & 0xFF000000u) >> 24;
-	http2_data_frame[6] = (stream_id & 0xFF0000u) >> 16;
-	http2_data_frame[7] = (stream_id & 0xFF00u) >> 8;
-	http2_data_frame[8] = (stream_id & 0xFFu);
+	uint8_t payload[36];
+	uint32_t values[6];
+	int i;
 
-	DEBUG_TRACE("HTTP2 begin data frame: stream %u, frame_size %u (final: %i)",
-	            stream_id,
-	            frame_size,
-	            is_final);
+	values[0] = set->settings_header_table_size;
+	values[1] = set->settings_enable_push;
+	values[2] = set->settings_max_concurrent_streams;
+	values[3] = set->settings_initial_window_size;
+	values[4] = set->settings_max_frame_size;
+	values[5] = set->settings_max_header_list_size;
+	for (i = 0; i < 6; i++) {
+		/* identifiers 1 to 6, RFC 7540 section 6.5.2 */
+		payload[i * 6] = 0;
+		payload[i * 6 + 1] = (uint8_t)(i + 1);
+		http2_put32(payload + i * 6 + 2, values[i]);
+	}
+	http2_send_frame(conn, HTTP2_FRAME_SETTINGS, 0, 0, payload, 36);
 
-	mg_xwrite(conn, http2_data_frame, 9);
+	DEBUG_TRACE("%s", "HTTP2 settings sent");
 }
 
 
@@ -1123,19 +1203,14 @@ http2_send_window(struct mg_connection *conn,
                   uint32_t stream_id,
                   uint32_t window_size)
 {
-	unsigned char http2_window_frame[9] = {0, 0, 4, 8, 0, 0, 0, 0, 0};
-	uint32_t data = htonl(window_size);
+	uint8_t payload[4];
 
-	DEBUG_TRACE("HTTP2 send window_size: stream %u, error %u",
+	DEBUG_TRACE("HTTP2 send window_size: stream %u, increment %u",
 	            stream_id,
 	            window_size);
 
-	http2_window_frame[5] = (stream_id & 0xFF000000u) >> 24;
-	http2_window_frame[6] = (stream_id & 0xFF0000u) >> 16;
-	http2_window_frame[7] = (stream_id & 0xFF00u) >> 8;
-	http2_window_frame[8] = (stream_id & 0xFFu);
-	mg_xwrite(conn, http2_window_frame, 9);
-	mg_xwrite(conn, &data, 4);
+	http2_put32(payload, window_size);
+	http2_send_frame(conn, HTTP2_FRAME_WINDOW_UPDATE, 0, stream_id, payload, 4);
 }
 
 
@@ -1144,742 +1219,1138 @@ http2_reset_stream(struct mg_connection *conn,
                    uint32_t stream_id,
                    uint32_t error_id)
 {
-	unsigned char http2_reset_frame[9] = {0, 0, 4, 3, 0, 0, 0, 0, 0};
-	uint32_t val = htonl(error_id);
+	uint8_t payload[4];
 
 	DEBUG_TRACE("HTTP2 send reset: stream %u, error %u", stream_id, error_id);
 
-	http2_reset_frame[5] = (stream_id & 0xFF000000u) >> 24;
-	http2_reset_frame[6] = (stream_id & 0xFF0000u) >> 16;
-	http2_reset_frame[7] = (stream_id & 0xFF00u) >> 8;
-	http2_reset_frame[8] = (stream_id & 0xFFu);
-	mg_xwrite(conn, http2_reset_frame, 9);
-	mg_xwrite(conn, &val, 4);
+	http2_put32(payload, error_id);
+	http2_send_frame(conn, HTTP2_FRAME_RST_STREAM, 0, stream_id, payload, 4);
 }
 
 
+/* Tell the client the connection ends, and why. Sent once. */
 static void
-http2_must_use_http1(struct mg_connection *conn)
+http2_goaway(struct mg_connection *conn, uint32_t error_id)
 {
-	DEBUG_TRACE("HTTP2 not available for this URL (%s)", conn->path_info);
-	http2_reset_stream(conn, conn->http2.stream_id, 0xd);
-}
+	uint8_t payload[8];
 
+	DEBUG_TRACE("HTTP2 send goaway: error %u", error_id);
 
-/* The HTTP2 implementation collects request headers as array of dynamically
- * allocated string values. This array must be freed once the request is
- * handled.
- * This is different to the HTTP/1.x implementation: For HTTP/1.x, the header
- * list is implemented as pointers into an existing buffer, so free must not
- * be called for HTTP/1.x.
- * Thus free_buffered_request_header_list is in mod_http2.inl.
- */
-#if defined(DEBUG)
-static int mem_h_count = 0;
-static int mem_d_count = 0;
-#define CHECK_LEAK_HDR_ALLOC(ptr)                                              \
-	DEBUG_TRACE("H NEW %p (%i): %s", ptr, ++mem_h_count, (const char *)ptr)
-#define CHECK_LEAK_HDR_FREE(ptr)                                               \
-	DEBUG_TRACE("H DEL %p (%i): %s", ptr, --mem_h_count, (const char *)ptr)
-#define CHECK_LEAK_DYN_ALLOC(ptr)                                              \
-	DEBUG_TRACE("D NEW %p (%i): %s", ptr, ++mem_d_count, (const char *)ptr)
-#define CHECK_LEAK_DYN_FREE(ptr)                                               \
-	DEBUG_TRACE("D DEL %p (%i): %s", ptr, --mem_d_count, (const char *)ptr)
-#else
-#define CHECK_LEAK_HDR_ALLOC(ptr)
-#define CHECK_LEAK_HDR_FREE(ptr)
-#define CHECK_LEAK_DYN_ALLOC(ptr)
-#define CHECK_LEAK_DYN_FREE(ptr)
-#endif
+	if (conn->http2.goaway != 2) {
+		http2_put32(payload, conn->http2.last_stream);
+		http2_put32(payload + 4, error_id);
+		http2_send_frame(conn, HTTP2_FRAME_GOAWAY, 0, 0, payload, 8);
+		http2_flush(conn);
+	}
+	conn->http2.goaway = 2;
+}
 
 
-/* The dynamic header table may be resized on a HTTP2 client request.
- * A tablesize=0 will free all memory.
- */
 static void
-purge_dynamic_header_table(struct mg_connection *conn, uint32_t tableSize)
+http2_must_use_http1(struct mg_connection *conn)
 {
-	DEBUG_TRACE("HTTP2 dynamic header table set to %u", tableSize);
-	while (conn->http2.dyn_table_size > tableSize) {
-		conn->http2.dyn_table_size--;
-
-		CHECK_LEAK_DYN_FREE(
-		    conn->http2.dyn_table[conn->http2.dyn_table_size].name);
-		CHECK_LEAK_DYN_FREE(
-		    conn->http2.dyn_table[conn->http2.dyn_table_size].value);
-
-		mg_free((void *)conn->http2.dyn_table[conn->http2.dyn_table_size].name);
-		conn->http2.dyn_table[conn->http2.dyn_table_size].name = 0;
-		mg_free(
-		    (void *)conn->http2.dyn_table[conn->http2.dyn_table_size].value);
-		conn->http2.dyn_table[conn->http2.dyn_table_size].value = 0;
-	}
+	DEBUG_TRACE("HTTP2 not available for this URL (%s)", conn->path_info);
+	http2_reset_stream(conn,
+	                   conn->http2.stream_id,
+	                   HTTP2_ERR_HTTP_1_1_REQUIRED);
+	conn->http2.stream_reset = 1;
 }
 
 
-/* Internal function to free request header list.
- * Not to be confused with the response header list.
- */
+/* WINDOW_UPDATE may arrive for a stream before its turn comes: keep the
+ * increment until then. */
 static void
-free_buffered_request_header_list(struct mg_connection *conn)
+http2_add_pending_window(struct mg_connection *conn,
+                         uint32_t stream_id,
+                         uint32_t delta)
 {
-	while (conn->request_info.num_headers > 0) {
-		conn->request_info.num_headers--;
-
-		CHECK_LEAK_HDR_FREE(
-		    conn->request_info.http_headers[conn->request_info.num_headers]
-		        .name);
-		CHECK_LEAK_HDR_FREE(
-		    conn->request_info.http_headers[conn->request_info.num_headers]
-		        .value);
+	struct mg_http2_connection *h2 = &conn->http2;
+	int i, free_slot = -1;
 
-		mg_free((void *)conn->request_info
-		            .http_headers[conn->request_info.num_headers]
-		            .name);
-		conn->request_info.http_headers[conn->request_info.num_headers].name =
-		    0;
-		mg_free((void *)conn->request_info
-		            .http_headers[conn->request_info.num_headers]
-		            .value);
-		conn->request_info.http_headers[conn->request_info.num_headers].value =
-		    0;
+	for (i = 0; i < HTTP2_PENDING_WINDOWS; i++) {
+		if (h2->pending_window[i].id == stream_id) {
+			h2->pending_window[i].delta += delta;
+			return;
+		}
+		if ((h2->pending_window[i].id == 0) && (free_slot < 0)) {
+			free_slot = i;
+		}
+	}
+	if (free_slot >= 0) {
+		h2->pending_window[free_slot].id = stream_id;
+		h2->pending_window[free_slot].delta = delta;
 	}
 }
 
 
-/* HTTP2 requires a different handling loop */
-static void
-handle_http2(struct mg_connection *conn)
+static int64_t
+http2_take_pending_window(struct mg_connection *conn, uint32_t stream_id)
 {
-	unsigned char http2_frame_head[9];
-	uint32_t http2_frame_size;
-	uint8_t http2_frame_type;
-	uint8_t http2_frame_flags;
-	uint32_t http2_frame_stream_id;
-	uint32_t http_window_length = 0;
-	int bytes_read;
-	uint8_t *buf;
-	int my_settings_accepted = 0;
-	const char *my_hpack_headers[128];
-
-	struct http2_settings client_settings = http2_default_settings;
-	struct http2_settings server_settings = http2_default_settings;
-
-	/* Send own settings */
-	http2_send_settings(conn, &http2_civetweb_server_settings);
-	// http2_send_window(conn, 0, /* 0x3fff0001 */ 1024*1024);
-
-	/* initialize hpack header table with predefined header fields */
-	memset((void *)my_hpack_headers, 0, sizeof(my_hpack_headers));
-	memcpy((void *)my_hpack_headers,
-	       hpack_predefined,
-	       sizeof(hpack_predefined));
-
-	buf = (uint8_t *)mg_malloc_ctx(server_settings.settings_max_frame_size,
-	                               conn->phys_ctx);
-	if (!buf) {
-		/* Out of memory */
-		DEBUG_TRACE("%s", "Out of memory for HTTP2 frame");
-		return;
-	}
-
-	for (;;) {
-		/* HTTP/2 is handled frame by frame */
-		int frame_is_end_stream = 0;
-		int frame_is_end_headers = 0;
-		int frame_is_padded = 0;
-		int frame_is_priority = 0;
-
-#if defined(USE_SERVER_STATS)
-		conn->conn_state = 3; /* HTTP/2 ready */
-#endif
-
-		bytes_read = mg_read(conn, http2_frame_head, sizeof(http2_frame_head));
-		if (bytes_read != sizeof(http2_frame_head)) {
-			/* TODO: errormsg */
-			goto clean_http2;
-		}
+	struct mg_http2_connection *h2 = &conn->http2;
+	int64_t delta = 0;
+	int i;
 
-		/* Extract data from frame header */
-		http2_frame_size = ((uint32_t)http2_frame_head[0] * 0x10000u)
-		                   + ((uint32_t)http2_frame_head[1] * 0x100u)
-		                   + ((uint32_t)http2_frame_head[2]);
-		http2_frame_type = http2_frame_head[3];
-		http2_frame_flags = http2_frame_head[4];
-		http2_frame_stream_id = ((uint32_t)http2_frame_head[5] * 0x1000000u)
-		                        + ((uint32_t)http2_frame_head[6] * 0x10000u)
-		                        + ((uint32_t)http2_frame_head[7] * 0x100u)
-		                        + ((uint32_t)http2_frame_head[8]);
-
-		frame_is_end_stream = (0 != (http2_frame_flags & 0x01));
-		frame_is_end_headers = (0 != (http2_frame_flags & 0x04));
-		frame_is_padded = (0 != (http2_frame_flags & 0x08));
-		frame_is_priority = (0 != (http2_frame_flags & 0x20));
-
-		if (http2_frame_size > server_settings.settings_max_frame_size) {
-			/* TODO: Error Message */
-			DEBUG_TRACE("HTTP2 frame too large (%lu)",
-			            (unsigned long)http2_frame_size);
-			goto clean_http2;
+	for (i = 0; i < HTTP2_PENDING_WINDOWS; i++) {
+		if (h2->pending_window[i].id == stream_id) {
+			delta = h2->pending_window[i].delta;
 		}
-		bytes_read = mg_read(conn, buf, http2_frame_size);
-		if (bytes_read != (int)http2_frame_size) {
-			/* TODO: Error Message - or read again? */
-			DEBUG_TRACE("HTTP2 read error (%li != %li)",
-			            (signed long int)bytes_read,
-			            (signed long int)http2_frame_size);
-			goto clean_http2;
+		if (h2->pending_window[i].id <= stream_id) {
+			/* this one, and streams already done */
+			h2->pending_window[i].id = 0;
 		}
+	}
+	return delta;
+}
 
-		DEBUG_TRACE("HTTP2 frame type %u, size %u, stream %u, flags %02x",
-		            http2_frame_type,
-		            http2_frame_size,
-		            http2_frame_stream_id,
-		            http2_frame_flags);
-
-		/* Further processing according to frame type. See definition: */
-		/* https://tools.ietf.org/html/rfc7540#section-6 */
-		switch (http2_frame_type) {
-
-		case 0: /* DATA */
-		{
-			/* TODO */
-			DEBUG_TRACE("%s", "HTTP2 DATA frame?");
-		} break;
-
-		case 1: /* HEADERS */
-		{
-			int i = 0;
-			uint8_t padding = 0;
-			uint32_t dependency = 0;
-			uint8_t weight = 0;
-			uint8_t exclusive = 0;
-
-			/* Request start time */
-			clock_gettime(CLOCK_MONOTONIC, &(conn->req_time));
-
-			if (frame_is_padded) {
-				padding = buf[i];
-				i++;
-				DEBUG_TRACE("HTTP2 frame padded by %u bytes", padding);
-			}
-			if (frame_is_priority) {
-				uint32_t val = ((uint32_t)buf[0 + i] * 0x1000000u)
-				               + ((uint32_t)buf[1 + i] * 0x10000u)
-				               + ((uint32_t)buf[2 + i] * 0x100u)
-				               + ((uint32_t)buf[3 + i]);
-				dependency = (val & 0x7FFFFFFFu);
-				exclusive = ((val & 0x80000000u) != 0);
-				weight = buf[4 + i];
-				i += 5;
-				DEBUG_TRACE(
-				    "HTTP2 frame weight %u, dependency %u (exclusive: %i)",
-				    weight,
-				    dependency,
-				    exclusive);
-			}
-
-			conn->request_info.num_headers = 0;
-
-			while (i < (int)http2_frame_size - (int)padding) {
-				const char *key = 0;
-				const char *val = 0;
-				uint8_t idx_mask = 0;
-				uint8_t value_known = 0;
-				uint8_t indexing = 0;
-				uint64_t idx = 0;
-
-				/* Classify next entry by checking the bit mask */
-				if ((buf[i] & 0x80u) == 0x80u) {
-					/* Indexed Header Field Representation:
-					 * https://tools.ietf.org/html/rfc7541#section-6.1 */
-					idx_mask = 0x7fu;
-					value_known = 1;
-
-				} else if ((buf[i] & 0xC0u) == 0x40u) {
-					/* Literal Header Field with Incremental Indexing:
-					 * https://tools.ietf.org/html/rfc7541#section-6.2.1 */
-					idx_mask = 0x3fu;
-					indexing = 1;
-
-				} else if ((buf[i] & 0xF0u) == 0x00u) {
-					/* Literal Header Field without Indexing:
-					 * https://tools.ietf.org/html/rfc7541#section-6.2.2 */
-					idx_mask = 0x0fu;
-
-				} else if ((buf[i] & 0xF0u) == 0x10u) {
-					/* Literal Header Field Never Indexed:
-					 * https://tools.ietf.org/html/rfc7541#section-6.2.3 */
-					idx_mask = 0x0fu;
-
-				} else if ((buf[i] & 0xE0u) == 0x20u) {
-					uint64_t tableSize;
-					/* Dynamic Table Size Update:
-					 * https://tools.ietf.org/html/rfc7541#section-6.3 */
-					idx_mask = 0x1fu;
-					tableSize = hpack_getnum(buf, &i, idx_mask, conn->phys_ctx);
-
-					/* TODO: check if tablesize > allowed table size */
-
-					/* Purge additional table entries */
-					purge_dynamic_header_table(conn, (uint32_t)tableSize);
-
-					/* Process next frame */
-					continue;
-
-				} else {
-					DEBUG_TRACE("HTTP2 unknown start pattern %02x", buf[i]);
-					goto clean_http2;
-				}
-
-				/* Get the header name table index */
-				idx = hpack_getnum(buf, &i, idx_mask, conn->phys_ctx);
-
-				/* Get Header name "key" */
-				if (idx == 0) {
-					/* Index 0: Header name encoded in following bytes */
-					key =
-					    hpack_decode(buf, &i, (int)bytes_read, conn->phys_ctx);
-					CHECK_LEAK_HDR_ALLOC(key);
-					if (!key) {
-						DEBUG_TRACE("HTTP2 key decoding error");
-						goto clean_http2;
-					}
-				} else if (/*(idx >= 15) &&*/ (idx <= 61)) {
-					/* Take key name from predefined header table */
-					key = mg_strdup_ctx(hpack_predefined[idx].name,
-					                    conn->phys_ctx); /* leak? */
-					CHECK_LEAK_HDR_ALLOC(key);
-				} else if ((idx >= 62)
-				           && ((idx - 61) <= conn->http2.dyn_table_size)) {
-					/* Take from dynamic header table */
-					uint32_t local_table_idx = (uint32_t)idx - 62;
-					key = mg_strdup_ctx(
-					    conn->http2.dyn_table[local_table_idx].name,
-					    conn->phys_ctx);
-					CHECK_LEAK_HDR_ALLOC(key);
-				} else {
-					/* protocol violation */
-					DEBUG_TRACE("HTTP2 invalid index %lu", (unsigned long)idx);
-					goto clean_http2;
-				}
-				/* key is allocated now and must be freed later */
-
-				/* Get header value */
-				if (value_known) {
-					/* Server must already know the value */
-					if (idx <= 61) {
-						if (hpack_predefined[idx].value) {
-							val = mg_strdup_ctx(hpack_predefined[idx].value,
-							                    conn->phys_ctx); /* leak? */
-							CHECK_LEAK_HDR_ALLOC(val);
-						} else {
-							/* protocol violation */
-							DEBUG_TRACE("HTTP2 indexed header %lu has no value "
-							            "(key: %s)",
-							            (unsigned long)idx,
-							            key);
-							CHECK_LEAK_HDR_FREE(key);
-							mg_free((void *)key);
-							goto clean_http2;
-						}
-					} else if ((idx >= 62)
-					           && ((idx - 61) <= conn->http2.dyn_table_size)) {
-						uint32_t local_table_idx = (uint32_t)idx - 62;
-						val = mg_strdup_ctx(
-						    conn->http2.dyn_table[local_table_idx].value,
-						    conn->phys_ctx);
-						CHECK_LEAK_HDR_ALLOC(val);
-					} else {
-						/* protocol violation */
-						DEBUG_TRACE(
-						    "HTTP2 indexed header %lu out of range (key: %s)",
-						    (unsigned long)idx,
-						    key);
-						CHECK_LEAK_HDR_FREE(key);
-						mg_free((void *)key);
-						goto clean_http2;
-					}
-
-				} else {
-					/* Read value from HTTP2 stream */
-					val = hpack_decode(buf,
-					                   &i,
-					                   (int)bytes_read,
-					                   conn->phys_ctx); /* leak? */
-					CHECK_LEAK_HDR_ALLOC(val);
-					if (!val) {
-						DEBUG_TRACE("HTTP2 value decoding error");
-						mg_free((void *)key);
-						goto clean_http2;
-					}
 
-					if (indexing) {
-						/* Add to index */
-						if (conn->http2.dyn_table_size
-						    >= HTTP2_DYN_TABLE_SIZE) {
-							/* Too many elements */
-							DEBUG_TRACE("HTTP2 index table is full (key: %s, "
-							            "value: %s)",
-							            key,
-							            val);
-
-							CHECK_LEAK_HDR_FREE(key);
-							CHECK_LEAK_HDR_FREE(val);
-
-							mg_free((void *)key);
-							mg_free((void *)val);
-							goto clean_http2;
-						}
-
-						/* Add to table of dynamic headers */
-						conn->http2.dyn_table[conn->http2.dyn_table_size].name =
-						    mg_strdup_ctx(key, conn->phys_ctx); /* leak */
-						conn->http2.dyn_table[conn->http2.dyn_table_size]
-						    .value =
-						    mg_strdup_ctx(val, conn->phys_ctx); /* leak */
-
-						CHECK_LEAK_DYN_ALLOC(
-						    conn->http2.dyn_table[conn->http2.dyn_table_size]
-						        .name);
-						CHECK_LEAK_DYN_ALLOC(
-						    conn->http2.dyn_table[conn->http2.dyn_table_size]
-						        .value);
-
-						conn->http2.dyn_table_size++;
-
-						DEBUG_TRACE("HTTP2 new dynamic header table entry %i "
-						            "(key: %s, value: %s)",
-						            (int)conn->http2.dyn_table_size,
-						            key,
-						            val);
-					}
-				}
-				/* val and key are allocated now and must be freed later */
-				/* Store these pointers in conn->request_info[].http_headers,
-				 * free_buffered_header_list(conn) will clean up later. */
-
-				/* Add header for this request */
-				if ((key != NULL) && (val != NULL)
-				    && (conn->request_info.num_headers < MG_MAX_HEADERS)) {
-					conn->request_info
-					    .http_headers[conn->request_info.num_headers]
-					    .name = key;
-					conn->request_info
-					    .http_headers[conn->request_info.num_headers]
-					    .value = val;
-					conn->request_info.num_headers++;
-
-					/* Some headers need to be stored in the request structure
-					 */
-					if (!strcmp(":method", key)) {
-						conn->request_info.request_method = val;
-					} else if (!strcmp(":path", key)) {
-						conn->request_info.local_uri = val;
-						conn->request_info.request_uri = val;
-						conn->request_info.local_uri_raw = val;
-					} else if (!strcmp(":status", key)) {
-						conn->status_code = atoi(val);
-					}
+/* Apply the client's SETTINGS (a frame, or the HTTP2-Settings header of
+ * an upgrade). Returns 0 or a connection error code. */
+static int
+http2_apply_settings(struct mg_connection *conn,
+                     const uint8_t *p,
+                     uint32_t len)
+{
+	struct mg_http2_connection *h2 = &conn->http2;
+	uint32_t i;
 
-					DEBUG_TRACE("HTTP2 request header (key: %s, value: %s)",
-					            key,
-					            val);
-
-				} else {
-					/* - either key or value are NULL (out of memory)
-					 * - or the max. number of headers is reached
-					 * in both cases free all memory
-					 */
-					DEBUG_TRACE("%s", "HTTP2 cannot add header");
-					CHECK_LEAK_HDR_FREE(key);
-					CHECK_LEAK_HDR_FREE(val);
-
-					mg_free((void *)key);
-					key = NULL;
-					mg_free((void *)val);
-					val = NULL;
-				}
+	if (len % 6) {
+		return HTTP2_ERR_FRAME_SIZE_ERROR;
+	}
+	for (i = 0; i < len; i += 6) {
+		uint16_t id = (uint16_t)((p[i] << 8) | p[i + 1]);
+		uint32_t val = http2_get32(p + i + 2);
+
+		switch (id) {
+		case 1:
+			/* HEADER_TABLE_SIZE: the most the encoder table may hold. A
+			 * change is announced in the next header block. */
+			if (val > HPACK_TABLE_MAX) {
+				val = HPACK_TABLE_MAX;
 			}
-
-			/* stream id */
-			conn->http2.stream_id = http2_frame_stream_id;
-
-			/* header parsed */
-			DEBUG_TRACE("HTTP2 handle_request (stream %u)",
-			            http2_frame_stream_id);
-			handle_request_stat_log(conn);
-
-			/* Send "final" frame */
-			DEBUG_TRACE("HTTP2 handle_request done (stream %u)",
-			            http2_frame_stream_id);
-			http2_data_frame_head(conn, 0, 1);
-			free_buffered_response_header_list(conn);
-			free_buffered_request_header_list(conn);
-		} break;
-
-		case 2: /* PRIORITY */
-		{
-			uint32_t dependStream =
-			    ((uint32_t)buf[0] * 0x1000000u) + ((uint32_t)buf[1] * 0x10000u)
-			    + ((uint32_t)buf[2] * 0x100u) + ((uint32_t)buf[3]);
-			uint8_t weight = buf[4];
-			DEBUG_TRACE("HTTP2 priority %u dependent stream %u",
-			            weight,
-			            dependStream);
-		} break;
-
-		case 3: /* RST_STREAM */
-		{
-			uint32_t errorId =
-			    ((uint32_t)buf[0] * 0x1000000u) + ((uint32_t)buf[1] * 0x10000u)
-			    + ((uint32_t)buf[2] * 0x100u) + ((uint32_t)buf[3]);
-			DEBUG_TRACE("HTTP2 reset with error %u", errorId);
-		} break;
-
-		case 4: /* SETTINGS */
-			if (http2_frame_stream_id != 0) {
-				/* Send protocol error */
-				http2_reset_stream(conn,
-				                   http2_frame_stream_id,
-				                   HTTP2_ERR_PROTOCOL_ERROR);
-				DEBUG_TRACE("%s", "HTTP2 received invalid settings frame");
-			} else if (http2_frame_flags) {
-				/* ACK frame. Do not reply. */
-				my_settings_accepted++;
-				DEBUG_TRACE("%s", "CivetWeb settings confirmed by peer");
-			} else {
-				int i;
-				for (i = 0; i < (int)http2_frame_size; i += 6) {
-					uint16_t id =
-					    ((uint16_t)buf[i] * 0x100u) + ((uint16_t)buf[i + 1]);
-					uint32_t val = ((uint32_t)buf[i + 2] * 0x1000000u)
-					               + ((uint32_t)buf[i + 3] * 0x10000u)
-					               + ((uint32_t)buf[i + 4] * 0x100u)
-					               + ((uint32_t)buf[i + 5]);
-					switch (id) {
-					case 1:
-						client_settings.settings_header_table_size = val;
-						DEBUG_TRACE("Received settings header_table_size: %u",
-						            val);
-						break;
-					case 2:
-						client_settings.settings_enable_push = (val != 0);
-						DEBUG_TRACE("Received settings enable_push: %u", val);
-						break;
-					case 3:
-						client_settings.settings_max_concurrent_streams = val;
-						DEBUG_TRACE(
-						    "Received settings max_concurrent_streams: %u",
-						    val);
-						break;
-					case 4:
-						client_settings.settings_initial_window_size = val;
-						DEBUG_TRACE("Received settings initial_window_size: %u",
-						            val);
-						break;
-					case 5:
-						client_settings.settings_max_frame_size = val;
-						DEBUG_TRACE("Received settings max_frame_size: %u",
-						            val);
-						break;
-					case 6:
-						client_settings.settings_max_header_list_size = val;
-						DEBUG_TRACE(
-						    "Received settings max_header_list_size: %u", val);
-						break;
-					default:
-						/* Unknown setting. Ignore it. */
-						DEBUG_TRACE("Received unknown settings id=%u: %u",
-						            id,
-						            val);
-						break;
-					}
+			if (val != h2->enc.max_bytes) {
+				h2->enc.max_bytes = val;
+				hpack_table_evict(&h2->enc, val);
+				if (val < h2->enc_size_low) {
+					h2->enc_size_low = val;
 				}
-
-				/* Every settings frame must be acknowledged */
-				http2_settings_acknowledge(conn);
+				h2->enc_size_update = val;
 			}
 			break;
-
-		case 5: /* PUSH_PROMISE */
-			DEBUG_TRACE("%s", "Push promise not supported");
+		case 2:
+			/* ENABLE_PUSH: nothing is pushed anyway */
+			if (val > 1) {
+				return HTTP2_ERR_PROTOCOL_ERROR;
+			}
 			break;
-
-		case 6: /* PING */
-			if (http2_frame_flags == 0) {
-				/* Set "reply" flag, and send same data back */
-				DEBUG_TRACE("%s", "Replying to ping");
-				http2_frame_head[4] = 1;
-				mg_xwrite(conn, http2_frame_head, sizeof(http2_frame_head));
-				mg_xwrite(conn, buf, http2_frame_size);
+		case 4:
+			/* INITIAL_WINDOW_SIZE also adjusts the open stream */
+			if (val > 0x7FFFFFFF) {
+				return HTTP2_ERR_FLOW_CONTROL_ERROR;
 			}
+			h2->stream_window += (int64_t)val - h2->peer_initial_window;
+			h2->peer_initial_window = val;
 			break;
-
-		case 7: /* GOAWAY */
-		{
-			uint32_t lastStream =
-			    ((uint32_t)buf[0] * 0x1000000u) + ((uint32_t)buf[1] * 0x10000u)
-			    + ((uint32_t)buf[2] * 0x100u) + ((uint32_t)buf[3]);
-			uint32_t errorId =
-			    ((uint32_t)buf[4] * 0x1000000u) + ((uint32_t)buf[5] * 0x10000u)
-			    + ((uint32_t)buf[6] * 0x100u) + ((uint32_t)buf[7]);
-			; /* followed by debug data */
-			uint32_t debugDataLen = http2_frame_size - 8;
-			char *debugData = (char *)buf + 8;
-
-			DEBUG_TRACE("HTTP2 goaway stream %u, error %u (%.*s)",
-			            lastStream,
-			            errorId,
-			            debugDataLen,
-			            debugData);
-
-		} break;
-
-		case 8: /* WINDOW_UPDATE */
-		{
-			uint32_t val = ((uint32_t)buf[0] * 0x1000000u)
-			               + ((uint32_t)buf[1] * 0x10000u)
-			               + ((uint32_t)buf[2] * 0x100u) + ((uint32_t)buf[3]);
-			http_window_length = (val & 0x7FFFFFFFu);
-
-			DEBUG_TRACE("HTTP2 window update stream %u, length %u",
-			            http2_frame_stream_id,
-			            http_window_length);
-		} break;
-
-		case 9: /* CONTINUATION */
-			DEBUG_TRACE("%s", "HTTP2 Continue");
+		case 5:
+			/* MAX_FRAME_SIZE: frames sent stay at the minimum, 16384 */
+			if ((val < 16384) || (val > 16777215)) {
+				return HTTP2_ERR_PROTOCOL_ERROR;
+			}
 			break;
-
 		default:
-			/* TODO: Error Message */
-			DEBUG_TRACE("%s", "Unknown frame type");
-			goto clean_http2;
+			/* MAX_CONCURRENT_STREAMS and MAX_HEADER_LIST_SIZE limit what
+			 * the client receives as requests; unknown ones are ignored */
+			break;
 		}
-
-		/* not used in the moment */
-		(void)frame_is_end_stream;
-		(void)frame_is_end_headers;
-		(void)client_settings;
 	}
+	return 0;
+}
 
-clean_http2:
-	DEBUG_TRACE("%s", "HTTP2 free buffer, connection handler finished");
-	mg_free(buf);
+
+/* Apply a WINDOW_UPDATE. Returns 0 or a connection error code. */
+static int
+http2_window_update(struct mg_connection *conn,
+                    uint32_t stream_id,
+                    const uint8_t *p,
+                    uint32_t len)
+{
+	struct mg_http2_connection *h2 = &conn->http2;
+	uint32_t inc;
+
+	if (len != 4) {
+		return HTTP2_ERR_FRAME_SIZE_ERROR;
+	}
+	inc = http2_get32(p) & 0x7FFFFFFFu;
+	if (stream_id == 0) {
+		if (inc == 0) {
+			return HTTP2_ERR_PROTOCOL_ERROR;
+		}
+		h2->conn_window += inc;
+		if (h2->conn_window > 0x7FFFFFFF) {
+			return HTTP2_ERR_FLOW_CONTROL_ERROR;
+		}
+	} else if (stream_id == h2->stream_id) {
+		h2->stream_window += inc;
+	} else if (stream_id > h2->stream_id) {
+		http2_add_pending_window(conn, stream_id, inc);
+	}
+	return 0;
 }
 
 
-#if 0
-static void
-HPACK_TEST()
+/* Answer a PING, or take a SETTINGS frame and acknowledge it */
+static int
+http2_control_frame(struct mg_connection *conn,
+                    const uint8_t *head,
+                    const uint8_t *payload,
+                    uint32_t len)
 {
-	uint64_t test;
-
-	for (test = 0;; test++) {
-		char in[32] = {0};
-		uint8_t out[32] = {0};
-		char *check;
-		int i;
-		int l;
-
-		memcpy(in, &test, sizeof(test));
-		l = hpack_encode(out, in, 0);
-		i = 0;
-		check = hpack_decode(out, &i, NULL);
-
-		if (strcmp(in, check)) {
-			printf("Error\n");
+	uint32_t stream_id = http2_get32(head + 5) & 0x7FFFFFFFu;
+	int err;
+
+	if (stream_id != 0) {
+		return HTTP2_ERR_PROTOCOL_ERROR;
+	}
+	if (head[3] == HTTP2_FRAME_PING) {
+		if (len != 8) {
+			return HTTP2_ERR_FRAME_SIZE_ERROR;
+		}
+		if (!(head[4] & HTTP2_FLAG_END_STREAM)) {
+			http2_send_frame(conn,
+			                 HTTP2_FRAME_PING,
+			                 HTTP2_FLAG_END_STREAM,
+			                 0,
+			                 payload,
+			                 8);
 		}
-		mg_free(check);
+		return 0;
+	}
+	if (head[4] & HTTP2_FLAG_END_STREAM) {
+		/* our SETTINGS acknowledged */
+		return (len == 0) ? 0 : HTTP2_ERR_FRAME_SIZE_ERROR;
 	}
+	err = http2_apply_settings(conn, payload, len);
+	if (!err) {
+		http2_send_frame(conn,
+		                 HTTP2_FRAME_SETTINGS,
+		                 HTTP2_FLAG_END_STREAM,
+		                 0,
+		                 NULL,
+		                 0);
+	}
+	return err;
 }
 
-static void
-HPACK_TABLE_TEST()
+
+/* Block until the stream and the connection may take more DATA. Control
+ * frames are handled meanwhile; frames opening further streams are set
+ * aside for the main loop. Returns 0 if the stream can't go on. */
+static int
+http2_wait_window(struct mg_connection *conn)
 {
-	int i;
+	struct mg_http2_connection *h2 = &conn->http2;
+	uint8_t head[9];
+
+	if (!http2_flush(conn)) {
+		h2->goaway = 1;
+		return 0;
+	}
+	while ((h2->conn_window <= 0) || (h2->stream_window <= 0)) {
+		uint32_t stream_id;
+		int len, err = 0;
 
-	uint32_t hpack_huff_end_code_expected[32] = { 0 };
-	uint8_t hpack_huff_start_index_expected[32] = { 0 };
-	int reverse_map[256] = { 0 };
+		if (h2->stream_reset || h2->goaway
+		    || !STOP_FLAG_IS_ZERO(&conn->phys_ctx->stop_flag)) {
+			return 0;
+		}
+		len = http2_read_frame(conn, head, h2->frame);
+		if (len < 0) {
+			if (len == -2) {
+				http2_goaway(conn, HTTP2_ERR_FRAME_SIZE_ERROR);
+			}
+			h2->goaway = 1;
+			return 0;
+		}
+		stream_id = http2_get32(head + 5) & 0x7FFFFFFFu;
 
-	for (i = 0; i < 256; i++) {
-		reverse_map[i] = -1;
+		switch (head[3]) {
+		case HTTP2_FRAME_WINDOW_UPDATE:
+			err = http2_window_update(conn, stream_id, h2->frame, len);
+			break;
+		case HTTP2_FRAME_SETTINGS:
+		case HTTP2_FRAME_PING:
+			err = http2_control_frame(conn, head, h2->frame, len);
+			if (!err && !http2_flush(conn)) {
+				h2->goaway = 1;
+			}
+			break;
+		case HTTP2_FRAME_RST_STREAM:
+			if (stream_id == h2->stream_id) {
+				h2->stream_reset = 1;
+			}
+			break;
+		case HTTP2_FRAME_GOAWAY:
+			h2->goaway = 1;
+			break;
+		default:
+			err = http2_set_aside(conn, head, h2->frame, len);
+			break;
+		}
+		if (err) {
+			http2_goaway(conn, err);
+			return 0;
+		}
 	}
+	return 1;
+}
+
+
+/* mg_write for HTTP/2: DATA frames of at most HTTP2_MAX_FRAME bytes,
+ * within the windows the client grants. Returns len, or -1 if the stream
+ * or the connection ended. */
+static int
+http2_write_data(struct mg_connection *conn, const char *buf, size_t len)
+{
+	struct mg_http2_connection *h2 = &conn->http2;
+	size_t sent = 0;
+
+	while (sent < len) {
+		int64_t n = (int64_t)(len - sent);
 
-	for (i = 0; i < 256; i++) {
-		uint8_t bits = hpack_huff_dec[i].bitcount;
-		uint8_t dec = hpack_huff_dec[i].decoded;
-		if (bits > hpack_huff_dec[i + 1].bitcount) {
-			ck_abort_msg("hpack_huff_dec disorder at index %i", i);
+		if (h2->stream_reset || h2->goaway) {
+			return -1;
+		}
+		if (((h2->conn_window <= 0) || (h2->stream_window <= 0))
+		    && !http2_wait_window(conn)) {
+			return -1;
+		}
+		if (n > HTTP2_MAX_FRAME) {
+			n = HTTP2_MAX_FRAME;
+		}
+		if (n > h2->conn_window) {
+			n = h2->conn_window;
 		}
-		if (hpack_huff_dec[i].encoded & (0xFFFFFFFFul << bits)) {
-			ck_abort_msg("hpack_huff_dec bits inconsistent at index %i", i);
+		if (n > h2->stream_window) {
+			n = h2->stream_window;
 		}
-		if ((bits < 5) || (bits > 30)) {
-			ck_abort_msg("hpack_huff_dec bits out of range at index %i", i);
+		if (!http2_send_frame(
+		        conn, HTTP2_FRAME_DATA, 0, h2->stream_id, buf + sent, (uint32_t)n)) {
+			h2->goaway = 1;
+			return -1;
+		}
+		h2->conn_window -= n;
+		h2->stream_window -= n;
+		sent += (size_t)n;
+	}
+	conn->num_bytes_sent += (int64_t)len;
+	return (int)len;
+}
+
+
+/* Add a response header field: an exact match in either table goes as
+ * an index. Other fields go as literals, named by index where possible,
+ * and enter the encoder table unless they change from one response to
+ * the next. A field that doesn't fit the block is left out before the
+ * table is touched, so both sides' tables stay alike. */
+static int
+http2_encode_field(struct mg_connection *conn,
+                   uint8_t *out,
+                   int pos,
+                   int max,
+                   const char *name,
+                   const char *value)
+{
+	static const char *const volatile_fields[] = {"content-length",
+	                                              "content-range",
+	                                              "date",
+	                                              "etag",
+	                                              "last-modified",
+	                                              NULL};
+	struct mg_hpack_table *t = &conn->http2.enc;
+	char lname[128];
+	size_t name_len = strlen(name), value_len = strlen(value), i;
+	uint32_t idx;
+	uint8_t first;
+	int exact, prefix, start = pos;
+
+	if ((name_len >= sizeof(lname))
+	    || (name_len + value_len + 16 > (size_t)(max - pos))) {
+		DEBUG_TRACE("HTTP2 response header %s left out", name);
+		return pos;
+	}
+	for (i = 0; i <= name_len; i++) {
+		lname[i] = (char)tolower((unsigned char)name[i]);
+	}
+
+	idx = hpack_find(t, lname, value, &exact);
+	if (exact) {
+		return hpack_put_int(out, pos, max, 0x80, 7, idx);
+	}
+
+	/* literal: with incremental indexing, without, or never indexed */
+	first = 0x40;
+	prefix = 6;
+	if (!strcmp(lname, "set-cookie")) {
+		first = 0x10;
+		prefix = 4;
+	}
+	for (i = 0; volatile_fields[i]; i++) {
+		if (!strcmp(lname, volatile_fields[i])) {
+			first = 0x00;
+			prefix = 4;
 		}
-		if (reverse_map[dec] != -1) {
-			ck_abort_msg("hpack_huff_dec duplicate: %i", hpack_huff_dec[i].decoded);
+	}
+	pos = hpack_put_int(out, pos, max, first, prefix, idx);
+	if ((pos >= 0) && (idx == 0)) {
+		pos = hpack_put_string(out, pos, max, lname);
+	}
+	if (pos >= 0) {
+		pos = hpack_put_string(out, pos, max, value);
+	}
+	if (pos < 0) {
+		return start; /* not reached, see the size check above */
+	}
+	if (first == 0x40) {
+		char *n = mg_strdup_ctx(lname, conn->phys_ctx);
+		char *v = mg_strdup_ctx(value, conn->phys_ctx);
+		if (n && v) {
+			hpack_table_add(t, n, v);
+		} else {
+			/* the client adds it: keep the tables alike */
+			mg_free(n);
+			mg_free(v);
+			return -1;
 		}
-		reverse_map[dec] = i;
+	}
+	return pos;
+}
+
+
+static int
+http2_send_response_headers(struct mg_connection *conn)
+{
+	static const char *const hop_by_hop[] = {"Connection",
+	                                         "Keep-Alive",
+	                                         "Proxy-Connection",
+	                                         "Transfer-Encoding",
+	                                         "Upgrade",
+	                                         NULL};
+	struct mg_http2_connection *h2 = &conn->http2;
+	uint8_t *block;
+	char status[4];
+	int max = HTTP2_MAX_FRAME;
+	int pos = 0, has_date = 0;
+	int i, j, ok;
+
+	if (h2->stream_reset || h2->goaway) {
+		return 0;
+	}
+	block = (uint8_t *)mg_malloc_ctx(max, conn->phys_ctx);
+	if (!block) {
+		return 0;
+	}
 
-		hpack_huff_end_code_expected[bits - 5] = hpack_huff_dec[i].encoded;
+	if ((conn->status_code < 100) || (conn->status_code > 999)) {
+		/* Invalid status: Set status to "Internal Server Error" */
+		conn->status_code = 500;
 	}
 
-	for (i = 255; i >= 0; i--) {
-		uint8_t bits = hpack_huff_dec[i].bitcount;
-		hpack_huff_start_index_expected[bits - 5] = i;
+	/* A table size change comes first (RFC 7541 section 4.2): the
+	 * smallest since the last block, then the current one */
+	if (h2->enc_size_update != UINT32_MAX) {
+		if (h2->enc_size_low < h2->enc_size_update) {
+			pos = hpack_put_int(block, pos, max, 0x20, 5, h2->enc_size_low);
+		}
+		pos = hpack_put_int(block, pos, max, 0x20, 5, h2->enc_size_update);
+		h2->enc_size_update = h2->enc_size_low = UINT32_MAX;
 	}
 
-	for (i = 0; i < 256; i++) {
-		if (reverse_map[i] == -1) {
-			ck_abort_msg("reverse map at %i missing", i);
+	sprintf(status, "%03d", conn->status_code);
+	pos = http2_encode_field(conn, block, pos, max, ":status", status);
+
+	/* Add all headers */
+	for (i = 0; (pos >= 0) && (i < conn->response_info.num_headers); i++) {
+		const char *name = conn->response_info.http_headers[i].name;
+		const char *value = conn->response_info.http_headers[i].value;
+
+		/* Filter headers not valid in HTTP/2 */
+		for (j = 0; hop_by_hop[j]; j++) {
+			if (!mg_strcasecmp(hop_by_hop[j], name)) {
+				break;
+			}
+		}
+		if (hop_by_hop[j]) {
+			continue; /* do not send */
+		}
+
+		/* Mark required headers as sent */
+		if (!mg_strcasecmp("Date", name)) {
+			has_date = 1;
 		}
+		pos = http2_encode_field(conn, block, pos, max, name, value);
 	}
 
-	i = sizeof(hpack_huff_start_index) / sizeof(hpack_huff_start_index[0]);
-	if (i != 27) {
-		ck_abort_msg("hpack_huff_start_index size error: ", i);
+	/* Add required headers, if they have not been sent yet */
+	if ((pos >= 0) && !has_date) {
+		char date[64];
+		time_t curtime = time(NULL);
+
+		gmt_time_string(date, sizeof(date), &curtime);
+		pos = http2_encode_field(conn, block, pos, max, "date", date);
 	}
 
-	i = sizeof(hpack_huff_end_code) / sizeof(hpack_huff_end_code[0]);
-	if (i != 27) {
-		ck_abort_msg("hpack_huff_end_code size error: ", i);
+	/* Send header frame */
+	ok = (pos >= 0)
+	     && http2_send_frame(conn,
+	                         HTTP2_FRAME_HEADERS,
+	                         HTTP2_FLAG_END_HEADERS,
+	                         h2->stream_id,
+	                         block,
+	                         (uint32_t)pos);
+	mg_free(block);
+	if (pos < 0) {
+		/* the encoder table may differ from the client's now */
+		http2_goaway(conn, HTTP2_ERR_INTERNAL_ERROR);
+	}
+	if (ok) {
+		DEBUG_TRACE("HTTP2 response header sent: stream %u", h2->stream_id);
+	} else {
+		DEBUG_TRACE("HTTP2 response header sending error: stream %u",
+		            h2->stream_id);
 	}
 
-	for (i = 0; i < 27; i++) {
-		if (hpack_huff_start_index_expected[i] != hpack_huff_start_index[i]) {
-			ck_abort_msg("hpack_huff_start_index error at %i", i);
+	return ok;
+}
+
+
+/* The HTTP2 implementation collects request headers as array of dynamically
+ * allocated string values. This array must be freed once the request is
+ * handled.
+ * This is different to the HTTP/1.x implementation: For HTTP/1.x, the header
+ * list is implemented as pointers into an existing buffer, so free must not
+ * be called for HTTP/1.x.
+ * Thus free_buffered_request_header_list is in mod_http2.inl.
+ */
+static void
+free_buffered_request_header_list(struct mg_connection *conn)
+{
+	while (conn->request_info.num_headers > 0) {
+		conn->request_info.num_headers--;
+		mg_free((void *)conn->request_info
+		            .http_headers[conn->request_info.num_headers]
+		            .name);
+		conn->request_info.http_headers[conn->request_info.num_headers].name =
+		    0;
+		mg_free((void *)conn->request_info
+		            .http_headers[conn->request_info.num_headers]
+		            .value);
+		conn->request_info.http_headers[conn->request_info.num_headers].value =
+		    0;
+	}
+}
+
+
+/* Decode a request header block into conn->request_info. Pseudo header
+ * fields are kept in the list as well, as ":path" and so on. Returns 0,
+ * or a connection error code: once a block fails to decode, the decoder
+ * table can't be trusted any more. */
+static int
+http2_decode_headers(struct mg_connection *conn, const uint8_t *buf, int len)
+{
+	struct mg_request_info *ri = &conn->request_info;
+	struct mg_hpack_table *t = &conn->http2.dec;
+	const char *authority = NULL;
+	int has_host = 0;
+	int i = 0;
+
+	ri->num_headers = 0;
+	ri->request_method = NULL;
+	ri->request_uri = NULL;
+	ri->local_uri = NULL;
+	ri->local_uri_raw = NULL;
+	ri->query_string = NULL;
+	ri->http_version = "2";
+
+	while (i < len) {
+		uint8_t b = buf[i];
+		const char *name, *value;
+		char *key = NULL, *val = NULL;
+		uint64_t idx;
+
+		if (b & 0x80) {
+			/* Indexed header field */
+			idx = hpack_getnum(buf, &i, len, 0x7f);
+			if (!hpack_lookup(t, idx, &name, &value)) {
+				return HTTP2_ERR_COMPRESSION_ERROR;
+			}
+			key = mg_strdup_ctx(name, conn->phys_ctx);
+			val = mg_strdup_ctx(value, conn->phys_ctx);
+
+		} else if ((b & 0xE0) == 0x20) {
+			/* Dynamic table size update */
+			idx = hpack_getnum(buf, &i, len, 0x1f);
+			if (idx > HPACK_TABLE_MAX) {
+				return HTTP2_ERR_COMPRESSION_ERROR;
+			}
+			t->max_bytes = (uint32_t)idx;
+			hpack_table_evict(t, t->max_bytes);
+			continue;
+
+		} else {
+			/* Literal, with incremental indexing (0x40), without (0x00)
+			 * or never indexed (0x10) */
+			int indexing = (b & 0x40) != 0;
+			idx = hpack_getnum(buf, &i, len, indexing ? 0x3f : 0x0f);
+			if (idx == UINT64_MAX) {
+				return HTTP2_ERR_COMPRESSION_ERROR;
+			}
+			if (idx) {
+				if (!hpack_lookup(t, idx, &name, &value)) {
+					return HTTP2_ERR_COMPRESSION_ERROR;
+				}
+				key = mg_strdup_ctx(name, conn->phys_ctx);
+			} else {
+				key = hpack_decode(buf, &i, len, conn->phys_ctx);
+			}
+			if (key) {
+				val = hpack_decode(buf, &i, len, conn->phys_ctx);
+			}
+			if (key && val && indexing) {
+				char *n = mg_strdup_ctx(key, conn->phys_ctx);
+				char *v = mg_strdup_ctx(val, conn->phys_ctx);
+				if (!n || !v) {
+					mg_free(n);
+					mg_free(v);
+					mg_free(key);
+					mg_free(val);
+					return HTTP2_ERR_INTERNAL_ERROR;
+				}
+				hpack_table_add(t, n, v);
+			}
 		}
-		if (hpack_huff_end_code_expected[i] != hpack_huff_end_code[i]) {
-			ck_abort_msg("hpack_huff_end_code error at %i", i);
+		if (!key || !val) {
+			mg_free(key);
+			mg_free(val);
+			return HTTP2_ERR_COMPRESSION_ERROR;
+		}
+
+		if (ri->num_headers >= MG_MAX_HEADERS) {
+			/* Too many to keep; still decoded for the table */
+			mg_free(key);
+			mg_free(val);
+			continue;
+		}
+		ri->http_headers[ri->num_headers].name = key;
+		ri->http_headers[ri->num_headers].value = val;
+		ri->num_headers++;
+
+		if (!strcmp(key, ":method")) {
+			ri->request_method = val;
+		} else if (!strcmp(key, ":path")) {
+			ri->request_uri = val;
+		} else if (!strcmp(key, ":authority")) {
+			authority = val;
+		} else if (!mg_strcasecmp(key, "host")) {
+			has_host = 1;
 		}
 	}
 
+	/* Handlers look for a Host header */
+	if (authority && !has_host && (ri->num_headers < MG_MAX_HEADERS)) {
+		char *n = mg_strdup_ctx("host", conn->phys_ctx);
+		char *v = mg_strdup_ctx(authority, conn->phys_ctx);
+		if (n && v) {
+			ri->http_headers[ri->num_headers].name = n;
+			ri->http_headers[ri->num_headers].value = v;
+			ri->num_headers++;
+		} else {
+			mg_free(n);
+			mg_free(v);
+		}
+	}
+	return 0;
 }
+
+
+/* Answer the request in conn->request_info as stream conn->http2.stream_id.
+ * The request headers are freed afterwards if owned (decoded from HPACK,
+ * not the HTTP/1.1 request of an upgrade). */
+static void
+http2_handle_stream(struct mg_connection *conn, int owned)
+{
+	struct mg_http2_connection *h2 = &conn->http2;
+	struct mg_request_info *ri = &conn->request_info;
+	char *query;
+
+	h2->stream_window = (int64_t)h2->peer_initial_window
+	                    + http2_take_pending_window(conn, h2->stream_id);
+	h2->stream_reset = 0;
+
+	conn->num_bytes_sent = conn->consumed_content = 0;
+	conn->path_info = NULL;
+	conn->status_code = -1;
+	conn->content_len = 0; /* no body: mg_read returns 0 */
+	conn->is_chunked = 0;
+	conn->must_close = 0;
+	conn->request_state = 0;
+	conn->throttle = 0;
+	ri->content_length = 0;
+	ri->remote_user = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &conn->req_time);
+
+	if (owned && ri->request_uri) {
+		/* the query string is split off as parse_http_request does */
+		query = strchr(ri->request_uri, '?');
+		if (query) {
+			*query++ = 0;
+			ri->query_string = query;
+		}
+		ri->local_uri_raw = ri->request_uri;
+	}
+	ri->local_uri = (char *)ri->local_uri_raw;
+
+	if (!ri->request_method || !ri->local_uri || (ri->local_uri[0] != '/')) {
+		http2_reset_stream(conn, h2->stream_id, HTTP2_ERR_PROTOCOL_ERROR);
+	} else {
+		handle_request_stat_log(conn);
+
+		if (h2->stream_reset || h2->goaway) {
+			/* nothing more to send on this stream */
+		} else if (conn->request_state < 2) {
+			/* The handler didn't answer */
+			http2_reset_stream(conn, h2->stream_id, HTTP2_ERR_INTERNAL_ERROR);
+		} else {
+			http2_send_frame(conn,
+			                 HTTP2_FRAME_DATA,
+			                 HTTP2_FLAG_END_STREAM,
+			                 h2->stream_id,
+			                 NULL,
+			                 0);
+		}
+	}
+
+	/* Free cleaned local URI (if any) */
+	if (ri->local_uri != ri->local_uri_raw) {
+		mg_free((void *)ri->local_uri);
+	}
+	ri->local_uri = ri->local_uri_raw = NULL;
+	if (ri->remote_user != NULL) {
+		mg_free((void *)ri->remote_user);
+		ri->remote_user = NULL;
+	}
+	free_buffered_response_header_list(conn);
+	if (owned) {
+		free_buffered_request_header_list(conn);
+	} else {
+		ri->num_headers = 0;
+	}
+	conn->handled_requests++;
+}
+
+
+/* Whether more input is waiting, so that output may wait as well */
+static int
+http2_input_pending(struct mg_connection *conn)
+{
+	struct mg_pollfd pfd;
+
+	if ((conn->http2.backlog_pos < conn->http2.backlog_len)
+	    || (conn->http2.buf_pos < conn->data_len)) {
+		return 1;
+	}
+	pfd.fd = conn->client.sock;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) > 0;
+}
+
+
+/* HTTP2 requires a different handling loop. Streams are answered one at
+ * a time, in the order their headers arrive; the client still saves the
+ * connection setup and the repeated headers. */
+static void
+handle_http2(struct mg_connection *conn)
+{
+	struct mg_http2_connection *h2 = &conn->http2;
+	uint8_t head[9];
+	uint8_t *block = NULL;
+	size_t block_len = 0, block_cap = 0;
+	uint32_t block_stream = 0;
+	int block_end_stream = 0;
+	int in_block = 0;
+	int err = 0;
+
+	for (;;) {
+		uint8_t type, flags;
+		uint32_t stream_id;
+		int len;
+
+#if defined(USE_SERVER_STATS)
+		conn->conn_state = 3; /* HTTP/2 ready */
 #endif
 
+		/* Send what has been collected before waiting for the client */
+		if (!http2_input_pending(conn) && !http2_flush(conn)) {
+			break;
+		}
+		if (!STOP_FLAG_IS_ZERO(&conn->phys_ctx->stop_flag)) {
+			break;
+		}
+		len = http2_next_frame(conn, head, h2->frame);
+		if (len < 0) {
+			if (len == -2) {
+				err = HTTP2_ERR_FRAME_SIZE_ERROR;
+			}
+			break;
+		}
+		type = head[3];
+		flags = head[4];
+		stream_id = http2_get32(head + 5) & 0x7FFFFFFFu;
+
+		/* A header block must not be interrupted */
+		if (in_block
+		    && ((type != HTTP2_FRAME_CONTINUATION)
+		        || (stream_id != block_stream))) {
+			err = HTTP2_ERR_PROTOCOL_ERROR;
+			break;
+		}
+
+		switch (type) {
+		case HTTP2_FRAME_DATA:
+			/* Request bodies are refused (below); their data still
+			 * counts against the connection window */
+			if (stream_id == 0) {
+				err = HTTP2_ERR_PROTOCOL_ERROR;
+			} else if (len > 0) {
+				http2_send_window(conn, 0, (uint32_t)len);
+			}
+			break;
+
+		case HTTP2_FRAME_HEADERS: {
+			int off = 0, pad = 0;
+			if ((stream_id == 0) || !(stream_id & 1)
+			    || (stream_id <= h2->last_stream)) {
+				err = HTTP2_ERR_PROTOCOL_ERROR;
+				break;
+			}
+			if (flags & HTTP2_FLAG_PADDED) {
+				if (len < 1) {
+					err = HTTP2_ERR_PROTOCOL_ERROR;
+					break;
+				}
+				pad = h2->frame[0];
+				off = 1;
+			}
+			if (flags & HTTP2_FLAG_PRIORITY) {
+				off += 5;
+			}
+			if (off + pad > len) {
+				err = HTTP2_ERR_PROTOCOL_ERROR;
+				break;
+			}
+			block_len = 0;
+			block_stream = stream_id;
+			block_end_stream = (flags & HTTP2_FLAG_END_STREAM) != 0;
+			in_block = 1;
+			len -= off + pad;
+			memmove(h2->frame, h2->frame + off, len);
+		}
+			/* fall through */
+		case HTTP2_FRAME_CONTINUATION:
+			if (!in_block) {
+				err = HTTP2_ERR_PROTOCOL_ERROR;
+				break;
+			}
+			if (block_len + len > HTTP2_MAX_HEADER_BLOCK) {
+				err = HTTP2_ERR_ENHANCE_YOUR_CALM;
+				break;
+			}
+			if (block_len + len > block_cap) {
+				size_t cap = block_cap ? block_cap * 2 : HTTP2_MAX_FRAME;
+				uint8_t *p;
+				while (cap < block_len + len) {
+					cap *= 2;
+				}
+				p = (uint8_t *)mg_realloc_ctx(block, cap, conn->phys_ctx);
+				if (!p) {
+					err = HTTP2_ERR_INTERNAL_ERROR;
+					break;
+				}
+				block = p;
+				block_cap = cap;
+			}
+			memcpy(block + block_len, h2->frame, len);
+			block_len += len;
+			in_block = !(flags & HTTP2_FLAG_END_HEADERS);
+			break;
+
+		case HTTP2_FRAME_PRIORITY:
+			if (len != 5) {
+				err = HTTP2_ERR_FRAME_SIZE_ERROR;
+			}
+			break;
+
+		case HTTP2_FRAME_RST_STREAM:
+			/* Streams are answered as soon as their headers are in,
+			 * so there is nothing left to cancel */
+			if (len != 4) {
+				err = HTTP2_ERR_FRAME_SIZE_ERROR;
+			}
+			break;
+
+		case HTTP2_FRAME_SETTINGS:
+		case HTTP2_FRAME_PING:
+			err = http2_control_frame(conn, head, h2->frame, len);
+			break;
+
+		case HTTP2_FRAME_PUSH_PROMISE:
+			/* Clients don't push */
+			err = HTTP2_ERR_PROTOCOL_ERROR;
+			break;
 
+		case HTTP2_FRAME_GOAWAY:
+			/* The client is leaving */
+			goto clean_http2;
+
+		case HTTP2_FRAME_WINDOW_UPDATE:
+			err = http2_window_update(conn, stream_id, h2->frame, len);
+			break;
+
+		default:
+			/* Unknown frame types are ignored (RFC 7540 section 4.1) */
+			break;
+		}
+		if (err) {
+			break;
+		}
+
+		if ((type == HTTP2_FRAME_HEADERS || type == HTTP2_FRAME_CONTINUATION)
+		    && !in_block) {
+			/* A complete header block: decode it even for a refused
+			 * stream, so that the decoder table stays in step */
+			h2->last_stream = block_stream;
+			err = http2_decode_headers(conn, block, (int)block_len);
+			if (err) {
+				free_buffered_request_header_list(conn);
+				break;
+			}
+			h2->stream_id = block_stream;
+			if (!block_end_stream) {
+				/* Requests with a body are left to HTTP/1.1 */
+				http2_reset_stream(conn,
+				                   block_stream,
+				                   HTTP2_ERR_HTTP_1_1_REQUIRED);
+				free_buffered_request_header_list(conn);
+			} else {
+				http2_handle_stream(conn, 1);
+			}
+			if (h2->goaway) {
+				break;
+			}
+		}
+	}
+
+	if (err) {
+		http2_goaway(conn, (uint32_t)err);
+	} else if (!STOP_FLAG_IS_ZERO(&conn->phys_ctx->stop_flag)) {
+		http2_goaway(conn, HTTP2_ERR_NO_ERROR);
+	}
+
+clean_http2:
+	DEBUG_TRACE("%s", "HTTP2 free buffer, connection handler finished");
+	http2_flush(conn);
+	mg_free(block);
+}
+
+
+/* Set up conn->http2 for a new HTTP/2 connection. Returns 0 if out of
+ * memory. */
+static int
+http2_init(struct mg_connection *conn)
+{
+	struct mg_http2_connection *h2 = &conn->http2;
+	int one = 1;
+
+	memset(h2, 0, sizeof(*h2));
+	h2->dec.max_bytes = h2->enc.max_bytes = HPACK_TABLE_MAX;
+	h2->enc_size_update = h2->enc_size_low = UINT32_MAX;
+	h2->conn_window = h2->stream_window = h2->peer_initial_window = 65535;
+	h2->frame = (uint8_t *)mg_malloc_ctx(HTTP2_MAX_FRAME, conn->phys_ctx);
+	h2->out = (uint8_t *)mg_malloc_ctx(HTTP2_OUT_SIZE, conn->phys_ctx);
+	conn->protocol_type = PROTOCOL_TYPE_HTTP2;
+	conn->content_len = 0;
+	conn->is_chunked = 0; /* HTTP2 is never chunked */
+
+	/* Frames are collected and flushed in one go: don't let them wait for
+	 * acknowledgements on top of that */
+	(void)setsockopt(conn->client.sock,
+	                 IPPROTO_TCP,
+	                 TCP_NODELAY,
+	                 (SOCK_OPT_TYPE)&one,
+	                 sizeof(one));
+
+	return (h2->frame != NULL) && (h2->out != NULL);
+}
+
+
+static void
+http2_free(struct mg_connection *conn)
+{
+	struct mg_http2_connection *h2 = &conn->http2;
+
+	/* Free memory allocated for headers, if not done yet */
+	DEBUG_TRACE("%s", "Free remaining HTTP2 header memory");
+	free_buffered_response_header_list(conn);
+	hpack_table_evict(&h2->dec, 0);
+	hpack_table_evict(&h2->enc, 0);
+	mg_free(h2->backlog);
+	mg_free(h2->frame);
+	mg_free(h2->out);
+	h2->backlog = h2->frame = h2->out = NULL;
+}
+
+
+/* Read and check the HTTP/2 primer/preface, or what is left of it:
+ * See https://tools.ietf.org/html/rfc7540#section-3.5 */
+static int
+is_valid_http2_primer(struct mg_connection *conn, size_t offset)
+{
+	size_t pri_len = http2_pri_len - offset;
+	char buf[32]; /* Buffer must hold 24 bytes primer */
+
+	if (http2_read(conn, buf, (int)pri_len) != (int)pri_len) {
+		/* Size does not match.
+		 * This includes cases where reading returns error codes */
+		return 0;
+	}
+	return 0 == memcmp(buf, http2_pri + offset, pri_len);
+}
+
+
+/* HTTP/2 negotiated by ALPN: the connection starts with the preface */
 static void
 process_new_http2_connection(struct mg_connection *conn)
 {
-	if (!is_valid_http2_primer(conn)) {
+	if (!http2_init(conn)) {
+		DEBUG_TRACE("%s", "Out of memory for HTTP2");
+	} else if (!is_valid_http2_primer(conn, 0)) {
 		/* Primer does not match expectation from RFC.
 		 * See https://tools.ietf.org/html/rfc7540#section-3.5 */
 		DEBUG_TRACE("%s", "No valid HTTP2 primer");
-		mg_send_http_error(conn, 400, "%s", "Invalid HTTP/2 primer");
-
 	} else {
 		/* Valid HTTP/2 primer received */
 		DEBUG_TRACE("%s", "Start handling HTTP2");
+		http2_send_settings(conn, &http2_civetweb_server_settings);
 		handle_http2(conn);
+	}
+	http2_free(conn);
+}
 
-		/* Free memory allocated for headers, if not done yet */
-		DEBUG_TRACE("%s", "Free remaining HTTP2 header memory");
-		free_buffered_response_header_list(conn);
-		free_buffered_request_header_list(conn);
-		purge_dynamic_header_table(conn, 0);
+
+/* Whether the HTTP/1.1 request in conn asks for h2c in a way that can be
+ * taken up (RFC 7540 section 3.2): it has no body, since the body would
+ * have to be read before switching. The client's settings are decoded
+ * into settings (base64url, at most 64 bytes). Returns their length, or
+ * -1 to answer the request as HTTP/1.1. */
+static int
+http2_upgrade_settings(struct mg_connection *conn, uint8_t *settings)
+{
+	const char *upgrade = mg_get_header(conn, "Upgrade");
+	const char *s = mg_get_header(conn, "HTTP2-Settings");
+	uint32_t acc = 0;
+	int bits = 0, n = 0;
+
+	if (mg_strcasecmp(conn->dom_ctx->config[ENABLE_HTTP2], "yes")
+	    || strcmp(conn->request_info.http_version, "1.1") || !upgrade || !s
+	    || !mg_strcasestr(upgrade, "h2c") || (conn->content_len > 0)
+	    || conn->is_chunked) {
+		return -1;
+	}
+	for (; *s && (*s != '='); s++) {
+		int v;
+		if ((*s >= 'A') && (*s <= 'Z')) {
+			v = *s - 'A';
+		} else if ((*s >= 'a') && (*s <= 'z')) {
+			v = *s - 'a' + 26;
+		} else if ((*s >= '0') && (*s <= '9')) {
+			v = *s - '0' + 52;
+		} else if (*s == '-') {
+			v = 62;
+		} else if (*s == '_') {
+			v = 63;
+		} else {
+			return -1;
+		}
+		acc = (acc << 6) | (uint32_t)v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			if (n == 64) {
+				return -1;
+			}
+			settings[n++] = (uint8_t)(acc >> bits);
+		}
+	}
+	return n;
+}
+
+
+/* HTTP/2 over cleartext (h2c). Either the first request line was the
+ * start of the preface (prior knowledge), or the HTTP/1.1 request in
+ * conn asked to upgrade and is answered as stream 1. */
+static void
+process_h2c_connection(struct mg_connection *conn, int upgrade)
+{
+	static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+	                                "Connection: Upgrade\r\n"
+	                                "Upgrade: h2c\r\n\r\n";
+	uint8_t settings[64];
+	int settings_len = 0;
+
+	if (upgrade) {
+		settings_len = http2_upgrade_settings(conn, settings);
 	}
+	if (!http2_init(conn)) {
+		DEBUG_TRACE("%s", "Out of memory for HTTP2");
+		http2_free(conn);
+		return;
+	}
+	/* "PRI * HTTP/2.0\r\n\r\n", or the request to upgrade */
+	conn->http2.buf_pos = conn->request_len;
+
+	if (!upgrade) {
+		if (!is_valid_http2_primer(conn, conn->request_len)) {
+			DEBUG_TRACE("%s", "No valid HTTP2 primer");
+			http2_free(conn);
+			return;
+		}
+		http2_send_settings(conn, &http2_civetweb_server_settings);
+
+	} else {
+		/* Implicitly acknowledged by the 101 response */
+		if ((settings_len > 0)
+		    && http2_apply_settings(conn, settings, (uint32_t)settings_len)) {
+			http2_free(conn);
+			return;
+		}
+		if (mg_xwrite(conn, switching, sizeof(switching) - 1)
+		    != (int)sizeof(switching) - 1) {
+			http2_free(conn);
+			return;
+		}
+		http2_send_settings(conn, &http2_civetweb_server_settings);
+
+		/* The request becomes stream 1, half closed by the client */
+		conn->request_info.http_version = "2";
+		conn->http2.stream_id = conn->http2.last_stream = 1;
+		http2_handle_stream(conn, 0);
+		if (!http2_flush(conn) || conn->http2.goaway
+		    || !is_valid_http2_primer(conn, 0)) {
+			http2_free(conn);
+			return;
+		}
+	}
+
+	DEBUG_TRACE("%s", "Start handling HTTP2");
+	handle_http2(conn);
+	http2_free(conn);
 }
@@ -123,159 +123,457 @@ send_compressed_data(struct mg_connection *conn, struct mg_file *filep)
 	deflateEnd(&zstream);
 
 	/* Send "end of chunked data" marker */
-	mg_write(conn, "0\r\n\r\n", 5);
+	if (conn->protocol_type == PROTOCOL_TYPE_HTTP1) {
+		mg_write(conn, "0\r\n\r\n", 5);
+	}
+}
+
+
+#if defined(USE_WEBSOCKET)
+/* permessage-deflate (RFC 7692) with context takeover. The offer is
+ * settled in the handshake. The compressor is set up on first use by a
+ * writer, under the connection lock, and the decompressor by the reader
+ * thread, so a connection that never sends or receives a compressed
+ * message costs no zlib memory. */
+
+#if !defined(WEBSOCKET_DEFLATE_LEVEL)
+#define WEBSOCKET_DEFLATE_LEVEL (Z_DEFAULT_COMPRESSION)
+#endif
+
+/* Shorter messages gain nothing from compression and are sent as is */
+#if !defined(WEBSOCKET_DEFLATE_MIN_SIZE)
+#define WEBSOCKET_DEFLATE_MIN_SIZE (16)
+#endif
+
+/* Largest frame a client may have the server inflate */
+#if !defined(WEBSOCKET_INFLATE_MAX_SIZE)
+#define WEBSOCKET_INFLATE_MAX_SIZE (16 * 1024 * 1024)
+#endif
+
+/* The end of a sync flush, which senders drop from each message */
+static const unsigned char websocket_deflate_tail[4] = {0, 0, 0xff, 0xff};
+
+
+static const char *
+websocket_deflate_skip_blanks(const char *s, const char *end)
+{
+	while ((s < end) && ((*s == ' ') || (*s == '\t'))) {
+		s++;
+	}
+	return s;
 }
 
 
-#if defined(USE_WEBSOCKET) && defined(MG_EXPERIMENTAL_INTERFACES)
+/* Settle one permessage-deflate offer from the parameters in [s, end)
+ * that follow its name, with the server's window at most window_bits.
+ * Returns 0 with conn's parameters set, or -1 if it must be declined:
+ * unknown or repeated parameters, bad values, or a server window of 8,
+ * which zlib cannot compress with. */
 static int
-websocket_deflate_initialize(struct mg_connection *conn, int server)
+websocket_deflate_accept_offer(struct mg_connection *conn,
+                               const char *s,
+                               const char *end,
+                               int window_bits)
 {
-	int zret =
-	    deflateInit2(&conn->websocket_deflate_state,
-	                 Z_BEST_COMPRESSION,
-	                 Z_DEFLATED,
-	                 server
-	                     ? -1 * conn->websocket_deflate_server_max_windows_bits
-	                     : -1 * conn->websocket_deflate_client_max_windows_bits,
-	                 MEM_LEVEL,
-	                 Z_DEFAULT_STRATEGY);
-	if (zret != Z_OK) {
-		mg_cry_internal(conn,
-		                "Websocket deflate init failed (%i): %s",
-		                zret,
-		                (conn->websocket_deflate_state.msg
-		                     ? conn->websocket_deflate_state.msg
-		                     : "<no error message>"));
-		deflateEnd(&conn->websocket_deflate_state);
-		return zret;
+	struct mg_websocket_deflate_stats *st = &conn->websocket_deflate_stats;
+	int server_bits = -1, client_bits = -1; /* -1: absent, 0: no value */
+	int server_nct = 0, client_nct = 0;
+	const char *name, *name_end, *v;
+	int val, digits, quoted;
+	size_t n;
+
+	for (;;) {
+		s = websocket_deflate_skip_blanks(s, end);
+		if (s == end) {
+			break;
+		}
+		if (*s++ != ';') {
+			return -1;
+		}
+		name = websocket_deflate_skip_blanks(s, end);
+		for (s = name; (s < end) && (*s != ';') && (*s != '='); s++)
+			;
+		for (name_end = s;
+		     (name_end > name) && ((name_end[-1] == ' ') || (name_end[-1] == '\t'));
+		     name_end--)
+			;
+		n = (size_t)(name_end - name);
+		val = -1;
+		if ((s < end) && (*s == '=')) {
+			v = websocket_deflate_skip_blanks(s + 1, end);
+			quoted = (v < end) && (*v == '"');
+			v += quoted;
+			for (val = digits = 0; (v < end) && isdigit((unsigned char)*v);
+			     v++, digits++) {
+				if (val < 100) {
+					val = val * 10 + (*v - '0');
+				}
+			}
+			if (!digits || (quoted && ((v == end) || (*v++ != '"')))) {
+				return -1;
+			}
+			s = v;
+		}
+
+		if ((n == 26) && !mg_strncasecmp(name, "server_no_context_takeover", n)) {
+			if (server_nct || (val != -1)) {
+				return -1;
+			}
+			server_nct = 1;
+		} else if ((n == 26)
+		           && !mg_strncasecmp(name, "client_no_context_takeover", n)) {
+			if (client_nct || (val != -1)) {
+				return -1;
+			}
+			client_nct = 1;
+		} else if ((n == 22)
+		           && !mg_strncasecmp(name, "server_max_window_bits", n)) {
+			if ((server_bits != -1) || (val < 8) || (val > 15)) {
+				return -1;
+			}
+			server_bits = val;
+		} else if ((n == 22)
+		           && !mg_strncasecmp(name, "client_max_window_bits", n)) {
+			if ((client_bits != -1) || ((val != -1) && ((val < 8) || (val > 15)))) {
+				return -1;
+			}
+			client_bits = (val == -1) ? 0 : val;
+		} else {
+			return -1;
+		}
+	}
+	if (server_bits == 8) {
+		return -1;
 	}
 
-	zret = inflateInit2(
-	    &conn->websocket_inflate_state,
-	    server ? -1 * conn->websocket_deflate_client_max_windows_bits
-	           : -1 * conn->websocket_deflate_server_max_windows_bits);
-	if (zret != Z_OK) {
-		mg_cry_internal(conn,
-		                "Websocket inflate init failed (%i): %s",
-		                zret,
-		                (conn->websocket_inflate_state.msg
-		                     ? conn->websocket_inflate_state.msg
-		                     : "<no error message>"));
-		inflateEnd(&conn->websocket_inflate_state);
-		return zret;
+	conn->websocket_deflate_server_max_windows_bits =
+	    ((server_bits > 0) && (server_bits < window_bits)) ? server_bits
+	                                                       : window_bits;
+	/* A client that doesn't say it can limit its window uses 15 bits */
+	if (client_bits == -1) {
+		conn->websocket_deflate_client_max_windows_bits = 15;
+	} else if ((client_bits == 0) || (client_bits > window_bits)) {
+		conn->websocket_deflate_client_max_windows_bits = window_bits;
+	} else {
+		conn->websocket_deflate_client_max_windows_bits = client_bits;
 	}
-	if ((conn->websocket_deflate_server_no_context_takeover && server)
-	    || (conn->websocket_deflate_client_no_context_takeover && !server))
-		conn->websocket_deflate_flush = Z_FULL_FLUSH;
-	else
-		conn->websocket_deflate_flush = Z_SYNC_FLUSH;
-
-	conn->websocket_deflate_initialized = 1;
-	return Z_OK;
+	conn->websocket_deflate_client_bits_offered = (client_bits != -1);
+	conn->websocket_deflate_server_no_context_takeover = server_nct;
+	conn->websocket_deflate_client_no_context_takeover = client_nct;
+	conn->websocket_deflate_flush = server_nct ? Z_FULL_FLUSH : Z_SYNC_FLUSH;
+
+	st->window_bits = conn->websocket_deflate_server_max_windows_bits;
+	st->client_window_bits = conn->websocket_deflate_client_max_windows_bits;
+	st->context_takeover = !server_nct;
+	return 0;
 }
 
 
+/* Accept the first permessage-deflate offer the server can take, unless
+ * websocket_deflate_window_bits is 0 */
 static void
 websocket_deflate_negotiate(struct mg_connection *conn)
 {
-	const char *extensions = mg_get_header(conn, "Sec-WebSocket-Extensions");
-	int val;
-	if (extensions && !strncmp(extensions, "permessage-deflate", 18)) {
-		conn->accept_gzip = 1;
-		conn->websocket_deflate_client_max_windows_bits = 15;
-		conn->websocket_deflate_server_max_windows_bits = 15;
-		conn->websocket_deflate_server_no_context_takeover = 0;
-		conn->websocket_deflate_client_no_context_takeover = 0;
-		extensions += 18;
-		while (*extensions != '\0') {
-			if (*extensions == ';' || *extensions == ' ')
-				++extensions;
-			else if (!strncmp(extensions, "server_no_context_takeover", 26)) {
-				extensions += 26;
-				conn->websocket_deflate_server_no_context_takeover = 1;
-			} else if (!strncmp(extensions, "client_no_context_takeover", 26)) {
-				extensions += 26;
-				conn->websocket_deflate_client_no_context_takeover = 1;
-			} else if (!strncmp(extensions, "server_max_window_bits", 22)) {
-				extensions += 22;
-				if (*extensions == '=') {
-					++extensions;
-					if (*extensions == '"')
-						++extensions;
-					val = 0;
-					while (*extensions >= '0' && *extensions <= '9') {
-						val = val * 10 + (*extensions - '0');
-						++extensions;
-					}
-					if (val < 9 || val > 15) {
-						// The permessage-deflate spec specifies that a
-						// value of 8 is also allowed, but zlib doesn't accept
-						// that.
-						mg_cry_internal(conn,
-						                "server-max-window-bits must be "
-						                "between 9 and 15. Got %i",
-						                val);
-					} else
-						conn->websocket_deflate_server_max_windows_bits = val;
-					if (*extensions == '"')
-						++extensions;
-				}
-			} else if (!strncmp(extensions, "client_max_window_bits", 22)) {
-				extensions += 22;
-				if (*extensions == '=') {
-					++extensions;
-					if (*extensions == '"')
-						++extensions;
-					val = 0;
-					while (*extensions >= '0' && *extensions <= '9') {
-						val = val * 10 + (*extensions - '0');
-						++extensions;
-					}
-					if (val < 9 || val > 15)
-						// The permessage-deflate spec specifies that a
-						// value of 8 is also allowed, but zlib doesn't
-						// accept that.
-						mg_cry_internal(conn,
-						                "client-max-window-bits must be "
-						                "between 9 and 15. Got %i",
-						                val);
-					else
-						conn->websocket_deflate_client_max_windows_bits = val;
-					if (*extensions == '"')
-						++extensions;
-				}
-			} else {
-				mg_cry_internal(conn,
-				                "Unknown parameter %s for permessage-deflate",
-				                extensions);
-				break;
-			}
+	const char *offers = mg_get_header(conn, "Sec-WebSocket-Extensions");
+	const char *bits = conn->dom_ctx->config[WEBSOCKET_DEFLATE_WINDOW_BITS];
+	const char *level = conn->dom_ctx->config[WEBSOCKET_DEFLATE_MEM_LEVEL];
+	int window_bits = bits ? atoi(bits) : 0;
+	int mem_level = level ? atoi(level) : MEM_LEVEL;
+	const char *end, *name_end;
+
+	conn->websocket_deflate_negotiated = 0;
+	conn->websocket_deflate_initialized = 0;
+	conn->websocket_inflate_initialized = 0;
+	conn->websocket_inflating = 0;
+	memset(&conn->websocket_deflate_stats,
+	       0,
+	       sizeof(conn->websocket_deflate_stats));
+	if ((offers == NULL) || (window_bits <= 0)) {
+		return;
+	}
+	window_bits = (window_bits < 9) ? 9 : (window_bits > 15) ? 15 : window_bits;
+	mem_level = (mem_level < 1) ? 1 : (mem_level > 9) ? 9 : mem_level;
+	conn->websocket_deflate_mem_level = mem_level;
+	conn->websocket_deflate_stats.mem_level = mem_level;
+
+	/* Offers are listed in the client's order of preference */
+	while (*offers) {
+		end = strchr(offers, ',');
+		if (end == NULL) {
+			end = offers + strlen(offers);
 		}
-	} else {
-		conn->accept_gzip = 0;
+		offers = websocket_deflate_skip_blanks(offers, end);
+		for (name_end = offers; (name_end < end) && (*name_end != ';')
+		                        && (*name_end != ' ') && (*name_end != '\t');
+		     name_end++)
+			;
+		if ((name_end - offers == 18)
+		    && !mg_strncasecmp(offers, "permessage-deflate", 18)
+		    && !websocket_deflate_accept_offer(conn,
+		                                       name_end,
+		                                       end,
+		                                       window_bits)) {
+			conn->websocket_deflate_negotiated = 1;
+			return;
+		}
+		offers = *end ? end + 1 : end;
 	}
-	conn->websocket_deflate_initialized = 0;
 }
 
 
 static void
 websocket_deflate_response(struct mg_connection *conn)
 {
-	if (conn->accept_gzip) {
+	if (!conn->websocket_deflate_negotiated) {
+		return;
+	}
+	mg_printf(conn,
+	          "Sec-WebSocket-Extensions: permessage-deflate%s%s; "
+	          "server_max_window_bits=%i",
+	          conn->websocket_deflate_server_no_context_takeover
+	              ? "; server_no_context_takeover"
+	              : "",
+	          conn->websocket_deflate_client_no_context_takeover
+	              ? "; client_no_context_takeover"
+	              : "",
+	          conn->websocket_deflate_server_max_windows_bits);
+	/* Only a client that offered it may be told to limit its window */
+	if (conn->websocket_deflate_client_bits_offered) {
 		mg_printf(conn,
-		          "Sec-WebSocket-Extensions: permessage-deflate; "
-		          "server_max_window_bits=%i; "
-		          "client_max_window_bits=%i"
-		          "%s%s\r\n",
-		          conn->websocket_deflate_server_max_windows_bits,
-		          conn->websocket_deflate_client_max_windows_bits,
-		          conn->websocket_deflate_client_no_context_takeover
-		              ? "; client_no_context_takeover"
-		              : "",
-		          conn->websocket_deflate_server_no_context_takeover
-		              ? "; server_no_context_takeover"
-		              : "");
-	};
+		          "; client_max_window_bits=%i",
+		          conn->websocket_deflate_client_max_windows_bits);
+	}
+	mg_printf(conn, "%s", "\r\n");
+}
+
+
+/* Compress a whole message. Returns the payload to send, which the caller
+ * frees, without the tail the receiver adds back; NULL on error. Called
+ * with the connection locked. */
+static unsigned char *
+websocket_deflate(struct mg_connection *conn,
+                  const char *data,
+                  size_t len,
+                  size_t *out_len)
+{
+	z_stream *z = &conn->websocket_deflate_state;
+	size_t cap = len + len / 8 + 64, n = 0;
+	unsigned char *out = NULL, *p;
+	int zret;
+
+	if (!conn->websocket_deflate_initialized) {
+		memset(z, 0, sizeof(*z));
+		z->zalloc = zalloc;
+		z->zfree = zfree;
+		z->opaque = (void *)conn;
+		zret = deflateInit2(z,
+		                    WEBSOCKET_DEFLATE_LEVEL,
+		                    Z_DEFLATED,
+		                    -conn->websocket_deflate_server_max_windows_bits,
+		                    conn->websocket_deflate_mem_level,
+		                    Z_DEFAULT_STRATEGY);
+		if (zret != Z_OK) {
+			mg_cry_internal(conn,
+			                "Websocket deflate init failed (%i): %s",
+			                zret,
+			                (z->msg ? z->msg : "<no error message>"));
+			return NULL;
+		}
+		conn->websocket_deflate_initialized = 1;
+	}
+
+	z->next_in = (Bytef *)data;
+	z->avail_in = (uInt)len;
+	for (;;) {
+		p = (unsigned char *)mg_realloc_ctx(out, cap, conn->phys_ctx);
+		if (p == NULL) {
+			mg_cry_internal(conn,
+			                "Out of memory: Cannot allocate deflate buffer "
+			                "of %lu bytes",
+			                (unsigned long)cap);
+			mg_free(out);
+			return NULL;
+		}
+		out = p;
+		z->next_out = out + n;
+		z->avail_out = (uInt)(cap - n);
+		zret = deflate(z, conn->websocket_deflate_flush);
+		n = cap - z->avail_out;
+		if (zret == Z_STREAM_ERROR) {
+			break;
+		}
+		if (z->avail_out != 0) {
+			break;
+		}
+		cap *= 2;
+	}
+	if ((zret == Z_STREAM_ERROR) || (n < 4)
+	    || memcmp(out + n - 4, websocket_deflate_tail, 4)) {
+		mg_cry_internal(conn, "Websocket deflate failed (%i)", zret);
+		mg_free(out);
+		return NULL;
+	}
+	conn->websocket_deflate_stats.sent_bytes += len;
+	conn->websocket_deflate_stats.sent_compressed += n - 4;
+	*out_len = n - 4;
+	return out;
+}
+
+
+/* Run the decompressor over in, growing *out as it fills */
+static int
+websocket_inflate_run(struct mg_connection *conn,
+                      const unsigned char *in,
+                      size_t in_len,
+                      unsigned char **out,
+                      size_t *n,
+                      size_t *cap)
+{
+	z_stream *z = &conn->websocket_inflate_state;
+	unsigned char *p;
+	size_t grow;
+	int zret;
+
+	z->next_in = (Bytef *)in;
+	z->avail_in = (uInt)in_len;
+	do {
+		if (*n == *cap) {
+			if (*cap > WEBSOCKET_INFLATE_MAX_SIZE) {
+				mg_cry_internal(conn,
+				                "Websocket message inflates to over %lu bytes",
+				                (unsigned long)WEBSOCKET_INFLATE_MAX_SIZE);
+				return -1;
+			}
+			grow = *cap ? *cap * 2 : in_len * 4 + 256;
+			if (grow > WEBSOCKET_INFLATE_MAX_SIZE) {
+				grow = WEBSOCKET_INFLATE_MAX_SIZE + 1;
+			}
+			p = (unsigned char *)mg_realloc_ctx(*out, grow, conn->phys_ctx);
+			if (p == NULL) {
+				mg_cry_internal(conn,
+				                "Out of memory: Cannot allocate inflate "
+				                "buffer of %lu bytes",
+				                (unsigned long)grow);
+				return -1;
+			}
+			*out = p;
+			*cap = grow;
+		}
+		z->next_out = *out + *n;
+		z->avail_out = (uInt)(*cap - *n);
+		zret = inflate(z, Z_SYNC_FLUSH);
+		*n = *cap - z->avail_out;
+		if (zret == Z_STREAM_END) {
+			/* A final block: the next message starts a new stream */
+			inflateReset(z);
+			return 0;
+		}
+		if ((zret != Z_OK) && (zret != Z_BUF_ERROR)) {
+			mg_cry_internal(conn,
+			                "Websocket inflate error (%i): %s",
+			                zret,
+			                (z->msg ? z->msg : "<no error message>"));
+			return -1;
+		}
+	} while ((z->avail_in != 0) || (z->avail_out == 0));
+	return 0;
+}
+
+
+/* Decompress one frame of a compressed message; the last one (fin) gets
+ * the dropped tail back. Returns the data, which the caller frees, or
+ * NULL on error. Reader thread only. */
+static unsigned char *
+websocket_inflate(struct mg_connection *conn,
+                  const unsigned char *data,
+                  size_t len,
+                  int fin,
+                  size_t *out_len)
+{
+	z_stream *z = &conn->websocket_inflate_state;
+	struct mg_websocket_deflate_stats *st = &conn->websocket_deflate_stats;
+	unsigned char *out = NULL;
+	size_t n = 0, cap = 0;
+	int bits, zret;
+
+	if (!conn->websocket_inflate_initialized) {
+		/* zlib clients told 8 bits still use a 9-bit window */
+		bits = conn->websocket_deflate_client_max_windows_bits;
+		memset(z, 0, sizeof(*z));
+		z->zalloc = zalloc;
+		z->zfree = zfree;
+		z->opaque = (void *)conn;
+		zret = inflateInit2(z, (bits < 9) ? -9 : -bits);
+		if (zret != Z_OK) {
+			mg_cry_internal(conn,
+			                "Websocket inflate init failed (%i): %s",
+			                zret,
+			                (z->msg ? z->msg : "<no error message>"));
+			return NULL;
+		}
+		conn->websocket_inflate_initialized = 1;
+	}
+
+	if (websocket_inflate_run(conn, data, len, &out, &n, &cap)
+	    || (fin
+	        && websocket_inflate_run(
+	            conn, websocket_deflate_tail, 4, &out, &n, &cap))) {
+		mg_free(out);
+		return NULL;
+	}
+	if (out == NULL) {
+		out = (unsigned char *)mg_malloc_ctx(1, conn->phys_ctx);
+	}
+	mg_lock_connection(conn);
+	st->received_bytes += n;
+	st->received_compressed += len;
+	mg_unlock_connection(conn);
+	*out_len = n;
+	return out;
+}
+
+
+/* Whether a frame's payload is compressed: one with RSV1 set starts a
+ * compressed message, whose continuation frames follow without it.
+ * Returns -1 for RSV1 where it isn't allowed. Reader thread only. */
+static int
+websocket_frame_compressed(struct mg_connection *conn, unsigned char mop)
+{
+	int opcode = mop & 0xf;
+	int rsv1 = (mop & 0x40) ? 1 : 0;
+
+	if ((opcode == MG_WEBSOCKET_OPCODE_TEXT)
+	    || (opcode == MG_WEBSOCKET_OPCODE_BINARY)) {
+		if (rsv1 && !conn->websocket_deflate_negotiated) {
+			return -1;
+		}
+		conn->websocket_inflating = rsv1;
+		return rsv1;
+	}
+	if (rsv1) {
+		return -1;
+	}
+	return (opcode == MG_WEBSOCKET_OPCODE_CONTINUATION)
+	           ? conn->websocket_inflating
+	           : 0;
+}
+
+
+/* Free the zlib streams when the connection closes. Writes that come
+ * after this go out uncompressed. */
+static void
+websocket_deflate_free(struct mg_connection *conn)
+{
+	mg_lock_connection(conn);
+	if (conn->websocket_deflate_initialized) {
+		deflateEnd(&conn->websocket_deflate_state);
+		conn->websocket_deflate_initialized = 0;
+	}
+	if (conn->websocket_inflate_initialized) {
+		inflateEnd(&conn->websocket_inflate_state);
+		conn->websocket_inflate_initialized = 0;
+	}
+	conn->websocket_deflate_negotiated = 0;
+	mg_unlock_connection(conn);
 }
 #endif
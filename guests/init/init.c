@@ -5,6 +5,8 @@
 #include <dirent.h>
 #include <errno.h>
 
+#include "portator.h"
+
 static int mkdirs(const char *path) {
     char tmp[4096];
     snprintf(tmp, sizeof(tmp), "%s", path);
@@ -52,39 +54,70 @@ static int copy_file(const char *src, const char *dst) {
     return 0;
 }
 
-/* Recursively copy zipdir/ to outdir/ */
+/* Recursively copy zipdir/ to outdir/. Each directory is listed in one
+   call, types included, instead of a readdir() and stat() per entry. */
 static int copy_tree(const char *zipdir, const char *outdir) {
-    DIR *d = opendir(zipdir);
-    if (!d) {
+    void *buf;
+    uint64_t cookie = 0;
+    long n = portator_readdir_alloc(zipdir, &buf, &cookie);
+    if (n < 0) {
         fprintf(stderr, "init: cannot open %s\n", zipdir);
         return -1;
     }
 
-    struct dirent *ent;
-    while ((ent = readdir(d)) != NULL) {
-        if (ent->d_name[0] == '.') continue;
+    int rc = 0;
+    const struct PortatorDirent *d;
+    for (d = buf; rc == 0 && (char *)d < (char *)buf + n;
+         d = portator_dirent_next(d)) {
+        if (d->name[0] == '.') continue;
 
         char src[4096], dst[4096];
-        snprintf(src, sizeof(src), "%s/%s", zipdir, ent->d_name);
-        snprintf(dst, sizeof(dst), "%s/%s", outdir, ent->d_name);
+        snprintf(src, sizeof(src), "%s/%s", zipdir, d->name);
+        snprintf(dst, sizeof(dst), "%s/%s", outdir, d->name);
 
-        struct stat st;
-        if (stat(src, &st) == 0 && S_ISDIR(st.st_mode)) {
-            if (copy_tree(src, dst)) { closedir(d); return -1; }
+        if (d->type == DT_DIR) {
+            rc = copy_tree(src, dst);
         } else {
             printf("  %s\n", dst);
-            if (copy_file(src, dst)) { closedir(d); return -1; }
+            rc = copy_file(src, dst);
         }
     }
-    closedir(d);
-    return 0;
+    if (n) munmap(buf, n);
+    return rc;
+}
+
+/* Write zipdir out to outdir natively, listing what was written.
+   Returns 0, or 1 if the host couldn't (all or some), for copy_tree to
+   try. */
+static int extract(const char *zipdir, const char *outdir) {
+    char *manifest;
+    int failed = 0;
+    long n = portator_extract_alloc(zipdir, outdir, &manifest);
+    if (n < 0) return 1;
+    for (char *line = manifest; line < manifest + n;) {
+        char *end = memchr(line, '\n', manifest + n - line);
+        if (!end) break;
+        /* "w <crc32> <size> <path>" for each file written */
+        failed |= line[0] == '!';
+        if (line[0] == 'w') {
+            char *path = strchr(strchr(line + 2, ' ') + 1, ' ') + 1;
+            printf("  %s/%.*s\n", outdir, (int)(end - path), path);
+        }
+        line = end + 1;
+    }
+    munmap(manifest, n);
+    return failed;
+}
+
+static int install(const char *zipdir, const char *outdir) {
+    return extract(zipdir, outdir) ? copy_tree(zipdir, outdir) : 0;
 }
 
 int main(void) {
     printf("Extracting shared files...\n");
 
-    if (copy_tree("zip/include", "include")) return 1;
-    if (copy_tree("zip/src", "src")) return 1;
+    if (install("zip/include", "include")) return 1;
+    if (install("zip/src", "src")) return 1;
 
     printf("Done.\n");
     return 0;
@@ -4,6 +4,13 @@
 #include "portator.h"
 
 static void print_file(const char *path) {
+    size_t size;
+    void *map = portator_mapfile(path, &size);
+    if (map != (void *)-1) {
+        fwrite(map, 1, size, stdout);
+        portator_unmapfile(map, size);
+        return;
+    }
     FILE *f = fopen(path, "r");
     if (!f) return;
     char buf[4096];
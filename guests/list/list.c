@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include "portator.h"
 #include <cjson/cJSON.h>
 
@@ -8,28 +9,17 @@ int main(void) {
     if (portator_version(ver, sizeof(ver)) > 0)
         printf("Running on %s\n", ver);
 
-    long n = portator_list(NULL, 0);
+    char *buf;
+    long n = portator_list_alloc(&buf);
     if (n <= 0) {
-        printf("Failed to get app list size\n");
-        return 1;
-    }
-
-    char *buf = malloc(n);
-    if (!buf) {
-        printf("Out of memory\n");
+        printf("Failed to get app list\n");
         return 1;
     }
 
     // TODO: Rewrite this to do its own scanning without the syscall
 
-    if (portator_list(buf, n) <= 0) {
-        printf("Failed to get app list\n");
-        free(buf);
-        return 1;
-    }
-
     cJSON *root = cJSON_Parse(buf);
-    free(buf);
+    munmap(buf, n);
     if (!root) {
         printf("JSON parse error\n");
         return 1;
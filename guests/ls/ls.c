@@ -2,7 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
-#include <sys/stat.h>
+
+#include "portator.h"
 
 int main(int argc, char **argv) {
     const char *pwd = getenv("PWD");
@@ -18,25 +19,21 @@ int main(int argc, char **argv) {
         snprintf(path, sizeof(path), "%s", pwd);
     }
 
-    DIR *d = opendir(path);
-    if (!d) {
+    /* names and types come 64K at a time, in a call or two */
+    static char buf[65536];
+    uint64_t cookie = 0;
+    long n;
+    while ((n = portator_readdir(path, buf, sizeof(buf), &cookie)) > 0) {
+        const struct PortatorDirent *d;
+        for (d = (const struct PortatorDirent *)buf; (char *)d < buf + n;
+             d = portator_dirent_next(d)) {
+            if (d->name[0] == '.') continue;
+            printf("%s%s\n", d->name, d->type == DT_DIR ? "/" : "");
+        }
+    }
+    if (n < 0) {
         fprintf(stderr, "ls: cannot open '%s'\n", argc > 1 ? argv[1] : path);
         return 1;
     }
-
-    struct dirent *ent;
-    while ((ent = readdir(d)) != NULL) {
-        if (ent->d_name[0] == '.') continue;
-
-        char fullpath[4096];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", path, ent->d_name);
-
-        struct stat st;
-        if (stat(fullpath, &st) == 0 && S_ISDIR(st.st_mode))
-            printf("%s/\n", ent->d_name);
-        else
-            printf("%s\n", ent->d_name);
-    }
-    closedir(d);
     return 0;
 }
@@ -0,0 +1,95 @@
+/* membench: find the size at which PORTATOR_SYS_MEM beats the guest's
+   own memmove/memset/memcmp/memchr. Each size runs both ways for about
+   50ms; the crossover is the smallest size from which the host call is
+   faster at every larger size too. Build the guests that use
+   portator_memcpy() and friends with -DPORTATOR_MEM_THRESHOLD=<that>.
+
+       portator build membench && portator run membench */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "portator.h"
+
+#define MIN_SIZE 64
+#define MAX_SIZE (8 << 20)
+#define RUN_NS 50000000LL
+
+enum { MOVE, SET, CMP, CHR, NOPS };
+static const char *const kOpNames[NOPS] = { "memmove", "memset", "memcmp",
+                                            "memchr" };
+
+static unsigned char *a, *b;
+static volatile long sink;
+
+static void run(int op, int host, size_t n) {
+    if (host) {
+        switch (op) {
+            case MOVE: portator_mem(PORTATOR_MEM_OP_MOVE, a, (long)b, n); break;
+            case SET: portator_mem(PORTATOR_MEM_OP_SET, a, 7, n); break;
+            case CMP: sink = portator_mem(PORTATOR_MEM_OP_CMP, a, (long)b, n); break;
+            case CHR: sink = portator_mem(PORTATOR_MEM_OP_CHR, a, 1, n); break;
+        }
+    } else {
+        switch (op) {
+            case MOVE: memmove(a, b, n); break;
+            case SET: memset(a, 7, n); break;
+            case CMP: sink = memcmp(a, b, n); break;
+            case CHR: sink = (long)memchr(a, 1, n); break;
+        }
+    }
+}
+
+/* Nanoseconds per call of op at size n */
+static double measure(int op, int host, size_t n) {
+    long calls = 0;
+    int64_t start = portator_monotonic_ns(), now;
+    do {
+        for (int i = 0; i < 16; i++) run(op, host, n);
+        calls += 16;
+        now = portator_monotonic_ns();
+    } while (now - start < RUN_NS);
+    return (double)(now - start) / calls;
+}
+
+int main(void) {
+    size_t crossover[NOPS];
+    a = malloc(MAX_SIZE);
+    b = malloc(MAX_SIZE);
+    if (!a || !b) return 1;
+    /* equal buffers with no 1 byte: memcmp and memchr scan the whole
+       length, as they would in their worst case */
+    memset(a, 0, MAX_SIZE);
+    memset(b, 0, MAX_SIZE);
+
+    printf("%10s", "bytes");
+    for (int op = 0; op < NOPS; op++) printf(" %9s guest/host", kOpNames[op]);
+    printf("\n");
+    for (int op = 0; op < NOPS; op++) crossover[op] = 0;
+    for (size_t n = MIN_SIZE; n <= MAX_SIZE; n *= 2) {
+        printf("%10zu", n);
+        for (int op = 0; op < NOPS; op++) {
+            double guest = measure(op, 0, n), host = measure(op, 1, n);
+            printf(" %9.0fns %7.0fns", guest, host);
+            if (host >= guest) crossover[op] = 0;
+            else if (!crossover[op]) crossover[op] = n;
+            /* a and b are equal again for the next op */
+            memset(a, 0, n);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    printf("\ncrossover:");
+    size_t worst = 0;
+    for (int op = 0; op < NOPS; op++) {
+        if (crossover[op]) printf(" %s %zu", kOpNames[op], crossover[op]);
+        else printf(" %s never", kOpNames[op]);
+        if (crossover[op] > worst) worst = crossover[op];
+    }
+    printf("\n");
+    if (worst)
+        printf("suggested: -DPORTATOR_MEM_THRESHOLD=%zu (default %d)\n", worst,
+               PORTATOR_MEM_THRESHOLD);
+    return 0;
+}
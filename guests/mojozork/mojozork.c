@@ -16,6 +16,10 @@
 #include <stdint.h>
 #include <time.h>
 
+#if !defined(MULTIZORK) && !defined(MOJOZORK_LIBRETRO)
+#include "portator.h"
+#endif
+
 #define MOJOZORK_DEBUGGING 0
 
 static inline void dbg(const char *fmt, ...)
@@ -2076,7 +2080,27 @@ static void loadStory(const char *fname)
 
     if (!fname) {
         GState->die("USAGE: mojozork <story_file>");
-    } else if ((io = fopen(fname, "rb")) == NULL) {
+    }
+
+#ifdef PORTATOR_SYS_MAPFILE
+    {
+        /* one call maps the story out of the zip; copy it, since the
+           Z-machine writes to its dynamic memory */
+        size_t maplen;
+        void *map = portator_mapfile(fname, &maplen);
+        if (map != (void *) -1 && maplen) {
+            if ((story = (uint8 *) malloc(maplen)) == NULL) {
+                GState->die("Out of memory");
+            }
+            memcpy(story, map, maplen);
+            portator_unmapfile(map, maplen);
+            initStory(fname, story, (uint32) maplen);
+            return;
+        }
+    }
+#endif
+
+    if ((io = fopen(fname, "rb")) == NULL) {
         GState->die("Failed to open '%s'", fname);
     } else if ((fseek(io, 0, SEEK_END) == -1) || ((len = ftell(io)) == -1)) {
         GState->die("Failed to determine size of '%s'", fname);
@@ -8,7 +8,6 @@
 
 #include "portator.h"
 #include <cjson/cJSON.h>
-#include "mustach-cjson.h"
 
 static int makedir(const char *path) {
     if (mkdir(path, 0755) && errno != EEXIST) {
@@ -18,25 +17,9 @@ static int makedir(const char *path) {
     return 0;
 }
 
-/* Read an entire file into a malloc'd buffer. Returns NULL on failure. */
-static char *read_file(const char *path, size_t *out_len) {
-    FILE *f = fopen(path, "r");
-    if (!f) return NULL;
-    fseek(f, 0, SEEK_END);
-    long len = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    char *buf = malloc(len + 1);
-    if (!buf) { fclose(f); return NULL; }
-    size_t n = fread(buf, 1, len, f);
-    buf[n] = '\0';
-    fclose(f);
-    if (out_len) *out_len = n;
-    return buf;
-}
-
-
 /* Process a template directory: for each file in apps/new/templates/<type>/,
-   apply mustache substitution and write to <name>/ */
+   apply mustache substitution and write to <name>/. The host renders
+   each file natively, reading the template and writing the result. */
 static int process_templates(const char *type, const char *name) {
     char tmpldir[4096];
     snprintf(tmpldir, sizeof(tmpldir), "zip/apps/new/templates/%s", type);
@@ -51,6 +34,12 @@ static int process_templates(const char *type, const char *name) {
 
     cJSON *data = cJSON_CreateObject();
     cJSON_AddStringToObject(data, "name", name);
+    char *json = cJSON_PrintUnformatted(data);
+    cJSON_Delete(data);
+    if (!json) {
+        closedir(d);
+        return -1;
+    }
     fprintf(stderr, "I %s(%d): name: %s\n", __FILE__, __LINE__, name);
 
     struct dirent *ent;
@@ -64,13 +53,6 @@ static int process_templates(const char *type, const char *name) {
 
         fprintf(stderr, "I %s(%d): srcpath: %s\n", __FILE__, __LINE__, srcpath);
 
-        /* Read template */
-        size_t tmpl_len;
-        char *tmpl = read_file(srcpath, &tmpl_len);
-        if (!tmpl) continue;
-
-        fprintf(stderr, "I %s(%d): tmpl: \n=====\n%s\n=====\n", __FILE__, __LINE__, tmpl);
-
         /* Determine output filename: replace __NAME__ with project name */
         char outname[256];
         const char *p = strstr(ent->d_name, "__NAME__");
@@ -83,34 +65,21 @@ static int process_templates(const char *type, const char *name) {
         }
         fprintf(stderr, "I %s(%d): outname: %s\n", __FILE__, __LINE__, outname);
 
-        /* Render template with mustache */
-        char *result = NULL;
-        size_t result_len = 0;
-        int rc = mustach_cJSON_mem(tmpl, tmpl_len, data, 0, &result, &result_len);
-        free(tmpl);
+        /* Render template with mustache, straight into the output */
+        char outpath[4096];
+        snprintf(outpath, sizeof(outpath), "%s/%s", name, outname);
+        long n = portator_render_file(srcpath, json, outpath);
 
-        fprintf(stderr, "I %s(%d): rc: %d\n", __FILE__, __LINE__, rc);
+        fprintf(stderr, "I %s(%d): rendered: %ld\n", __FILE__, __LINE__, n);
 
-        if (rc != MUSTACH_OK || !result) {
+        if (n < 0) {
             fprintf(stderr, "new: template error in %s\n", ent->d_name);
             continue;
         }
-
-        fprintf(stderr, "I %s(%d): result: \n=====\n%s\n=====\n", __FILE__, __LINE__, result);
-
-        /* Write output */
-        char outpath[4096];
-        snprintf(outpath, sizeof(outpath), "%s/%s", name, outname);
-        FILE *f = fopen(outpath, "w");
-        if (f) {
-            fwrite(result, 1, result_len, f);
-            fclose(f);
-            printf("  %s\n", outpath);
-        }
-        free(result);
+        printf("  %s\n", outpath);
     }
     closedir(d);
-    cJSON_Delete(data);
+    free(json);
     return 0;
 }
 
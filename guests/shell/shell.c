@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <termios.h>
 #include <unistd.h>
 #include "portator.h"
@@ -77,6 +78,72 @@ static void refresh_line(const char *prompt, const char *buf, int len, int pos)
     write(STDOUT_FILENO, seq, strlen(seq));
 }
 
+/*───────────────────────────────────────────────────────────────────────────╗
+│ Completion                                                                 │
+╚───────────────────────────────────────────────────────────────────────────*/
+
+#define COMPLETE_MAX 64
+
+/* Insert s at pos. Returns the new cursor position. */
+static int insert_text(char *buf, int bufsize, int *len, int pos,
+                       const char *s, int n) {
+    if (*len + n > bufsize - 1) n = bufsize - 1 - *len;
+    if (n <= 0) return pos;
+    memmove(buf + pos + n, buf + pos, *len - pos);
+    memcpy(buf + pos, s, n);
+    *len += n;
+    buf[*len] = '\0';
+    return pos + n;
+}
+
+/* Complete the app name being typed as the command word: fill in what
+   all the matches share, or list them when that adds nothing. The host
+   does the prefix filtering; the answer needs no parsing. Returns the
+   new cursor position. */
+static int complete_app(char *buf, int bufsize, int *len, int pos) {
+    char prefix[256];
+    if (memchr(buf, ' ', pos)) return pos;  /* past the command word */
+    memcpy(prefix, buf, pos);
+    prefix[pos] = '\0';
+
+    struct PortatorListQuery q = { prefix, -1, 0, COMPLETE_MAX, 0 };
+    struct PortatorListHeader *h;
+    long size = portator_list_query_alloc(&q, &h);
+    if (size <= 0) return pos;
+    const struct PortatorAppInfo *apps = portator_list_apps(h);
+
+    if (h->count == 1) {
+        const char *name = portator_list_str(h, apps[0].name);
+        pos = insert_text(buf, bufsize, len, pos, name + pos,
+                          strlen(name) - pos);
+        pos = insert_text(buf, bufsize, len, pos, " ", 1);
+    } else if (h->count > 1) {
+        const char *first = portator_list_str(h, apps[0].name);
+        size_t common = strlen(first);
+        for (uint32_t i = 1; i < h->count; i++) {
+            const char *name = portator_list_str(h, apps[i].name);
+            size_t k = 0;
+            while (k < common && name[k] == first[k]) k++;
+            common = k;
+        }
+        if (common > (size_t)pos) {
+            pos = insert_text(buf, bufsize, len, pos, first + pos,
+                              common - pos);
+        } else {
+            write(STDOUT_FILENO, "\r\n", 2);
+            for (uint32_t i = 0; i < h->count; i++) {
+                const char *name = portator_list_str(h, apps[i].name);
+                write(STDOUT_FILENO, name, strlen(name));
+                write(STDOUT_FILENO, "  ", 2);
+            }
+            if (h->total > h->count) write(STDOUT_FILENO, "...", 3);
+            write(STDOUT_FILENO, "\r\n", 2);
+        }
+    }
+    munmap(h, size);
+    return pos;
+}
+
 /* Read a line with history support. Returns -1 on EOF, 0 on success. */
 static int read_line(const char *prompt, char *buf, int bufsize) {
     if (enable_raw() < 0) {
@@ -124,6 +191,12 @@ static int read_line(const char *prompt, char *buf, int bufsize) {
             continue;
         }
 
+        if (c == '\t') {  /* Tab: complete an app name */
+            pos = complete_app(buf, bufsize, &len, pos);
+            refresh_line(prompt, buf, len, pos);
+            continue;
+        }
+
         if (c == 1) {  /* Ctrl-A: beginning of line */
             pos = 0;
             refresh_line(prompt, buf, len, pos);
@@ -301,7 +374,7 @@ int main(void) {
             printf("  cd <path>   - change directory\n");
             printf("  cd ..       - go up one level\n");
             printf("  pwd         - print current directory\n");
-            printf("  <app>       - run a guest app\n");
+            printf("  <app>       - run a guest app (Tab completes)\n");
             printf("  exit        - leave the shell\n");
             continue;
         }
@@ -193,6 +193,9 @@ int main(void) {
 
     init();
 
+    /* Step every 100ms from the clock page, so time spent drawing
+       doesn't slow the game down */
+    int64_t next = portator_monotonic_ns();
     while (!game_over) {
         int k = read_key();
         if (k == 'q' || k == 'Q') break;
@@ -203,7 +206,10 @@ int main(void) {
 
         step();
         draw();
-        usleep(100000);
+        next += 100000000;
+        int64_t wait = next - portator_monotonic_ns();
+        if (wait > 0) usleep(wait / 1000);
+        else next -= wait;  /* fell behind: don't try to catch up */
     }
 
     restore_term();
@@ -0,0 +1,379 @@
+#include "hash.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static uint32_t Rol32(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+static uint32_t Ror32(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+static uint64_t Rol64(uint64_t x, int n) { return (x << n) | (x >> (64 - n)); }
+
+static uint32_t GetBe32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void PutBe32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static void PutBe64(unsigned char *p, uint64_t v) {
+    PutBe32(p, (uint32_t)(v >> 32));
+    PutBe32(p + 4, (uint32_t)v);
+}
+
+static uint32_t GetLe32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t GetLe64(const unsigned char *p) {
+    return GetLe32(p) | (uint64_t)GetLe32(p + 4) << 32;
+}
+
+/*───────────────────────────────────────────────────────────────────────────*
+ │ SHA-256 and SHA-1                                                         │
+ *───────────────────────────────────────────────────────────────────────────*/
+
+static const uint32_t kSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void Sha256Blocks(uint32_t s[8], const unsigned char *p, size_t n) {
+    uint32_t w[64];
+    for (; n; n--, p += 64) {
+        uint32_t a = s[0], b = s[1], c = s[2], d = s[3];
+        uint32_t e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int i = 0; i < 16; i++) w[i] = GetBe32(p + i * 4);
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = Ror32(w[i - 15], 7) ^ Ror32(w[i - 15], 18) ^
+                          (w[i - 15] >> 3);
+            uint32_t s1 = Ror32(w[i - 2], 17) ^ Ror32(w[i - 2], 19) ^
+                          (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (Ror32(e, 6) ^ Ror32(e, 11) ^ Ror32(e, 25)) +
+                          ((e & f) ^ (~e & g)) + kSha256K[i] + w[i];
+            uint32_t t2 = (Ror32(a, 2) ^ Ror32(a, 13) ^ Ror32(a, 22)) +
+                          ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+        s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+    }
+}
+
+static void Sha1Blocks(uint32_t s[5], const unsigned char *p, size_t n) {
+    uint32_t w[80];
+    for (; n; n--, p += 64) {
+        uint32_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4];
+        for (int i = 0; i < 16; i++) w[i] = GetBe32(p + i * 4);
+        for (int i = 16; i < 80; i++)
+            w[i] = Rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) f = (b & c) | (~b & d), k = 0x5a827999;
+            else if (i < 40) f = b ^ c ^ d, k = 0x6ed9eba1;
+            else if (i < 60) f = (b & c) | (b & d) | (c & d), k = 0x8f1bbcdc;
+            else f = b ^ c ^ d, k = 0xca62c1d6;
+            uint32_t t = Rol32(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = Rol32(b, 30); b = a; a = t;
+        }
+        s[0] += a; s[1] += b; s[2] += c; s[3] += d; s[4] += e;
+    }
+}
+
+#if defined(__x86_64__)
+
+/* The SHA extensions take the state as ABEF/CDGH (SHA-256) or ABCD and
+   E (SHA-1) in reversed word order, so both convert on the way in and
+   out. Each pass of the loops below is four rounds. */
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void Sha256BlocksNi(uint32_t s[8], const unsigned char *p, size_t n) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                        0x0405060700010203ULL);
+    __m128i st0, st1, tmp, msg, m[4], abef, cdgh;
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)s), 0xb1);
+    st1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(s + 4)), 0x1b);
+    st0 = _mm_alignr_epi8(tmp, st1, 8);
+    st1 = _mm_blend_epi16(st1, tmp, 0xf0);
+    for (; n; n--, p += 64) {
+        abef = st0;
+        cdgh = st1;
+        for (int i = 0; i < 16; i++) {
+            if (i < 4)
+                m[i] = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i *)(p + i * 16)), mask);
+            msg = _mm_add_epi32(
+                m[i & 3], _mm_loadu_si128((const __m128i *)(kSha256K + i * 4)));
+            st1 = _mm_sha256rnds2_epu32(st1, st0, msg);
+            if (i >= 3 && i <= 14) {
+                tmp = _mm_alignr_epi8(m[i & 3], m[(i + 3) & 3], 4);
+                m[(i + 1) & 3] = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(m[(i + 1) & 3], tmp), m[i & 3]);
+            }
+            st0 = _mm_sha256rnds2_epu32(st0, st1, _mm_shuffle_epi32(msg, 0x0e));
+            if (i >= 1 && i <= 12)
+                m[(i + 3) & 3] = _mm_sha256msg1_epu32(m[(i + 3) & 3], m[i & 3]);
+        }
+        st0 = _mm_add_epi32(st0, abef);
+        st1 = _mm_add_epi32(st1, cdgh);
+    }
+    tmp = _mm_shuffle_epi32(st0, 0x1b);
+    st1 = _mm_shuffle_epi32(st1, 0xb1);
+    _mm_storeu_si128((__m128i *)s, _mm_blend_epi16(tmp, st1, 0xf0));
+    _mm_storeu_si128((__m128i *)(s + 4), _mm_alignr_epi8(st1, tmp, 8));
+}
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void Sha1BlocksNi(uint32_t s[5], const unsigned char *p, size_t n) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+                                        0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e[2], e_save, m[4];
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)s), 0x1b);
+    e[0] = _mm_set_epi32(s[4], 0, 0, 0);
+    for (; n; n--, p += 64) {
+        abcd_save = abcd;
+        e_save = e[0];
+        for (int g = 0; g < 20; g++) {
+            if (g < 4)
+                m[g] = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i *)(p + g * 16)), mask);
+            if (g == 0)
+                e[0] = _mm_add_epi32(e[0], m[0]);
+            else
+                e[g & 1] = _mm_sha1nexte_epu32(e[g & 1], m[g & 3]);
+            e[(g + 1) & 1] = abcd;
+            if (g >= 3 && g <= 18)
+                m[(g + 1) & 3] = _mm_sha1msg2_epu32(m[(g + 1) & 3], m[g & 3]);
+            /* the round function has to be an immediate */
+            switch (g / 5) {
+                case 0: abcd = _mm_sha1rnds4_epu32(abcd, e[g & 1], 0); break;
+                case 1: abcd = _mm_sha1rnds4_epu32(abcd, e[g & 1], 1); break;
+                case 2: abcd = _mm_sha1rnds4_epu32(abcd, e[g & 1], 2); break;
+                default: abcd = _mm_sha1rnds4_epu32(abcd, e[g & 1], 3); break;
+            }
+            if (g >= 1 && g <= 16)
+                m[(g + 3) & 3] = _mm_sha1msg1_epu32(m[(g + 3) & 3], m[g & 3]);
+            if (g >= 2 && g <= 17)
+                m[(g + 2) & 3] = _mm_xor_si128(m[(g + 2) & 3], m[g & 3]);
+        }
+        e[0] = _mm_sha1nexte_epu32(e[0], e_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+    _mm_storeu_si128((__m128i *)s, _mm_shuffle_epi32(abcd, 0x1b));
+    s[4] = (uint32_t)_mm_extract_epi32(e[0], 3);
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cHw(uint32_t crc, const unsigned char *p, size_t n) {
+    uint64_t c = crc;
+    for (; n >= 8; n -= 8, p += 8) c = _mm_crc32_u64(c, GetLe64(p));
+    crc = (uint32_t)c;
+    for (; n; n--) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+#endif /* __x86_64__ */
+
+/*───────────────────────────────────────────────────────────────────────────*
+ │ CRC32C and xxHash64                                                       │
+ *───────────────────────────────────────────────────────────────────────────*/
+
+static uint32_t s_crc32c[256];
+
+static uint32_t Crc32cSw(uint32_t crc, const unsigned char *p, size_t n) {
+    for (; n; n--) crc = s_crc32c[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+static uint64_t XxhRound(uint64_t acc, uint64_t in) {
+    return Rol64(acc + in * XXH_P2, 31) * XXH_P1;
+}
+
+static uint64_t XxhMerge(uint64_t h, uint64_t v) {
+    return (h ^ XxhRound(0, v)) * XXH_P1 + XXH_P4;
+}
+
+static void XxhBlocks(uint64_t v[4], const unsigned char *p, size_t n) {
+    for (; n; n--, p += 32) {
+        for (int i = 0; i < 4; i++) v[i] = XxhRound(v[i], GetLe64(p + i * 8));
+    }
+}
+
+static uint64_t XxhDigest(const struct HashCtx *h) {
+    const uint64_t *v = h->s.xxh;
+    const unsigned char *p = h->buf;
+    size_t n = h->len & 31;
+    uint64_t d;
+    if (h->len >= 32) {
+        d = Rol64(v[0], 1) + Rol64(v[1], 7) + Rol64(v[2], 12) + Rol64(v[3], 18);
+        for (int i = 0; i < 4; i++) d = XxhMerge(d, v[i]);
+    } else {
+        d = XXH_P5;                /* seed 0 */
+    }
+    d += h->len;
+    for (; n >= 8; n -= 8, p += 8)
+        d = Rol64(d ^ XxhRound(0, GetLe64(p)), 27) * XXH_P1 + XXH_P4;
+    if (n >= 4) {
+        d = Rol64(d ^ GetLe32(p) * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        n -= 4;
+        p += 4;
+    }
+    for (; n; n--) d = Rol64(d ^ *p++ * XXH_P5, 11) * XXH_P1;
+    d ^= d >> 33;
+    d *= XXH_P2;
+    d ^= d >> 29;
+    d *= XXH_P3;
+    d ^= d >> 32;
+    return d;
+}
+
+/*───────────────────────────────────────────────────────────────────────────*
+ │ Dispatch                                                                  │
+ *───────────────────────────────────────────────────────────────────────────*/
+
+static struct {
+    int ready;
+    void (*sha256)(uint32_t *, const unsigned char *, size_t);
+    void (*sha1)(uint32_t *, const unsigned char *, size_t);
+    uint32_t (*crc32c)(uint32_t, const unsigned char *, size_t);
+} s_impl;
+
+/* Picks the implementations once. Racing callers pick the same ones. */
+static void Setup(void) {
+    if (s_impl.ready) return;
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        s_crc32c[i] = c;
+    }
+    s_impl.sha256 = Sha256Blocks;
+    s_impl.sha1 = Sha1Blocks;
+    s_impl.crc32c = Crc32cSw;
+#if defined(__x86_64__)
+    unsigned a, b, c, d;
+    if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_2)) {
+        s_impl.crc32c = Crc32cHw;
+        if (__get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_SHA)) {
+            s_impl.sha256 = Sha256BlocksNi;
+            s_impl.sha1 = Sha1BlocksNi;
+        }
+    }
+#endif
+    __atomic_store_n(&s_impl.ready, 1, __ATOMIC_RELEASE);
+}
+
+int HashSize(int alg) {
+    switch (alg) {
+        case HASH_SHA256: return 32;
+        case HASH_SHA1: return 20;
+        case HASH_CRC32C: return 4;
+        case HASH_XXH64: return 8;
+        default: return 0;
+    }
+}
+
+int HashInit(struct HashCtx *h, int alg) {
+    static const uint32_t kSha256Iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    static const uint32_t kSha1Iv[5] = {
+        0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+    };
+    if (!HashSize(alg)) return -1;
+    Setup();
+    memset(h, 0, sizeof(*h));
+    h->alg = alg;
+    switch (alg) {
+        case HASH_SHA256: memcpy(h->s.sha, kSha256Iv, sizeof(kSha256Iv)); break;
+        case HASH_SHA1: memcpy(h->s.sha, kSha1Iv, sizeof(kSha1Iv)); break;
+        case HASH_CRC32C: h->s.crc = ~0u; break;
+        case HASH_XXH64:
+            h->s.xxh[0] = XXH_P1 + XXH_P2;
+            h->s.xxh[1] = XXH_P2;
+            h->s.xxh[2] = 0;
+            h->s.xxh[3] = -XXH_P1;
+            break;
+    }
+    return 0;
+}
+
+static void Blocks(struct HashCtx *h, const unsigned char *p, size_t n) {
+    switch (h->alg) {
+        case HASH_SHA256: s_impl.sha256(h->s.sha, p, n); break;
+        case HASH_SHA1: s_impl.sha1(h->s.sha, p, n); break;
+        case HASH_XXH64: XxhBlocks(h->s.xxh, p, n); break;
+    }
+}
+
+void HashUpdate(struct HashCtx *h, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    size_t bs = h->alg == HASH_XXH64 ? 32 : 64;
+    size_t have = h->len & (bs - 1);
+    if (h->alg == HASH_CRC32C) {
+        h->s.crc = s_impl.crc32c(h->s.crc, p, len);
+        h->len += len;
+        return;
+    }
+    h->len += len;
+    if (have) {
+        size_t n = bs - have < len ? bs - have : len;
+        memcpy(h->buf + have, p, n);
+        p += n;
+        len -= n;
+        if (have + n < bs) return;
+        Blocks(h, h->buf, 1);
+    }
+    if (len >= bs) {
+        Blocks(h, p, len / bs);
+        p += len / bs * bs;
+        len %= bs;
+    }
+    memcpy(h->buf, p, len);
+}
+
+int HashFinal(struct HashCtx *h, unsigned char *out) {
+    int size = HashSize(h->alg);
+    unsigned char pad[72];
+    uint64_t bits = h->len * 8;
+    size_t n;
+    switch (h->alg) {
+        case HASH_CRC32C:
+            PutBe32(out, ~h->s.crc);
+            return size;
+        case HASH_XXH64:
+            PutBe64(out, XxhDigest(h));
+            return size;
+    }
+    /* SHA: 0x80, zeros to 56 mod 64, then the length in bits */
+    n = 64 - (h->len & 63);
+    if (n < 9) n += 64;
+    memset(pad, 0, n);
+    pad[0] = 0x80;
+    PutBe64(pad + n - 8, bits);
+    HashUpdate(h, pad, n);
+    for (int i = 0; i < size / 4; i++) PutBe32(out + i * 4, h->s.sha[i]);
+    return size;
+}
@@ -0,0 +1,40 @@
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Hashes computed natively for guests (PORTATOR_SYS_HASH), which would
+   otherwise run them 20-50x slower under emulation. SHA-256 and SHA-1
+   use the SHA extensions and CRC32C uses SSE4.2 when the CPU has them. */
+
+#define HASH_SHA256 1              /* PORTATOR_HASH_* */
+#define HASH_SHA1   2
+#define HASH_CRC32C 3
+#define HASH_XXH64  4
+
+#define HASH_MAX_DIGEST 32
+
+struct HashCtx {
+    int alg;
+    uint64_t len;                  /* bytes hashed so far */
+    union {
+        uint32_t sha[8];           /* SHA-256, or SHA-1 in the first 5 */
+        uint32_t crc;
+        uint64_t xxh[4];
+    } s;
+    unsigned char buf[64];         /* partial block */
+};
+
+/* Digest size of alg in bytes, or 0 if alg is unknown */
+int HashSize(int alg);
+
+/* Start a hash. Returns 0, or -1 if alg is unknown. */
+int HashInit(struct HashCtx *h, int alg);
+void HashUpdate(struct HashCtx *h, const void *data, size_t len);
+
+/* Store the digest in out (HashSize bytes, big-endian as usually
+   printed) and return its size. */
+int HashFinal(struct HashCtx *h, unsigned char *out);
+
+#endif /* HASH_H_ */
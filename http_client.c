@@ -0,0 +1,433 @@
+#include "http_client.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "resolve.h"
+
+#define HOST_MAX 256
+#define PORT_MAX 16
+#define LINE_MAX_ 1024
+#define BUF_SIZE 16384
+#define TIMEOUT_S 30               /* for connecting, sending and reading */
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct HttpConn {
+    int fd;
+    int reused;                    /* came from the pool */
+    int64_t idle_ns;               /* when it went into the pool */
+    char origin[HOST_MAX + PORT_MAX];
+    struct HttpConn *next;
+    size_t pos, end;               /* unread bytes in buf */
+    char buf[BUF_SIZE];
+};
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t s_once = PTHREAD_ONCE_INIT;
+static struct HttpConn *s_pool;    /* idle connections, newest first */
+
+static int64_t NowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void CloseConn(struct HttpConn *c) {
+    close(c->fd);
+    free(c);
+}
+
+/* An idle connection to origin, dropping expired ones on the way. One
+   the server has closed (or sent something on, unasked) reads ready. */
+static struct HttpConn *TakeIdle(const char *origin) {
+    struct HttpConn **p, *c, *found = NULL;
+    int64_t old = NowNs() - HTTP_IDLE_S * 1000000000LL;
+    pthread_mutex_lock(&s_lock);
+    for (p = &s_pool; (c = *p);) {
+        struct pollfd pfd = { c->fd, POLLIN, 0 };
+        if (c->idle_ns < old ||
+            (!found && !strcmp(c->origin, origin) && poll(&pfd, 1, 0))) {
+            *p = c->next;
+            CloseConn(c);
+        } else if (!found && !strcmp(c->origin, origin)) {
+            *p = c->next;
+            found = c;
+        } else {
+            p = &c->next;
+        }
+    }
+    pthread_mutex_unlock(&s_lock);
+    if (found) found->reused = 1;
+    return found;
+}
+
+static void BeforeFork(void) {
+    pthread_mutex_lock(&s_lock);
+}
+
+static void AfterForkParent(void) {
+    pthread_mutex_unlock(&s_lock);
+}
+
+/* A child must not reuse its parent's sockets: two processes writing
+   requests down one connection would garble both. */
+static void AfterForkChild(void) {
+    while (s_pool) {
+        struct HttpConn *c = s_pool;
+        s_pool = c->next;
+        CloseConn(c);
+    }
+    pthread_mutex_unlock(&s_lock);
+}
+
+static void RegisterFork(void) {
+    pthread_atfork(BeforeFork, AfterForkParent, AfterForkChild);
+}
+
+static void PutIdle(struct HttpConn *c) {
+    struct HttpConn *p;
+    int n = 0;
+    pthread_once(&s_once, RegisterFork);
+    pthread_mutex_lock(&s_lock);
+    for (p = s_pool; p; p = p->next) n += !strcmp(p->origin, c->origin);
+    if (n < HTTP_POOL_PER_ORIGIN) {
+        c->idle_ns = NowNs();
+        c->next = s_pool;
+        s_pool = c;
+        c = NULL;
+    }
+    pthread_mutex_unlock(&s_lock);
+    if (c) CloseConn(c);
+}
+
+static struct HttpConn *Dial(const char *host, const char *port,
+                             const char *origin) {
+    struct ResolveAddr addrs[RESOLVE_MAX_ADDRS];
+    struct timeval tv = { TIMEOUT_S, 0 };
+    struct HttpConn *c;
+    int n, fd = -1, one = 1;
+    if ((n = Resolve(host, port, addrs)) <= 0) return NULL;
+    for (int i = 0; i < n && fd == -1; i++) {
+        struct sockaddr_storage ss;
+        socklen_t len;
+        memset(&ss, 0, sizeof(ss));
+        if (addrs[i].family == 2) {    /* Linux AF_INET */
+            struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+            sin->sin_family = AF_INET;
+            sin->sin_port = addrs[i].port;
+            memcpy(&sin->sin_addr, addrs[i].addr, 4);
+            len = sizeof(*sin);
+        } else {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = addrs[i].port;
+            memcpy(&sin6->sin6_addr, addrs[i].addr, 16);
+            len = sizeof(*sin6);
+        }
+        if ((fd = socket(ss.ss_family, SOCK_STREAM, 0)) == -1) continue;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, (struct sockaddr *)&ss, len)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd == -1) return NULL;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (!(c = (struct HttpConn *)calloc(1, sizeof(*c)))) {
+        close(fd);
+        return NULL;
+    }
+    c->fd = fd;
+    strcpy(c->origin, origin);
+    return c;
+}
+
+/* Split "http://host[:port]/target" into its parts */
+static int ParseUrl(const char *url, char host[HOST_MAX],
+                    char port[PORT_MAX], const char **target) {
+    const char *h, *e, *colon;
+    size_t n;
+    if (strncasecmp(url, "http://", 7)) return -1;
+    h = url + 7;
+    e = h + strcspn(h, "/?#");
+    *target = e;
+    if (memchr(h, '@', e - h)) return -1;      /* no credentials */
+    if (*h == '[') {                           /* [v6 address] */
+        const char *rb = (const char *)memchr(h, ']', e - h);
+        if (!rb) return -1;
+        colon = rb + 1 < e && rb[1] == ':' ? rb + 1 : NULL;
+        n = rb - h - 1;
+        h++;
+    } else {
+        colon = (const char *)memchr(h, ':', e - h);
+        n = (colon ? colon : e) - h;
+    }
+    if (!n || n >= HOST_MAX) return -1;
+    memcpy(host, h, n);
+    host[n] = '\0';
+    if (colon) {
+        n = e - colon - 1;
+        if (!n || n >= PORT_MAX) return -1;
+        memcpy(port, colon + 1, n);
+        port[n] = '\0';
+    } else {
+        strcpy(port, "80");
+    }
+    return 0;
+}
+
+static int SendAll(int fd, const char *p, size_t n) {
+    while (n) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+static ssize_t Fill(struct HttpConn *c) {
+    ssize_t n;
+    do n = read(c->fd, c->buf, BUF_SIZE);
+    while (n < 0 && errno == EINTR);
+    c->pos = 0;
+    c->end = n > 0 ? n : 0;
+    return n;
+}
+
+/* One CRLF-terminated line, without the CRLF */
+static int ReadLine(struct HttpConn *c, char *line, size_t size) {
+    size_t n = 0;
+    for (;;) {
+        if (c->pos == c->end && Fill(c) <= 0) return -1;
+        char ch = c->buf[c->pos++];
+        if (ch == '\n') break;
+        if (n + 1 < size) line[n++] = ch;
+    }
+    if (n && line[n - 1] == '\r') n--;
+    line[n] = '\0';
+    return 0;
+}
+
+/* Read a response head into x. Returns 0, -1, or -2 if the connection
+   closed before sending anything, which on a pooled connection means
+   the server dropped it and the request can go again. */
+static int ReadHead(struct HttpExchange *x) {
+    struct HttpConn *c = x->conn;
+    size_t n = 0, cap = 1024;
+    char *h = (char *)malloc(cap);
+    if (!h) return -1;
+    for (;;) {
+        if (c->pos == c->end && Fill(c) <= 0) {
+            free(h);
+            return n ? -1 : -2;
+        }
+        while (c->pos < c->end) {
+            if (n + 2 > cap) {
+                char *g;
+                if (cap >= HTTP_HEAD_MAX ||
+                    !(g = (char *)realloc(h, cap * 2))) {
+                    free(h);
+                    return -1;
+                }
+                h = g;
+                cap *= 2;
+            }
+            h[n++] = c->buf[c->pos++];
+            if (n >= 4 && !memcmp(h + n - 4, "\r\n\r\n", 4)) {
+                h[n] = '\0';
+                free(x->head);
+                x->head = h;
+                x->head_len = n;
+                return 0;
+            }
+        }
+    }
+}
+
+/* The value of header name in a response head, or NULL */
+static const char *FindHeader(const char *head, const char *name,
+                              size_t *len) {
+    size_t n = strlen(name);
+    for (const char *p = strstr(head, "\r\n"); p && p[2] != '\r';
+         p = strstr(p + 2, "\r\n")) {
+        const char *v = p + 2;
+        if (strncasecmp(v, name, n) || v[n] != ':') continue;
+        v += n + 1;
+        while (*v == ' ' || *v == '\t') v++;
+        *len = strcspn(v, "\r");
+        return v;
+    }
+    return NULL;
+}
+
+static int HasToken(const char *v, size_t len, const char *token) {
+    size_t n = strlen(token);
+    for (size_t i = 0; i + n <= len; i++)
+        if (!strncasecmp(v + i, token, n)) return 1;
+    return 0;
+}
+
+/* Read the response head, skipping any 1xx, and work out how the body
+   is delimited */
+static int ReadResponse(struct HttpExchange *x, int head_request) {
+    const char *v;
+    size_t len;
+    int minor, rc;
+    do {
+        if ((rc = ReadHead(x))) return rc;
+        if (sscanf(x->head, "HTTP/1.%d %d", &minor, &x->status) != 2)
+            return -1;
+    } while (x->status >= 100 && x->status < 200);
+    x->keep_alive = minor >= 1;
+    if ((v = FindHeader(x->head, "Connection", &len))) {
+        if (HasToken(v, len, "close")) x->keep_alive = 0;
+        else if (HasToken(v, len, "keep-alive")) x->keep_alive = 1;
+    }
+    x->length = -1;
+    if (head_request || x->status == 204 || x->status == 304) {
+        x->length = 0;
+        x->done = 1;
+    } else if ((v = FindHeader(x->head, "Transfer-Encoding", &len)) &&
+               HasToken(v, len, "chunked")) {
+        x->chunked = 1;
+    } else if ((v = FindHeader(x->head, "Content-Length", &len))) {
+        char *end;
+        x->length = strtoll(v, &end, 10);
+        if (end == v || x->length < 0) return -1;
+        x->left = x->length;
+        x->done = !x->left;
+    } else {
+        x->keep_alive = 0;             /* the body runs to the close */
+    }
+    return 0;
+}
+
+struct HttpExchange *HttpOpen(const char *method, const char *url,
+                              const char *headers, const void *body,
+                              size_t body_len) {
+    char host[HOST_MAX], port[PORT_MAX], origin[HOST_MAX + PORT_MAX];
+    struct HttpExchange *x;
+    const char *target;
+    char *req;
+    int n, head_request;
+    if (!method) method = "GET";
+    if (method[strcspn(method, "\r\n")]) return NULL;
+    if (!headers) headers = "";
+    if (ParseUrl(url, host, port, &target)) return NULL;
+    snprintf(origin, sizeof(origin), "%s:%s", host, port);
+    head_request = !strcasecmp(method, "HEAD");
+    if (!(req = (char *)malloc(strlen(method) + strlen(target) +
+                               sizeof(origin) + strlen(headers) + 128 +
+                               body_len)))
+        return NULL;
+    n = sprintf(req, "%s %s%.*s HTTP/1.1\r\nHost: %s%s%s\r\n%s", method,
+                *target == '/' ? "" : "/", (int)strcspn(target, "#"), target,
+                host, strcmp(port, "80") ? ":" : "",
+                strcmp(port, "80") ? port : "", headers);
+    if (body_len || (strcasecmp(method, "GET") && !head_request))
+        n += sprintf(req + n, "Content-Length: %zu\r\n", body_len);
+    n += sprintf(req + n, "\r\n");
+    if (body_len) memcpy(req + n, body, body_len);
+    if (!(x = (struct HttpExchange *)calloc(1, sizeof(*x)))) {
+        free(req);
+        return NULL;
+    }
+    /* a pooled connection the server has since dropped fails before any
+       reply arrives; then the request goes once more on a new one */
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int rc = -1, reused;
+        if (!attempt) x->conn = TakeIdle(origin);
+        if (!x->conn && !(x->conn = Dial(host, port, origin))) break;
+        reused = x->conn->reused;
+        if (!SendAll(x->conn->fd, req, n + body_len) &&
+            !(rc = ReadResponse(x, head_request))) {
+            free(req);
+            return x;
+        }
+        CloseConn(x->conn);
+        x->conn = NULL;
+        if (!reused || rc == -1) break;
+    }
+    free(req);
+    free(x->head);
+    free(x);
+    return NULL;
+}
+
+/* Start the next chunk of a chunked body, or finish at the last one */
+static int NextChunk(struct HttpExchange *x) {
+    char line[LINE_MAX_];
+    if (x->chunked > 1 && (ReadLine(x->conn, line, sizeof(line)) || *line))
+        return -1;                     /* the CRLF after the last chunk */
+    if (ReadLine(x->conn, line, sizeof(line))) return -1;
+    x->chunked = 2;
+    if (!(x->left = strtoull(line, NULL, 16))) {
+        do {                           /* trailers, to the blank line */
+            if (ReadLine(x->conn, line, sizeof(line))) return -1;
+        } while (*line);
+        x->done = 1;
+    }
+    return 0;
+}
+
+ssize_t HttpRead(struct HttpExchange *x, void *buf, size_t len) {
+    struct HttpConn *c = x->conn;
+    ssize_t n;
+    if (x->done || !len) return 0;
+    if (x->chunked && !x->left) {
+        if (NextChunk(x)) return -1;
+        if (x->done) return 0;
+    }
+    if ((x->chunked || x->length >= 0) && len > x->left) len = x->left;
+    if (c->pos < c->end) {
+        n = c->end - c->pos < len ? c->end - c->pos : len;
+        memcpy(buf, c->buf + c->pos, n);
+        c->pos += n;
+    } else {
+        /* big reads go straight to the caller */
+        do n = read(c->fd, buf, len);
+        while (n < 0 && errno == EINTR);
+        if (n < 0) return -1;
+        if (!n) {
+            if (x->chunked || x->length >= 0) return -1;   /* cut short */
+            x->done = 1;
+            return 0;
+        }
+    }
+    if (x->chunked || x->length >= 0) {
+        x->left -= n;
+        if (!x->chunked && !x->left) x->done = 1;
+    }
+    return n;
+}
+
+void HttpClose(struct HttpExchange *x) {
+    if (!x) return;
+    /* a chunked body read to the end of its data still has the last,
+       empty chunk to come, which the server has likely sent already */
+    if (x->conn && x->chunked && !x->done && !x->left && x->keep_alive)
+        NextChunk(x);
+    if (x->conn) {
+        if (x->done && x->keep_alive) PutIdle(x->conn);
+        else CloseConn(x->conn);
+    }
+    free(x->head);
+    free(x);
+}
@@ -0,0 +1,50 @@
+#ifndef HTTP_CLIENT_H_
+#define HTTP_CLIENT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A small HTTP/1.1 client for guests (PORTATOR_SYS_HTTP), so that a
+   request costs a few host calls instead of an emulated socket stack
+   and HTTP parser. Connections are kept alive and pooled per origin, so
+   polling a service doesn't pay a TCP handshake each time. Plain http://
+   only: there is no TLS in the host yet. */
+
+#define HTTP_POOL_PER_ORIGIN 8     /* idle connections kept per host:port */
+#define HTTP_IDLE_S 30             /* and for how long */
+#define HTTP_HEAD_MAX 65536        /* longest response head accepted */
+
+struct HttpConn;
+
+/* One request, sent, with its response head read. The body is then
+   read with HttpRead. */
+struct HttpExchange {
+    int status;
+    int64_t length;                /* Content-Length, or -1 if not known */
+    char *head;                    /* response headers, NUL-terminated */
+    size_t head_len;
+    struct HttpConn *conn;
+    int chunked;
+    int keep_alive;
+    int done;                      /* the whole body has been read */
+    uint64_t left;                 /* of the body, or of the current chunk */
+};
+
+/* Send method (e.g. "GET") to url ("http://host[:port]/path"), with
+   extra header lines (each ending in CRLF, or NULL) and an optional
+   body, on a pooled connection when there is one. Returns the exchange
+   once the response head has arrived, or NULL. */
+struct HttpExchange *HttpOpen(const char *method, const char *url,
+                              const char *headers, const void *body,
+                              size_t body_len);
+
+/* Read up to len bytes of the response body, undoing any chunked
+   encoding. Returns the bytes read, 0 at the end, or -1. */
+ssize_t HttpRead(struct HttpExchange *x, void *buf, size_t len);
+
+/* Finish the exchange. Its connection goes back to the pool if the body
+   was read to the end and both sides agreed to keep it alive. */
+void HttpClose(struct HttpExchange *x);
+
+#endif /* HTTP_CLIENT_H_ */
@@ -7,6 +7,9 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 
 /* Portator custom syscall numbers */
 #define PORTATOR_SYS_PRESENT  0x7000
@@ -18,12 +21,34 @@
 #define PORTATOR_SYS_VERSION 0x7006
 #define PORTATOR_SYS_LIST    0x7007
 #define PORTATOR_SYS_LAUNCH  0x7008
+#define PORTATOR_SYS_RING_SETUP 0x7009
+#define PORTATOR_SYS_RING_ENTER 0x700A
+#define PORTATOR_SYS_LOG     0x700B
+#define PORTATOR_SYS_BATCH   0x700C
+#define PORTATOR_SYS_TIMEPAGE 0x700D
+#define PORTATOR_SYS_HASH    0x700E
+#define PORTATOR_SYS_ZLIB    0x700F
+#define PORTATOR_SYS_RENDER  0x7010
+#define PORTATOR_SYS_MEM     0x7011
+#define PORTATOR_SYS_MAPFILE 0x7012
+#define PORTATOR_SYS_READDIR 0x7013
+#define PORTATOR_SYS_EXTRACT 0x7014
+#define PORTATOR_SYS_RESOLVE 0x7015
+#define PORTATOR_SYS_HTTP    0x7016
+#define PORTATOR_SYS_SHM     0x7017
 
 /* App types */
 #define PORTATOR_APP_CONSOLE  0
 #define PORTATOR_APP_GFX      1
 #define PORTATOR_APP_WEB      2
 
+/* Declare the app's type once at file scope, e.g. PORTATOR_APP(GFX);
+   The host lists the app by this instead of guessing from the calls
+   its binary makes. */
+#define PORTATOR_APP(type)                                          \
+    __attribute__((__used__)) static const char                     \
+        portator_app_type_[] = "portator-app-type=" #type
+
 /* Event types */
 #define PORTATOR_KEY_DOWN     1
 #define PORTATOR_KEY_UP       2
@@ -50,6 +75,500 @@ static inline long portator_syscall(long nr, long a1, long a2, long a3) {
     return ret;
 }
 
+static inline long portator_syscall6(long nr, long a1, long a2, long a3,
+                                     long a4, long a5, long a6) {
+    long ret;
+    register long r10 __asm__("r10") = a4;
+    register long r8 __asm__("r8") = a5;
+    register long r9 __asm__("r9") = a6;
+    __asm__ volatile("syscall"
+                     : "=a"(ret)
+                     : "a"(nr), "D"(a1), "S"(a2), "d"(a3), "r"(r10),
+                       "r"(r8), "r"(r9)
+                     : "rcx", "r11", "memory");
+    return ret;
+}
+
+/* Present a width x height framebuffer of 0x00RRGGBB pixels.
+   Under `portator web` the frame is streamed to every browser watching
+   this app; each one gets it at a quality its connection can keep up
+   with. Returns 0, or -1 if the size is invalid (max 1920x1080). */
+static inline long portator_present(const uint32_t *pixels, int width,
+                                    int height) {
+    return portator_syscall(PORTATOR_SYS_PRESENT, (long)pixels, width, height);
+}
+
+/* Take up to max pending input events into events, waiting up to
+   timeout_ms for the first one (0 = don't wait, -1 = forever). Drain a
+   whole input burst in one call. Mouse moves may be collapsed into the
+   latest position when the guest falls behind. Returns the number of
+   events, 0 if none arrived (always 0 outside `portator web`). */
+static inline long portator_poll_events(struct PortatorEvent *events,
+                                        int max, int timeout_ms) {
+    return portator_syscall(PORTATOR_SYS_POLL, (long)events, max, timeout_ms);
+}
+
+/* Take one pending event without waiting. Returns 1 or 0. */
+static inline long portator_poll(struct PortatorEvent *event) {
+    return portator_poll_events(event, 1, 0);
+}
+
+/* One message for portator_ws_send */
+struct PortatorIovec {
+    const void *base;
+    size_t len;
+};
+
+/* Send count text messages to every browser attached to this app, in
+   one trap. Each message is copied straight from guest memory into the
+   host's queue; waits while that queue is full. Returns the number of
+   messages sent (at most 64 per call), or -1 on error. */
+static inline long portator_ws_send(const struct PortatorIovec *iov,
+                                    int count) {
+    return portator_syscall(PORTATOR_SYS_WS_SEND, (long)iov, count, 0);
+}
+
+/* Receive as many queued browser messages as fit in buf, waiting up to
+   timeout_ms for the first (0 = don't wait, -1 = forever). Each message
+   is stored as a little-endian uint32_t length followed by the bytes,
+   padded to a multiple of 4; walk them with portator_ws_next. Returns
+   the bytes stored, 0 if none arrived, or -1 if the next message does
+   not fit. With buf=NULL, returns the size the next message needs. */
+static inline long portator_ws_recv(void *buf, long len, int timeout_ms) {
+    return portator_syscall(PORTATOR_SYS_WS_RECV, (long)buf, len, timeout_ms);
+}
+
+/* Step through the messages portator_ws_recv stored in buf (of size
+   used). Start with *off = 0. Returns the next message and stores its
+   length in *len, or returns NULL after the last one. */
+static inline const char *portator_ws_next(const void *buf, long used,
+                                           long *off, uint32_t *len) {
+    const unsigned char *p = (const unsigned char *)buf + *off;
+    if (*off + 4 > used) return NULL;
+    *len = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+    *off += (4 + *len + 3) & ~3L;
+    return (const char *)p + 4;
+}
+
+/* Write one line to the host's stderr (up to 1023 bytes, no newline
+   needed). Returns the bytes written, or -1. */
+static inline long portator_log(const char *msg, long len) {
+    return portator_syscall(PORTATOR_SYS_LOG, (long)msg, len, 0);
+}
+
+/* One call in a batch. result is filled in by the host. */
+struct PortatorCall {
+    int64_t nr;             /* PORTATOR_SYS_* */
+    int64_t args[6];
+    int64_t result;
+};
+
+#define PORTATOR_BATCH_STOP_ON_ERROR 1
+
+/* Run count calls in order in one trap, e.g. present + poll + ws_send
+   every tick. With PORTATOR_BATCH_STOP_ON_ERROR, stops after the first
+   call that returns -1; later results are left untouched. Returns the
+   number of calls run (at most 128), or -1 if the array is unreadable.
+   Ring and batch calls can't be batched. */
+static inline long portator_batch(struct PortatorCall *calls, int count,
+                                  int flags) {
+    return portator_syscall(PORTATOR_SYS_BATCH, (long)calls, count, flags);
+}
+
+/* Submission/completion rings.
+
+   Instead of one trap per call, queue Portator calls in a ring in your
+   own memory and hand them all to the host with one portator_ring_enter.
+   Each submission is a syscall number and its arguments; each
+   completion carries the submission's user_data and the call's return
+   value. Calls that would block -- poll and ws_recv with a timeout, and
+   launch -- don't hold up the rest: they complete on a later enter. The
+   ring-setup and ring-enter calls cannot themselves be submitted.
+
+       static struct PortatorSqe sq[64];
+       static struct PortatorCqe cq[128];
+       static struct PortatorRing ring = { .sq_entries = 64,
+           .cq_entries = 128, .sq = sq, .cq = cq };
+       portator_ring_setup(&ring);
+       ...
+       struct PortatorSqe *e = portator_ring_sqe(&ring);
+       e->op = PORTATOR_SYS_PRESENT; e->args[0] = (long)pixels; ...
+       portator_ring_submit(&ring);
+       portator_ring_enter(1, -1);
+       struct PortatorCqe *c;
+       while ((c = portator_ring_cqe(&ring))) { ...; portator_ring_seen(&ring); }
+*/
+
+struct PortatorSqe {
+    uint32_t op;            /* PORTATOR_SYS_* */
+    uint32_t flags;         /* reserved, 0 */
+    uint64_t user_data;     /* copied to the completion */
+    int64_t  args[6];
+};
+
+struct PortatorCqe {
+    uint64_t user_data;
+    int64_t  result;
+};
+
+struct PortatorRing {
+    volatile uint32_t sq_head;  /* advanced by the host */
+    volatile uint32_t sq_tail;  /* advanced by the guest */
+    volatile uint32_t cq_head;  /* advanced by the guest */
+    volatile uint32_t cq_tail;  /* advanced by the host */
+    uint32_t sq_entries;        /* powers of two, up to 4096 */
+    uint32_t cq_entries;
+    struct PortatorSqe *sq;
+    struct PortatorCqe *cq;
+};
+
+/* Register the ring. Returns 0, or -1 if the sizes are invalid. */
+static inline long portator_ring_setup(struct PortatorRing *ring) {
+    return portator_syscall(PORTATOR_SYS_RING_SETUP, (long)ring, 0, 0);
+}
+
+/* Run everything submitted, then wait up to timeout_ms (-1 = forever)
+   until at least min_complete completions are waiting. Submissions stay
+   queued while the completion ring is full. Returns the number of
+   submissions consumed, or -1 on error. */
+static inline long portator_ring_enter(unsigned min_complete, int timeout_ms) {
+    return portator_syscall(PORTATOR_SYS_RING_ENTER, min_complete, timeout_ms, 0);
+}
+
+/* Next free submission slot, or NULL if the ring is full */
+static inline struct PortatorSqe *portator_ring_sqe(struct PortatorRing *r) {
+    if (r->sq_tail - r->sq_head == r->sq_entries) return NULL;
+    struct PortatorSqe *e = r->sq + (r->sq_tail & (r->sq_entries - 1));
+    e->flags = 0;
+    return e;
+}
+
+/* Queue the slot returned by portator_ring_sqe */
+static inline void portator_ring_submit(struct PortatorRing *r) {
+    r->sq_tail++;
+}
+
+/* Oldest unread completion, or NULL */
+static inline struct PortatorCqe *portator_ring_cqe(struct PortatorRing *r) {
+    if (r->cq_head == r->cq_tail) return NULL;
+    return r->cq + (r->cq_head & (r->cq_entries - 1));
+}
+
+/* Release the completion returned by portator_ring_cqe */
+static inline void portator_ring_seen(struct PortatorRing *r) {
+    r->cq_head++;
+}
+
+/* Clock page. The host keeps a read-only page in every guest up to date
+   (about every millisecond), so reading the time is a few loads instead
+   of a trapped clock_gettime. seq is odd while the host is writing; the
+   readers below retry until they see the same even value on both sides
+   (x86 doesn't reorder loads, so a compiler barrier is all they need).
+   Readings are current to within period_us. */
+struct PortatorTimePage {
+    volatile uint32_t seq;
+    uint32_t period_us;
+    int64_t  monotonic_ns;  /* CLOCK_MONOTONIC */
+    int64_t  realtime_ns;   /* CLOCK_REALTIME */
+    uint64_t tick;          /* frames (at tick_hz) since the page started */
+    uint32_t tick_hz;
+    uint32_t reserved;
+};
+
+/* Address of the clock page, or NULL if the host can't provide one.
+   Only the first call traps. */
+static inline const struct PortatorTimePage *portator_time_page(void) {
+    static const struct PortatorTimePage *page;
+    static int tried;
+    if (!tried) {
+        long p = portator_syscall(PORTATOR_SYS_TIMEPAGE, 0, 0, 0);
+        page = p == -1 ? NULL : (const struct PortatorTimePage *)p;
+        tried = 1;
+    }
+    return page;
+}
+
+#define PORTATOR_TIME_SPINS 1000  /* tries before giving up on the page */
+
+/* Copy the page's fields under its seqlock. Returns 0, or -1 if there's
+   no page or it stays mid-update (its updater died while writing), in
+   which case callers fall back to clock_gettime. */
+static inline int portator_time_read(struct PortatorTimePage *out) {
+    const struct PortatorTimePage *p = portator_time_page();
+    uint32_t seq;
+    int spins = 0;
+    if (!p) return -1;
+    for (;;) {
+        while ((seq = p->seq) & 1) {
+            if (++spins > PORTATOR_TIME_SPINS) return -1;
+        }
+        __asm__ volatile("" ::: "memory");
+        out->monotonic_ns = p->monotonic_ns;
+        out->realtime_ns = p->realtime_ns;
+        out->tick = p->tick;
+        __asm__ volatile("" ::: "memory");
+        if (p->seq == seq) break;
+        if (++spins > PORTATOR_TIME_SPINS) return -1;
+    }
+    out->seq = seq;
+    out->period_us = p->period_us;
+    out->tick_hz = p->tick_hz;
+    return 0;
+}
+
+static inline int64_t portator_clock_ns(clockid_t clock) {
+    struct PortatorTimePage t;
+    struct timespec ts;
+    if (!portator_time_read(&t))
+        return clock == CLOCK_REALTIME ? t.realtime_ns : t.monotonic_ns;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* CLOCK_MONOTONIC and CLOCK_REALTIME in nanoseconds, from the clock
+   page when there is one */
+static inline int64_t portator_monotonic_ns(void) {
+    return portator_clock_ns(CLOCK_MONOTONIC);
+}
+
+static inline int64_t portator_realtime_ns(void) {
+    return portator_clock_ns(CLOCK_REALTIME);
+}
+
+/* Frame ticks (60 per second) since the host started the clock page,
+   or 0 without one */
+static inline uint64_t portator_frame_tick(void) {
+    struct PortatorTimePage t;
+    return portator_time_read(&t) ? 0 : t.tick;
+}
+
+/* Native hashing. The host hashes guest memory or a file at full
+   speed, with the SHA extensions and SSE4.2 where the CPU has them.
+   Digests are stored big-endian, as they are usually printed:
+   SHA-256 32 bytes, SHA-1 20, CRC32C 4, xxHash64 (seed 0) 8. */
+#define PORTATOR_HASH_SHA256 1
+#define PORTATOR_HASH_SHA1   2
+#define PORTATOR_HASH_CRC32C 3
+#define PORTATOR_HASH_XXH64  4
+#define PORTATOR_HASH_MAX_DIGEST 32
+
+#define PORTATOR_HASH_OP_BUFFER 0
+#define PORTATOR_HASH_OP_FILE   1
+#define PORTATOR_HASH_OP_INIT   2
+#define PORTATOR_HASH_OP_UPDATE 3
+#define PORTATOR_HASH_OP_FINAL  4
+
+/* Hash len bytes at data into digest. Returns the digest size, or -1. */
+static inline long portator_hash(int alg, const void *data, long len,
+                                 unsigned char *digest) {
+    return portator_syscall6(PORTATOR_SYS_HASH, PORTATOR_HASH_OP_BUFFER, alg,
+                             (long)data, len, (long)digest, 0);
+}
+
+/* Hash the whole file at path. Returns the digest size, or -1. */
+static inline long portator_hash_file(int alg, const char *path,
+                                      unsigned char *digest) {
+    return portator_syscall6(PORTATOR_SYS_HASH, PORTATOR_HASH_OP_FILE, alg,
+                             (long)path, (long)digest, 0, 0);
+}
+
+/* Streaming: portator_hash_init returns a handle (up to 64 open per
+   process) to feed with portator_hash_update and close with
+   portator_hash_final, which stores the digest (unless digest is NULL)
+   and returns its size. All return -1 on error. */
+static inline long portator_hash_init(int alg) {
+    return portator_syscall6(PORTATOR_SYS_HASH, PORTATOR_HASH_OP_INIT, alg,
+                             0, 0, 0, 0);
+}
+
+static inline long portator_hash_update(long handle, const void *data,
+                                        long len) {
+    return portator_syscall6(PORTATOR_SYS_HASH, PORTATOR_HASH_OP_UPDATE,
+                             handle, (long)data, len, 0, 0);
+}
+
+static inline long portator_hash_final(long handle, unsigned char *digest) {
+    return portator_syscall6(PORTATOR_SYS_HASH, PORTATOR_HASH_OP_FINAL,
+                             handle, (long)digest, 0, 0, 0);
+}
+
+/* Native compression with the host's zlib, much faster than zlib
+   compiled into the guest. flags pick the format and direction, and for
+   deflate, the level: e.g. PORTATOR_ZLIB_GZIP | PORTATOR_ZLIB_LEVEL(6),
+   or PORTATOR_ZLIB_RAW | PORTATOR_ZLIB_INFLATE. */
+#define PORTATOR_ZLIB_RAW      0    /* bare deflate data */
+#define PORTATOR_ZLIB_ZLIB     1
+#define PORTATOR_ZLIB_GZIP     2
+#define PORTATOR_ZLIB_INFLATE  4    /* decompress; otherwise compress */
+#define PORTATOR_ZLIB_LEVEL(n) (((n) + 1) << 8)  /* 0-9; default 6 */
+
+#define PORTATOR_ZLIB_OP_ONESHOT 0
+#define PORTATOR_ZLIB_OP_INIT    1
+#define PORTATOR_ZLIB_OP_STREAM  2
+#define PORTATOR_ZLIB_OP_END     3
+#define PORTATOR_ZLIB_OP_BATCH   4
+
+/* Compress or decompress all of in into out. Returns the output size,
+   or -1 on bad data or if out is too small. With out NULL, returns the
+   size needed (for compression, an upper bound). */
+static inline long portator_zlib(int flags, const void *in, long in_len,
+                                 void *out, long out_cap) {
+    return portator_syscall6(PORTATOR_SYS_ZLIB, PORTATOR_ZLIB_OP_ONESHOT,
+                             flags, (long)in, in_len, (long)out, out_cap);
+}
+
+/* One step of a stream, like zlib's z_stream: the host consumes input
+   and produces output, advancing the pointers and reducing the lengths
+   past what it used. */
+#define PORTATOR_ZLIB_NO_FLUSH   0
+#define PORTATOR_ZLIB_SYNC_FLUSH 1
+#define PORTATOR_ZLIB_FINISH     2  /* no more input after this */
+
+struct PortatorZlibStream {
+    const void *in;
+    uint64_t in_len;
+    void *out;
+    uint64_t out_len;
+    uint32_t flush;         /* PORTATOR_ZLIB_*_FLUSH / FINISH */
+    uint32_t reserved;
+};
+
+/* Open a stream (up to 64 per process). Returns a handle, or -1. */
+static inline long portator_zlib_init(int flags) {
+    return portator_syscall6(PORTATOR_SYS_ZLIB, PORTATOR_ZLIB_OP_INIT, flags,
+                             0, 0, 0, 0);
+}
+
+/* Run s through the stream until its input is used up (and with
+   PORTATOR_ZLIB_FINISH, the stream is complete) or its output is full.
+   Returns 1 once the stream has ended, 0 to call again with more input
+   or output room, or -1 on error. */
+static inline long portator_zlib_stream(long handle,
+                                        struct PortatorZlibStream *s) {
+    return portator_syscall6(PORTATOR_SYS_ZLIB, PORTATOR_ZLIB_OP_STREAM,
+                             handle, (long)s, 0, 0, 0);
+}
+
+static inline long portator_zlib_end(long handle) {
+    return portator_syscall6(PORTATOR_SYS_ZLIB, PORTATOR_ZLIB_OP_END, handle,
+                             0, 0, 0, 0);
+}
+
+/* One buffer of a batch. result is filled in as portator_zlib would
+   return it. */
+struct PortatorZlibBuffer {
+    const void *in;
+    uint64_t in_len;
+    void *out;
+    uint64_t out_cap;
+    int64_t result;
+};
+
+/* Compress or decompress count independent buffers (at most 256) with
+   the same flags in one call. Returns the number of buffers run. */
+static inline long portator_zlib_batch(int flags,
+                                       struct PortatorZlibBuffer *bufs,
+                                       int count) {
+    return portator_syscall6(PORTATOR_SYS_ZLIB, PORTATOR_ZLIB_OP_BATCH, flags,
+                             (long)bufs, count, 0, 0);
+}
+
+/* Mustache rendering on the host. json is the context, as JSON text.
+   {{> partials}} are read from files, as mustach would. */
+#define PORTATOR_RENDER_TEMPLATE_FILE 2  /* template is a path */
+#define PORTATOR_RENDER_OUTPUT_FILE   4  /* out is a path to write */
+
+/* Render len bytes of template into buf. Returns the rendered size, or
+   -1 on a bad template or JSON. Probe/fill: with buf NULL, returns the
+   size (the fill that follows reuses the rendering). */
+static inline long portator_render(const char *template, long len,
+                                   const char *json, char *buf, long buf_len) {
+    return portator_syscall6(PORTATOR_SYS_RENDER, (long)template, len,
+                             (long)json, (long)buf, buf_len, 0);
+}
+
+/* Render the template file at template_path straight into the file at
+   out_path. Returns the bytes written, or -1. */
+static inline long portator_render_file(const char *template_path,
+                                        const char *json,
+                                        const char *out_path) {
+    return portator_syscall6(PORTATOR_SYS_RENDER, (long)template_path, 0,
+                             (long)json, (long)out_path, 0,
+                             PORTATOR_RENDER_TEMPLATE_FILE |
+                             PORTATOR_RENDER_OUTPUT_FILE);
+}
+
+/* Bulk memory. memmove/memset/memcmp/memchr over large buffers run on
+   the host at native speed, instead of as emulated loops. Each call
+   traps, so below PORTATOR_MEM_THRESHOLD bytes the helpers use libc;
+   run guests/membench to find the crossover on your machine and build
+   with -DPORTATOR_MEM_THRESHOLD=<bytes> to change it. */
+#ifndef PORTATOR_MEM_THRESHOLD
+#define PORTATOR_MEM_THRESHOLD 16384
+#endif
+
+#define PORTATOR_MEM_OP_MOVE 0
+#define PORTATOR_MEM_OP_SET  1
+#define PORTATOR_MEM_OP_CMP  2  /* returns the first differing offset, or n */
+#define PORTATOR_MEM_OP_CHR  3  /* returns the first matching offset, or n */
+
+/* The raw call, whatever the size. Returns -1 on a bad address. */
+static inline long portator_mem(int op, const void *a, long b, size_t n) {
+    return portator_syscall6(PORTATOR_SYS_MEM, op, (long)a, b, (long)n, 0, 0);
+}
+
+static inline void *portator_memmove(void *dst, const void *src, size_t n) {
+    if (n < PORTATOR_MEM_THRESHOLD ||
+        portator_mem(PORTATOR_MEM_OP_MOVE, dst, (long)src, n) == -1)
+        return memmove(dst, src, n);
+    return dst;
+}
+
+static inline void *portator_memcpy(void *dst, const void *src, size_t n) {
+    return portator_memmove(dst, src, n);
+}
+
+static inline void *portator_memset(void *dst, int c, size_t n) {
+    if (n < PORTATOR_MEM_THRESHOLD ||
+        portator_mem(PORTATOR_MEM_OP_SET, dst, c, n) == -1)
+        return memset(dst, c, n);
+    return dst;
+}
+
+static inline int portator_memcmp(const void *a, const void *b, size_t n) {
+    long off;
+    if (n < PORTATOR_MEM_THRESHOLD ||
+        (off = portator_mem(PORTATOR_MEM_OP_CMP, a, (long)b, n)) == -1)
+        return memcmp(a, b, n);
+    if ((size_t)off == n) return 0;
+    return ((const unsigned char *)a)[off] - ((const unsigned char *)b)[off];
+}
+
+static inline void *portator_memchr(const void *p, int c, size_t n) {
+    long off;
+    if (n < PORTATOR_MEM_THRESHOLD ||
+        (off = portator_mem(PORTATOR_MEM_OP_CHR, p, (unsigned char)c, n)) == -1)
+        return (void *)memchr(p, c, n);
+    return (size_t)off == n ? NULL : (char *)p + off;
+}
+
+/* Map the file at path (e.g. "/zip/apps/foo/data.bin") read-only into
+   memory in one call and store its size in *size. Bundled files map
+   straight from the portator executable, or from one decompressed copy
+   the host keeps. Returns the address of the contents (NULL for an
+   empty file), or (void *)-1 on error. Release with portator_unmapfile. */
+static inline void *portator_mapfile(const char *path, size_t *size) {
+    return (void *)portator_syscall(PORTATOR_SYS_MAPFILE, (long)path,
+                                    (long)size, 0);
+}
+
+/* The mapping may start partway into a page, so round out to pages */
+static inline int portator_unmapfile(void *addr, size_t size) {
+    uintptr_t start = (uintptr_t)addr & -(uintptr_t)4096;
+    if (!addr) return 0;
+    return munmap((void *)start, (uintptr_t)addr + size - start);
+}
+
 static inline long portator_exit(int code) {
     return portator_syscall(PORTATOR_SYS_EXIT, code, 0, 0);
 }
@@ -71,6 +590,300 @@ static inline long portator_list(char *buf, long len) {
     return portator_syscall(PORTATOR_SYS_LIST, (long)buf, len, 0);
 }
 
+/* Flag for calls that return variable-length data: instead of filling
+   a buffer, the host maps a new one into the guest and stores its
+   address at the pointer passed as the buffer. One trap, no probe.
+   Release it with munmap(ptr, size). */
+#define PORTATOR_ALLOC 1
+
+/* Get the JSON listing of apps in one call. Stores a NUL-terminated
+   buffer in *out and returns its size, or -1. munmap(*out, size) it. */
+static inline long portator_list_alloc(char **out) {
+    return portator_syscall(PORTATOR_SYS_LIST, (long)out, 0, PORTATOR_ALLOC);
+}
+
+/* Binary app listing: no JSON to parse. The response is a
+   PortatorListHeader, then count PortatorAppInfo records, then a table
+   of NUL-terminated strings the records point into. Apps are sorted by
+   name. */
+#define PORTATOR_LIST_BINARY 2
+#define PORTATOR_LIST_MAGIC  0x54534c50  /* "PLST" */
+
+struct PortatorListQuery {
+    const char *prefix;     /* only names starting with this, or NULL */
+    int32_t  type;          /* only this PORTATOR_APP_*, or -1 for any */
+    uint32_t offset;        /* skip this many matches */
+    uint32_t limit;         /* return at most this many, 0 = all */
+    uint32_t reserved;
+};
+
+struct PortatorListHeader {
+    uint32_t magic;
+    uint32_t count;         /* records in this response */
+    uint32_t total;         /* apps matching, before offset/limit */
+    uint32_t strings;       /* offset of the string table from the header */
+};
+
+struct PortatorAppInfo {
+    uint32_t name;          /* string table offsets */
+    uint32_t source;        /* "guests" or "/zip/apps" */
+    int32_t  type;          /* PORTATOR_APP_* */
+    uint32_t reserved;
+    uint64_t size;          /* of the binary */
+    int64_t  mtime;         /* of the binary, seconds since the epoch */
+};
+
+/* Get the apps matching q (NULL for all) into buf. Probe/fill like
+   portator_list. Returns the size of the response, or -1. */
+static inline long portator_list_query(const struct PortatorListQuery *q,
+                                       void *buf, long len) {
+    return portator_syscall6(PORTATOR_SYS_LIST, (long)buf, len,
+                             PORTATOR_LIST_BINARY, (long)q, 0, 0);
+}
+
+/* Same, in one call: stores a new buffer in *out; munmap it after. */
+static inline long portator_list_query_alloc(const struct PortatorListQuery *q,
+                                             struct PortatorListHeader **out) {
+    return portator_syscall6(PORTATOR_SYS_LIST, (long)out, 0,
+                             PORTATOR_LIST_BINARY | PORTATOR_ALLOC, (long)q,
+                             0, 0);
+}
+
+static inline const struct PortatorAppInfo *
+portator_list_apps(const struct PortatorListHeader *h) {
+    return (const struct PortatorAppInfo *)(h + 1);
+}
+
+static inline const char *portator_list_str(const struct PortatorListHeader *h,
+                                            uint32_t off) {
+    return (const char *)h + h->strings + off;
+}
+
+/* A directory's entries with their types, sizes, modes and mtimes, in
+   a few calls rather than a readdir() and stat() per entry. The buffer
+   holds packed PortatorDirent records, sorted by name, without "." and
+   "..". *cookie (start it at 0) is the index of the next entry and is
+   advanced past what was returned: call until it returns 0. Probing
+   with (NULL, 0) gives the size of all the remaining records; a buffer
+   too small for even the next record gets -1. */
+struct PortatorDirent {
+    uint16_t reclen;        /* bytes from this record to the next */
+    uint8_t  type;          /* DT_REG, DT_DIR, ... */
+    uint8_t  reserved;
+    uint32_t mode;          /* st_mode */
+    uint64_t size;
+    int64_t  mtime;         /* seconds since the epoch */
+    char     name[];        /* NUL-terminated */
+};
+
+static inline long portator_readdir(const char *path, void *buf, long len,
+                                    uint64_t *cookie) {
+    return portator_syscall6(PORTATOR_SYS_READDIR, (long)path, (long)buf,
+                             len, (long)cookie, 0, 0);
+}
+
+/* Same, in one call: stores a new buffer of all the remaining records in
+   *out (NULL if there are none); munmap it after. */
+static inline long portator_readdir_alloc(const char *path, void **out,
+                                          uint64_t *cookie) {
+    return portator_syscall6(PORTATOR_SYS_READDIR, (long)path, (long)out, 0,
+                             (long)cookie, PORTATOR_ALLOC, 0);
+}
+
+/* The record after d, for walking the n bytes starting at buf:
+   for (d = buf; (char *)d < (char *)buf + n; d = portator_dirent_next(d)) */
+static inline const struct PortatorDirent *
+portator_dirent_next(const struct PortatorDirent *d) {
+    return (const struct PortatorDirent *)((const char *)d + d->reclen);
+}
+
+/* Write the /zip directory src (e.g. "/zip/include") out to dest, done
+   natively by the host: inflated on several threads, and files already
+   holding the right contents (by size and CRC) left alone. The manifest
+   has a line per file, "<w|=|!> <crc32> <size> <path>\n", for written,
+   unchanged or failed; names with a leading / or a ".." part always
+   fail. Returns the manifest's size, copying as much as fits into buf
+   (NULL if not wanted), even if some files failed: look for '!' lines.
+   Returns -1 if src names no files. */
+static inline long portator_extract(const char *src, const char *dest,
+                                    char *buf, long len) {
+    return portator_syscall6(PORTATOR_SYS_EXTRACT, (long)src, (long)dest,
+                             (long)buf, len, 0, 0);
+}
+
+/* Same, storing the whole manifest in a new buffer at *out; munmap it */
+static inline long portator_extract_alloc(const char *src, const char *dest,
+                                          char **out) {
+    return portator_syscall6(PORTATOR_SYS_EXTRACT, (long)src, (long)dest,
+                             (long)out, 0, PORTATOR_ALLOC, 0);
+}
+
+/* Resolve a host name with the host's resolver instead of musl's (which
+   reads resolv.conf and talks UDP under emulation, and doesn't work at
+   all on some hosts). Answers, failures included, are cached for every
+   guest the host runs. The result is a uint32_t count followed by that
+   many PortatorAddr records; use probe/fill, or a buffer of
+   PORTATOR_RESOLVE_SIZE for all of them. port may be NULL or a service
+   name. Returns the result's size, or -1 if the name doesn't resolve. */
+#define PORTATOR_RESOLVE_MAX   16
+#define PORTATOR_RESOLVE_SIZE  (4 + 20 * PORTATOR_RESOLVE_MAX)
+#define PORTATOR_RESOLVE_BATCH 2
+
+struct PortatorAddr {
+    uint16_t family;        /* AF_INET or AF_INET6 */
+    uint16_t port;          /* network byte order */
+    uint8_t  addr[16];      /* IPv4 in the first 4 bytes */
+};
+
+static inline long portator_resolve(const char *host, const char *port,
+                                    void *buf, long len) {
+    return portator_syscall6(PORTATOR_SYS_RESOLVE, (long)host, (long)port,
+                             (long)buf, len, 0, 0);
+}
+
+static inline uint32_t portator_resolve_count(const void *buf) {
+    uint32_t n;
+    memcpy(&n, buf, 4);
+    return n;
+}
+
+static inline const struct PortatorAddr *
+portator_resolve_addrs(const void *buf) {
+    return (const struct PortatorAddr *)((const char *)buf + 4);
+}
+
+/* Resolve many names in one call; the host looks them up concurrently.
+   Each query's result is what portator_resolve would have returned for
+   it. Returns how many resolved, or -1. */
+struct PortatorResolveQuery {
+    const char *host;
+    const char *port;
+    void *buf;
+    long len;
+    long result;
+};
+
+static inline long portator_resolve_batch(struct PortatorResolveQuery *q,
+                                          long count) {
+    return portator_syscall6(PORTATOR_SYS_RESOLVE, (long)q, count, 0, 0,
+                             PORTATOR_RESOLVE_BATCH, 0);
+}
+
+/* HTTP/1.1 requests made by the host, on connections it keeps alive
+   and pools per origin, so repeated requests skip the TCP handshake and
+   the guest runs no socket or parser code. Plain http:// only.
+   portator_http_open sends the request and waits for the response head,
+   filling in status and length (-1 if the server didn't say); it returns
+   a handle (up to 64 open per process). Read the body with
+   portator_http_read, which returns the bytes read, 0 at the end, or -1.
+   portator_http_close returns the connection to the pool if the body was
+   read to the end. */
+#define PORTATOR_HTTP_OP_OPEN    0
+#define PORTATOR_HTTP_OP_READ    1
+#define PORTATOR_HTTP_OP_HEADERS 2
+#define PORTATOR_HTTP_OP_CLOSE   3
+
+struct PortatorHttpRequest {
+    const char *method;     /* NULL for GET */
+    const char *url;        /* "http://host[:port]/path" */
+    const char *headers;    /* extra "Name: value\r\n" lines, or NULL */
+    const void *body;
+    uint64_t body_len;
+    uint32_t status;        /* out */
+    uint32_t reserved;
+    int64_t length;         /* out: Content-Length, or -1 */
+};
+
+static inline long portator_http_open(struct PortatorHttpRequest *req) {
+    return portator_syscall6(PORTATOR_SYS_HTTP, PORTATOR_HTTP_OP_OPEN,
+                             (long)req, 0, 0, 0, 0);
+}
+
+static inline long portator_http_read(long handle, void *buf, long len) {
+    return portator_syscall6(PORTATOR_SYS_HTTP, PORTATOR_HTTP_OP_READ, handle,
+                             (long)buf, len, 0, 0);
+}
+
+/* The response's status line and headers as one NUL-terminated string
+   (probe/fill: returns the size including the NUL) */
+static inline long portator_http_headers(long handle, char *buf, long len) {
+    return portator_syscall6(PORTATOR_SYS_HTTP, PORTATOR_HTTP_OP_HEADERS,
+                             handle, (long)buf, len, 0, 0);
+}
+
+static inline long portator_http_close(long handle) {
+    return portator_syscall6(PORTATOR_SYS_HTTP, PORTATOR_HTTP_OP_CLOSE,
+                             handle, 0, 0, 0, 0);
+}
+
+/* GET url into buf. Returns the status code, with *len set to the body's
+   size, or -1 if the request failed or the body didn't fit. */
+static inline long portator_http_get(const char *url, void *buf, long *len) {
+    struct PortatorHttpRequest req = { .url = url };
+    long handle, n = 0, got = 0;
+    if ((handle = portator_http_open(&req)) < 0) return -1;
+    while (got < *len &&
+           (n = portator_http_read(handle, (char *)buf + got, *len - got)) > 0)
+        got += n;
+    /* a full buffer is only fine if the body ended there */
+    if (n > 0 && req.length != got) {
+        char c;
+        n = portator_http_read(handle, &c, 1) ? -1 : 0;
+    }
+    if (n < 0) got = -1;
+    portator_http_close(handle);
+    if (got < 0) return -1;
+    *len = got;
+    return req.status;
+}
+
+/* Named shared memory between guests running at the same time, e.g. a
+   pipeline started with portator_launch_ex. portator_shm_create makes a
+   region of size bytes (zero-filled) and maps it; portator_shm_attach
+   maps one another guest created, storing its size unless size is NULL.
+   Both return the address, or NULL if the name is taken (create) or
+   unknown (attach). Unmap with portator_shm_detach, not munmap; a region
+   is gone once no guest has it mapped. Up to 64 regions exist at once.
+
+   portator_shm_wait sleeps while the 32-bit word at addr holds expected,
+   for up to timeout_ms (-1 for no limit), and returns 0 once woken, or
+   -1 if the word differed or the time ran out. portator_shm_wake wakes
+   up to count waiters and returns how many woke. Pair them with atomics
+   on the word, as with a futex. */
+#define PORTATOR_SHM_OP_CREATE 0
+#define PORTATOR_SHM_OP_ATTACH 1
+#define PORTATOR_SHM_OP_DETACH 2
+#define PORTATOR_SHM_OP_WAIT   3
+#define PORTATOR_SHM_OP_WAKE   4
+
+static inline void *portator_shm_create(const char *name, size_t size) {
+    long rc = portator_syscall6(PORTATOR_SYS_SHM, PORTATOR_SHM_OP_CREATE,
+                                (long)name, size, 0, 0, 0);
+    return rc == -1 ? NULL : (void *)rc;
+}
+
+static inline void *portator_shm_attach(const char *name, size_t *size) {
+    long rc = portator_syscall6(PORTATOR_SYS_SHM, PORTATOR_SHM_OP_ATTACH,
+                                (long)name, (long)size, 0, 0, 0);
+    return rc == -1 ? NULL : (void *)rc;
+}
+
+static inline long portator_shm_detach(void *addr) {
+    return portator_syscall6(PORTATOR_SYS_SHM, PORTATOR_SHM_OP_DETACH,
+                             (long)addr, 0, 0, 0, 0);
+}
+
+static inline long portator_shm_wait(void *addr, int expected,
+                                     long timeout_ms) {
+    return portator_syscall6(PORTATOR_SYS_SHM, PORTATOR_SHM_OP_WAIT,
+                             (long)addr, expected, timeout_ms, 0, 0);
+}
+
+static inline long portator_shm_wake(void *addr, long count) {
+    return portator_syscall6(PORTATOR_SYS_SHM, PORTATOR_SHM_OP_WAKE,
+                             (long)addr, count, 0, 0, 0);
+}
+
 /* Launch another guest app by name. Blocks until the child exits.
    Returns the child's exit code, or -1 on error.
    argv: NULL-terminated argument array (passed to guest main), or NULL.
@@ -0,0 +1,343 @@
+/* Minimal baseline JPEG encoder for framebuffer streaming.
+   4:4:4 sampling, standard Huffman tables, AAN float DCT. */
+#include "jpeg.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct BitWriter {
+    unsigned char *buf;
+    size_t len, cap;
+    uint32_t bits;
+    int nbits;
+    int oom;
+};
+
+struct HuffCode {
+    uint16_t code;
+    uint8_t len;
+};
+
+/* Natural order index -> zigzag position */
+static const unsigned char kZigZag[64] = {
+    0,  1,  5,  6,  14, 15, 27, 28, 2,  4,  7,  13, 16, 26, 29, 42,
+    3,  8,  12, 17, 25, 30, 41, 43, 9,  11, 18, 24, 31, 40, 44, 53,
+    10, 19, 23, 32, 39, 45, 52, 54, 20, 22, 33, 38, 46, 51, 55, 60,
+    21, 34, 37, 47, 50, 56, 59, 61, 35, 36, 48, 49, 57, 58, 62, 63,
+};
+
+static const unsigned char kLumaQuant[64] = {
+    16, 11, 10, 16,  24,  40,  51,  61,  12, 12, 14, 19,  26,  58,  60,  55,
+    14, 13, 16, 24,  40,  57,  69,  56,  14, 17, 22, 29,  51,  87,  80,  62,
+    18, 22, 37, 56,  68,  109, 103, 77,  24, 35, 55, 64,  81,  104, 113, 92,
+    49, 64, 78, 87,  103, 121, 120, 101, 72, 92, 95, 98,  112, 100, 103, 99,
+};
+
+static const unsigned char kChromaQuant[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+};
+
+static const unsigned char kDcLumaBits[16] = {
+    0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+};
+static const unsigned char kDcChromaBits[16] = {
+    0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+};
+static const unsigned char kDcVals[12] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+};
+
+static const unsigned char kAcLumaBits[16] = {
+    0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d,
+};
+static const unsigned char kAcLumaVals[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+    0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+    0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+    0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45,
+    0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75,
+    0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+    0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+    0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4,
+    0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+};
+
+static const unsigned char kAcChromaBits[16] = {
+    0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77,
+};
+static const unsigned char kAcChromaVals[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41,
+    0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+    0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44,
+    0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74,
+    0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+    0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+    0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4,
+    0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+};
+
+/* AAN scale factors folded into the quantizer */
+static const float kAanScale[8] = {
+    1.0f * 2.828427125f,         1.387039845f * 2.828427125f,
+    1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
+    1.0f * 2.828427125f,         0.785694958f * 2.828427125f,
+    0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f,
+};
+
+static void PutByte(struct BitWriter *bw, unsigned char c) {
+    if (bw->len == bw->cap) {
+        size_t cap = bw->cap ? bw->cap * 2 : 16384;
+        unsigned char *tmp = (unsigned char *)realloc(bw->buf, cap);
+        if (!tmp) { bw->oom = 1; return; }
+        bw->buf = tmp;
+        bw->cap = cap;
+    }
+    bw->buf[bw->len++] = c;
+}
+
+static void PutBytes(struct BitWriter *bw, const unsigned char *p, size_t n) {
+    while (n--) PutByte(bw, *p++);
+}
+
+static void PutWord(struct BitWriter *bw, unsigned w) {
+    PutByte(bw, w >> 8);
+    PutByte(bw, w & 255);
+}
+
+static void PutBits(struct BitWriter *bw, unsigned code, int len) {
+    bw->nbits += len;
+    bw->bits |= code << (24 - bw->nbits);
+    while (bw->nbits >= 8) {
+        unsigned char c = (bw->bits >> 16) & 255;
+        PutByte(bw, c);
+        if (c == 255) PutByte(bw, 0);  /* byte stuffing */
+        bw->bits <<= 8;
+        bw->nbits -= 8;
+    }
+}
+
+/* Build canonical Huffman codes from a JPEG BITS/HUFFVAL pair */
+static void BuildHuffman(const unsigned char bits[16],
+                         const unsigned char *vals, struct HuffCode out[256]) {
+    unsigned code = 0;
+    int k = 0;
+    for (int len = 1; len <= 16; len++) {
+        for (int i = 0; i < bits[len - 1]; i++) {
+            out[vals[k]].code = code++;
+            out[vals[k]].len = len;
+            k++;
+        }
+        code <<= 1;
+    }
+}
+
+static void PutHuffmanTable(struct BitWriter *bw, int cls_id,
+                            const unsigned char bits[16],
+                            const unsigned char *vals) {
+    int n = 0;
+    for (int i = 0; i < 16; i++) n += bits[i];
+    PutByte(bw, cls_id);
+    PutBytes(bw, bits, 16);
+    PutBytes(bw, vals, n);
+}
+
+static void Dct8(float *d, int s) {
+    float tmp0 = d[0] + d[7 * s], tmp7 = d[0] - d[7 * s];
+    float tmp1 = d[s] + d[6 * s], tmp6 = d[s] - d[6 * s];
+    float tmp2 = d[2 * s] + d[5 * s], tmp5 = d[2 * s] - d[5 * s];
+    float tmp3 = d[3 * s] + d[4 * s], tmp4 = d[3 * s] - d[4 * s];
+
+    /* even part */
+    float tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+    float tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+    d[0] = tmp10 + tmp11;
+    d[4 * s] = tmp10 - tmp11;
+    float z1 = (tmp12 + tmp13) * 0.707106781f;
+    d[2 * s] = tmp13 + z1;
+    d[6 * s] = tmp13 - z1;
+
+    /* odd part */
+    tmp10 = tmp4 + tmp5;
+    tmp11 = tmp5 + tmp6;
+    tmp12 = tmp6 + tmp7;
+    float z5 = (tmp10 - tmp12) * 0.382683433f;
+    float z2 = tmp10 * 0.541196100f + z5;
+    float z4 = tmp12 * 1.306562965f + z5;
+    float z3 = tmp11 * 0.707106781f;
+    float z11 = tmp7 + z3, z13 = tmp7 - z3;
+    d[5 * s] = z13 + z2;
+    d[3 * s] = z13 - z2;
+    d[s] = z11 + z4;
+    d[7 * s] = z11 - z4;
+}
+
+static void EncodeBlock(struct BitWriter *bw, float blk[64],
+                        const float fdtbl[64], int *dc,
+                        const struct HuffCode *hdc,
+                        const struct HuffCode *hac) {
+    int du[64];
+    for (int i = 0; i < 64; i += 8) Dct8(blk + i, 1);
+    for (int i = 0; i < 8; i++) Dct8(blk + i, 8);
+    for (int i = 0; i < 64; i++) {
+        float v = blk[i] * fdtbl[i];
+        du[kZigZag[i]] = (int)(v < 0 ? ceilf(v - 0.5f) : floorf(v + 0.5f));
+    }
+
+    /* DC coefficient as a difference from the previous block */
+    int diff = du[0] - *dc;
+    *dc = du[0];
+    int mag = diff < 0 ? -diff : diff;
+    int cat = 0;
+    while (mag >> cat) cat++;
+    PutBits(bw, hdc[cat].code, hdc[cat].len);
+    if (cat) PutBits(bw, (diff < 0 ? diff - 1 : diff) & ((1 << cat) - 1), cat);
+
+    /* AC coefficients, run-length coded */
+    int last = 63;
+    while (last > 0 && !du[last]) last--;
+    for (int i = 1, run = 0; i <= last; i++) {
+        if (!du[i]) { run++; continue; }
+        while (run >= 16) {
+            PutBits(bw, hac[0xf0].code, hac[0xf0].len);
+            run -= 16;
+        }
+        mag = du[i] < 0 ? -du[i] : du[i];
+        cat = 0;
+        while (mag >> cat) cat++;
+        int sym = (run << 4) | cat;
+        PutBits(bw, hac[sym].code, hac[sym].len);
+        PutBits(bw, (du[i] < 0 ? du[i] - 1 : du[i]) & ((1 << cat) - 1), cat);
+        run = 0;
+    }
+    if (last != 63) PutBits(bw, hac[0].code, hac[0].len);
+}
+
+static void ScaleQuant(const unsigned char *base, int scale,
+                       unsigned char zz[64], float fdtbl[64]) {
+    for (int i = 0; i < 64; i++) {
+        int q = (base[i] * scale + 50) / 100;
+        if (q < 1) q = 1;
+        if (q > 255) q = 255;
+        zz[kZigZag[i]] = q;
+    }
+    for (int row = 0, k = 0; row < 8; row++) {
+        for (int col = 0; col < 8; col++, k++) {
+            fdtbl[k] = 1.0f / (zz[kZigZag[k]] * kAanScale[row] * kAanScale[col]);
+        }
+    }
+}
+
+unsigned char *JpegEncode(const uint32_t *pixels, int w, int h, int stride,
+                          int quality, size_t *out_len) {
+    static struct HuffCode dcy[256], acy[256], dcc[256], acc[256];
+    static int tables_ready;
+    struct BitWriter bw;
+    unsigned char qy[64], qc[64];
+    float fdy[64], fdc[64];
+
+    if (w <= 0 || h <= 0 || w > 65535 || h > 65535) return NULL;
+    if (!tables_ready) {
+        /* idempotent, so a benign race between streamer threads */
+        BuildHuffman(kDcLumaBits, kDcVals, dcy);
+        BuildHuffman(kAcLumaBits, kAcLumaVals, acy);
+        BuildHuffman(kDcChromaBits, kDcVals, dcc);
+        BuildHuffman(kAcChromaBits, kAcChromaVals, acc);
+        tables_ready = 1;
+    }
+
+    if (quality < 1) quality = 1;
+    if (quality > 100) quality = 100;
+    int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    ScaleQuant(kLumaQuant, scale, qy, fdy);
+    ScaleQuant(kChromaQuant, scale, qc, fdc);
+
+    memset(&bw, 0, sizeof(bw));
+
+    /* SOI + JFIF APP0 */
+    static const unsigned char kHead[] = {
+        0xff, 0xd8, 0xff, 0xe0, 0, 16, 'J', 'F', 'I', 'F', 0,
+        1, 1, 0, 0, 1, 0, 1, 0, 0,
+    };
+    PutBytes(&bw, kHead, sizeof(kHead));
+
+    /* DQT */
+    PutWord(&bw, 0xffdb);
+    PutWord(&bw, 2 + 2 * 65);
+    PutByte(&bw, 0);
+    PutBytes(&bw, qy, 64);
+    PutByte(&bw, 1);
+    PutBytes(&bw, qc, 64);
+
+    /* SOF0: 8-bit, three components, no subsampling */
+    PutWord(&bw, 0xffc0);
+    PutWord(&bw, 17);
+    PutByte(&bw, 8);
+    PutWord(&bw, h);
+    PutWord(&bw, w);
+    PutByte(&bw, 3);
+    for (int c = 1; c <= 3; c++) {
+        PutByte(&bw, c);
+        PutByte(&bw, 0x11);
+        PutByte(&bw, c == 1 ? 0 : 1);
+    }
+
+    /* DHT */
+    PutWord(&bw, 0xffc4);
+    PutWord(&bw, 2 + 4 * 17 + 12 + 162 + 12 + 162);
+    PutHuffmanTable(&bw, 0x00, kDcLumaBits, kDcVals);
+    PutHuffmanTable(&bw, 0x10, kAcLumaBits, kAcLumaVals);
+    PutHuffmanTable(&bw, 0x01, kDcChromaBits, kDcVals);
+    PutHuffmanTable(&bw, 0x11, kAcChromaBits, kAcChromaVals);
+
+    /* SOS */
+    static const unsigned char kSos[] = {
+        0xff, 0xda, 0, 12, 3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0,
+    };
+    PutBytes(&bw, kSos, sizeof(kSos));
+
+    int dcy_prev = 0, dcu_prev = 0, dcv_prev = 0;
+    float by[64], bu[64], bv[64];
+    for (int y0 = 0; y0 < h; y0 += 8) {
+        for (int x0 = 0; x0 < w; x0 += 8) {
+            for (int k = 0; k < 64; k++) {
+                /* replicate edge pixels into partial blocks */
+                int y = y0 + (k >> 3), x = x0 + (k & 7);
+                if (y >= h) y = h - 1;
+                if (x >= w) x = w - 1;
+                uint32_t p = pixels[(size_t)y * stride + x];
+                float r = (p >> 16) & 255, g = (p >> 8) & 255, b = p & 255;
+                by[k] = 0.299f * r + 0.587f * g + 0.114f * b - 128;
+                bu[k] = -0.16874f * r - 0.33126f * g + 0.5f * b;
+                bv[k] = 0.5f * r - 0.41869f * g - 0.08131f * b;
+            }
+            EncodeBlock(&bw, by, fdy, &dcy_prev, dcy, acy);
+            EncodeBlock(&bw, bu, fdc, &dcu_prev, dcc, acc);
+            EncodeBlock(&bw, bv, fdc, &dcv_prev, dcc, acc);
+        }
+    }
+
+    PutBits(&bw, 0x7f, 7);  /* pad the final byte with ones */
+    PutWord(&bw, 0xffd9);
+
+    if (bw.oom) {
+        free(bw.buf);
+        return NULL;
+    }
+    *out_len = bw.len;
+    return bw.buf;
+}
@@ -0,0 +1,14 @@
+#ifndef JPEG_H_
+#define JPEG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Encode a w x h image of 0x00RRGGBB pixels as a baseline JPEG.
+   stride is the distance between rows, in pixels. quality is 1-100.
+   Returns a malloc'd buffer and stores its length in *out_len,
+   or NULL if out of memory. Caller must free() the result. */
+unsigned char *JpegEncode(const uint32_t *pixels, int w, int h, int stride,
+                          int quality, size_t *out_len);
+
+#endif /* JPEG_H_ */
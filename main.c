@@ -3,7 +3,11 @@
 │ Portator (ISC license) by Matt Cruikshank                                    │
 │ A modified fork of Blink (ISC license) by Justine Tunney                     │
 ╚─────────────────────────────────────────────────────────────────────────────*/
+#include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,15 +17,21 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <unistd.h>
-#include <dirent.h>
+#include <zlib.h>
+#ifdef __COSMOPOLITAN__
+#include <cosmo.h>
+#endif
 
 #include "config.h"
 #include "blink/assert.h"
 #include "blink/bus.h"
+#include "blink/endian.h"
 #include "blink/flag.h"
 #include "blink/jit.h"
 #include "blink/loader.h"
+#include "blink/lock.h"
 #include "blink/log.h"
+#include "blink/macros.h"
 #include "blink/machine.h"
 #include "blink/map.h"
 #include "blink/overlays.h"
@@ -31,7 +41,17 @@
 #include "blink/vfs.h"
 #include "blink/web.h"
 #include "blink/xlat.h"
+#include "apps.h"
+#include "hash.h"
+#include "http_client.h"
+#include "render.h"
+#include "resolve.h"
+#include "shm.h"
+#include "session.h"
+#include "stream.h"
+#include "timepage.h"
 #include "web_server.h"
+#include "zipstore.h"
 
 extern char **environ;
 static char g_pathbuf[PATH_MAX];
@@ -39,6 +59,8 @@ static char g_pathbuf[PATH_MAX];
 static void Print(int fd, const char *s);
 static int CmdRun(int argc, char **argv);
 static int CmdRunForked(int argc, char **argv);
+static int InitRuntime(void);
+static const char *ExecutablePath(void);
 
 static int WriteFile(const char *path, const char *content, size_t len) {
   FILE *f = fopen(path, "w");
@@ -143,6 +165,49 @@ static int BuildWithTcc(const char *src, const char *out, char **argv) {
   return CmdRun(13, tcc_argv);
 }
 
+/* Write the zip store's dir (e.g. "include") out to dest natively, the
+   way the EXTRACT syscall does, listing each file when verbose and each
+   file that failed regardless */
+static int ExtractDir(const char *dir, const char *dest, int verbose) {
+  char *manifest = NULL;
+  size_t len;
+  int n;
+  if (ZipStoreOpen(ExecutablePath())) {
+    Print(2, "portator: no zip store in this executable\n");
+    return -1;
+  }
+  n = ZipStoreExtract(dir, dest, 0, &manifest, &len);
+  if (manifest && verbose) Print(1, manifest);
+  if (n == -1) {
+    for (char *line = verbose ? NULL : manifest; line && *line;) {
+      char *end = strchr(line, '\n');
+      *end = '\0';
+      if (*line == '!') {
+        Print(2, line);
+        Print(2, "\n");
+      }
+      line = end + 1;
+    }
+    Print(2, "portator: cannot extract ");
+    Print(2, dir);
+    Print(2, "\n");
+  }
+  free(manifest);
+  return n == -1 ? -1 : 0;
+}
+
+static int CmdExtract(int argc, char **argv) {
+  const char *dir;
+  if (argc < 3) {
+    Print(2, "Usage: portator extract <dir> [to]\n");
+    return 1;
+  }
+  dir = argv[2];
+  if (!strncmp(dir, "/zip/", 5)) dir += 5;
+  else if (!strncmp(dir, "zip/", 4)) dir += 4;
+  return ExtractDir(dir, argc > 3 ? argv[3] : dir, 1) ? 1 : 0;
+}
+
 static int CmdBuild(int argc, char **argv) {
   char src[PATH_MAX];
   char out[PATH_MAX];
@@ -179,8 +244,8 @@ static int CmdBuild(int argc, char **argv) {
 
   /* Extract shared files if needed */
   if (access("include", F_OK) || access("src", F_OK)) {
-    char *init_argv[] = { argv[0], (char *)"run", (char *)"init", NULL };
-    if (CmdRun(3, init_argv)) return 1;
+    if (ExtractDir("include", "include", 0) || ExtractDir("src", "src", 0))
+      return 1;
   }
 
   Print(1, "Building ");
@@ -316,69 +381,1903 @@ void TerminateSignal(struct Machine *m, int sig, int code) {
 #define PORTATOR_VERSION "0.0.0-dev"
 #endif
 
-/* Build a JSON string like {"apps":[{"name":"snake"},{"name":"list"}]}
-   by scanning for directories where <name>/<name>.c exists.
-   Caller must free() the result. */
-static char *BuildAppListJson(void) {
-  DIR *d;
-  struct dirent *ent;
-  char probe[PATH_MAX];
+/* Guest memory at addr, for the session message rings to copy through */
+struct GuestCopy {
+  struct Machine *m;
+  i64 addr;
+};
+
+static int CopyInFromGuest(void *ctx, void *dst, size_t len) {
+  struct GuestCopy *gc = (struct GuestCopy *)ctx;
+  return CopyFromUserRead(gc->m, dst, gc->addr, len);
+}
+
+static int CopyOutToGuest(void *ctx, size_t off, const void *src,
+                          size_t len) {
+  struct GuestCopy *gc = (struct GuestCopy *)ctx;
+  return CopyToUserWrite(gc->m, gc->addr + off, (void *)src, len);
+}
+
+/* Map size bytes of fresh read/write memory into the guest, as an
+   anonymous mmap would. Returns the guest address, or -1. */
+static i64 GuestMmap(struct Machine *m, u64 size) {
+  i64 virt;
+  size = (size + 4095) & -4096;
+  LOCK(&m->system->mmap_lock);
+  if ((virt = FindVirtual(m->system, m->system->automap, size)) != -1) {
+    if (ReserveVirtual(m->system, virt, size, PAGE_U | PAGE_RW | PAGE_XD, -1,
+                       0, false, false) != -1) {
+      m->system->automap = virt + size;
+    } else {
+      virt = -1;
+    }
+  }
+  UNLOCK(&m->system->mmap_lock);
+  return virt;
+}
+
+/* Undo a mapping of size bytes at virt that the guest never saw. */
+static void GuestMunmap(struct Machine *m, i64 virt, u64 size) {
+  i64 skip = virt & 4095;
+  LOCK(&m->system->mmap_lock);
+  FreeVirtual(m->system, virt - skip, (size + skip + 4095) & -4096);
+  UNLOCK(&m->system->mmap_lock);
+}
+
+/* The time page is mapped read-only once per guest address space; a
+   guest that execs gets a new System and maps it again. */
+static struct {
+  pthread_mutex_t lock;
+  struct System *system;
+  i64 virt;
+} g_timepage = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static i64 MapTimePage(struct Machine *m) {
+  i64 virt = -1;
+  int fd;
+  pthread_mutex_lock(&g_timepage.lock);
+  if (g_timepage.system == m->system) {
+    virt = g_timepage.virt;
+  } else if ((fd = TimePageFd()) != -1) {
+    LOCK(&m->system->mmap_lock);
+    if ((virt = FindVirtual(m->system, m->system->automap, 4096)) != -1) {
+      if (ReserveVirtual(m->system, virt, 4096, PAGE_U | PAGE_XD, fd, 0,
+                         true, false) != -1) {
+        m->system->automap = virt + 4096;
+        g_timepage.system = m->system;
+        g_timepage.virt = virt;
+      } else {
+        virt = -1;
+      }
+    }
+    UNLOCK(&m->system->mmap_lock);
+  }
+  pthread_mutex_unlock(&g_timepage.lock);
+  return virt;
+}
+
+/* Variable-length responses (probe/fill) come from data the host keeps
+   between calls, so the fill after a probe copies what the probe
+   measured instead of scanning again. The app scan behind LIST is kept
+   while its generation is unchanged, for up to APPS_TTL_NS (an app
+   built into an existing directory doesn't change the generation). */
+#define APPS_TTL_NS 1000000000LL
+#define RESPONSE_ALLOC 1
+#define LIST_BINARY 2
+
+static struct {
+  pthread_mutex_t lock;
+  u64 gen;
+  i64 scanned_ns;              /* 0 until the first scan */
+  struct AppList list;
+  char *json;                  /* the full JSON listing, once asked for */
+} g_apps = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Hand the guest a response: the size for a probe (buf=0), the bytes for
+   a fill, or with RESPONSE_ALLOC, a fresh mapping holding the bytes
+   whose address is stored at buf. */
+static i64 PutResponse(struct Machine *m, u64 buf, u64 len, u64 flags,
+                       const void *data, size_t size) {
+  if (flags & RESPONSE_ALLOC) {
+    u8 ptr[8];
+    i64 virt = GuestMmap(m, size);
+    if (virt == -1) return -1;
+    Write64(ptr, virt);
+    if (CopyToUserWrite(m, virt, (void *)data, size) ||
+        CopyToUserWrite(m, buf, ptr, 8)) {
+      GuestMunmap(m, virt, size);
+      return -1;
+    }
+    return size;
+  }
+  if (!buf || !len) return size;
+  if (size > len) size = len;
+  return CopyToUserWrite(m, buf, (void *)data, size) ? -1 : (i64)size;
+}
+
+/* Rescan the apps if the cached scan is stale. Caller holds the lock. */
+static int RefreshApps(void) {
+  u64 gen = AppGeneration();
+  i64 now = StreamNowNs();
+  struct AppList list;
+  if (g_apps.scanned_ns && g_apps.gen == gen &&
+      now - g_apps.scanned_ns <= APPS_TTL_NS)
+    return 0;
+  if (AppRescan(&list, &g_apps.list)) return -1;
+  AppListFree(&g_apps.list);
+  free(g_apps.json);
+  g_apps.list = list;
+  g_apps.json = NULL;
+  g_apps.gen = gen;
+  g_apps.scanned_ns = now;
+  return 0;
+}
+
+/* Read a struct PortatorListQuery from the guest */
+static int ReadListQuery(struct Machine *m, i64 addr, struct AppQuery *q) {
+  u8 raw[24];
+  q->prefix = NULL;
+  q->type = -1;
+  q->offset = q->limit = 0;
+  if (!addr) return 0;
+  if (CopyFromUserRead(m, raw, addr, sizeof(raw))) return -1;
+  if (Read64(raw) && !(q->prefix = CopyStr(m, Read64(raw)))) return -1;
+  q->type = (i32)Read32(raw + 8);
+  q->offset = Read32(raw + 12);
+  q->limit = Read32(raw + 16);
+  return 0;
+}
+
+static i64 ListApps(struct Machine *m, u64 buf, u64 len, u64 flags,
+                    i64 query) {
+  struct AppQuery q;
+  i64 rc = -1;
+  if (flags & ~(u64)(RESPONSE_ALLOC | LIST_BINARY)) return -1;
+  if ((flags & LIST_BINARY) && ReadListQuery(m, query, &q)) return -1;
+  pthread_mutex_lock(&g_apps.lock);
+  if (RefreshApps()) goto done;
+  if (flags & LIST_BINARY) {
+    size_t size;
+    void *bin = AppListBinary(&g_apps.list, &q, &size);
+    if (bin) rc = PutResponse(m, buf, len, flags, bin, size);
+    free(bin);
+  } else {
+    if (!g_apps.json && !(g_apps.json = AppListJson(&g_apps.list, NULL)))
+      goto done;
+    rc = PutResponse(m, buf, len, flags, g_apps.json,
+                     strlen(g_apps.json) + 1);
+  }
+done:
+  pthread_mutex_unlock(&g_apps.lock);
+  return rc;
+}
+
+/*─────────────────────────────────────────────────────────────────────────────╗
+│ Portator native hashing                                                     │
+╚─────────────────────────────────────────────────────────────────────────────*/
+
+/* HASH runs SHA-256, SHA-1, CRC32C or xxHash64 on the host, over a guest
+   buffer, a file the guest names, or input fed through a handle across
+   several calls. Guest memory and files are read in HASH_CHUNK pieces. */
+#define HASH_BUFFER 0          /* PORTATOR_HASH_OP_* */
+#define HASH_FILE 1
+#define HASH_INIT 2
+#define HASH_UPDATE 3
+#define HASH_FINAL 4
+#define HASH_CHUNK 65536
+#define HASH_HANDLES 64
+
+static struct {
+  pthread_mutex_t lock;
+  struct HashCtx *ctx[HASH_HANDLES];   /* handle is index + 1 */
+} g_hash = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int HashGuestMemory(struct Machine *m, struct HashCtx *h, i64 addr,
+                           u64 len) {
+  u8 *chunk;
+  if (!(chunk = (u8 *)malloc(MIN(len, HASH_CHUNK) + 1))) return -1;
+  while (len) {
+    u64 n = MIN(len, HASH_CHUNK);
+    if (CopyFromUserRead(m, chunk, addr, n)) break;
+    HashUpdate(h, chunk, n);
+    addr += n;
+    len -= n;
+  }
+  free(chunk);
+  return len ? -1 : 0;
+}
+
+/* The path goes through Blink's VFS, so it names what the guest's own
+   open() would, /zip included. */
+static int HashGuestFile(struct Machine *m, struct HashCtx *h, i64 path_ptr) {
+  char *path;
+  u8 *chunk;
+  ssize_t n = -1;
+  int fd;
+  if (!(path = CopyStr(m, path_ptr))) return -1;
+  if ((fd = VfsOpen(AT_FDCWD, path, O_RDONLY, 0)) == -1) return -1;
+  if ((chunk = (u8 *)malloc(HASH_CHUNK))) {
+    while ((n = VfsRead(fd, chunk, HASH_CHUNK)) > 0) HashUpdate(h, chunk, n);
+    free(chunk);
+  }
+  VfsClose(fd);
+  return n ? -1 : 0;
+}
+
+static i64 PutDigest(struct Machine *m, struct HashCtx *h, i64 out) {
+  u8 digest[HASH_MAX_DIGEST];
+  int size = HashFinal(h, digest);
+  return CopyToUserWrite(m, out, digest, size) ? -1 : size;
+}
+
+/* Take handle's context out of the table, or return NULL */
+static struct HashCtx *TakeHash(u64 handle) {
+  struct HashCtx *h = NULL;
+  if (handle - 1 >= HASH_HANDLES) return NULL;
+  pthread_mutex_lock(&g_hash.lock);
+  h = g_hash.ctx[handle - 1];
+  g_hash.ctx[handle - 1] = NULL;
+  pthread_mutex_unlock(&g_hash.lock);
+  return h;
+}
+
+static void PutBackHash(u64 handle, struct HashCtx *h) {
+  pthread_mutex_lock(&g_hash.lock);
+  g_hash.ctx[handle - 1] = h;
+  pthread_mutex_unlock(&g_hash.lock);
+}
+
+static i64 HashOp(struct Machine *m, u64 op, u64 a, u64 b, u64 c, u64 d) {
+  struct HashCtx ctx, *h;
+  i64 rc = -1;
+  switch (op) {
+    case HASH_BUFFER:  /* a=alg, b=buf, c=len, d=out */
+      if (HashInit(&ctx, a) || HashGuestMemory(m, &ctx, b, c)) return -1;
+      return PutDigest(m, &ctx, d);
+    case HASH_FILE:  /* a=alg, b=path, c=out */
+      if (HashInit(&ctx, a) || HashGuestFile(m, &ctx, b)) return -1;
+      return PutDigest(m, &ctx, c);
+    case HASH_INIT:  /* a=alg */
+      if (!(h = (struct HashCtx *)malloc(sizeof(*h)))) return -1;
+      if (HashInit(h, a)) {
+        free(h);
+        return -1;
+      }
+      pthread_mutex_lock(&g_hash.lock);
+      for (int i = 0; i < HASH_HANDLES; i++) {
+        if (!g_hash.ctx[i]) {
+          g_hash.ctx[i] = h;
+          rc = i + 1;
+          break;
+        }
+      }
+      pthread_mutex_unlock(&g_hash.lock);
+      if (rc == -1) free(h);
+      return rc;
+    case HASH_UPDATE:  /* a=handle, b=buf, c=len */
+      /* taken out of the table while in use, so a second thread
+         updating the same handle fails instead of racing */
+      if (!(h = TakeHash(a))) return -1;
+      rc = HashGuestMemory(m, h, b, c);
+      PutBackHash(a, h);
+      return rc;
+    case HASH_FINAL:  /* a=handle, b=out (0 to discard) */
+      if (!(h = TakeHash(a))) return -1;
+      rc = b ? PutDigest(m, h, b) : 0;
+      free(h);
+      return rc;
+    default:
+      return -1;
+  }
+}
+
+/*─────────────────────────────────────────────────────────────────────────────╗
+│ Portator native compression                                                 │
+╚─────────────────────────────────────────────────────────────────────────────*/
+
+/* ZLIB runs deflate and inflate on the host with the zlib Blink links,
+   as raw deflate, zlib or gzip streams. Guest buffers move through
+   ZLIB_CHUNK-sized host buffers. */
+#define ZLIB_ONESHOT 0         /* PORTATOR_ZLIB_OP_* */
+#define ZLIB_INIT 1
+#define ZLIB_STREAM 2
+#define ZLIB_END 3
+#define ZLIB_BATCH 4
+#define ZLIB_FORMAT 3          /* PORTATOR_ZLIB_RAW/ZLIB/GZIP */
+#define ZLIB_INFLATE 4
+#define ZLIB_LEVEL(f) ((int)((f) >> 8 & 15) - 1)
+#define ZLIB_CHUNK 65536
+#define ZLIB_HANDLES 64
+#define ZLIB_BATCH_MAX 256
+#define ZLIB_RECORD 40         /* struct PortatorZlibBuffer */
+
+/* offsets into struct PortatorZlibStream */
+#define ZS_IN 0
+#define ZS_IN_LEN 8
+#define ZS_OUT 16
+#define ZS_OUT_LEN 24
+#define ZS_FLUSH 32
+#define ZS_SIZE 40
+
+struct ZlibStream {
+  z_stream z;
+  int inflate;
+  u8 in[ZLIB_CHUNK];
+  u8 out[ZLIB_CHUNK];
+};
+
+static struct {
+  pthread_mutex_t lock;
+  struct ZlibStream *zs[ZLIB_HANDLES];   /* handle is index + 1 */
+} g_zlib = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct ZlibStream *ZlibOpen(u64 flags) {
+  static const int kWindowBits[] = { -15, 15, 31 };
+  struct ZlibStream *zs;
+  int level = ZLIB_LEVEL(flags), rc;
+  if ((flags & ZLIB_FORMAT) > 2 || level > 9) return NULL;
+  if (!(zs = (struct ZlibStream *)calloc(1, sizeof(*zs)))) return NULL;
+  zs->inflate = !!(flags & ZLIB_INFLATE);
+  if (zs->inflate)
+    rc = inflateInit2(&zs->z, kWindowBits[flags & ZLIB_FORMAT]);
+  else
+    rc = deflateInit2(&zs->z, level < 0 ? Z_DEFAULT_COMPRESSION : level,
+                      Z_DEFLATED, kWindowBits[flags & ZLIB_FORMAT], 8,
+                      Z_DEFAULT_STRATEGY);
+  if (rc != Z_OK) {
+    free(zs);
+    return NULL;
+  }
+  return zs;
+}
+
+static void ZlibClose(struct ZlibStream *zs) {
+  if (zs->inflate)
+    inflateEnd(&zs->z);
+  else
+    deflateEnd(&zs->z);
+  free(zs);
+}
+
+/* Feed in_len bytes at guest address in through the stream, writing to
+   out (or just counting the output when out is 0) until the input is
+   used up -- and with Z_FINISH, the stream ended -- or out_len is full.
+   Advances the four values past what was used and returns the last
+   zlib status: Z_STREAM_END, Z_OK, or an error. */
+static int ZlibRun(struct Machine *m, struct ZlibStream *zs, i64 *in,
+                   u64 *in_len, i64 *out, u64 *out_len, int flush) {
+  int rc = Z_OK;
+  for (;;) {
+    u64 n = MIN(*in_len, ZLIB_CHUNK);
+    u64 room = MIN(*out_len, ZLIB_CHUNK);
+    if (!room) break;
+    if (n && CopyFromUserRead(m, zs->in, *in, n)) return Z_STREAM_ERROR;
+    zs->z.next_in = zs->in;
+    zs->z.avail_in = n;
+    zs->z.next_out = zs->out;
+    zs->z.avail_out = room;
+    /* only finish once the last of the input is in this chunk */
+    int f = n == *in_len ? flush : Z_NO_FLUSH;
+    rc = zs->inflate ? inflate(&zs->z, f) : deflate(&zs->z, f);
+    if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) return rc;
+    u64 used = n - zs->z.avail_in, made = room - zs->z.avail_out;
+    if (made && *out && CopyToUserWrite(m, *out, zs->out, made))
+      return Z_STREAM_ERROR;
+    *in += used;
+    *in_len -= used;
+    if (*out) *out += made;
+    *out_len -= made;
+    if (rc == Z_STREAM_END) break;
+    if (!used && !made) {        /* needs more input or output room */
+      rc = Z_OK;
+      break;
+    }
+  }
+  return rc;
+}
+
+/* Compress or decompress a whole buffer with zs, which is reset first.
+   Returns the output size, or -1 if it doesn't fit in out_cap. With out
+   0, returns the size needed: deflate's bound when compressing, the
+   exact size when inflating. */
+static i64 ZlibOneShot(struct Machine *m, struct ZlibStream *zs, i64 in,
+                       u64 in_len, i64 out, u64 out_cap) {
+  u64 room = out ? out_cap : -1;
+  if (zs->inflate)
+    inflateReset(&zs->z);
+  else
+    deflateReset(&zs->z);
+  if (!out && !zs->inflate) return deflateBound(&zs->z, in_len);
+  if (ZlibRun(m, zs, &in, &in_len, &out, &room, Z_FINISH) != Z_STREAM_END)
+    return -1;
+  return (out ? out_cap : (u64)-1) - room;
+}
+
+/* Many small buffers in one call: records of {in, in_len, out, out_cap,
+   result}, each one-shot through the same stream. Returns the number
+   of records run. */
+static i64 ZlibBatch(struct Machine *m, u64 flags, i64 addr, u64 count) {
+  struct ZlibStream *zs;
+  u8 (*recs)[ZLIB_RECORD];
+  u64 i, n = MIN(count, ZLIB_BATCH_MAX);
+  i64 rc = -1;
+  if (!n || !(zs = ZlibOpen(flags))) return -1;
+  if ((recs = (u8 (*)[ZLIB_RECORD])malloc(n * ZLIB_RECORD)) &&
+      !CopyFromUserRead(m, recs, addr, n * ZLIB_RECORD)) {
+    for (i = 0; i < n; i++) {
+      u8 *r = recs[i];
+      Write64(r + 32, ZlibOneShot(m, zs, Read64(r), Read64(r + 8),
+                                  Read64(r + 16), Read64(r + 24)));
+    }
+    if (!CopyToUserWrite(m, addr, recs, n * ZLIB_RECORD)) rc = n;
+  }
+  free(recs);
+  ZlibClose(zs);
+  return rc;
+}
+
+/* Take handle's stream out of the table while it's in use */
+static struct ZlibStream *TakeZlib(u64 handle) {
+  struct ZlibStream *zs;
+  if (handle - 1 >= ZLIB_HANDLES) return NULL;
+  pthread_mutex_lock(&g_zlib.lock);
+  zs = g_zlib.zs[handle - 1];
+  g_zlib.zs[handle - 1] = NULL;
+  pthread_mutex_unlock(&g_zlib.lock);
+  return zs;
+}
+
+static void PutBackZlib(u64 handle, struct ZlibStream *zs) {
+  pthread_mutex_lock(&g_zlib.lock);
+  g_zlib.zs[handle - 1] = zs;
+  pthread_mutex_unlock(&g_zlib.lock);
+}
+
+/* Run a struct PortatorZlibStream through handle's stream and write its
+   advanced pointers and lengths back. Returns 1 at the end of the
+   stream, 0 otherwise, or -1. */
+static i64 ZlibStreamStep(struct Machine *m, u64 handle, i64 addr) {
+  static const int kFlush[] = { Z_NO_FLUSH, Z_SYNC_FLUSH, Z_FINISH };
+  struct ZlibStream *zs;
+  u8 st[ZS_SIZE];
+  i64 in, out;
+  u64 in_len, out_len, flush;
+  int rc;
+  if (CopyFromUserRead(m, st, addr, ZS_SIZE)) return -1;
+  in = Read64(st + ZS_IN);
+  in_len = Read64(st + ZS_IN_LEN);
+  out = Read64(st + ZS_OUT);
+  out_len = Read64(st + ZS_OUT_LEN);
+  if ((flush = Read32(st + ZS_FLUSH)) > 2 || !out) return -1;
+  if (!(zs = TakeZlib(handle))) return -1;
+  rc = ZlibRun(m, zs, &in, &in_len, &out, &out_len, kFlush[flush]);
+  PutBackZlib(handle, zs);
+  if (rc != Z_OK && rc != Z_STREAM_END) return -1;
+  Write64(st + ZS_IN, in);
+  Write64(st + ZS_IN_LEN, in_len);
+  Write64(st + ZS_OUT, out);
+  Write64(st + ZS_OUT_LEN, out_len);
+  if (CopyToUserWrite(m, addr, st, ZS_SIZE)) return -1;
+  return rc == Z_STREAM_END;
+}
+
+static i64 ZlibOp(struct Machine *m, u64 op, u64 a, u64 b, u64 c, u64 d,
+                  u64 e) {
+  struct ZlibStream *zs;
+  i64 rc = -1;
+  switch (op) {
+    case ZLIB_ONESHOT:  /* a=flags, b=in, c=in_len, d=out, e=out_cap */
+      if (!(zs = ZlibOpen(a))) return -1;
+      rc = ZlibOneShot(m, zs, b, c, d, e);
+      ZlibClose(zs);
+      return rc;
+    case ZLIB_INIT:  /* a=flags */
+      if (!(zs = ZlibOpen(a))) return -1;
+      pthread_mutex_lock(&g_zlib.lock);
+      for (int i = 0; i < ZLIB_HANDLES; i++) {
+        if (!g_zlib.zs[i]) {
+          g_zlib.zs[i] = zs;
+          rc = i + 1;
+          break;
+        }
+      }
+      pthread_mutex_unlock(&g_zlib.lock);
+      if (rc == -1) ZlibClose(zs);
+      return rc;
+    case ZLIB_STREAM:  /* a=handle, b=stream_ptr */
+      return ZlibStreamStep(m, a, b);
+    case ZLIB_END:  /* a=handle */
+      if (!(zs = TakeZlib(a))) return -1;
+      ZlibClose(zs);
+      return 0;
+    case ZLIB_BATCH:  /* a=flags, b=records_ptr, c=count */
+      return ZlibBatch(m, a, b, c);
+    default:
+      return -1;
+  }
+}
+
+/*─────────────────────────────────────────────────────────────────────────────╗
+│ Portator native mustache rendering                                          │
+╚─────────────────────────────────────────────────────────────────────────────*/
+
+/* RENDER fills in a mustache template from a JSON context on the host.
+   The template is a guest buffer or a file, and the result goes to a
+   guest buffer (probe/fill or RESPONSE_ALLOC) or straight to a file.
+   Files and {{> partials}} are opened through Blink's VFS, as the
+   guest's own open() would. The last buffer render is kept so the fill
+   after a probe doesn't render again; it's keyed on the template, the
+   JSON and the partials it read, each by path, inode, size and mtime. */
+#define RENDER_TEMPLATE_FILE 2
+#define RENDER_OUTPUT_FILE 4
+#define RENDER_MAX (16 << 20)  /* bytes of template */
+
+struct RenderPartial {
+  char *path;
+  struct stat st;              /* as it was when read */
+};
+
+struct RenderPartials {
+  struct RenderPartial *p;
+  size_t n;
+  bool unknown;                /* one couldn't be recorded: don't cache */
+};
+
+static struct {
+  pthread_mutex_t lock;
+  char *template;              /* what the last render was of */
+  size_t template_len;
   char *json;
-  size_t cap = 512, len = 0;
-  int first = 1;
-
-  json = (char *)malloc(cap);
-  if (!json) return NULL;
-
-  len += snprintf(json + len, cap - len, "{\"apps\":[");
-
-  /* Scan local guests/<name>/bin/<name> and /zip/apps/<name>/bin/<name> */
-  const char *dirs[] = { "guests", "/zip/apps", NULL };
-  int di;
-  for (di = 0; dirs[di]; di++) {
-    d = opendir(dirs[di]);
-    if (!d) continue;
-    while ((ent = readdir(d)) != NULL) {
-      if (ent->d_name[0] == '.') continue;
-      snprintf(probe, sizeof(probe), "%s/%s/bin/%s",
-               dirs[di], ent->d_name, ent->d_name);
-      if (access(probe, F_OK) != 0) continue;
-      /* skip if already listed (local overrides bundled) */
-      char needle[PATH_MAX];
-      snprintf(needle, sizeof(needle), "\"%s\"", ent->d_name);
-      if (strstr(json, needle)) continue;
-      /* grow buffer if needed */
-      size_t need = len + strlen(ent->d_name) + 32;
-      if (need > cap) {
-        cap = need * 2;
-        char *tmp = (char *)realloc(json, cap);
-        if (!tmp) { free(json); closedir(d); return NULL; }
-        json = tmp;
+  struct RenderPartials partials;
+  struct RenderPartials reading;  /* read by the render in progress */
+  char *result;
+  size_t result_len;
+} g_render = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Read a file of up to max bytes through the VFS into a malloc()ed,
+   NUL-terminated buffer */
+static char *ReadVfsFileMax(const char *path, size_t *len, size_t max) {
+  char *buf = NULL, *tmp;
+  size_t cap = 0, n = 0;
+  ssize_t got;
+  int fd;
+  if ((fd = VfsOpen(AT_FDCWD, path, O_RDONLY, 0)) == -1) return NULL;
+  for (;;) {
+    if (n + 1 >= cap) {
+      cap = cap ? cap * 2 : 4096;
+      if (cap > max + 2) cap = max + 2;  /* room to see max + 1 bytes */
+      if (n + 1 >= cap || !(tmp = (char *)realloc(buf, cap))) break;
+      buf = tmp;
+    }
+    if ((got = VfsRead(fd, buf + n, cap - n - 1)) <= 0) {
+      if (!got && n <= max) {
+        VfsClose(fd);
+        buf[n] = '\0';
+        *len = n;
+        return buf;
       }
-      if (!first) json[len++] = ',';
-      len += snprintf(json + len, cap - len,
-                      "{\"name\":\"%s\"}", ent->d_name);
-      first = 0;
+      break;
+    }
+    n += got;
+  }
+  VfsClose(fd);
+  free(buf);
+  return NULL;
+}
+
+static char *ReadVfsFile(const char *path, size_t *len) {
+  return ReadVfsFileMax(path, len, RENDER_MAX);
+}
+
+static void FreePartials(struct RenderPartials *ps) {
+  for (size_t i = 0; i < ps->n; i++) free(ps->p[i].path);
+  free(ps->p);
+  ps->p = NULL;
+  ps->n = 0;
+  ps->unknown = false;
+}
+
+/* The render loader: reads a partial and notes which file it was. Runs
+   under g_render.lock, from Render(). */
+static char *LoadPartial(const char *path, size_t *len) {
+  struct RenderPartials *ps = &g_render.reading;
+  struct RenderPartial *tmp;
+  struct stat st;
+  if (VfsStat(AT_FDCWD, path, &st, 0) ||
+      !(tmp = (struct RenderPartial *)realloc(ps->p,
+                                              (ps->n + 1) * sizeof(*tmp)))) {
+    ps->unknown = true;
+  } else {
+    ps->p = tmp;
+    if ((tmp[ps->n].path = strdup(path))) {
+      tmp[ps->n++].st = st;
+    } else {
+      ps->unknown = true;
+    }
+  }
+  return ReadVfsFile(path, len);
+}
+
+/* Whether the partials the cached render read are still the same files */
+static bool PartialsUnchanged(const struct RenderPartials *ps) {
+  struct stat st;
+  for (size_t i = 0; i < ps->n; i++) {
+    const struct stat *was = &ps->p[i].st;
+    if (VfsStat(AT_FDCWD, ps->p[i].path, &st, 0) ||
+        st.st_dev != was->st_dev || st.st_ino != was->st_ino ||
+        st.st_size != was->st_size ||
+        st.st_mtim.tv_sec != was->st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != was->st_mtim.tv_nsec)
+      return false;
+  }
+  return true;
+}
+
+static i64 WriteVfsFile(struct Machine *m, i64 path_ptr, const char *data,
+                        size_t len) {
+  char *path;
+  size_t off = 0;
+  ssize_t n;
+  int fd;
+  if (!(path = CopyStr(m, path_ptr))) return -1;
+  if ((fd = VfsOpen(AT_FDCWD, path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+    return -1;
+  while (off < len && (n = VfsWrite(fd, data + off, len - off)) > 0) off += n;
+  VfsClose(fd);
+  return off == len ? (i64)len : -1;
+}
+
+static i64 RenderTemplate(struct Machine *m, i64 template, u64 template_len,
+                          i64 json_ptr, i64 out, u64 out_len, u64 flags) {
+  static bool loader;
+  char *text, *json, *result, *fresh = NULL;
+  size_t len, result_len;
+  i64 rc = -1;
+  if (flags & ~(u64)(RESPONSE_ALLOC | RENDER_TEMPLATE_FILE |
+                     RENDER_OUTPUT_FILE))
+    return -1;
+  if (!(json = CopyStr(m, json_ptr))) return -1;
+  if (flags & RENDER_TEMPLATE_FILE) {
+    char *path = CopyStr(m, template);
+    if (!path || !(text = ReadVfsFile(path, &len))) return -1;
+  } else {
+    if (template_len > RENDER_MAX) return -1;
+    if (!(text = (char *)malloc(template_len + 1))) return -1;
+    if (CopyFromUserRead(m, text, template, template_len)) {
+      free(text);
+      return -1;
+    }
+    len = template_len;
+  }
+  pthread_mutex_lock(&g_render.lock);
+  if (!loader) {
+    RenderSetLoader(LoadPartial);
+    loader = true;
+  }
+  if (g_render.result && g_render.template_len == len &&
+      !memcmp(g_render.template, text, len) && !strcmp(g_render.json, json) &&
+      PartialsUnchanged(&g_render.partials)) {
+    result = g_render.result;
+    result_len = g_render.result_len;
+  } else {
+    char *key;
+    FreePartials(&g_render.reading);
+    if (Render(text, len, json, &result, &result_len)) {
+      FreePartials(&g_render.reading);
+      goto done;
+    }
+    /* drop the old entry first: a failure below leaves none */
+    free(g_render.template);
+    free(g_render.json);
+    free(g_render.result);
+    FreePartials(&g_render.partials);
+    g_render.template = NULL;
+    g_render.json = NULL;
+    g_render.result = NULL;
+    if (!g_render.reading.unknown && (key = strdup(json))) {
+      g_render.template = text;
+      g_render.template_len = len;
+      g_render.json = key;
+      g_render.partials = g_render.reading;
+      g_render.reading.p = NULL;
+      g_render.reading.n = 0;
+      g_render.result = result;
+      g_render.result_len = result_len;
+      text = NULL;
+    } else {
+      FreePartials(&g_render.reading);
+      fresh = result;
+    }
+  }
+  if (flags & RENDER_OUTPUT_FILE)
+    rc = WriteVfsFile(m, out, result, result_len);
+  else
+    rc = PutResponse(m, out, out_len, flags, result, result_len);
+done:
+  pthread_mutex_unlock(&g_render.lock);
+  free(fresh);
+  free(text);
+  return rc;
+}
+
+/*─────────────────────────────────────────────────────────────────────────────╗
+│ Portator bulk memory                                                        │
+╚─────────────────────────────────────────────────────────────────────────────*/
+
+/* MEM runs memmove, memset, memcmp and memchr over guest ranges with the
+   host's vectorized routines. Guest pages needn't be contiguous in host
+   memory, so ranges are walked a page at a time: reads go through host
+   pointers from LookupAddress, and writes through CopyToUserWrite so
+   Blink sees them as it would the guest's own stores. */
+#define MEM_MOVE 0             /* PORTATOR_MEM_OP_* */
+#define MEM_SET 1
+#define MEM_CMP 2
+#define MEM_CHR 3
+#define MEM_PAGE 4096
+#define MEM_BOUNCE 65536       /* bytes per step of an overlapping move */
+
+/* Bytes from addr to the end of its page, at most n */
+static u64 PageRun(i64 addr, u64 n) {
+  return MIN(n, MEM_PAGE - (addr & (MEM_PAGE - 1)));
+}
+
+static i64 MemMove(struct Machine *m, i64 dst, i64 src, u64 n) {
+  u8 *p;
+  bool backwards = dst > src;
+  if (dst == src || !n) return 0;
+  if ((u64)(dst - src) >= n && (u64)(src - dst) >= n) {
+    /* no overlap: copy straight out of the source pages */
+    while (n) {
+      u64 k = PageRun(src, n);
+      if (!(p = LookupAddress(m, src)) || CopyToUserWrite(m, dst, p, k))
+        return -1;
+      dst += k;
+      src += k;
+      n -= k;
+    }
+    return 0;
+  }
+  /* overlapping: through a buffer, backwards when moving up */
+  if (!(p = (u8 *)malloc(MIN(n, MEM_BOUNCE)))) return -1;
+  for (u64 done = 0; done < n;) {
+    u64 k = MIN(n - done, MEM_BOUNCE);
+    u64 off = backwards ? n - done - k : done;
+    if (CopyFromUserRead(m, p, src + off, k) ||
+        CopyToUserWrite(m, dst + off, p, k)) {
+      free(p);
+      return -1;
+    }
+    done += k;
+  }
+  free(p);
+  return 0;
+}
+
+static i64 MemSet(struct Machine *m, i64 dst, int c, u64 n) {
+  u8 page[MEM_PAGE];
+  memset(page, c, sizeof(page));
+  while (n) {
+    u64 k = PageRun(dst, n);
+    if (CopyToUserWrite(m, dst, page, k)) return -1;
+    dst += k;
+    n -= k;
+  }
+  return 0;
+}
+
+/* Offset of the first byte that differs, or n if the ranges match */
+static i64 MemCmp(struct Machine *m, i64 a, i64 b, u64 n) {
+  u64 off = 0;
+  while (off < n) {
+    u64 k = MIN(PageRun(a + off, n - off), PageRun(b + off, n - off));
+    u8 *x = LookupAddress(m, a + off), *y = LookupAddress(m, b + off);
+    if (!x || !y) return -1;
+    if (memcmp(x, y, k)) {
+      while (*x == *y) x++, y++, off++;
+      return off;
     }
-    closedir(d);
+    off += k;
   }
+  return n;
+}
+
+/* Offset of the first byte equal to c, or n if there's none */
+static i64 MemChr(struct Machine *m, i64 addr, int c, u64 n) {
+  u64 off = 0;
+  while (off < n) {
+    u64 k = PageRun(addr + off, n - off);
+    u8 *p = LookupAddress(m, addr + off), *hit;
+    if (!p) return -1;
+    if ((hit = (u8 *)memchr(p, c, k))) return off + (hit - p);
+    off += k;
+  }
+  return n;
+}
 
-  /* grow if needed for closing */
-  if (len + 4 > cap) {
-    char *tmp = (char *)realloc(json, len + 4);
-    if (!tmp) { free(json); return NULL; }
-    json = tmp;
+static i64 MemOp(struct Machine *m, u64 op, u64 a, u64 b, u64 n) {
+  if ((i64)n < 0) return -1;
+  switch (op) {
+    case MEM_MOVE:  /* a=dst, b=src */
+      return MemMove(m, a, b, n);
+    case MEM_SET:  /* a=dst, b=byte */
+      return MemSet(m, a, (u8)b, n);
+    case MEM_CMP:  /* a, b */
+      return MemCmp(m, a, b, n);
+    case MEM_CHR:  /* a=addr, b=byte */
+      return MemChr(m, a, (u8)b, n);
+    default:
+      return -1;
+  }
+}
+
+/*─────────────────────────────────────────────────────────────────────────────╗
+│ Portator file mapping                                                       │
+╚─────────────────────────────────────────────────────────────────────────────*/
+
+/* MAPFILE maps a whole file read-only into the guest in one call. Files
+   under /zip come straight from the zip store: a stored entry maps the
+   executable itself around the entry's data, and a deflated one maps the
+   store's shared decompressed copy. Anything else is read through the
+   VFS into a fresh mapping. The address returned is where the contents
+   begin, which for stored entries is partway into a page; an empty
+   file maps nothing and gets address 0. */
+#define MAPFILE_MAX (1ull << 30)
+
+static const char *ExecutablePath(void) {
+#ifdef __COSMOPOLITAN__
+  return GetProgramExecutableName();
+#else
+  return "/proc/self/exe";
+#endif
+}
+
+/* The part of a guest path ("/zip/x" or "zip/x") inside the zip store,
+   "" for the store itself, or NULL if the path is elsewhere or there's
+   no store */
+static const char *ZipStorePath(const char *path) {
+  if (*path == '/') path++;
+  if (strncmp(path, "zip", 3) || (path[3] && path[3] != '/')) return NULL;
+  for (path += 3; *path == '/';) path++;
+  return ZipStoreOpen(ExecutablePath()) ? NULL : path;
+}
+
+/* The zip entry a guest path names, or NULL */
+static const struct ZipEntry *FindZipPath(const char *path) {
+  return (path = ZipStorePath(path)) ? ZipStoreFind(path) : NULL;
+}
+
+/* Map size bytes of fd from offset read-only into the guest. Returns
+   the guest address of offset, or -1. */
+static i64 GuestMmapFd(struct Machine *m, int fd, i64 offset, u64 size) {
+  i64 virt, skip = offset & 4095;
+  u64 len = (size + skip + 4095) & -4096;
+  LOCK(&m->system->mmap_lock);
+  if ((virt = FindVirtual(m->system, m->system->automap, len)) != -1) {
+    if (ReserveVirtual(m->system, virt, len, PAGE_U | PAGE_XD, fd,
+                       offset - skip, false, false) != -1) {
+      m->system->automap = virt + len;
+    } else {
+      virt = -1;
+    }
+  }
+  UNLOCK(&m->system->mmap_lock);
+  return virt == -1 ? -1 : virt + skip;
+}
+
+static i64 MapFile(struct Machine *m, i64 path_ptr, i64 size_ptr) {
+  const struct ZipEntry *e;
+  char *path, *data;
+  size_t size;
+  i64 virt = -1, offset;
+  u8 buf[8];
+  int fd;
+  if (!(path = CopyStr(m, path_ptr))) return -1;
+  if ((e = FindZipPath(path)) && e->size &&
+      (fd = ZipStoreContents(e, &offset)) != -1) {
+    size = e->size;
+    virt = GuestMmapFd(m, fd, offset, size);
+  } else if ((data = ReadVfsFileMax(path, &size, MAPFILE_MAX))) {
+    if (!size)
+      virt = 0;                /* nothing to map */
+    else if ((virt = GuestMmap(m, size)) != -1 &&
+             CopyToUserWrite(m, virt, data, size)) {
+      GuestMunmap(m, virt, size);
+      virt = -1;
+    }
+    free(data);
+  }
+  if (virt == -1) return -1;
+  Write64(buf, size);
+  if (size_ptr && CopyToUserWrite(m, size_ptr, buf, 8)) {
+    if (size) GuestMunmap(m, virt, size);
+    return -1;
+  }
+  return virt;
+}
+
+/*─────────────────────────────────────────────────────────────────────────────╗
+│ Portator directory listing                                                  │
+╚─────────────────────────────────────────────────────────────────────────────*/
+
+/* READDIR lists a directory as packed records: a 24-byte header (reclen,
+   type, mode, size, mtime) and the NUL-terminated name, padded to 8
+   bytes. Entries are sorted by name, without "." and "..". A fill
+   writes as many whole records as fit and moves the guest's cookie (the
+   index of the next entry) past them, so a big directory takes a few
+   calls; it returns 0 once the cookie reaches the end. Directories
+   under /zip are listed from the zip store's index; others are read and
+   stat'd through the VFS, and only for the records a call returns. */
+#define DIRENT_HEADER 24
+
+struct DirEntry {
+  char *name;
+  u8 type;                     /* DT_* */
+  bool known;                  /* mode, size and mtime are filled in */
+  u32 mode;
+  u64 size;
+  i64 mtime;
+};
+
+struct DirList {
+  struct DirEntry *p;
+  size_t n, cap;
+};
+
+static struct DirEntry *DirAppend(struct DirList *l, const char *name,
+                                  size_t len) {
+  struct DirEntry *p;
+  if (l->n == l->cap) {
+    size_t cap = l->cap ? l->cap * 2 : 64;
+    if (!(p = (struct DirEntry *)realloc(l->p, cap * sizeof(*p)))) return NULL;
+    l->p = p;
+    l->cap = cap;
+  }
+  p = l->p + l->n;
+  memset(p, 0, sizeof(*p));
+  if (!(p->name = strndup(name, len))) return NULL;
+  l->n++;
+  return p;
+}
+
+static void DirListFree(struct DirList *l) {
+  for (size_t i = 0; i < l->n; i++) free(l->p[i].name);
+  free(l->p);
+}
+
+static int CompareDirEntries(const void *a, const void *b) {
+  return strcmp(((const struct DirEntry *)a)->name,
+                ((const struct DirEntry *)b)->name);
+}
+
+/* List a /zip directory from the index. Returns 1 if path names one, 0
+   if it isn't in the zip store, or -1 out of memory. A zip needn't
+   record its directories, so they are also inferred from the paths of
+   the entries inside them. */
+static int ListZipDir(const char *path, struct DirList *l) {
+  const struct ZipEntry *e;
+  struct DirEntry *d;
+  char prefix[PATH_MAX];
+  size_t n, lo, hi, plen;
+  bool found = false;
+  if (!(path = ZipStorePath(path)) ||
+      (plen = strlen(path)) + 2 > sizeof(prefix))
+    return 0;
+  memcpy(prefix, path, plen);
+  while (plen && prefix[plen - 1] == '/') plen--;
+  if (plen) prefix[plen++] = '/';
+  prefix[plen] = 0;
+  e = ZipStoreEntries(&n);
+  for (lo = 0, hi = n; lo < hi;) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (strcmp(e[mid].name, prefix) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  /* everything under prefix is contiguous, and so is everything under
+     each child directory, so a repeat is always of the last child */
+  for (; lo < n && !strncmp(e[lo].name, prefix, plen); lo++) {
+    const char *rest = e[lo].name + plen, *slash = strchr(rest, '/');
+    size_t len = slash ? (size_t)(slash - rest) : strlen(rest);
+    u32 perm = e[lo].mode & 07777;
+    found = true;
+    if (!len) continue;        /* the directory's own entry */
+    if (l->n && !strncmp(l->p[l->n - 1].name, rest, len) &&
+        !l->p[l->n - 1].name[len])
+      continue;
+    if (!(d = DirAppend(l, rest, len))) return -1;
+    d->known = true;
+    d->mtime = e[lo].mtime;
+    if (slash) {
+      d->type = DT_DIR;
+      d->mode = S_IFDIR | (perm && !slash[1] ? perm : 0755);
+    } else if (e[lo].mode & S_IFMT) {
+      d->type = (e[lo].mode & S_IFMT) >> 12;
+      d->mode = e[lo].mode;
+      d->size = e[lo].size;
+    } else {
+      d->type = DT_REG;
+      d->mode = S_IFREG | (perm ? perm : 0644);
+      d->size = e[lo].size;
+    }
+  }
+  return found;
+}
+
+static int ListVfsDir(const char *path, struct DirList *l) {
+  struct dirent *ent;
+  struct DirEntry *d;
+  DIR *dir;
+  int fd, rc = 0;
+  if ((fd = VfsOpen(AT_FDCWD, path, O_RDONLY | O_DIRECTORY, 0)) == -1)
+    return -1;
+  if (!(dir = VfsOpendir(fd))) {
+    VfsClose(fd);
+    return -1;
+  }
+  while ((ent = VfsReaddir(dir))) {
+    if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+    if (!(d = DirAppend(l, ent->d_name, strlen(ent->d_name)))) {
+      rc = -1;
+      break;
+    }
+    d->type = ent->d_type;
+  }
+  VfsClosedir(dir);
+  return rc;
+}
+
+static int ListDir(const char *path, struct DirList *l) {
+  int rc;
+  if (!(rc = ListZipDir(path, l))) rc = ListVfsDir(path, l) ? -1 : 1;
+  if (rc == -1) return -1;
+  qsort(l->p, l->n, sizeof(*l->p), CompareDirEntries);
+  return 0;
+}
+
+/* Fill in what the directory listing didn't say. An entry that can't be
+   stat'd (a dangling link, say) keeps its type and zeros. */
+static void StatDirEntry(const char *dir, struct DirEntry *d) {
+  char full[PATH_MAX];
+  struct stat st;
+  if (d->known) return;
+  d->known = true;
+  if (snprintf(full, sizeof(full), "%s/%s", dir, d->name) >=
+          (int)sizeof(full) ||
+      VfsStat(AT_FDCWD, full, &st, 0))
+    return;
+  d->type = (st.st_mode & S_IFMT) >> 12;
+  d->mode = st.st_mode;
+  d->size = st.st_size;
+  d->mtime = st.st_mtime;
+}
+
+static size_t DirRecordSize(const struct DirEntry *d) {
+  return (DIRENT_HEADER + strlen(d->name) + 1 + 7) & -8;
+}
+
+static i64 ReadDir(struct Machine *m, i64 path_ptr, u64 buf, u64 len,
+                   i64 cookie_ptr, u64 flags) {
+  struct DirList l = { 0 };
+  u64 cookie = 0, end, size = 0, cap;
+  bool probe = !(flags & RESPONSE_ALLOC) && (!buf || !len);
+  u8 word[8], *out = NULL, *r;
+  char *path;
+  i64 rc = -1;
+  if (flags & ~(u64)RESPONSE_ALLOC) return -1;
+  if (!(path = CopyStr(m, path_ptr))) return -1;
+  if (cookie_ptr) {
+    if (CopyFromUserRead(m, word, cookie_ptr, 8)) return -1;
+    cookie = Read64(word);
+  }
+  if (ListDir(path, &l)) goto done;
+  cookie = MIN(cookie, l.n);
+  cap = probe || (flags & RESPONSE_ALLOC) ? UINT64_MAX : len;
+  for (end = cookie; end < l.n; end++) {
+    u64 rec = DirRecordSize(l.p + end);
+    if (size + rec > cap) break;
+    size += rec;
+  }
+  if (probe) {
+    rc = size;
+    goto done;
+  }
+  if (end == cookie && end < l.n) goto done;   /* not even one fits */
+  if (!(out = (u8 *)calloc(1, size + 1))) goto done;
+  for (r = out; cookie < end; cookie++) {
+    struct DirEntry *d = l.p + cookie;
+    size_t rec = DirRecordSize(d);
+    StatDirEntry(path, d);
+    r[0] = rec;
+    r[1] = rec >> 8;
+    r[2] = d->type;
+    Write32(r + 4, d->mode);
+    Write64(r + 8, d->size);
+    Write64(r + 16, d->mtime);
+    strcpy((char *)r + DIRENT_HEADER, d->name);
+    r += rec;
+  }
+  if (size) {
+    rc = PutResponse(m, buf, len, flags, out, size);
+  } else if (flags & RESPONSE_ALLOC) {
+    Write64(word, 0);          /* nothing left: no mapping */
+    rc = CopyToUserWrite(m, buf, word, 8) ? -1 : 0;
+  } else {
+    rc = 0;
+  }
+  if (rc != -1 && cookie_ptr) {
+    Write64(word, cookie);
+    if (CopyToUserWrite(m, cookie_ptr, word, 8)) rc = -1;
+  }
+done:
+  free(out);
+  DirListFree(&l);
+  return rc;
+}
+
+/*─────────────────────────────────────────────────────────────────────────────╗
+│ Portator tree extraction                                                    │
+╚─────────────────────────────────────────────────────────────────────────────*/
+
+/* EXTRACT writes a /zip subtree out to a directory natively: the files
+   are spread over threads, stored ones are copied in the kernel and
+   deflated ones inflated straight to disk, and a file that already has
+   the right size and CRC isn't touched. The response is the manifest,
+   one "<w|=|!> <crc32> <size> <path>" line per file. */
+
+/* Whether path has a ".." part */
+static bool HasDotDot(const char *path) {
+  for (const char *p = path;;) {
+    size_t n = strcspn(p, "/");
+    if (n == 2 && p[0] == '.' && p[1] == '.') return true;
+    if (!p[n]) return false;
+    p += n + 1;
+  }
+}
+
+/* Whether host path stays under root with symlinks followed: the
+   deepest part of it that exists has to resolve inside root. */
+static bool UnderRoot(const char *root, const char *path) {
+  char real_root[PATH_MAX], real[PATH_MAX], part[PATH_MAX];
+  size_t n;
+  if (!realpath(root, real_root) ||
+      snprintf(part, sizeof(part), "%s", path) >= (int)sizeof(part))
+    return false;
+  while (!realpath(part, real)) {
+    char *slash = strrchr(part, '/');
+    if (errno != ENOENT || !slash || slash == part) return false;
+    *slash = '\0';
+  }
+  n = strlen(real_root);
+  return !strncmp(real, real_root, n) &&
+         (n == 1 || real[n] == '/' || !real[n]);
+}
+
+/* The host path of a guest path. The VFS roots the guest at the
+   directory portator started in (FLAG_prefix), under which the guest's
+   absolute paths lie, so a path with a ".." part, or that a symlink
+   takes out from under the root, is refused. */
+static int HostPath(const char *path, char *buf, size_t size) {
+  int n;
+#ifndef DISABLE_VFS
+  char cwd[PATH_MAX];
+  const char *root = FLAG_prefix ? FLAG_prefix : "";
+  if (HasDotDot(path)) return -1;
+  if (*path == '/') {
+    n = snprintf(buf, size, "%s%s", root, path);
+  } else {
+    if (!VfsGetcwd(cwd, sizeof(cwd))) return -1;
+    n = snprintf(buf, size, "%s%s/%s", root, strcmp(cwd, "/") ? cwd : "",
+                 path);
+  }
+  if (n >= 0 && (size_t)n < size && *root && !UnderRoot(root, buf))
+    return -1;
+#else
+  n = snprintf(buf, size, "%s", path);
+#endif
+  return n >= 0 && (size_t)n < size ? 0 : -1;
+}
+
+static i64 ExtractTree(struct Machine *m, i64 src_ptr, i64 dest_ptr, u64 buf,
+                       u64 len, u64 flags) {
+  char *src, *dest, host[PATH_MAX], *manifest;
+  const char *prefix;
+  size_t size;
+  i64 rc = -1;
+  if (flags & ~(u64)RESPONSE_ALLOC) return -1;
+  if (!(src = CopyStr(m, src_ptr)) || !(dest = CopyStr(m, dest_ptr)))
+    return -1;
+  if (!(prefix = ZipStorePath(src)) || HostPath(dest, host, sizeof(host)))
+    return -1;
+  /* failures still get the manifest: its '!' lines say which files */
+  (void)ZipStoreExtract(prefix, host, 0, &manifest, &size);
+  if (manifest) rc = PutResponse(m, buf, len, flags, manifest, size);
+  free(manifest);
+  return rc;
+}
+
+/*─────────────────────────────────────────────────────────────────────────────╗
+│ Portator name resolution                                                    │
+╚─────────────────────────────────────────────────────────────────────────────*/
+
+/* RESOLVE looks names up with the host's resolver, through the cache in
+   resolve.c that all guests forked from this process share. A name's
+   answer is a u32 count and that many 20-byte PortatorAddr records
+   (probe/fill). With RESOLVE_BATCH, di points at count 40-byte queries,
+   {host, port, buf, len, result}, which are resolved at once; each
+   result is what a single RESOLVE would have returned. */
+#define RESOLVE_BATCH 2
+#define RESOLVE_BATCH_MAX 256
+#define RESOLVE_QUERY 40
+
+static i64 PutAddrs(struct Machine *m, u64 buf, u64 len,
+                    const struct ResolveAddr *addrs, int n) {
+  u8 out[4 + sizeof(struct ResolveAddr) * RESOLVE_MAX_ADDRS];
+  size_t size = 4 + sizeof(*addrs) * n;
+  if (buf && len && len < size) return -1;
+  Write32(out, n);
+  memcpy(out + 4, addrs, sizeof(*addrs) * n);
+  return PutResponse(m, buf, len, 0, out, size);
+}
+
+static i64 ResolveName(struct Machine *m, i64 host_ptr, i64 port_ptr,
+                       u64 buf, u64 len) {
+  struct ResolveAddr addrs[RESOLVE_MAX_ADDRS];
+  char *host = NULL, *port = NULL;
+  int n;
+  if (host_ptr && !(host = CopyStr(m, host_ptr))) return -1;
+  if (port_ptr && !(port = CopyStr(m, port_ptr))) return -1;
+  if ((n = Resolve(host, port, addrs)) == -1) return -1;
+  return PutAddrs(m, buf, len, addrs, n);
+}
+
+static i64 ResolveBatch(struct Machine *m, i64 addr, u64 count) {
+  struct ResolveAddr (*out)[RESOLVE_MAX_ADDRS] = NULL;
+  const char **names = NULL;
+  int *counts = NULL;
+  u64 *which = NULL;           /* the query each name pair came from */
+  u8 *q = NULL;
+  i64 rc = -1, resolved = 0;
+  u64 i, n = 0;
+  if (!count || count > RESOLVE_BATCH_MAX) return -1;
+  if (!(q = (u8 *)malloc(count * RESOLVE_QUERY)) ||
+      !(names = (const char **)calloc(count * 2, sizeof(*names))) ||
+      !(counts = (int *)malloc(count * sizeof(*counts))) ||
+      !(which = (u64 *)malloc(count * sizeof(*which))) ||
+      !(out = (struct ResolveAddr (*)[RESOLVE_MAX_ADDRS])malloc(
+            count * sizeof(*out))) ||
+      CopyFromUserRead(m, q, addr, count * RESOLVE_QUERY))
+    goto done;
+  for (i = 0; i < count; i++) {
+    u8 *r = q + i * RESOLVE_QUERY;
+    const char *host = NULL, *port = NULL;
+    /* a bad pointer fails its query; it mustn't look like NULL */
+    if ((Read64(r) && !(host = CopyStr(m, Read64(r)))) ||
+        (Read64(r + 8) && !(port = CopyStr(m, Read64(r + 8))))) {
+      Write64(r + 32, -1);
+      continue;
+    }
+    names[n] = host;
+    names[count + n] = port;
+    which[n++] = i;
+  }
+  if (n) ResolveMany(names, names + count, n, out, counts);
+  for (i = 0; i < n; i++) {
+    u8 *r = q + which[i] * RESOLVE_QUERY;
+    i64 res = -1;
+    if (counts[i] >= 0)
+      res = PutAddrs(m, Read64(r + 16), Read64(r + 24), out[i], counts[i]);
+    resolved += res != -1;
+    Write64(r + 32, res);
+  }
+  if (!CopyToUserWrite(m, addr, q, count * RESOLVE_QUERY)) rc = resolved;
+done:
+  free(out);
+  free(which);
+  free(counts);
+  free(names);
+  free(q);
+  return rc;
+}
+
+/*─────────────────────────────────────────────────────────────────────────────╗
+│ Portator HTTP client                                                        │
+╚─────────────────────────────────────────────────────────────────────────────*/
+
+/* HTTP runs requests with the host's client in http_client.c, which
+   keeps connections alive in a per-origin pool. OPEN takes a 56-byte
+   PortatorHttpRequest {method, url, headers, body, body_len, status,
+   length}, sends it, fills in status and length from the response head
+   and returns a handle. READ then copies the body into guest memory as
+   it arrives, as much as fits per call, and HEADERS gives the raw
+   response head (probe/fill). CLOSE hands the connection back. */
+#define HTTP_OPEN 0            /* PORTATOR_HTTP_OP_* */
+#define HTTP_READ 1
+#define HTTP_HEADERS 2
+#define HTTP_CLOSE 3
+#define HTTP_HANDLES 64
+#define HTTP_REQUEST 56
+#define HTTP_BODY_MAX (64ull << 20)
+#define HTTP_CHUNK 65536
+
+static struct {
+  pthread_mutex_t lock;
+  struct HttpExchange *x[HTTP_HANDLES];   /* handle is index + 1 */
+} g_http = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct HttpExchange *TakeHttp(u64 handle) {
+  struct HttpExchange *x;
+  if (handle - 1 >= HTTP_HANDLES) return NULL;
+  pthread_mutex_lock(&g_http.lock);
+  x = g_http.x[handle - 1];
+  g_http.x[handle - 1] = NULL;
+  pthread_mutex_unlock(&g_http.lock);
+  return x;
+}
+
+static void PutBackHttp(u64 handle, struct HttpExchange *x) {
+  pthread_mutex_lock(&g_http.lock);
+  g_http.x[handle - 1] = x;
+  pthread_mutex_unlock(&g_http.lock);
+}
+
+static i64 HttpOpenGuest(struct Machine *m, i64 req_ptr) {
+  struct HttpExchange *x;
+  char *method = NULL, *url, *headers = NULL;
+  u8 req[HTTP_REQUEST], *body = NULL;
+  u64 body_len;
+  i64 rc = -1;
+  if (CopyFromUserRead(m, req, req_ptr, HTTP_REQUEST)) return -1;
+  if (Read64(req) && !(method = CopyStr(m, Read64(req)))) return -1;
+  if (!(url = CopyStr(m, Read64(req + 8)))) return -1;
+  if (Read64(req + 16) && !(headers = CopyStr(m, Read64(req + 16))))
+    return -1;
+  if ((body_len = Read64(req + 32)) > HTTP_BODY_MAX) return -1;
+  if (body_len && (!(body = (u8 *)malloc(body_len)) ||
+                   CopyFromUserRead(m, body, Read64(req + 24), body_len))) {
+    free(body);
+    return -1;
+  }
+  x = HttpOpen(method, url, headers, body, body_len);
+  free(body);
+  if (!x) return -1;
+  Write32(req + 40, x->status);
+  Write64(req + 48, x->length);
+  if (CopyToUserWrite(m, req_ptr + 40, req + 40, 16)) {
+    HttpClose(x);
+    return -1;
+  }
+  pthread_mutex_lock(&g_http.lock);
+  for (int i = 0; i < HTTP_HANDLES; i++) {
+    if (!g_http.x[i]) {
+      g_http.x[i] = x;
+      rc = i + 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_http.lock);
+  if (rc == -1) HttpClose(x);
+  return rc;
+}
+
+/* Read body into the guest until len is filled or the body ends */
+static i64 HttpReadGuest(struct Machine *m, struct HttpExchange *x, i64 buf,
+                         u64 len) {
+  u8 *chunk;
+  u64 got = 0;
+  ssize_t n = 0;
+  if (!(chunk = (u8 *)malloc(MIN(len, HTTP_CHUNK) + 1))) return -1;
+  while (got < len &&
+         (n = HttpRead(x, chunk, MIN(len - got, HTTP_CHUNK))) > 0) {
+    if (CopyToUserWrite(m, buf + got, chunk, n)) {
+      n = -1;
+      break;
+    }
+    got += n;
+  }
+  free(chunk);
+  return n < 0 && !got ? -1 : (i64)got;
+}
+
+static i64 HttpOp(struct Machine *m, u64 op, u64 a, u64 b, u64 c) {
+  struct HttpExchange *x;
+  i64 rc;
+  switch (op) {
+    case HTTP_OPEN:  /* a=request */
+      return HttpOpenGuest(m, a);
+    case HTTP_READ:  /* a=handle, b=buf, c=len */
+      if (!(x = TakeHttp(a))) return -1;
+      rc = HttpReadGuest(m, x, b, c);
+      PutBackHttp(a, x);
+      return rc;
+    case HTTP_HEADERS:  /* a=handle, b=buf, c=len */
+      if (!(x = TakeHttp(a))) return -1;
+      rc = PutResponse(m, b, c, 0, x->head, x->head_len + 1);
+      PutBackHttp(a, x);
+      return rc;
+    case HTTP_CLOSE:  /* a=handle */
+      if (!(x = TakeHttp(a))) return -1;
+      HttpClose(x);
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+/*─────────────────────────────────────────────────────────────────────────────╗
+│ Portator shared memory                                                      │
+╚─────────────────────────────────────────────────────────────────────────────*/
+
+/* SHM gives guests named regions they can all map at once (shm.c keeps
+   the names). CREATE makes a region and maps it, ATTACH maps one another
+   guest made, and DETACH unmaps it; a region goes away when the last
+   guest holding it detaches or exits. The mapping is the memfd itself,
+   so what one guest writes the others see with no copying. WAIT and
+   WAKE are a futex on a 32-bit word, which works between guests when
+   the word is in a region. Unmap regions with DETACH, not munmap. */
+#define SHM_CREATE 0           /* PORTATOR_SHM_OP_* */
+#define SHM_ATTACH 1
+#define SHM_DETACH 2
+#define SHM_WAIT 3
+#define SHM_WAKE 4
+#define SHM_MAPS 64
+
+/* This process's mappings. A guest that execs gets a new System, and
+   whatever the old one had mapped is released on the next attach. */
+static struct {
+  pthread_mutex_t lock;
+  struct {
+    struct System *system;     /* NULL if the entry is free */
+    i64 virt;
+    u64 len;
+    int id;
+  } map[SHM_MAPS];
+} g_shm = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static i64 ShmMap(struct Machine *m, i64 name_ptr, u64 size, int create,
+                  i64 size_ptr) {
+  char *name;
+  i64 virt = -1;
+  u64 len;
+  u8 buf[8];
+  int id, fd, slot = -1;
+  if (!(name = CopyStr(m, name_ptr))) return -1;
+  if ((id = ShmAcquire(name, size, create, &size)) == -1) return -1;
+  len = (size + 4095) & -4096;
+  pthread_mutex_lock(&g_shm.lock);
+  for (int i = 0; i < SHM_MAPS; i++) {
+    if (g_shm.map[i].system && g_shm.map[i].system != m->system) {
+      ShmRelease(g_shm.map[i].id);
+      g_shm.map[i].system = NULL;
+    }
+    if (!g_shm.map[i].system && slot == -1) slot = i;
+  }
+  if (slot != -1 && (fd = ShmFd(id)) != -1) {
+    LOCK(&m->system->mmap_lock);
+    if ((virt = FindVirtual(m->system, m->system->automap, len)) != -1) {
+      if (ReserveVirtual(m->system, virt, len, PAGE_U | PAGE_RW | PAGE_XD, fd,
+                         0, true, false) != -1) {
+        m->system->automap = virt + len;
+      } else {
+        virt = -1;
+      }
+    }
+    UNLOCK(&m->system->mmap_lock);
+  }
+  if (virt != -1) {
+    g_shm.map[slot].system = m->system;
+    g_shm.map[slot].virt = virt;
+    g_shm.map[slot].len = len;
+    g_shm.map[slot].id = id;
+  } else {
+    ShmRelease(id);
+  }
+  pthread_mutex_unlock(&g_shm.lock);
+  if (virt != -1 && size_ptr) {
+    Write64(buf, size);
+    if (CopyToUserWrite(m, size_ptr, buf, 8)) return -1;
+  }
+  return virt;
+}
+
+static i64 ShmUnmap(struct Machine *m, i64 virt) {
+  i64 rc = -1;
+  pthread_mutex_lock(&g_shm.lock);
+  for (int i = 0; i < SHM_MAPS; i++) {
+    if (g_shm.map[i].system == m->system && g_shm.map[i].virt == virt) {
+      LOCK(&m->system->mmap_lock);
+      rc = FreeVirtual(m->system, virt, g_shm.map[i].len);
+      UNLOCK(&m->system->mmap_lock);
+      ShmRelease(g_shm.map[i].id);
+      g_shm.map[i].system = NULL;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_shm.lock);
+  return rc == -1 ? -1 : 0;
+}
+
+/* The host address of an aligned 32-bit guest word */
+static int *ShmWord(struct Machine *m, i64 addr) {
+  if (addr & 3) return NULL;
+  return (int *)LookupAddress(m, addr);
+}
+
+static i64 ShmOp(struct Machine *m, u64 op, u64 a, u64 b, u64 c) {
+  int *word;
+  switch (op) {
+    case SHM_CREATE:  /* a=name, b=size */
+      return ShmMap(m, a, b, 1, 0);
+    case SHM_ATTACH:  /* a=name, b=size_ptr (0 to skip) */
+      return ShmMap(m, a, 0, 0, b);
+    case SHM_DETACH:  /* a=addr */
+      return ShmUnmap(m, a);
+    case SHM_WAIT:  /* a=addr, b=expected value, c=timeout_ms (-1 forever) */
+      if (!(word = ShmWord(m, a))) return -1;
+      return ShmWait(word, (int)b, (int)c);
+    case SHM_WAKE:  /* a=addr, b=count */
+      if (!(word = ShmWord(m, a))) return -1;
+      return ShmWake(word, (int)MIN(b, 0x7fffffff));
+    default:
+      return -1;
   }
-  len += snprintf(json + len, 4, "]}");
-  return json;
 }
 
 extern i64 (*OnPortatorSyscall)(struct Machine *, u64, u64, u64, u64,
                                 u64, u64, u64);
 
+static i64 HandlePortatorSyscall(struct Machine *, u64, u64, u64, u64, u64,
+                                 u64, u64);
+
+static pid_t SpawnGuest(struct Machine *, i64, i64, i64);
+
+/* BATCH runs a vector of {nr, args[6], result} records in order,
+   reading them in and writing the results back with one copy each way.
+   Ring and batch calls can't be nested inside one. */
+#define BATCH_MAX 128
+#define BATCH_RECORD 64
+#define BATCH_STOP_ON_ERROR 1
+
+static i64 RunBatch(struct Machine *m, i64 addr, u64 count, u64 flags) {
+  u8 recs[BATCH_MAX][BATCH_RECORD];
+  u64 i, n = MIN(count, BATCH_MAX);
+  if (!n || (flags & ~(u64)BATCH_STOP_ON_ERROR)) return -1;
+  if (CopyFromUserRead(m, recs, addr, n * BATCH_RECORD)) return -1;
+  for (i = 0; i < n;) {
+    u8 *r = recs[i++];
+    u64 nr = Read64(r);
+    i64 res = -1;
+    if (nr != 0x7009 && nr != 0x700A && nr != 0x700C)
+      res = HandlePortatorSyscall(m, nr, Read64(r + 8), Read64(r + 16),
+                                  Read64(r + 24), Read64(r + 32),
+                                  Read64(r + 40), Read64(r + 48));
+    Write64(r + 56, res);
+    if (res == -1 && (flags & BATCH_STOP_ON_ERROR)) break;
+  }
+  if (CopyToUserWrite(m, addr, recs, i * BATCH_RECORD)) return -1;
+  return i;
+}
+
+/*─────────────────────────────────────────────────────────────────────────────╗
+│ Portator submission/completion rings                                        │
+╚─────────────────────────────────────────────────────────────────────────────*/
+
+/* A guest registers one struct PortatorRing with RING_SETUP: a header of
+   four u32 counters and the sizes, followed by pointers to its array of
+   64-byte submissions and 16-byte completions. It queues Portator calls
+   there and traps once with RING_ENTER, which runs everything submitted
+   and posts the results, so a whole tick's worth of calls costs one
+   trap. Calls that would block (poll or ws_recv with a timeout, launch)
+   are parked and completed by a later RING_ENTER once they are ready.
+   Other calls run without the ring lock, so one that blocks (an HTTP
+   request, say) doesn't hold up the guest's other threads. */
+
+#define RING_MAX_ENTRIES 4096
+#define RING_MAX_PENDING 64
+#define RING_CHUNK 64          /* entries copied per CopyFromUser/ToUser */
+#define RING_LAUNCH_WAIT_MS 10 /* how often to check on parked launches */
+
+/* offsets into struct PortatorRing */
+#define RING_SQ_HEAD 0
+#define RING_CQ_TAIL 12
+#define RING_HEADER 40
+
+struct RingOp {
+  u64 user_data;
+  u64 op;
+  u64 args[6];
+  i64 deadline;                /* ns; -1 waits forever */
+  pid_t pid;                   /* parked launch */
+};
+
+static struct {
+  pthread_mutex_t lock;        /* guest threads may enter concurrently */
+  i64 addr;                    /* 0 until RING_SETUP */
+  u32 sq_entries, cq_entries;
+  i64 sq, cq;
+  u32 owed;                    /* CQ slots held for calls now running */
+  int npending;
+  struct RingOp pending[RING_MAX_PENDING];
+} g_ring = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* One RING_ENTER's view of the counters, and completions not yet
+   copied out to the guest */
+struct RingCall {
+  struct Machine *m;
+  u32 sq_head, sq_tail, cq_head, cq_tail;
+  int nout;
+  u8 out[RING_CHUNK][16];
+};
+
+static int IsPow2(u32 x) {
+  return x && !(x & (x - 1));
+}
+
+static i64 RingSetup(struct Machine *m, i64 addr) {
+  u8 hdr[RING_HEADER];
+  i64 rc = -1;
+  if (CopyFromUserRead(m, hdr, addr, sizeof(hdr))) return -1;
+  u32 sq_entries = Read32(hdr + 16), cq_entries = Read32(hdr + 20);
+  pthread_mutex_lock(&g_ring.lock);
+  if (IsPow2(sq_entries) && sq_entries <= RING_MAX_ENTRIES &&
+      IsPow2(cq_entries) && cq_entries <= RING_MAX_ENTRIES &&
+      !g_ring.npending && !g_ring.owed) {
+    g_ring.addr = addr;
+    g_ring.sq_entries = sq_entries;
+    g_ring.cq_entries = cq_entries;
+    g_ring.sq = Read64(hdr + 24);
+    g_ring.cq = Read64(hdr + 32);
+    rc = 0;
+  }
+  pthread_mutex_unlock(&g_ring.lock);
+  return rc;
+}
+
+/* Read the guest's counters into rc. Caller holds the lock. */
+static int RingLoad(struct RingCall *rc) {
+  u8 hdr[16];
+  if (CopyFromUserRead(rc->m, hdr, g_ring.addr, sizeof(hdr))) return -1;
+  rc->sq_head = Read32(hdr + 0);
+  rc->sq_tail = Read32(hdr + 4);
+  rc->cq_head = Read32(hdr + 8);
+  rc->cq_tail = Read32(hdr + 12);
+  if (rc->sq_tail - rc->sq_head > g_ring.sq_entries ||
+      rc->cq_tail - rc->cq_head + g_ring.owed > g_ring.cq_entries)
+    return -1;
+  return 0;
+}
+
+static u32 RingCqFree(struct RingCall *rc) {
+  return g_ring.cq_entries - (rc->cq_tail + rc->nout - rc->cq_head) -
+         g_ring.owed;
+}
+
+/* Copy buffered completions into the guest's CQ and publish them */
+static int RingFlush(struct RingCall *rc) {
+  u8 tail[4];
+  for (int i = 0; i < rc->nout;) {
+    u32 slot = rc->cq_tail & (g_ring.cq_entries - 1);
+    u32 n = MIN(rc->nout - i, g_ring.cq_entries - slot);
+    if (CopyToUserWrite(rc->m, g_ring.cq + slot * 16, rc->out[i], n * 16))
+      return -1;
+    rc->cq_tail += n;
+    i += n;
+  }
+  rc->nout = 0;
+  Write32(tail, rc->cq_tail);
+  return CopyToUserWrite(rc->m, g_ring.addr + RING_CQ_TAIL, tail, 4);
+}
+
+static int RingComplete(struct RingCall *rc, u64 user_data, i64 result) {
+  if (rc->nout == RING_CHUNK && RingFlush(rc)) return -1;
+  Write64(rc->out[rc->nout], user_data);
+  Write64(rc->out[rc->nout] + 8, result);
+  rc->nout++;
+  return 0;
+}
+
+/* Calls the ring may park instead of blocking in */
+static int RingMayPark(const struct RingOp *op) {
+  return op->op == 0x7008 ||
+         ((op->op == 0x7001 || op->op == 0x7004) && op->args[2]);
+}
+
+/* Park one submission, or complete it if that takes no waiting.
+   Returns 1 if it has to run in full, or -1 if the guest's CQ could not
+   be written. */
+static int RingStart(struct RingCall *rc, struct RingOp *op, i64 now) {
+  i64 res;
+  if (!RingMayPark(op) || g_ring.npending == RING_MAX_PENDING) {
+    return 1;
+  } else if (op->op == 0x7008) {
+    if ((op->pid = SpawnGuest(rc->m, op->args[0], op->args[1],
+                              op->args[2])) < 0) {
+      res = -1;
+    } else {
+      g_ring.pending[g_ring.npending++] = *op;
+      return 0;
+    }
+  } else {
+    /* poll/ws_recv: try without waiting, park on nothing */
+    res = HandlePortatorSyscall(rc->m, op->op, op->args[0], op->args[1], 0,
+                                op->args[3], op->args[4], op->args[5]);
+    if (!res) {
+      i64 timeout = op->args[2];
+      op->deadline = timeout < 0 ? -1 : now + timeout * 1000000;
+      op->pid = 0;
+      g_ring.pending[g_ring.npending++] = *op;
+      return 0;
+    }
+  }
+  return RingComplete(rc, op->user_data, res);
+}
+
+/* Complete whichever parked calls are ready, as CQ room allows */
+static int RingReap(struct RingCall *rc, i64 now) {
+  int i = 0, status;
+  while (i < g_ring.npending && RingCqFree(rc)) {
+    struct RingOp *op = g_ring.pending + i;
+    i64 res;
+    if (op->pid) {
+      pid_t got = waitpid(op->pid, &status, WNOHANG);
+      if (!got) { i++; continue; }
+      res = got > 0 && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    } else {
+      res = HandlePortatorSyscall(rc->m, op->op, op->args[0], op->args[1],
+                                  0, op->args[3], op->args[4], op->args[5]);
+      if (!res && (op->deadline < 0 || now < op->deadline)) { i++; continue; }
+    }
+    if (RingComplete(rc, op->user_data, res)) return -1;
+    *op = g_ring.pending[--g_ring.npending];
+  }
+  return 0;
+}
+
+/* Consume submissions while there is room to complete them. Caller
+   holds the lock; it is dropped while calls run, with their CQ slots
+   held in g_ring.owed and the SQ head already past them, so another
+   thread's RING_ENTER can't take them too. Returns the number
+   consumed, or -1 if guest memory is bad. */
+static i64 RingSubmit(struct RingCall *rc, i64 now) {
+  u8 sqes[RING_CHUNK][64], head[4];
+  struct RingOp run[RING_CHUNK];
+  i64 res[RING_CHUNK], total = 0;
+  while (rc->sq_head != rc->sq_tail) {
+    u32 slot = rc->sq_head & (g_ring.sq_entries - 1);
+    u32 n = MIN(rc->sq_tail - rc->sq_head, g_ring.sq_entries - slot);
+    int nrun = 0;
+    n = MIN(n, RING_CHUNK);
+    n = MIN(n, RingCqFree(rc));
+    if (!n) break;
+    if (CopyFromUserRead(rc->m, sqes, g_ring.sq + slot * 64, n * 64))
+      return -1;
+    rc->sq_head += n;
+    total += n;
+    Write32(head, rc->sq_head);
+    if (CopyToUserWrite(rc->m, g_ring.addr + RING_SQ_HEAD, head, 4))
+      return -1;
+    for (u32 i = 0; i < n; i++) {
+      struct RingOp op = { 0 };
+      int must_run;
+      op.op = Read32(sqes[i]);
+      op.user_data = Read64(sqes[i] + 8);
+      for (int j = 0; j < 6; j++) op.args[j] = Read64(sqes[i] + 16 + j * 8);
+      if ((must_run = RingStart(rc, &op, now)) < 0) return -1;
+      if (must_run) run[nrun++] = op;
+    }
+    if (!nrun) continue;
+    i64 addr = g_ring.addr;
+    if (RingFlush(rc)) return -1;
+    g_ring.owed += nrun;
+    pthread_mutex_unlock(&g_ring.lock);
+    for (int i = 0; i < nrun; i++) {
+      if (run[i].op == 0x7009 || run[i].op == 0x700A) {
+        res[i] = -1;  /* no rings within rings */
+      } else {
+        res[i] = HandlePortatorSyscall(rc->m, run[i].op, run[i].args[0],
+                                       run[i].args[1], run[i].args[2],
+                                       run[i].args[3], run[i].args[4],
+                                       run[i].args[5]);
+      }
+    }
+    pthread_mutex_lock(&g_ring.lock);
+    g_ring.owed -= nrun;
+    /* other threads may have moved the counters meanwhile */
+    if (g_ring.addr != addr || RingLoad(rc)) return -1;
+    for (int i = 0; i < nrun; i++)
+      if (RingComplete(rc, run[i].user_data, res[i])) return -1;
+    if (RingFlush(rc)) return -1;
+  }
+  return total;
+}
+
+static i64 RingEnter(struct Machine *m, u64 min_complete, int timeout_ms) {
+  struct RingCall rc = { .m = m };
+  i64 submitted = 0, n;
+  i64 deadline = timeout_ms < 0 ? -1 : StreamNowNs() + timeout_ms * 1000000LL;
+  pthread_mutex_lock(&g_ring.lock);
+  if (!g_ring.addr) goto fail;
+  for (;;) {
+    if (RingLoad(&rc)) goto fail;
+    i64 now = StreamNowNs();
+    if (RingReap(&rc, now) || (n = RingSubmit(&rc, now)) < 0) goto fail;
+    submitted += n;
+    if (RingFlush(&rc)) goto fail;
+    if (rc.cq_tail - rc.cq_head >= min_complete || !g_ring.npending) break;
+    i64 left = deadline < 0 ? 100 : (deadline - StreamNowNs()) / 1000000;
+    if (left <= 0) break;
+    int ms = MIN(left, 100), launches = 0, waiters = 0;
+    for (int i = 0; i < g_ring.npending; i++) {
+      if (g_ring.pending[i].pid) {
+        launches = 1;
+      } else {
+        waiters = 1;
+      }
+    }
+    if (launches) ms = MIN(ms, RING_LAUNCH_WAIT_MS);
+    /* Sleep until the web server has input or messages for us, or
+       briefly to check on launches. Other guest threads may enter. */
+    pthread_mutex_unlock(&g_ring.lock);
+    if (waiters && SessionGuest()) {
+      SessionGuestWait(ms);
+    } else {
+      poll(NULL, 0, ms);
+    }
+    pthread_mutex_lock(&g_ring.lock);
+    if (!g_ring.addr) goto fail;
+  }
+  pthread_mutex_unlock(&g_ring.lock);
+  return submitted;
+fail:
+  pthread_mutex_unlock(&g_ring.lock);
+  return -1;
+}
+
+
 static i64 HandlePortatorSyscall(struct Machine *m, u64 ax, u64 di, u64 si,
                                  u64 dx, u64 r0, u64 r8, u64 r9) {
+  /* a forked guest may keep reading its parent's clock page */
+  TimePageUse();
   switch (ax) {
+    case 0x7000: {  /* present: di=buf_ptr, si=width, dx=height */
+      /* No browser attached (e.g. `portator run`): frames go nowhere */
+      if (!SessionGuest()) return 0;
+      /* check before narrowing: 0x100000001 must not pass as 1 */
+      if (si > SESSION_FB_MAX_W || dx > SESSION_FB_MAX_H) return -1;
+      uint32_t w = (uint32_t)si, h = (uint32_t)dx;
+      uint32_t *fb = SessionGuestBeginFrame(w, h);
+      if (!fb) return -1;
+      int rc = CopyFromUserRead(m, fb, di, (size_t)w * h * 4);
+      SessionGuestEndFrame();
+      return rc ? -1 : 0;
+    }
+    case 0x7001: {  /* poll: di=events_ptr, si=max_events, dx=timeout_ms */
+      struct SessionEvent ev[SESSION_POLL_MAX];
+      u64 max = si ? si : 1;  /* 0: the original one-event form */
+      if (max > SESSION_POLL_MAX) max = SESSION_POLL_MAX;
+      int n = SessionGuestPollEvents(ev, max, (int)(i64)dx);
+      if (n && CopyToUserWrite(m, di, ev, n * sizeof(ev[0])))
+        return -1;
+      return n;
+    }
+    case 0x7003: {  /* ws_send: di=iov_ptr, si=iov_count */
+      /* Each {base, len} is one text message to every browser, copied
+         straight from guest memory into the session's ring */
+      u8 iov[SESSION_MSG_BATCH][16];
+      u64 i, n = si < SESSION_MSG_BATCH ? si : SESSION_MSG_BATCH;
+      if (!SessionGuest() || !n) return -1;
+      if (CopyFromUserRead(m, iov, di, n * 16)) return -1;
+      for (i = 0; i < n; i++) {
+        struct GuestCopy gc = { m, (i64)Read64(iov[i]) };
+        if (SessionGuestSend(Read64(iov[i] + 8), CopyInFromGuest, &gc, -1))
+          break;
+      }
+      if (i) SessionGuestNotify();
+      return i ? (i64)i : -1;
+    }
+    case 0x7004: {  /* ws_recv: di=buf_ptr, si=buf_len, dx=timeout_ms */
+      struct GuestCopy gc = { m, (i64)di };
+      if (!SessionGuest()) return 0;
+      return SessionGuestRecv(di ? si : 0, CopyOutToGuest, &gc, (int)(i64)dx);
+    }
     case 0x7006: {  /* version: di=buf_ptr, si=buf_len */
       const char *ver = "Portator " PORTATOR_VERSION;
       size_t vlen = strlen(ver);
@@ -387,61 +2286,107 @@ static i64 HandlePortatorSyscall(struct Machine *m, u64 ax, u64 di, u64 si,
         return -1;
       return vlen;
     }
-    case 0x7007: {  /* list: di=buf_ptr, si=buf_len */
-      char *json = BuildAppListJson();
-      if (!json) return -1;
-      size_t jlen = strlen(json) + 1;
-      if (!di || !si) { free(json); return jlen; }
-      if (jlen > (u64)si) jlen = si;
-      i64 rc = CopyToUserWrite(m, di, (void *)json, jlen) ? -1 : (i64)jlen;
-      free(json);
-      return rc;
-    }
+    case 0x7007:  /* list: di=buf_ptr, si=buf_len, dx=flags, r10=query_ptr */
+      return ListApps(m, di, si, dx, r0);
     case 0x7008: {  /* launch: di=name_ptr, si=argv_ptr (0=none), dx=envp_ptr (0=inherit) */
-      char *name = CopyStr(m, di);
-      if (!name) return -1;
-      /* Read argv from guest if provided */
-      char **guest_argv = NULL;
-      if (si) guest_argv = CopyStrList(m, si);
-      /* Read envp from guest if provided */
-      char **guest_envp = NULL;
-      if (dx) guest_envp = CopyStrList(m, dx);
-      /* Build the run argv: "portator" "run" <name> [guest_argv...] NULL */
-      int nargs = 0;
-      if (guest_argv) {
-        while (guest_argv[nargs]) nargs++;
-      }
-      int run_argc = 3 + nargs;
-      char **run_argv = (char **)malloc((run_argc + 1) * sizeof(char *));
-      if (!run_argv) return -1;
-      run_argv[0] = (char *)"portator";
-      run_argv[1] = (char *)"run";
-      run_argv[2] = name;
-      for (int i = 0; i < nargs; i++)
-        run_argv[3 + i] = guest_argv[i];
-      run_argv[run_argc] = NULL;
-      pid_t pid = fork();
-      if (pid < 0) { free(run_argv); return -1; }
-      if (pid == 0) {
-        /* Set environment in child only */
-        if (guest_envp) {
-          for (int i = 0; guest_envp[i]; i++)
-            putenv(guest_envp[i]);
-        }
-        CmdRunForked(run_argc, run_argv);
-        _exit(127);
-      }
-      free(run_argv);
       int status;
+      pid_t pid = SpawnGuest(m, di, si, dx);
+      if (pid < 0) return -1;
       if (waitpid(pid, &status, 0) < 0) return -1;
       if (WIFEXITED(status)) return WEXITSTATUS(status);
       return -1;
     }
+    case 0x7009:  /* ring_setup: di=ring_ptr */
+      return RingSetup(m, di);
+    case 0x700A:  /* ring_enter: di=min_complete, si=timeout_ms */
+      return RingEnter(m, di, (int)(i64)si);
+    case 0x700B: {  /* log: di=msg_ptr, si=len */
+      char line[1024];
+      size_t n = si < sizeof(line) - 1 ? si : sizeof(line) - 1;
+      if (CopyFromUserRead(m, line, di, n)) return -1;
+      line[n] = '\n';
+      /* one write, so lines from concurrent guests don't interleave */
+      return write(2, line, n + 1) < 0 ? -1 : (i64)n;
+    }
+    case 0x700C:  /* batch: di=records_ptr, si=count, dx=flags */
+      return RunBatch(m, di, si, dx);
+    case 0x700D:  /* timepage: returns the address of the time page */
+      return MapTimePage(m);
+    case 0x700E:  /* hash: di=op, si..r8=op's arguments */
+      return HashOp(m, di, si, dx, r0, r8);
+    case 0x700F:  /* zlib: di=op, si..r9=op's arguments */
+      return ZlibOp(m, di, si, dx, r0, r8, r9);
+    case 0x7010:  /* render: di=template, si=template_len, dx=json_ptr,
+                     r10=out, r8=out_len, r9=flags */
+      return RenderTemplate(m, di, si, dx, r0, r8, r9);
+    case 0x7011:  /* mem: di=op, si=dst/a, dx=src/b/byte, r10=len */
+      return MemOp(m, di, si, dx, r0);
+    case 0x7012:  /* mapfile: di=path_ptr, si=size_ptr */
+      return MapFile(m, di, si);
+    case 0x7013:  /* readdir: di=path_ptr, si=buf, dx=len, r10=cookie_ptr,
+                     r8=flags */
+      return ReadDir(m, di, si, dx, r0, r8);
+    case 0x7014:  /* extract: di=src_ptr, si=dest_ptr, dx=buf, r10=len,
+                     r8=flags */
+      return ExtractTree(m, di, si, dx, r0, r8);
+    case 0x7015:  /* resolve: di=host_ptr, si=port_ptr, dx=buf, r10=len;
+                     or with r8=RESOLVE_BATCH, di=queries, si=count */
+      if (r8 & ~(u64)RESOLVE_BATCH) return -1;
+      if (r8) return ResolveBatch(m, di, si);
+      return ResolveName(m, di, si, dx, r0);
+    case 0x7016:  /* http: di=op, si..r10=op's arguments */
+      return HttpOp(m, di, si, dx, r0);
+    case 0x7017:  /* shm: di=op, si..r10=op's arguments */
+      return ShmOp(m, di, si, dx, r0);
     default:
       return -1;
   }
 }
 
+/* Start "portator run <name> [argv...]" in a child, with the given
+   "KEY=VALUE" list added to its environment. Returns the child's pid. */
+static pid_t SpawnGuest(struct Machine *m, i64 name_ptr, i64 argv_ptr,
+                        i64 envp_ptr) {
+  char *name = CopyStr(m, name_ptr);
+  if (!name) return -1;
+  /* Read argv from guest if provided */
+  char **guest_argv = NULL;
+  if (argv_ptr) guest_argv = CopyStrList(m, argv_ptr);
+  /* Read envp from guest if provided */
+  char **guest_envp = NULL;
+  if (envp_ptr) guest_envp = CopyStrList(m, envp_ptr);
+  /* Build the run argv: "portator" "run" <name> [guest_argv...] NULL */
+  int nargs = 0;
+  if (guest_argv) {
+    while (guest_argv[nargs]) nargs++;
+  }
+  int run_argc = 3 + nargs;
+  char **run_argv = (char **)malloc((run_argc + 1) * sizeof(char *));
+  if (!run_argv) return -1;
+  run_argv[0] = (char *)"portator";
+  run_argv[1] = (char *)"run";
+  run_argv[2] = name;
+  for (int i = 0; i < nargs; i++)
+    run_argv[3 + i] = guest_argv[i];
+  run_argv[run_argc] = NULL;
+  pid_t pid = fork();
+  if (pid < 0) { free(run_argv); return -1; }
+  if (pid == 0) {
+    /* Set environment in child only */
+    if (guest_envp) {
+      for (int i = 0; guest_envp[i]; i++)
+        putenv(guest_envp[i]);
+    }
+    /* The ring registered by the parent guest doesn't exist here */
+    memset(&g_ring, 0, sizeof(g_ring));
+    pthread_mutex_init(&g_ring.lock, NULL);
+    CmdRunForked(run_argc, run_argv);
+    _exit(127);
+  }
+  free(run_argv);
+  return pid;
+}
+
 static int Exec(char *execfn, char *prog, char **argv, char **envp) {
   int i;
   struct Machine *m;
@@ -563,13 +2508,82 @@ static int CmdRun(int argc, char **argv) {
 │ portator web — start the web UI                                              │
 ╚─────────────────────────────────────────────────────────────────────────────*/
 
+/* Guests launched by the web server start in a child forked from it,
+   before the emulator runtime was initialized. */
+static int RunSessionGuest(int argc, char **argv) {
+  if (InitRuntime()) return 1;
+  return CmdRunForked(argc, argv);
+}
+
 static int CmdWeb(int argc, char **argv) {
   int port = 6711;
-  if (argc >= 3) port = atoi(argv[2]);
+  struct StreamLimits limits;
+  struct WebServerOptions web;
+  StreamGetLimits(&limits);
+  WebServerGetOptions(&web);
+  for (int i = 2; i < argc; i++) {
+    int *lo = NULL, *hi = NULL, *num = NULL;
+    if (!strcmp(argv[i], "--quality")) {
+      lo = &limits.quality_min, hi = &limits.quality_max;
+    } else if (!strcmp(argv[i], "--fps")) {
+      lo = &limits.fps_min, hi = &limits.fps_max;
+    } else if (!strcmp(argv[i], "--scale")) {
+      lo = &limits.scale_min, hi = &limits.scale_max;
+    } else if (!strcmp(argv[i], "--threads")) {
+      num = &web.threads;
+    } else if (!strcmp(argv[i], "--ws-threads")) {
+      num = &web.ws_threads;
+    } else if (!strcmp(argv[i], "--listen-backlog")) {
+      num = &web.listen_backlog;
+    } else if (!strcmp(argv[i], "--keep-alive-ms")) {
+      num = &web.keep_alive_ms;
+    } else if (!strcmp(argv[i], "--ws-deflate")) {
+      num = &web.ws_deflate;
+    } else if (!strcmp(argv[i], "--ws-mem-level")) {
+      num = &web.ws_mem_level;
+    } else if (!strcmp(argv[i], "--no-http2")) {
+      web.http2 = 0;
+      continue;
+    } else if (argv[i][0] != '-') {
+      port = atoi(argv[i]);
+      continue;
+    } else {
+      Print(2, "portator: unknown option ");
+      Print(2, argv[i]);
+      Print(2, "\n");
+      return 1;
+    }
+    if (num) {
+      char *end = NULL;
+      if (i + 1 < argc) *num = (int)strtol(argv[i + 1], &end, 10);
+      if (!end || end == argv[i + 1] || *end || *num < 0) {
+        Print(2, "portator: expected a number after ");
+        Print(2, argv[i]);
+        Print(2, "\n");
+        return 1;
+      }
+      i++;
+      continue;
+    }
+    if (i + 1 >= argc || StreamParseRange(argv[i + 1], lo, hi)) {
+      Print(2, "portator: expected MIN-MAX after ");
+      Print(2, argv[i]);
+      Print(2, "\n");
+      return 1;
+    }
+    i++;
+  }
   if (port <= 0 || port > 65535) {
     Print(2, "portator: invalid port\n");
     return 1;
   }
+  StreamSetLimits(&limits);
+  WebServerSetOptions(&web);
+  SessionSetLauncher(RunSessionGuest);
+  /* lets the asset cache take wwwroot's deflated bytes as they are */
+  (void)ZipStoreOpen(ExecutablePath());
+  /* sessions fork from here, so this process keeps their clock page */
+  (void)TimePageFd();
   if (WebServerStart(port, "/zip/wwwroot")) return 1;
   Print(1, "Press Enter to stop the server...\n");
   (void)getchar();
@@ -577,6 +2591,32 @@ static int CmdWeb(int argc, char **argv) {
   return 0;
 }
 
+/* Emulator setup needed before any guest can run */
+static int InitRuntime(void) {
+#ifndef DISABLE_OVERLAYS
+  if (SetOverlays(FLAG_overlays, true)) {
+    Print(2, "portator: bad overlays spec\n");
+    return 1;
+  }
+#endif
+#ifndef DISABLE_VFS
+  /* Use current directory as VFS prefix to avoid permission issues */
+  {
+    static char cwdbuf[PATH_MAX];
+    if (getcwd(cwdbuf, sizeof(cwdbuf))) {
+      FLAG_prefix = cwdbuf;
+    }
+  }
+  if (VfsInit(FLAG_prefix)) {
+    Print(2, "portator: vfs init failed\n");
+    return 1;
+  }
+#endif
+  HandleSigs();
+  InitBus();
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
   // TODO: Are we supposed to store OnPortatorSyscall, and pass on to it if we don't handle the Syscall???
   OnPortatorSyscall = HandlePortatorSyscall;
@@ -587,6 +2627,10 @@ int main(int argc, char *argv[]) {
   FLAG_overlays = ":o";
 #endif
   g_blink_path = argc > 0 ? argv[0] : 0;
+  /* before anything forks, so every guest shares the resolver cache and
+     the shared memory names */
+  ResolveInit();
+  ShmInit();
   WriteErrorInit();
   LogInit("/tmp/portator.log");
   // FLAG_strace = true;
@@ -605,7 +2649,18 @@ int main(int argc, char *argv[]) {
     Print(1, "    new <type> <name>   Create a new project (console, gui, web)\n");
     Print(1, "    build <name>        Compile a project\n");
     Print(1, "    init                Extract shared include/src files\n");
+    Print(1, "    extract <dir> [to]  Extract a directory of the zip store\n");
     Print(1, "    web [port]          Start the web UI (default: 6711)\n");
+    Print(1, "      --quality MIN-MAX   JPEG quality range for streamed apps\n");
+    Print(1, "      --fps MIN-MAX       Frame rate range for streamed apps\n");
+    Print(1, "      --scale MIN-MAX     Downscale factor range for streamed apps\n");
+    Print(1, "      --threads N         Workers for pages and the API (default: cores)\n");
+    Print(1, "      --ws-threads N      Workers kept for app viewers (default: threads, min 4)\n");
+    Print(1, "      --listen-backlog N  Pending connections the kernel queues\n");
+    Print(1, "      --keep-alive-ms N   Idle keep-alive timeout; 0 disables\n");
+    Print(1, "      --no-http2          Don't offer cleartext HTTP/2 (h2c)\n");
+    Print(1, "      --ws-deflate N      WebSocket compression window 2^N (9-15); 0 disables\n");
+    Print(1, "      --ws-mem-level N    WebSocket compressor memory level (1-9)\n");
     Print(1, "    credits             Show third-party credits\n");
     Print(1, "    license             Show license information\n");
     Print(1, "    help                Show this message\n");
@@ -654,27 +2709,10 @@ int main(int argc, char *argv[]) {
   if (strcmp(argv[1], "web") == 0) {
     return CmdWeb(argc, argv);
   }
-#ifndef DISABLE_OVERLAYS
-  if (SetOverlays(FLAG_overlays, true)) {
-    Print(2, "portator: bad overlays spec\n");
-    return 1;
-  }
-#endif
-#ifndef DISABLE_VFS
-  /* Use current directory as VFS prefix to avoid permission issues */
-  {
-    static char cwdbuf[PATH_MAX];
-    if (getcwd(cwdbuf, sizeof(cwdbuf))) {
-      FLAG_prefix = cwdbuf;
-    }
+  if (InitRuntime()) return 1;
+  if (strcmp(argv[1], "extract") == 0) {
+    return CmdExtract(argc, argv);
   }
-  if (VfsInit(FLAG_prefix)) {
-    Print(2, "portator: vfs init failed\n");
-    return 1;
-  }
-#endif
-  HandleSigs();
-  InitBus();
   if (strcmp(argv[1], "build") == 0) {
     return CmdBuild(argc, argv);
   }
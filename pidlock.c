@@ -0,0 +1,29 @@
+#include "pidlock.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define SPINS_BEFORE_CHECK 1000
+
+void PidLock(int *lock) {
+    int me = getpid(), owner = 0, spins = 0;
+    while (!__atomic_compare_exchange_n(lock, &owner, me, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        if (++spins >= SPINS_BEFORE_CHECK) {
+            spins = 0;
+            if (kill(owner, 0) && errno == ESRCH &&
+                __atomic_compare_exchange_n(lock, &owner, me, 0,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED))
+                return;
+        }
+        sched_yield();
+        owner = 0;
+    }
+}
+
+void PidUnlock(int *lock) {
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,12 @@
+#ifndef PIDLOCK_H_
+#define PIDLOCK_H_
+
+/* A spinlock for memory shared with forked children, holding the pid of
+   the process inside (0 when free). A process killed while holding it
+   would otherwise wedge the rest, so a waiter that finds the holder
+   gone takes the lock over. Not reentrant, and threads of one process
+   must serialize among themselves before taking it. */
+void PidLock(int *lock);
+void PidUnlock(int *lock);
+
+#endif /* PIDLOCK_H_ */
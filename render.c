@@ -0,0 +1,53 @@
+#include "render.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <cjson/cJSON.h>
+#include "mustach-cjson.h"
+
+#define PARTIAL_EXTENSION ".mustache"  /* as mustach's own loader */
+
+static RenderLoader s_load;
+
+/* Look for the partial as named, then with the extension added */
+static int GetPartial(const char *name, struct mustach_sbuf *sbuf) {
+    size_t n = strlen(name), len;
+    char *path, *text;
+    if (!s_load) return MUSTACH_ERROR_PARTIAL_NOT_FOUND;
+    if (!(path = (char *)malloc(n + sizeof(PARTIAL_EXTENSION))))
+        return MUSTACH_ERROR_SYSTEM;
+    memcpy(path, name, n + 1);
+    if (!(text = s_load(path, &len))) {
+        memcpy(path + n, PARTIAL_EXTENSION, sizeof(PARTIAL_EXTENSION));
+        text = s_load(path, &len);
+    }
+    free(path);
+    if (!text) return MUSTACH_ERROR_PARTIAL_NOT_FOUND;
+    sbuf->value = text;
+    sbuf->freecb = free;
+    sbuf->length = len;
+    return MUSTACH_OK;
+}
+
+void RenderSetLoader(RenderLoader load) {
+    s_load = load;
+    mustach_wrap_get_partial = GetPartial;
+}
+
+int Render(const char *template, size_t len, const char *json, char **out,
+           size_t *out_len) {
+    cJSON *root;
+    int rc;
+    *out = NULL;
+    *out_len = 0;
+    if (!(root = cJSON_Parse(json))) return -1;
+    rc = mustach_cJSON_mem(template, len, root, 0, out, out_len);
+    cJSON_Delete(root);
+    if (rc != MUSTACH_OK) {
+        free(*out);
+        *out = NULL;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef RENDER_H_
+#define RENDER_H_
+
+#include <stddef.h>
+
+/* Mustache rendering for guests (PORTATOR_SYS_RENDER), using the same
+   mustach and cJSON sources guests are built with, compiled natively. */
+
+/* Reads the file a {{> partial}} names into a malloc()ed buffer with a
+   NUL after the len bytes, or returns NULL. Partials are never read
+   from the host's filesystem directly. */
+typedef char *(*RenderLoader)(const char *path, size_t *len);
+
+void RenderSetLoader(RenderLoader load);
+
+/* Render len bytes of template with the JSON text json as its context.
+   On success stores a malloc()ed result (NUL-terminated) and its length
+   and returns 0; returns -1 if the JSON or the template is bad. */
+int Render(const char *template, size_t len, const char *json, char **out,
+           size_t *out_len);
+
+#endif /* RENDER_H_ */
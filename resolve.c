@@ -0,0 +1,225 @@
+#include "resolve.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pidlock.h"
+
+#define SLOTS 512                  /* a power of two */
+#define WAYS 4                     /* slots a key may occupy */
+#define HOST_MAX 256
+#define PORT_MAX 32
+
+/* Linux's address families, which guests see whatever the host is */
+#define LINUX_AF_INET 2
+#define LINUX_AF_INET6 10
+
+struct Slot {
+    char host[HOST_MAX];
+    char port[PORT_MAX];
+    int64_t expires_ns;            /* 0 if the slot is free */
+    int32_t count;                 /* addresses, or -1 for a failure */
+    uint32_t reserved;
+    struct ResolveAddr addrs[RESOLVE_MAX_ADDRS];
+};
+
+/* Shared with every forked child, under a PidLock */
+struct Cache {
+    int lock;
+    struct Slot slots[SLOTS];
+};
+
+static struct Cache *s_cache;
+
+static int64_t NowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int ResolveInit(void) {
+    void *p;
+    if (s_cache) return 0;
+    p = mmap(NULL, sizeof(*s_cache), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return -1;
+    s_cache = (struct Cache *)p;
+    return 0;
+}
+
+static const char *Str(const char *s) {
+    return s ? s : "";
+}
+
+/* Keys too long for a slot just aren't cached */
+static int Cacheable(const char *host, const char *port) {
+    return s_cache && strlen(Str(host)) < HOST_MAX &&
+           strlen(Str(port)) < PORT_MAX;
+}
+
+static struct Slot *Bucket(const char *host, const char *port) {
+    uint32_t h = 2166136261u;      /* FNV-1a over host, NUL, port */
+    for (const char *p = Str(host);; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+        if (!*p) break;
+    }
+    for (const char *p = Str(port); *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    return s_cache->slots + (h & (SLOTS - 1) & -WAYS);
+}
+
+static int Matches(const struct Slot *s, const char *host, const char *port) {
+    return s->expires_ns && !strcmp(s->host, Str(host)) &&
+           !strcmp(s->port, Str(port));
+}
+
+/* The cached answer for host and port: the count (-1 for a cached
+   failure) with the addresses in out, or -2 if there's none */
+static int Lookup(const char *host, const char *port,
+                  struct ResolveAddr *out) {
+    struct Slot *b;
+    int rc = -2;
+    if (!Cacheable(host, port)) return -2;
+    b = Bucket(host, port);
+    PidLock(&s_cache->lock);
+    for (int i = 0; i < WAYS; i++) {
+        if (Matches(b + i, host, port) && b[i].expires_ns > NowNs()) {
+            rc = b[i].count;
+            if (rc > 0) memcpy(out, b[i].addrs, rc * sizeof(*out));
+            break;
+        }
+    }
+    PidUnlock(&s_cache->lock);
+    return rc;
+}
+
+static void Store(const char *host, const char *port,
+                  const struct ResolveAddr *addrs, int count) {
+    struct Slot *b, *s = NULL;
+    int64_t now = NowNs();
+    if (!Cacheable(host, port)) return;
+    b = Bucket(host, port);
+    PidLock(&s_cache->lock);
+    /* the key's own slot, else a free or expired one, else the oldest */
+    for (int i = 0; i < WAYS && !s; i++)
+        if (Matches(b + i, host, port)) s = b + i;
+    for (int i = 0; i < WAYS && !s; i++)
+        if (b[i].expires_ns <= now) s = b + i;
+    if (!s) {
+        s = b;
+        for (int i = 1; i < WAYS; i++)
+            if (b[i].expires_ns < s->expires_ns) s = b + i;
+    }
+    strcpy(s->host, Str(host));
+    strcpy(s->port, Str(port));
+    s->count = count;
+    if (count > 0) memcpy(s->addrs, addrs, count * sizeof(*addrs));
+    s->expires_ns = now + 1000000000LL * (count > 0 ? RESOLVE_TTL_S
+                                                    : RESOLVE_NEGATIVE_TTL_S);
+    PidUnlock(&s_cache->lock);
+}
+
+/* getaddrinfo, flattened. Returns the count, -1 for an answer worth
+   caching (no such name), or -2 for a failure that may pass. */
+static int Query(const char *host, const char *port,
+                 struct ResolveAddr *out) {
+    struct addrinfo hints, *res, *ai;
+    int n = 0, rc;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;   /* one answer per address */
+    if ((rc = getaddrinfo(host, port, &hints, &res))) {
+#ifdef EAI_NODATA
+        if (rc == EAI_NODATA) return -1;
+#endif
+        return rc == EAI_NONAME ? -1 : -2;
+    }
+    for (ai = res; ai && n < RESOLVE_MAX_ADDRS; ai = ai->ai_next) {
+        struct ResolveAddr *a = out + n;
+        memset(a, 0, sizeof(*a));
+        if (ai->ai_family == AF_INET) {
+            const struct sockaddr_in *sin =
+                (const struct sockaddr_in *)ai->ai_addr;
+            a->family = LINUX_AF_INET;
+            a->port = sin->sin_port;
+            memcpy(a->addr, &sin->sin_addr, 4);
+        } else if (ai->ai_family == AF_INET6) {
+            const struct sockaddr_in6 *sin6 =
+                (const struct sockaddr_in6 *)ai->ai_addr;
+            a->family = LINUX_AF_INET6;
+            a->port = sin6->sin6_port;
+            memcpy(a->addr, &sin6->sin6_addr, 16);
+        } else {
+            continue;
+        }
+        n++;
+    }
+    freeaddrinfo(res);
+    return n ? n : -1;
+}
+
+/* Look host up and cache the answer */
+static int Fetch(const char *host, const char *port,
+                 struct ResolveAddr *out) {
+    int n;
+    if ((n = Query(host, port, out)) == -2) return -1;
+    Store(host, port, out, n);
+    return n;
+}
+
+int Resolve(const char *host, const char *port,
+            struct ResolveAddr out[RESOLVE_MAX_ADDRS]) {
+    int n = Lookup(host, port, out);
+    return n != -2 ? n : Fetch(host, port, out);
+}
+
+struct Many {
+    pthread_mutex_t lock;
+    const char *const *hosts, *const *ports;
+    struct ResolveAddr (*out)[RESOLVE_MAX_ADDRS];
+    int *counts;
+    size_t *todo;                  /* indices the cache couldn't answer */
+    size_t n, next;
+};
+
+static void *FetchWorker(void *arg) {
+    struct Many *w = (struct Many *)arg;
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        size_t j = w->next++;
+        pthread_mutex_unlock(&w->lock);
+        if (j >= w->n) break;
+        size_t i = w->todo[j];
+        w->counts[i] = Fetch(w->hosts[i], w->ports[i], w->out[i]);
+    }
+    return NULL;
+}
+
+void ResolveMany(const char *const *hosts, const char *const *ports,
+                 size_t n, struct ResolveAddr (*out)[RESOLVE_MAX_ADDRS],
+                 int *counts) {
+    struct Many w = { .lock = PTHREAD_MUTEX_INITIALIZER, .hosts = hosts,
+                      .ports = ports, .out = out, .counts = counts };
+    pthread_t th[RESOLVE_THREADS - 1];
+    size_t threads = 0;
+    /* answer what the cache can here, and look the rest up at once */
+    w.todo = (size_t *)malloc(n * sizeof(*w.todo) + 1);
+    for (size_t i = 0; i < n; i++) {
+        if ((counts[i] = Lookup(hosts[i], ports[i], out[i])) != -2) continue;
+        if (w.todo) w.todo[w.n++] = i;
+        else counts[i] = Fetch(hosts[i], ports[i], out[i]);
+    }
+    while (threads < RESOLVE_THREADS - 1 && threads + 1 < w.n &&
+           !pthread_create(th + threads, NULL, FetchWorker, &w))
+        threads++;
+    if (w.n) FetchWorker(&w);
+    while (threads) pthread_join(th[--threads], NULL);
+    free(w.todo);
+}
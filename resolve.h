@@ -0,0 +1,42 @@
+#ifndef RESOLVE_H_
+#define RESOLVE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Name resolution done by the host's getaddrinfo for guests
+   (PORTATOR_SYS_RESOLVE), whose own musl resolver reads resolv.conf and
+   talks UDP through emulated syscalls, and fails outright where Blink
+   can't carry that. Answers are kept in a cache that every guest forked
+   from this process shares, failures included. */
+
+#define RESOLVE_MAX_ADDRS 16
+#define RESOLVE_TTL_S 60           /* how long an answer is kept */
+#define RESOLVE_NEGATIVE_TTL_S 10  /* and a "no such name" */
+#define RESOLVE_THREADS 16         /* lookups run at once by ResolveMany */
+
+/* Same layout as struct PortatorAddr in include/portator.h */
+struct ResolveAddr {
+    uint16_t family;               /* AF_INET or AF_INET6 (Linux values) */
+    uint16_t port;                 /* network byte order */
+    uint8_t addr[16];              /* IPv4 in the first 4 bytes */
+};
+
+/* Map the shared cache. Call before forking anything that resolves;
+   without it, lookups still work but aren't cached. Returns 0 or -1. */
+int ResolveInit(void);
+
+/* Resolve host and port (either may be NULL, as for getaddrinfo) into
+   out, from the cache while the answer is fresh. Returns the number of
+   addresses, or -1 if the name doesn't resolve. */
+int Resolve(const char *host, const char *port,
+            struct ResolveAddr out[RESOLVE_MAX_ADDRS]);
+
+/* Resolve n names at once, looking up the ones not cached concurrently
+   on up to RESOLVE_THREADS threads. counts[i] gets what Resolve would
+   return for the ith. */
+void ResolveMany(const char *const *hosts, const char *const *ports,
+                 size_t n, struct ResolveAddr (*out)[RESOLVE_MAX_ADDRS],
+                 int *counts);
+
+#endif /* RESOLVE_H_ */
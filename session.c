@@ -0,0 +1,1135 @@
+#include "session.h"
+#include "stream.h"
+#include "civetweb/civetweb.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ENCODE_CACHE 4             /* distinct encodings kept per frame */
+#define KILL_GRACE_NS 1000000000LL
+#define MSG_BACKLOG_NS 5000000000LL /* a stuck guest drops browser messages */
+#define GUEST_WAIT_MS 100           /* longest sleep between ring checks */
+#define CLIENT_QUEUE_MAX SESSION_MSG_RING /* text a viewer may fall behind */
+#define CLIENT_QUEUE_LEN (SESSION_MSG_RING / 4) /* as many as a ring holds */
+#define TEXT_POOL_MIN 256           /* smallest pooled text buffer */
+#define TEXT_POOL_CLASSES 11        /* doubling up to SESSION_MSG_MAX */
+#define TEXT_POOL_KEEP 16           /* idle buffers kept per class */
+
+/* A message on its way to clients, shared by every client it goes to,
+   hence the count. Frames are malloc'd per encoding; text comes from
+   the session's pool and goes back there when the last writer is done. */
+struct Outgoing {
+    atomic_int refs;
+    int pool;                      /* text size class, or -1 for frames */
+    struct Outgoing *next;         /* in the session's text pool */
+    uint32_t frame;                /* the guest frame it shows */
+    size_t len;
+    unsigned char data[];
+};
+
+/* Each client has a writer thread that sends what the pump hands it, so
+   a slow browser only ever blocks its own thread and never the session
+   lock. Everything but the thread itself is protected by that lock. */
+struct SessionClient {
+    struct Session *session;
+    struct mg_connection *conn;
+    int id;
+    struct StreamClient stream;
+    pthread_t writer;
+    pthread_cond_t cond;           /* wakes the writer */
+    struct Outgoing **text;        /* text_cap slots, a power of two */
+    unsigned text_cap, text_head, text_tail;
+    size_t text_bytes;
+    unsigned text_dropped;         /* lost to a full queue */
+    struct Outgoing *frame;        /* encoded, not yet written */
+    int busy;                      /* a frame is being encoded or written */
+    int closing;
+    int deflate_ok;                /* deflate as of the last write */
+    struct mg_websocket_deflate_stats deflate;
+    struct SessionClient *next;
+};
+
+struct Session {
+    int id;
+    int refs;                      /* protected by s_lock */
+    char name[64];
+    pid_t pid;
+    int doorbell;                  /* read end, rung by the guest */
+    int events;                    /* write end, rung after queueing input */
+    int wake[2];                   /* self-pipe to wake the pump */
+    struct SessionShared *shared;
+    pthread_mutex_t lock;          /* everything below */
+    pthread_cond_t room;           /* the guest took browser messages */
+    struct SessionClient *clients;
+    int next_client;
+    int stopping;
+    int64_t stop_ns;
+    int exited;
+    int status;
+    uint32_t frame;                /* newest frame in snapshot */
+    int fb_w, fb_h;
+    uint32_t *snapshot;            /* pump thread only */
+    size_t snapshot_cap;
+    struct Outgoing *text_pool[TEXT_POOL_CLASSES];
+    int text_pool_len[TEXT_POOL_CLASSES];
+    struct Session *next;          /* protected by s_lock */
+};
+
+struct EncodedFrame {
+    int quality, scale;
+    struct Outgoing *out;
+};
+
+struct FrameDue {
+    int id;                        /* client, which may leave meanwhile */
+    struct StreamSettings set;
+};
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Session *s_sessions;
+static int s_next_id = 1;
+static SessionLauncher s_launcher;
+
+/* Guest side (set in the forked child only) */
+static struct SessionShared *s_guest;
+static int s_guest_doorbell = -1;
+static int s_guest_events = -1;
+static pthread_mutex_t s_guest_poll_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t s_guest_send_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t s_guest_recv_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct JsonBuf {
+    char *p;
+    size_t len, cap;
+    int oom;
+};
+
+static void Appendf(struct JsonBuf *b, const char *fmt, ...) {
+    va_list va;
+    for (;;) {
+        va_start(va, fmt);
+        int n = vsnprintf(b->p + b->len, b->cap - b->len, fmt, va);
+        va_end(va);
+        if (n < 0) { b->oom = 1; return; }
+        if (b->len + n < b->cap) { b->len += n; return; }
+        size_t cap = (b->len + n + 1) * 2;
+        char *tmp = (char *)realloc(b->p, cap);
+        if (!tmp) { b->oom = 1; return; }
+        b->p = tmp;
+        b->cap = cap;
+    }
+}
+
+static void PutLe32(unsigned char *p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static uint32_t GetLe32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t RecordSize(size_t len) {
+    return (4 + len + 3) & ~3u;
+}
+
+/* Returns where a len-byte message goes, or NULL if the ring is full.
+   Only the ring's producer may call this, followed by MsgCommit. */
+static unsigned char *MsgReserve(struct SessionMsgRing *r, size_t len) {
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+    unsigned off = tail & (SESSION_MSG_RING - 1);
+    unsigned need = RecordSize(len);
+    unsigned skip = SESSION_MSG_RING - off < need ? SESSION_MSG_RING - off : 0;
+    if (need + skip > SESSION_MSG_RING - (tail - head)) return NULL;
+    return r->data + (skip ? 0 : off) + 4;
+}
+
+static void MsgCommit(struct SessionMsgRing *r, size_t len) {
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned off = tail & (SESSION_MSG_RING - 1);
+    unsigned need = RecordSize(len);
+    unsigned skip = SESSION_MSG_RING - off < need ? SESSION_MSG_RING - off : 0;
+    if (skip) {
+        PutLe32(r->data + off, ~0u);
+        off = 0;
+    }
+    PutLe32(r->data + off, len);
+    memset(r->data + off + 4 + len, 0, need - 4 - len);
+    atomic_store_explicit(&r->tail, tail + skip + need, memory_order_release);
+}
+
+/* Returns the next record, starting at its length word, or NULL if the
+   ring is empty. Only the ring's consumer may call this. */
+static unsigned char *MsgPeek(struct SessionMsgRing *r, uint32_t *len) {
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head == tail) return NULL;
+    unsigned off = head & (SESSION_MSG_RING - 1);
+    uint32_t n = GetLe32(r->data + off);
+    if (n == ~0u) {
+        head += SESSION_MSG_RING - off;
+        atomic_store_explicit(&r->head, head, memory_order_release);
+        if (head == tail) return NULL;
+        off = 0;
+        n = GetLe32(r->data);
+    }
+    if (n > SESSION_MSG_MAX) {
+        /* the other process scribbled on the ring: discard it all */
+        atomic_store_explicit(&r->head, tail, memory_order_release);
+        return NULL;
+    }
+    *len = n;
+    return r->data + off;
+}
+
+static void MsgPop(struct SessionMsgRing *r, uint32_t len) {
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    atomic_store_explicit(&r->head, head + RecordSize(len),
+                          memory_order_release);
+}
+
+static int IsValidName(const char *name) {
+    size_t n = strlen(name);
+    if (!n || n >= sizeof(((struct Session *)0)->name)) return 0;
+    if (name[0] == '.') return 0;
+    for (const char *p = name; *p; p++) {
+        if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+              (*p >= '0' && *p <= '9') || *p == '-' || *p == '_' ||
+              *p == '.'))
+            return 0;
+    }
+    return 1;
+}
+
+static void Wake(struct Session *s) {
+    (void)!write(s->wake[1], "", 1);
+}
+
+void SessionSetLauncher(SessionLauncher launcher) {
+    s_launcher = launcher;
+}
+
+static void FreeSession(struct Session *s) {
+    if (s->shared) munmap(s->shared, sizeof(struct SessionShared));
+    if (s->doorbell >= 0) close(s->doorbell);
+    if (s->events >= 0) close(s->events);
+    if (s->wake[0] >= 0) close(s->wake[0]);
+    if (s->wake[1] >= 0) close(s->wake[1]);
+    pthread_cond_destroy(&s->room);
+    pthread_mutex_destroy(&s->lock);
+    free(s->snapshot);
+    for (int k = 0; k < TEXT_POOL_CLASSES; k++) {
+        while (s->text_pool[k]) {
+            struct Outgoing *o = s->text_pool[k];
+            s->text_pool[k] = o->next;
+            free(o);
+        }
+    }
+    free(s);
+}
+
+void SessionRelease(struct Session *s) {
+    int refs;
+    if (!s) return;
+    pthread_mutex_lock(&s_lock);
+    refs = --s->refs;
+    pthread_mutex_unlock(&s_lock);
+    if (!refs) FreeSession(s);
+}
+
+struct Session *SessionFind(int id) {
+    struct Session *s;
+    pthread_mutex_lock(&s_lock);
+    for (s = s_sessions; s; s = s->next) {
+        if (s->id == id) {
+            s->refs++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s_lock);
+    return s;
+}
+
+/* Copy the newest published frame out of shared memory. Returns 1 if a
+   new frame was taken, 0 if there is none or the guest is mid-write
+   (it rings the doorbell again when it finishes). */
+static int PullFrame(struct Session *s) {
+    struct SessionShared *sh = s->shared;
+    for (int tries = 0; tries < 4; tries++) {
+        unsigned seq = atomic_load_explicit(&sh->fb_seq, memory_order_acquire);
+        if (seq & 1) return 0;
+        if (seq / 2 == s->frame) return 0;
+        uint32_t w = sh->fb_w, h = sh->fb_h;
+        if (!w || !h || w > SESSION_FB_MAX_W || h > SESSION_FB_MAX_H)
+            return 0;
+        size_t n = (size_t)w * h;
+        if (n > s->snapshot_cap) {
+            uint32_t *tmp = (uint32_t *)realloc(s->snapshot, n * 4);
+            if (!tmp) return 0;
+            s->snapshot = tmp;
+            s->snapshot_cap = n;
+        }
+        memcpy(s->snapshot, sh->fb, n * 4);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&sh->fb_seq, memory_order_relaxed) != seq)
+            continue;
+        pthread_mutex_lock(&s->lock);
+        s->frame = seq / 2;
+        s->fb_w = w;
+        s->fb_h = h;
+        pthread_mutex_unlock(&s->lock);
+        return 1;
+    }
+    return 0;
+}
+
+static void Unref(struct Outgoing *o) {
+    if (o && atomic_fetch_sub(&o->refs, 1) == 1) free(o);
+}
+
+/* Returns the frame encoded with set, from the cache or freshly. The
+   snapshot is the pump's own, so this runs without the session lock. */
+static struct Outgoing *GetEncoded(struct Session *s,
+                                   struct EncodedFrame *cache, int *n,
+                                   const struct StreamSettings *set,
+                                   uint32_t frame, int fb_w, int fb_h) {
+    struct EncodedFrame *e;
+    for (int i = 0; i < *n; i++) {
+        if (cache[i].quality == set->quality && cache[i].scale == set->scale)
+            return cache[i].out;
+    }
+    if (*n == ENCODE_CACHE) {
+        Unref(cache[0].out);
+        memmove(cache, cache + 1, (ENCODE_CACHE - 1) * sizeof(*cache));
+        --*n;
+    }
+    int w, h;
+    size_t len;
+    unsigned char *jpeg =
+        StreamEncodeFrame(s->snapshot, fb_w, fb_h, set, &w, &h, &len);
+    if (!jpeg) return NULL;
+    struct Outgoing *o = (struct Outgoing *)malloc(sizeof(*o) + 12 + len);
+    if (!o) { free(jpeg); return NULL; }
+    atomic_init(&o->refs, 1);
+    o->pool = -1;
+    o->next = NULL;
+    o->frame = frame;
+    o->len = 12 + len;
+    /* 'F' scale quality 0 | seq | w h | JPEG */
+    unsigned char *msg = o->data;
+    msg[0] = 'F';
+    msg[1] = set->scale;
+    msg[2] = set->quality;
+    msg[3] = 0;
+    PutLe32(msg + 4, frame);
+    msg[8] = w; msg[9] = w >> 8;
+    msg[10] = h; msg[11] = h >> 8;
+    memcpy(msg + 12, jpeg, len);
+    free(jpeg);
+    e = cache + (*n)++;
+    e->quality = set->quality;
+    e->scale = set->scale;
+    e->out = o;
+    return o;
+}
+
+static struct SessionClient *FindClient(struct Session *s, int id) {
+    struct SessionClient *c;
+    for (c = s->clients; c; c = c->next) {
+        if (c->id == id) break;
+    }
+    return c;
+}
+
+/* Hand the current frame to every client that is due for one, and
+   return how long the pump may sleep before someone becomes due. The
+   lock is only held to pick the clients and to give them the result;
+   encoding and writing happen outside it. */
+static int DeliverFrames(struct Session *s) {
+    struct EncodedFrame cache[ENCODE_CACHE];
+    struct FrameDue *due = NULL;
+    int ncache = 0, ndue = 0, nclients = 0;
+    int64_t wait = 1000000000LL;
+    pthread_mutex_lock(&s->lock);
+    uint32_t frame = s->frame;
+    int fb_w = s->fb_w, fb_h = s->fb_h;
+    for (struct SessionClient *c = s->clients; c; c = c->next) nclients++;
+    if (frame && nclients)
+        due = (struct FrameDue *)malloc(nclients * sizeof(*due));
+    int64_t now = StreamNowNs();
+    for (struct SessionClient *c = s->clients; c && due; c = c->next) {
+        StreamClientAdapt(&c->stream, now);
+        /* a busy writer wakes us when it's done */
+        if (c->busy || c->stream.last_frame == frame) continue;
+        int64_t d = StreamClientDue(&c->stream, now);
+        if (d < 0) {
+            /* an ack wakes us; the frame is dropped for this client */
+            StreamClientSkipped(&c->stream, frame);
+            continue;
+        }
+        if (d > 0) {
+            if (d < wait) wait = d;
+            continue;
+        }
+        c->busy = 1;
+        due[ndue].id = c->id;
+        due[ndue].set = c->stream.cur;
+        ndue++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (!ndue) {
+        free(due);
+        return (int)((wait + 999999) / 1000000);
+    }
+
+    struct Outgoing **out = (struct Outgoing **)calloc(ndue, sizeof(*out));
+    for (int i = 0; i < ndue && out; i++) {
+        out[i] = GetEncoded(s, cache, &ncache, &due[i].set, frame, fb_w, fb_h);
+        if (out[i]) atomic_fetch_add(&out[i]->refs, 1);
+    }
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < ndue; i++) {
+        struct SessionClient *c = FindClient(s, due[i].id);
+        struct Outgoing *o = out ? out[i] : NULL;
+        if (!c || c->closing || !o) {
+            if (c) c->busy = 0;
+            Unref(o);
+            continue;
+        }
+        c->frame = o;
+        pthread_cond_signal(&c->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    for (int i = 0; i < ncache; i++) Unref(cache[i].out);
+    free(out);
+    free(due);
+    return (int)((wait + 999999) / 1000000);
+}
+
+/* Copies a text message into a buffer from the session's pool, holding
+   one reference for the caller. Caller holds the session lock. */
+static struct Outgoing *NewText(struct Session *s, const void *data,
+                                size_t len) {
+    struct Outgoing *o;
+    int k = 0;
+    while (k < TEXT_POOL_CLASSES - 1 && (size_t)TEXT_POOL_MIN << k < len) k++;
+    if (len > (size_t)TEXT_POOL_MIN << k) return NULL;
+    if ((o = s->text_pool[k])) {
+        s->text_pool[k] = o->next;
+        s->text_pool_len[k]--;
+    } else if (!(o = (struct Outgoing *)malloc(sizeof(*o) +
+                                               ((size_t)TEXT_POOL_MIN << k)))) {
+        return NULL;
+    }
+    atomic_init(&o->refs, 1);
+    o->pool = k;
+    o->next = NULL;
+    o->frame = 0;
+    o->len = len;
+    memcpy(o->data, data, len);
+    return o;
+}
+
+/* Drops a reference to pooled text. Caller holds the session lock. */
+static void ReleaseText(struct Session *s, struct Outgoing *o) {
+    if (atomic_fetch_sub(&o->refs, 1) != 1) return;
+    if (s->text_pool_len[o->pool] == TEXT_POOL_KEEP) {
+        free(o);
+        return;
+    }
+    o->next = s->text_pool[o->pool];
+    s->text_pool[o->pool] = o;
+    s->text_pool_len[o->pool]++;
+}
+
+/* Doubles c's text queue. Caller holds the session lock. */
+static int GrowText(struct SessionClient *c) {
+    unsigned cap = c->text_cap ? c->text_cap * 2 : 64;
+    unsigned n = c->text_tail - c->text_head;
+    struct Outgoing **q;
+    if (cap > CLIENT_QUEUE_LEN) return -1;
+    if (!(q = (struct Outgoing **)malloc(cap * sizeof(*q)))) return -1;
+    for (unsigned i = 0; i < n; i++)
+        q[i] = c->text[(c->text_head + i) & (c->text_cap - 1)];
+    free(c->text);
+    c->text = q;
+    c->text_cap = cap;
+    c->text_head = 0;
+    c->text_tail = n;
+    return 0;
+}
+
+/* Queue a text message for c. Caller holds the session lock. A client
+   that falls CLIENT_QUEUE_MAX behind loses messages rather than stall
+   the guest for everyone else. */
+static void QueueText(struct SessionClient *c, struct Outgoing *o) {
+    if (c->closing) return;
+    if (!o || c->text_bytes + o->len > CLIENT_QUEUE_MAX ||
+        (c->text_tail - c->text_head == c->text_cap && GrowText(c))) {
+        c->text_dropped++;
+        return;
+    }
+    atomic_fetch_add(&o->refs, 1);
+    c->text[c->text_tail++ & (c->text_cap - 1)] = o;
+    c->text_bytes += o->len;
+    pthread_cond_signal(&c->cond);
+}
+
+/* A client's writer: sends queued text in order, and each frame the pump
+   hands over, recording frame sends for the client's rate control. */
+static void *ClientWriter(void *arg) {
+    struct SessionClient *c = (struct SessionClient *)arg;
+    struct Session *s = c->session;
+    struct mg_websocket_deflate_stats st;
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (!c->closing && c->text_head == c->text_tail && !c->frame)
+            pthread_cond_wait(&c->cond, &s->lock);
+        if (c->closing) break;
+        struct Outgoing *o;
+        if (c->text_head != c->text_tail) {
+            o = c->text[c->text_head++ & (c->text_cap - 1)];
+            c->text_bytes -= o->len;
+            pthread_mutex_unlock(&s->lock);
+            mg_websocket_write(c->conn, MG_WEBSOCKET_OPCODE_TEXT,
+                               (const char *)o->data, o->len);
+            int ok = mg_websocket_get_deflate_stats(c->conn, &st);
+            pthread_mutex_lock(&s->lock);
+            ReleaseText(s, o);
+            c->deflate_ok = ok;
+            if (ok) c->deflate = st;
+            continue;
+        }
+        o = c->frame;
+        c->frame = NULL;
+        pthread_mutex_unlock(&s->lock);
+        int64_t t0 = StreamNowNs();
+        /* JPEG doesn't deflate */
+        mg_websocket_write_uncompressed(c->conn, MG_WEBSOCKET_OPCODE_BINARY,
+                                        (const char *)o->data, o->len);
+        int64_t t1 = StreamNowNs();
+        int ok = mg_websocket_get_deflate_stats(c->conn, &st);
+        pthread_mutex_lock(&s->lock);
+        StreamClientSent(&c->stream, o->frame, o->len, t1, t1 - t0);
+        c->busy = 0;
+        c->deflate_ok = ok;
+        if (ok) c->deflate = st;
+        Unref(o);
+        Wake(s);  /* there may be a newer frame for us */
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/* Move the guest's queued messages from the ring to every client's
+   writer, one shared buffer per message. Messages sent while nobody is
+   watching are discarded. */
+static void DeliverMessages(struct Session *s) {
+    struct SessionMsgRing *r = &s->shared->to_browser;
+    unsigned char *rec;
+    uint32_t len;
+    int any = 0;
+    pthread_mutex_lock(&s->lock);
+    while ((rec = MsgPeek(r, &len))) {
+        if (s->clients) {
+            struct Outgoing *o = NewText(s, rec + 4, len);
+            for (struct SessionClient *c = s->clients; c; c = c->next)
+                QueueText(c, o);
+            if (o) ReleaseText(s, o);
+        }
+        MsgPop(r, len);
+        any = 1;
+    }
+    pthread_mutex_unlock(&s->lock);
+    /* a WS_SEND may be waiting for room */
+    if (any) (void)!write(s->events, "", 1);
+}
+
+static void *SessionPump(void *arg) {
+    struct Session *s = (struct Session *)arg;
+    char buf[256];
+    char msg[64];
+    int status = 0;
+    for (;;) {
+        DeliverMessages(s);
+        int timeout = DeliverFrames(s);
+        pthread_mutex_lock(&s->lock);
+        if (s->stopping) {
+            if (StreamNowNs() - s->stop_ns > KILL_GRACE_NS) kill(s->pid, SIGKILL);
+            if (timeout > 100) timeout = 100;
+        }
+        pthread_mutex_unlock(&s->lock);
+        struct pollfd pfd[2] = {
+            { s->doorbell, POLLIN, 0 },
+            { s->wake[0], POLLIN, 0 },
+        };
+        if (poll(pfd, 2, timeout) < 0 && errno != EINTR) break;
+        if (pfd[1].revents & POLLIN) (void)!read(s->wake[0], buf, sizeof(buf));
+        if (pfd[0].revents & (POLLIN | POLLHUP)) {
+            ssize_t n = read(s->doorbell, buf, sizeof(buf));
+            PullFrame(s);
+            if (atomic_load(&s->shared->to_guest.waiting)) {
+                pthread_mutex_lock(&s->lock);
+                pthread_cond_broadcast(&s->room);
+                pthread_mutex_unlock(&s->lock);
+            }
+            if (!n || (n < 0 && errno != EAGAIN && errno != EINTR)) break;
+        }
+    }
+
+    /* Guest exited: reap it and tell its clients */
+    while (waitpid(s->pid, &status, 0) < 0 && errno == EINTR) {}
+    PullFrame(s);
+    DeliverMessages(s);
+    DeliverFrames(s);
+    pthread_mutex_lock(&s->lock);
+    s->exited = 1;
+    s->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    pthread_cond_broadcast(&s->room);
+    snprintf(msg, sizeof(msg), "{\"exit\":%d}", s->status);
+    struct Outgoing *o = NewText(s, msg, strlen(msg));
+    for (struct SessionClient *c = s->clients; c; c = c->next)
+        QueueText(c, o);
+    if (o) ReleaseText(s, o);
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_mutex_lock(&s_lock);
+    for (struct Session **p = &s_sessions; *p; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s_lock);
+    SessionRelease(s);
+    return NULL;
+}
+
+/* The guest inherits every descriptor the web server has open
+   (listening socket, client sockets, other sessions' pipes). Drop them
+   so other sessions still see EOF when their own guest exits. */
+static void CloseInheritedFds(int keep1, int keep2) {
+    long max = sysconf(_SC_OPEN_MAX);
+    if (max < 0 || max > 4096) max = 4096;
+    for (int fd = 3; fd < max; fd++) {
+        if (fd != keep1 && fd != keep2) close(fd);
+    }
+}
+
+struct Session *SessionStart(const char *name) {
+    struct Session *s;
+    int bell[2], events[2];
+    pthread_t th;
+    pthread_attr_t attr;
+
+    if (!s_launcher || !IsValidName(name)) return NULL;
+    if (!(s = (struct Session *)calloc(1, sizeof(*s)))) return NULL;
+    s->doorbell = s->events = s->wake[0] = s->wake[1] = -1;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->room, &ca);
+    pthread_condattr_destroy(&ca);
+    snprintf(s->name, sizeof(s->name), "%s", name);
+
+    s->shared = (struct SessionShared *)mmap(
+        NULL, sizeof(struct SessionShared), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s->shared == MAP_FAILED) {
+        s->shared = NULL;
+        FreeSession(s);
+        return NULL;
+    }
+    if (pipe(s->wake)) {
+        s->wake[0] = s->wake[1] = -1;
+        FreeSession(s);
+        return NULL;
+    }
+    fcntl(s->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(s->wake[1], F_SETFL, O_NONBLOCK);
+    if (pipe(events)) {
+        FreeSession(s);
+        return NULL;
+    }
+    s->events = events[1];
+    fcntl(events[0], F_SETFL, O_NONBLOCK);
+    fcntl(events[1], F_SETFL, O_NONBLOCK);
+    if (pipe(bell)) {
+        close(events[0]);
+        FreeSession(s);
+        return NULL;
+    }
+    fcntl(bell[0], F_SETFL, O_NONBLOCK);
+    fcntl(bell[1], F_SETFL, O_NONBLOCK);
+
+    s->pid = fork();
+    if (s->pid < 0) {
+        close(bell[0]);
+        close(bell[1]);
+        close(events[0]);
+        FreeSession(s);
+        return NULL;
+    }
+    if (s->pid == 0) {
+        char *argv[] = { (char *)"portator", (char *)"run", s->name, NULL };
+        CloseInheritedFds(bell[1], events[0]);
+        s_guest = s->shared;
+        s_guest_doorbell = bell[1];
+        s_guest_events = events[0];
+        _exit(s_launcher(3, argv));
+    }
+    close(bell[1]);
+    close(events[0]);
+    s->doorbell = bell[0];
+
+    pthread_mutex_lock(&s_lock);
+    s->id = s_next_id++;
+    s->refs = 2;  /* caller + pump */
+    s->next = s_sessions;
+    s_sessions = s;
+    pthread_mutex_unlock(&s_lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&th, &attr, SessionPump, s)) {
+        /* no pump: stop the guest and unlink the session ourselves */
+        kill(s->pid, SIGKILL);
+        while (waitpid(s->pid, NULL, 0) < 0 && errno == EINTR) {}
+        pthread_mutex_lock(&s_lock);
+        for (struct Session **p = &s_sessions; *p; p = &(*p)->next) {
+            if (*p == s) {
+                *p = s->next;
+                break;
+            }
+        }
+        s->refs = 1;
+        pthread_mutex_unlock(&s_lock);
+        SessionRelease(s);
+        s = NULL;
+    }
+    pthread_attr_destroy(&attr);
+    return s;
+}
+
+static void StopLocked(struct Session *s) {
+    if (s->stopping || s->exited) return;
+    s->stopping = 1;
+    s->stop_ns = StreamNowNs();
+    kill(s->pid, SIGTERM);
+}
+
+void SessionStopIfIdle(struct Session *s) {
+    pthread_mutex_lock(&s->lock);
+    if (!s->clients) StopLocked(s);
+    pthread_mutex_unlock(&s->lock);
+    Wake(s);
+}
+
+struct SessionClient *SessionAttach(struct Session *s,
+                                    struct mg_connection *conn) {
+    struct SessionClient *c;
+    char msg[128];
+    if (!(c = (struct SessionClient *)calloc(1, sizeof(*c)))) return NULL;
+    c->session = s;
+    c->conn = conn;
+    StreamClientInit(&c->stream, StreamNowNs());
+    pthread_cond_init(&c->cond, NULL);
+    if (pthread_create(&c->writer, NULL, ClientWriter, c)) {
+        pthread_cond_destroy(&c->cond);
+        free(c);
+        return NULL;
+    }
+    pthread_mutex_lock(&s_lock);
+    s->refs++;
+    pthread_mutex_unlock(&s_lock);
+    pthread_mutex_lock(&s->lock);
+    c->id = ++s->next_client;
+    pthread_mutex_unlock(&s->lock);
+    /* the writer has nothing to send until c is listed */
+    snprintf(msg, sizeof(msg), "{\"session\":%d,\"client\":%d,\"name\":\"%s\"}",
+             s->id, c->id, s->name);
+    mg_websocket_write(conn, MG_WEBSOCKET_OPCODE_TEXT, msg, strlen(msg));
+    c->deflate_ok = mg_websocket_get_deflate_stats(conn, &c->deflate);
+    pthread_mutex_lock(&s->lock);
+    c->next = s->clients;
+    s->clients = c;
+    if (s->exited) {
+        /* the pump only told the clients listed when the guest exited */
+        snprintf(msg, sizeof(msg), "{\"exit\":%d}", s->status);
+        struct Outgoing *o = NewText(s, msg, strlen(msg));
+        QueueText(c, o);
+        if (o) ReleaseText(s, o);
+    }
+    pthread_mutex_unlock(&s->lock);
+    Wake(s);
+    return c;
+}
+
+void SessionDetach(struct SessionClient *c) {
+    struct Session *s = c->session;
+    pthread_mutex_lock(&s->lock);
+    for (struct SessionClient **p = &s->clients; *p; p = &(*p)->next) {
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+    }
+    if (!s->clients) StopLocked(s);
+    c->closing = 1;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&s->lock);
+    Wake(s);
+    /* the pump finds clients by id, so once unlisted only the writer
+       can still be using c */
+    pthread_join(c->writer, NULL);
+    pthread_mutex_lock(&s->lock);
+    while (c->text_head != c->text_tail)
+        ReleaseText(s, c->text[c->text_head++ & (c->text_cap - 1)]);
+    pthread_mutex_unlock(&s->lock);
+    free(c->text);
+    Unref(c->frame);
+    pthread_cond_destroy(&c->cond);
+    free(c);
+    SessionRelease(s);
+}
+
+static int RingPush(struct SessionShared *sh, const struct SessionEvent *e) {
+    unsigned tail = atomic_load_explicit(&sh->ev_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&sh->ev_head, memory_order_acquire);
+    if (tail - head >= SESSION_EVENT_RING) return 0;
+    sh->ev[tail & (SESSION_EVENT_RING - 1)] = *e;
+    atomic_store_explicit(&sh->ev_tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+static struct SessionEvent UnpackMove(uint64_t xy) {
+    struct SessionEvent e = { SESSION_MOUSE_MOVE, (int32_t)(uint32_t)xy,
+                              (int32_t)(uint32_t)(xy >> 32), 0, 0 };
+    return e;
+}
+
+/* Queue one event for the guest. Caller holds the session lock, which
+   makes this thread the ring's only producer. */
+static void PushEvent(struct SessionShared *sh, const struct SessionEvent *e) {
+    /* A collapsed move is older than e: get it into the ring first */
+    if (atomic_load_explicit(&sh->ev_move_pending, memory_order_acquire)) {
+        unsigned tail = atomic_load_explicit(&sh->ev_tail, memory_order_relaxed);
+        unsigned head = atomic_load_explicit(&sh->ev_head, memory_order_acquire);
+        if (tail - head < SESSION_EVENT_RING &&
+            atomic_exchange(&sh->ev_move_pending, 0)) {
+            struct SessionEvent mv = UnpackMove(atomic_load(&sh->ev_move_xy));
+            RingPush(sh, &mv);
+        }
+    }
+    if (!atomic_load_explicit(&sh->ev_move_pending, memory_order_acquire) &&
+        RingPush(sh, e))
+        return;
+    if (e->type == SESSION_MOUSE_MOVE) {
+        atomic_store(&sh->ev_move_xy,
+                     (uint64_t)(uint32_t)e->y << 32 | (uint32_t)e->x);
+        atomic_store_explicit(&sh->ev_move_pending, 1, memory_order_release);
+    } else {
+        atomic_fetch_add(&sh->ev_dropped, 1);
+    }
+}
+
+void SessionClientMessage(struct SessionClient *c, const char *data,
+                          size_t len) {
+    struct Session *s = c->session;
+    const unsigned char *p = (const unsigned char *)data;
+    if (len < 4) return;
+    switch (p[0]) {
+        case 'A':  /* frame ack: 'A' 0 0 0 | seq */
+            if (len < 8) return;
+            pthread_mutex_lock(&s->lock);
+            StreamClientAck(&c->stream, GetLe32(p + 4), StreamNowNs());
+            pthread_mutex_unlock(&s->lock);
+            Wake(s);
+            break;
+        case 'E':  /* input: 'E' 0 0 0 | PortatorEvent... */
+            pthread_mutex_lock(&s->lock);
+            for (size_t i = 4; i + sizeof(struct SessionEvent) <= len;
+                 i += sizeof(struct SessionEvent)) {
+                struct SessionEvent e = {
+                    GetLe32(p + i), (int32_t)GetLe32(p + i + 4),
+                    (int32_t)GetLe32(p + i + 8), (int32_t)GetLe32(p + i + 12),
+                    (int32_t)GetLe32(p + i + 16),
+                };
+                if (!s->exited) PushEvent(s->shared, &e);
+            }
+            pthread_mutex_unlock(&s->lock);
+            /* one doorbell per burst; a full pipe is already rung */
+            (void)!write(s->events, "", 1);
+            break;
+        default:
+            break;
+    }
+}
+
+void SessionClientText(struct SessionClient *c, const char *data, size_t len) {
+    struct Session *s = c->session;
+    struct SessionMsgRing *r = &s->shared->to_guest;
+    struct timespec give_up;
+    unsigned char *p = NULL;
+    int waiting = 0, timedout = 0;
+    if (len > SESSION_MSG_MAX) {
+        atomic_fetch_add(&r->dropped, 1);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &give_up);
+    give_up.tv_sec += MSG_BACKLOG_NS / 1000000000;
+    /* While the guest is behind, hold up this client's reader thread so
+       TCP pushes back on the browser instead of us buffering. The guest
+       rings the doorbell when it takes messages while anyone waits. */
+    pthread_mutex_lock(&s->lock);
+    while (!s->exited && !(p = MsgReserve(r, len)) && !timedout) {
+        if (!waiting) {
+            atomic_fetch_add(&r->waiting, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            waiting = 1;
+            continue;  /* the guest may have made room meanwhile */
+        }
+        timedout = pthread_cond_timedwait(&s->room, &s->lock, &give_up) ==
+                   ETIMEDOUT;
+    }
+    if (waiting) atomic_fetch_sub(&r->waiting, 1);
+    if (p) {
+        memcpy(p, data, len);
+        MsgCommit(r, len);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (p) {
+        (void)!write(s->events, "", 1);
+    } else {
+        atomic_fetch_add(&r->dropped, 1);
+    }
+}
+
+/* A client's permessage-deflate settings and what it saved, or null.
+   The writer copies these after each send: asking the connection here
+   would wait behind a blocked write. */
+static void DeflateJson(const struct SessionClient *c, char *buf, size_t size) {
+    const struct mg_websocket_deflate_stats *st = &c->deflate;
+    if (!c->deflate_ok) {
+        snprintf(buf, size, "null");
+        return;
+    }
+    snprintf(buf, size,
+             "{\"window_bits\":%d,\"client_window_bits\":%d,"
+             "\"mem_level\":%d,\"context_takeover\":%s,\"sent\":%llu,"
+             "\"sent_compressed\":%llu,\"ratio\":%.2f,\"received\":%llu,"
+             "\"received_compressed\":%llu}",
+             st->window_bits, st->client_window_bits, st->mem_level,
+             st->context_takeover ? "true" : "false", st->sent_bytes,
+             st->sent_compressed,
+             st->sent_compressed ? (double)st->sent_bytes / st->sent_compressed
+                                 : 0.0,
+             st->received_bytes, st->received_compressed);
+}
+
+char *SessionListJson(void) {
+    struct JsonBuf b = { 0 };
+    char client[512], deflate[320];
+    struct StreamLimits l;
+    struct Session **list = NULL;
+    int n = 0;
+    StreamGetLimits(&l);
+    Appendf(&b, "{\"limits\":{\"quality\":[%d,%d],\"fps\":[%d,%d],"
+                "\"scale\":[%d,%d]},\"sessions\":[",
+            l.quality_min, l.quality_max, l.fps_min, l.fps_max,
+            l.scale_min, l.scale_max);
+    /* take references under s_lock, then visit each session on its own
+       so a busy session never holds up the list (or the other way) */
+    pthread_mutex_lock(&s_lock);
+    for (struct Session *s = s_sessions; s; s = s->next) n++;
+    if (n && !(list = (struct Session **)malloc(n * sizeof(*list)))) b.oom = 1;
+    n = 0;
+    for (struct Session *s = s_sessions; s && list; s = s->next) {
+        s->refs++;
+        list[n++] = s;
+    }
+    pthread_mutex_unlock(&s_lock);
+    for (int i = 0; i < n; i++) {
+        struct Session *s = list[i];
+        pthread_mutex_lock(&s->lock);
+        Appendf(&b, "%s{\"id\":%d,\"name\":\"%s\",\"pid\":%d,\"frame\":%u,"
+                    "\"width\":%d,\"height\":%d,\"events_dropped\":%u,"
+                    "\"messages_dropped\":%u,\"clients\":[",
+                i ? "," : "", s->id, s->name, (int)s->pid,
+                s->frame, s->fb_w, s->fb_h,
+                atomic_load(&s->shared->ev_dropped),
+                atomic_load(&s->shared->to_guest.dropped));
+        for (struct SessionClient *c = s->clients; c; c = c->next) {
+            StreamClientJson(&c->stream, client, sizeof(client));
+            DeflateJson(c, deflate, sizeof(deflate));
+            Appendf(&b, "%s{\"id\":%d,\"stream\":%s,\"deflate\":%s,"
+                        "\"queued_bytes\":%zu,\"messages_dropped\":%u}",
+                    c == s->clients ? "" : ",", c->id, client, deflate,
+                    c->text_bytes, c->text_dropped);
+        }
+        Appendf(&b, "]}");
+        pthread_mutex_unlock(&s->lock);
+        SessionRelease(s);
+    }
+    free(list);
+    Appendf(&b, "]}");
+    if (b.oom) {
+        free(b.p);
+        return NULL;
+    }
+    return b.p;
+}
+
+struct SessionShared *SessionGuest(void) {
+    return s_guest;
+}
+
+static int64_t Deadline(int timeout_ms) {
+    return timeout_ms < 0 ? -1 : StreamNowNs() + timeout_ms * 1000000LL;
+}
+
+/* Drain the doorbell before looking at a ring, so a push that lands
+   after the look is sure to leave a byte for GuestWait to see. */
+static void DrainEvents(void) {
+    char buf[64];
+    while (read(s_guest_events, buf, sizeof(buf)) > 0) {}
+}
+
+/* Sleep until the web server rings the guest's doorbell. Returns -1 once
+   the deadline has passed, on a signal for the guest, or if the web
+   server is gone. Sleeps are capped so a ring drained by another guest
+   thread costs latency rather than a hang. */
+static int GuestWait(int64_t deadline) {
+    int ms = GUEST_WAIT_MS;
+    if (deadline >= 0) {
+        int64_t left = (deadline - StreamNowNs() + 999999) / 1000000;
+        if (left <= 0) return -1;
+        if (left < ms) ms = (int)left;
+    }
+    struct pollfd pfd = { s_guest_events, POLLIN, 0 };
+    if (poll(&pfd, 1, ms) < 0) return -1;
+    if (pfd.revents & (POLLHUP | POLLERR)) return -1;
+    return 0;
+}
+
+int SessionGuestPollEvents(struct SessionEvent *out, int max, int timeout_ms) {
+    struct SessionShared *sh = s_guest;
+    int64_t deadline = Deadline(timeout_ms);
+    int n = 0;
+    if (!sh || max <= 0) return 0;
+    for (;;) {
+        DrainEvents();
+        pthread_mutex_lock(&s_guest_poll_lock);
+        unsigned head = atomic_load_explicit(&sh->ev_head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(&sh->ev_tail, memory_order_acquire);
+        while (n < max && head != tail)
+            out[n++] = sh->ev[head++ & (SESSION_EVENT_RING - 1)];
+        atomic_store_explicit(&sh->ev_head, head, memory_order_release);
+        if (n < max && head == tail &&
+            atomic_exchange(&sh->ev_move_pending, 0))
+            out[n++] = UnpackMove(atomic_load(&sh->ev_move_xy));
+        pthread_mutex_unlock(&s_guest_poll_lock);
+        if (n || !timeout_ms || GuestWait(deadline) < 0) return n;
+    }
+}
+
+int SessionGuestSend(size_t len, SessionCopyIn copy, void *ctx,
+                     int timeout_ms) {
+    struct SessionShared *sh = s_guest;
+    int64_t deadline = Deadline(timeout_ms);
+    if (!sh || len > SESSION_MSG_MAX) return -1;
+    for (;;) {
+        DrainEvents();
+        pthread_mutex_lock(&s_guest_send_lock);
+        unsigned char *p = MsgReserve(&sh->to_browser, len);
+        int rc = -1;
+        if (p && !copy(ctx, p, len)) {
+            MsgCommit(&sh->to_browser, len);
+            rc = 0;
+        }
+        pthread_mutex_unlock(&s_guest_send_lock);
+        if (p) return rc;
+        /* full: make sure the pump is draining, then wait for room */
+        SessionGuestNotify();
+        if (!timeout_ms || GuestWait(deadline) < 0) return -1;
+    }
+}
+
+long SessionGuestRecv(size_t cap, SessionCopyOut copy, void *ctx,
+                      int timeout_ms) {
+    struct SessionShared *sh = s_guest;
+    int64_t deadline = Deadline(timeout_ms);
+    if (!sh) return 0;
+    for (;;) {
+        unsigned char *rec;
+        uint32_t len;
+        long used = 0;
+        DrainEvents();
+        pthread_mutex_lock(&s_guest_recv_lock);
+        while ((rec = MsgPeek(&sh->to_guest, &len))) {
+            size_t size = RecordSize(len);
+            if (!cap) {
+                used = size;
+                break;
+            }
+            if (used + size > cap) {
+                if (!used) used = -1;
+                break;
+            }
+            if (copy(ctx, used, rec, size)) {
+                if (!used) used = -1;
+                break;
+            }
+            MsgPop(&sh->to_guest, len);
+            used += size;
+        }
+        pthread_mutex_unlock(&s_guest_recv_lock);
+        if (used > 0 && cap) {
+            /* a browser's reader thread may be waiting for room */
+            atomic_thread_fence(memory_order_seq_cst);
+            if (atomic_load(&sh->to_guest.waiting)) SessionGuestNotify();
+        }
+        if (used || !timeout_ms || GuestWait(deadline) < 0) return used;
+    }
+}
+
+int SessionGuestWait(int timeout_ms) {
+    if (!s_guest) return -1;
+    return GuestWait(Deadline(timeout_ms));
+}
+
+void SessionGuestNotify(void) {
+    /* a full pipe already means "something changed" */
+    if (s_guest_doorbell >= 0) (void)!write(s_guest_doorbell, "", 1);
+}
+
+uint32_t *SessionGuestBeginFrame(uint32_t w, uint32_t h) {
+    struct SessionShared *sh = s_guest;
+    if (!sh || !w || !h || w > SESSION_FB_MAX_W || h > SESSION_FB_MAX_H)
+        return NULL;
+    unsigned seq = atomic_load_explicit(&sh->fb_seq, memory_order_relaxed);
+    atomic_store_explicit(&sh->fb_seq, seq | 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    sh->fb_w = w;
+    sh->fb_h = h;
+    return sh->fb;
+}
+
+void SessionGuestEndFrame(void) {
+    struct SessionShared *sh = s_guest;
+    unsigned seq = atomic_load_explicit(&sh->fb_seq, memory_order_relaxed);
+    atomic_store_explicit(&sh->fb_seq, (seq | 1) + 1, memory_order_release);
+    SessionGuestNotify();
+}
@@ -0,0 +1,162 @@
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A session is one guest launched by `portator web` for one or more
+   browser clients. The guest runs in a forked child; the two processes
+   share a block of memory and a doorbell pipe the guest rings after
+   publishing something (e.g. a frame) for the web server to pick up. */
+
+#define SESSION_FB_MAX_W 1920
+#define SESSION_FB_MAX_H 1080
+#define SESSION_EVENT_RING 1024    /* power of two */
+#define SESSION_POLL_MAX 256       /* events returned per POLL */
+
+#define SESSION_MOUSE_MOVE 5       /* PORTATOR_MOUSE_MOVE */
+
+#define SESSION_MSG_RING (1 << 20)  /* bytes, power of two */
+#define SESSION_MSG_MAX (SESSION_MSG_RING / 4)
+#define SESSION_MSG_BATCH 64        /* messages per WS_SEND */
+
+/* Same layout as struct PortatorEvent in include/portator.h */
+struct SessionEvent {
+    uint32_t type;
+    int32_t x, y;
+    int32_t key;
+    int32_t button;
+};
+
+/* WebSocket messages between the guest and its browsers, as records of
+   a little-endian u32 length and the payload, padded to four bytes --
+   the same layout WS_RECV hands the guest. A length of ~0 means the
+   rest of the ring is unused and the next record starts at offset 0.
+   head and tail are free-running byte counts. */
+struct SessionMsgRing {
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_uint dropped;
+    atomic_uint waiting;           /* producers waiting for room */
+    unsigned char data[SESSION_MSG_RING];
+};
+
+/* Memory shared between the web server and the guest process */
+struct SessionShared {
+    /* Input events. A lock-free single-producer/single-consumer ring:
+       the web server is the only producer (its client threads take the
+       session lock) and the guest's POLL is the only consumer. When the
+       ring is full, mouse moves collapse into ev_move_xy instead of being
+       dropped; the guest delivers that position after the ring drains. */
+    atomic_uint ev_head;           /* next slot the guest reads */
+    atomic_uint ev_tail;           /* next slot the web server fills */
+    atomic_uint ev_move_pending;
+    atomic_ullong ev_move_xy;      /* x in the low half, y in the high */
+    atomic_uint ev_dropped;        /* non-move events lost to a full ring */
+    struct SessionEvent ev[SESSION_EVENT_RING];
+
+    /* Text messages: browsers -> guest is filled by the client threads
+       under the session lock; guest -> browsers is drained by the pump,
+       which copies each message once into a pooled buffer that every
+       client's writer thread then sends. */
+    struct SessionMsgRing to_guest;
+    struct SessionMsgRing to_browser;
+
+    /* Framebuffer, published by PORTATOR_SYS_PRESENT under a seqlock:
+       fb_seq is odd while the guest is writing, and fb_seq / 2 is the
+       frame number. Pixels are 0x00RRGGBB. */
+    atomic_uint fb_seq;
+    uint32_t fb_w, fb_h;
+    uint32_t fb[SESSION_FB_MAX_W * SESSION_FB_MAX_H];
+};
+
+struct mg_connection;
+struct Session;
+struct SessionClient;
+
+/* Runs a guest in the forked child. Receives "portator" "run" <name>. */
+typedef int (*SessionLauncher)(int argc, char **argv);
+
+void SessionSetLauncher(SessionLauncher launcher);
+
+/* Launch a new session running the named guest.
+   Returns a referenced session, or NULL on error. */
+struct Session *SessionStart(const char *name);
+
+/* Look up a running session by id. Returns a referenced session or NULL. */
+struct Session *SessionFind(int id);
+
+void SessionRelease(struct Session *s);
+
+/* Attach a browser connection to the session. The client holds its own
+   reference on the session until SessionDetach. Sends a hello message
+   identifying the session and client. */
+struct SessionClient *SessionAttach(struct Session *s,
+                                    struct mg_connection *conn);
+
+/* Detach a client. The guest is stopped once its last client leaves. */
+void SessionDetach(struct SessionClient *c);
+
+/* Stop the guest if no client ever attached (e.g. a failed handshake). */
+void SessionStopIfIdle(struct Session *s);
+
+/* Handle a binary WebSocket message from a client: frame acks ('A')
+   and batches of input events ('E'). */
+void SessionClientMessage(struct SessionClient *c, const char *data,
+                          size_t len);
+
+/* Queue a text WebSocket message from a client for the guest. */
+void SessionClientText(struct SessionClient *c, const char *data, size_t len);
+
+/* Build {"sessions":[...]} describing every session and the current
+   stream settings and WebSocket compression of each client. Caller must
+   free() the result. */
+char *SessionListJson(void);
+
+/* Guest side: the shared block this guest process publishes to,
+   or NULL when it was not launched by the web server. */
+struct SessionShared *SessionGuest(void);
+
+/* Guest side: move up to max pending input events into out, waiting up
+   to timeout_ms (-1 = forever) for the first one. Returns the number of
+   events, 0 on timeout or when no session is attached. */
+int SessionGuestPollEvents(struct SessionEvent *out, int max, int timeout_ms);
+
+/* Copies between guest memory and the message rings */
+typedef int (*SessionCopyIn)(void *ctx, void *dst, size_t len);
+typedef int (*SessionCopyOut)(void *ctx, size_t off, const void *src,
+                              size_t len);
+
+/* Guest side: queue a len-byte message for every browser, having copy
+   write it directly into the ring. Waits up to timeout_ms for room.
+   Returns 0, or -1 if the message is too large, the wait timed out or
+   the copy failed. The caller rings the doorbell once per batch. */
+int SessionGuestSend(size_t len, SessionCopyIn copy, void *ctx,
+                     int timeout_ms);
+
+/* Guest side: hand copy as many queued records (u32 length, payload,
+   padding) as fit in cap bytes, waiting up to timeout_ms for the first.
+   Returns the bytes handed over, 0 if none arrived, or -1 if the next
+   record does not fit or the copy failed. With cap == 0, returns the
+   size of the next record instead (probe/fill). */
+long SessionGuestRecv(size_t cap, SessionCopyOut copy, void *ctx,
+                      int timeout_ms);
+
+/* Guest side: sleep until the web server rings the guest (input,
+   messages, or room to send) or timeout_ms passes. Returns 0 if rung,
+   -1 on timeout or a signal. The doorbell is only drained by the calls
+   above, so wake-ups may be spurious until one of them runs. */
+int SessionGuestWait(int timeout_ms);
+
+/* Guest side: tell the web server something was published. */
+void SessionGuestNotify(void);
+
+/* Guest side: open a w x h frame for writing. Returns the pixel buffer
+   to fill, or NULL if no session is attached or the size is too large.
+   Must be followed by SessionGuestEndFrame, which publishes it. */
+uint32_t *SessionGuestBeginFrame(uint32_t w, uint32_t h);
+void SessionGuestEndFrame(void);
+
+#endif /* SESSION_H_ */
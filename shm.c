@@ -0,0 +1,217 @@
+#include "shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __COSMOPOLITAN__
+#include <cosmo.h>
+#include <stdatomic.h>
+#else
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "pidlock.h"
+
+/* A name in use, with the processes holding its memfd. The inode tells a
+   holder's fd apart from a later file that reused its number. */
+struct Region {
+    char name[SHM_NAME_MAX];       /* "" if the entry is free */
+    uint64_t size;
+    uint64_t ino;
+    int32_t pid[SHM_HOLDERS];      /* 0 if the holder entry is free */
+    int32_t fd[SHM_HOLDERS];
+};
+
+/* Shared with every forked child, under a PidLock */
+struct Registry {
+    int lock;
+    struct Region regions[SHM_REGIONS];
+};
+
+static struct Registry *s_reg;
+
+/* What this process holds, by region. Entries copied into a forked
+   child carry the parent's pid and count as not held. */
+static struct {
+    pthread_mutex_t lock;
+    struct {
+        int pid;
+        int refs;
+        int fd;
+    } held[SHM_REGIONS];
+} s_local = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+int ShmInit(void) {
+    void *p;
+    if (s_reg) return 0;
+    p = mmap(NULL, sizeof(*s_reg), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return -1;
+    s_reg = (struct Registry *)p;
+    return 0;
+}
+
+static int Alive(int pid) {
+    return pid == getpid() || !kill(pid, 0) || errno != ESRCH;
+}
+
+/* Forget holders that have exited, and the region if none are left */
+static void Prune(struct Region *r) {
+    int live = 0;
+    for (int i = 0; i < SHM_HOLDERS; i++) {
+        if (r->pid[i] && !Alive(r->pid[i])) r->pid[i] = 0;
+        if (r->pid[i]) live = 1;
+    }
+    if (!live) r->name[0] = 0;
+}
+
+static int AddHolder(struct Region *r, int fd) {
+    for (int i = 0; i < SHM_HOLDERS; i++) {
+        if (!r->pid[i]) {
+            r->pid[i] = getpid();
+            r->fd[i] = fd;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Open a region's memfd through a process that has it open */
+static int Reopen(const struct Region *r) {
+    char path[64];
+    struct stat st;
+    int fd;
+    for (int i = 0; i < SHM_HOLDERS; i++) {
+        if (!r->pid[i]) continue;
+        snprintf(path, sizeof(path), "/proc/%d/fd/%d", r->pid[i], r->fd[i]);
+        if ((fd = open(path, O_RDWR | O_CLOEXEC)) == -1) continue;
+        if (!fstat(fd, &st) && (uint64_t)st.st_ino == r->ino) return fd;
+        close(fd);
+    }
+    return -1;
+}
+
+static int Create(struct Region *r, const char *name, uint64_t size) {
+    struct stat st;
+    int fd;
+    if ((fd = memfd_create(name, MFD_CLOEXEC)) == -1) return -1;
+    if (ftruncate(fd, size) || fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+    memset(r, 0, sizeof(*r));
+    strcpy(r->name, name);
+    r->size = size;
+    r->ino = st.st_ino;
+    return fd;
+}
+
+int ShmAcquire(const char *name, uint64_t size, int create,
+               uint64_t *out_size) {
+    struct Region *r, *found = NULL, *empty = NULL;
+    int id = -1, fd = -1, me = getpid();
+    if (!s_reg || !*name || strlen(name) >= SHM_NAME_MAX) return -1;
+    if (create && (!size || size > SHM_SIZE_MAX)) return -1;
+    pthread_mutex_lock(&s_local.lock);
+    PidLock(&s_reg->lock);
+    for (int i = 0; i < SHM_REGIONS; i++) {
+        r = s_reg->regions + i;
+        if (r->name[0]) Prune(r);
+        if (!r->name[0]) {
+            if (!empty) empty = r;
+        } else if (!strcmp(r->name, name)) {
+            found = r;
+        }
+    }
+    if (found && !create) {
+        id = found - s_reg->regions;
+        if (s_local.held[id].pid == me) {
+            s_local.held[id].refs++;
+        } else if ((fd = Reopen(found)) == -1 || AddHolder(found, fd)) {
+            id = -1;
+        }
+    } else if (!found && create && empty &&
+               (fd = Create(empty, name, size)) != -1) {
+        id = empty - s_reg->regions;
+        AddHolder(empty, fd);
+    }
+    if (id != -1 && fd != -1) {
+        s_local.held[id].pid = me;
+        s_local.held[id].refs = 1;
+        s_local.held[id].fd = fd;
+    } else if (fd != -1) {
+        close(fd);
+    }
+    if (id != -1) *out_size = s_reg->regions[id].size;
+    PidUnlock(&s_reg->lock);
+    pthread_mutex_unlock(&s_local.lock);
+    return id;
+}
+
+int ShmFd(int id) {
+    int fd;
+    pthread_mutex_lock(&s_local.lock);
+    fd = s_local.held[id].pid == getpid() ? s_local.held[id].fd : -1;
+    pthread_mutex_unlock(&s_local.lock);
+    return fd;
+}
+
+void ShmRelease(int id) {
+    struct Region *r;
+    int me = getpid();
+    pthread_mutex_lock(&s_local.lock);
+    if (s_local.held[id].pid == me && !--s_local.held[id].refs) {
+        close(s_local.held[id].fd);
+        s_local.held[id].pid = 0;
+        PidLock(&s_reg->lock);
+        r = s_reg->regions + id;
+        for (int i = 0; i < SHM_HOLDERS; i++)
+            if (r->pid[i] == me) r->pid[i] = 0;
+        Prune(r);
+        PidUnlock(&s_reg->lock);
+    }
+    pthread_mutex_unlock(&s_local.lock);
+}
+
+int ShmWait(int *p, int expect, int timeout_ms) {
+    struct timespec ts, *tp = NULL;
+#ifdef __COSMOPOLITAN__
+    if (timeout_ms >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += timeout_ms % 1000 * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        tp = &ts;
+    }
+    return cosmo_futex_wait((atomic_int *)p, expect, PTHREAD_PROCESS_SHARED,
+                            CLOCK_MONOTONIC, tp) ? -1 : 0;
+#else
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = timeout_ms % 1000 * 1000000L;
+        tp = &ts;
+    }
+    return syscall(SYS_futex, p, FUTEX_WAIT, expect, tp, NULL, 0) ? -1 : 0;
+#endif
+}
+
+int ShmWake(int *p, int count) {
+    long rc;
+#ifdef __COSMOPOLITAN__
+    rc = cosmo_futex_wake((atomic_int *)p, count, PTHREAD_PROCESS_SHARED);
+#else
+    rc = syscall(SYS_futex, p, FUTEX_WAKE, count, NULL, NULL, 0);
+#endif
+    return rc < 0 ? 0 : (int)rc;
+}
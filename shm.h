@@ -0,0 +1,43 @@
+#ifndef SHM_H_
+#define SHM_H_
+
+#include <stdint.h>
+
+/* Named shared memory regions for guests (PORTATOR_SYS_SHM), so guests
+   running side by side can hand each other bulk data without it passing
+   through emulated reads and writes. A region is a host memfd; the
+   registry of names lives in memory shared with every guest forked from
+   this process, and records which processes hold each memfd so another
+   can open it through /proc. A region lasts while any process holds it. */
+
+#define SHM_REGIONS 64
+#define SHM_NAME_MAX 64
+#define SHM_HOLDERS 16             /* processes that can have one open */
+#define SHM_SIZE_MAX (1ull << 32)
+
+/* Map the registry. Call before forking any guest; without it there are
+   no regions. Returns 0 or -1. */
+int ShmInit(void);
+
+/* Open the region called name, creating it with size bytes if create is
+   set (which fails if it already exists). Stores its size in *out_size
+   and returns an id for ShmFd and ShmRelease, or -1. Each acquire needs
+   a release. */
+int ShmAcquire(const char *name, uint64_t size, int create,
+               uint64_t *out_size);
+
+/* The memfd for a region acquired by this process */
+int ShmFd(int id);
+
+/* Drop one acquire; the last one in a process closes its memfd */
+void ShmRelease(int id);
+
+/* Futex on a word of a shared region, across processes: sleep while *p
+   equals expect, for up to timeout_ms (-1 for no limit). Returns 0 when
+   woken, or -1 if *p differed, time ran out or a signal came in. */
+int ShmWait(int *p, int expect, int timeout_ms);
+
+/* Wake up to count waiters on p. Returns how many woke. */
+int ShmWake(int *p, int count);
+
+#endif /* SHM_H_ */
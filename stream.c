@@ -0,0 +1,232 @@
+#include "stream.h"
+#include "jpeg.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NS_PER_MS 1000000LL
+#define NS_PER_SEC 1000000000LL
+
+#define ADAPT_INTERVAL_NS (250 * NS_PER_MS)   /* min time between steps */
+#define RECOVER_AFTER_NS (2 * NS_PER_SEC)     /* calm time before stepping up */
+#define ACK_TIMEOUT_NS (2 * NS_PER_SEC)       /* unacked frames are lost */
+#define SLOW_WRITE_NS (50 * NS_PER_MS)        /* socket buffer is full */
+#define RTT_BASELINE_NS (10 * NS_PER_SEC)     /* baseline RTT window */
+
+static struct StreamLimits s_limits = {
+    .quality_min = 20, .quality_max = 85,
+    .fps_min = 5, .fps_max = 30,
+    .scale_min = 1, .scale_max = 4,
+};
+
+static int Clamp(int v, int lo, int hi) {
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+void StreamSetLimits(const struct StreamLimits *limits) {
+    struct StreamLimits l = *limits;
+    l.quality_min = Clamp(l.quality_min, 1, 100);
+    l.quality_max = Clamp(l.quality_max, l.quality_min, 100);
+    l.fps_min = Clamp(l.fps_min, 1, 120);
+    l.fps_max = Clamp(l.fps_max, l.fps_min, 120);
+    l.scale_min = Clamp(l.scale_min, 1, 8);
+    l.scale_max = Clamp(l.scale_max, l.scale_min, 8);
+    s_limits = l;
+}
+
+void StreamGetLimits(struct StreamLimits *limits) {
+    *limits = s_limits;
+}
+
+int StreamParseRange(const char *s, int *lo, int *hi) {
+    char *end;
+    long a = strtol(s, &end, 10);
+    long b = a;
+    if (end == s) return -1;
+    if (*end == '-') {
+        const char *p = end + 1;
+        b = strtol(p, &end, 10);
+        if (end == p) return -1;
+    }
+    if (*end || a <= 0 || b < a) return -1;
+    *lo = (int)a;
+    *hi = (int)b;
+    return 0;
+}
+
+int64_t StreamNowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+void StreamClientInit(struct StreamClient *c, int64_t now) {
+    memset(c, 0, sizeof(*c));
+    c->cur.quality = s_limits.quality_max;
+    c->cur.fps = s_limits.fps_max;
+    c->cur.scale = s_limits.scale_min;
+    c->rtt_min_ns = now;
+    c->last_adapt_ns = now;
+    c->last_pressure_ns = now;
+}
+
+static void DropInflight(struct StreamClient *c, int n) {
+    for (int i = 0; i < n; i++) c->inflight_bytes -= c->inflight[i].bytes;
+    memmove(c->inflight, c->inflight + n,
+            (c->ninflight - n) * sizeof(c->inflight[0]));
+    c->ninflight -= n;
+}
+
+int64_t StreamClientDue(struct StreamClient *c, int64_t now) {
+    /* Frames never acknowledged (tab hidden, link stalled) are written
+       off so the client can recover, but count as heavy congestion. */
+    int stale = 0;
+    while (stale < c->ninflight &&
+           now - c->inflight[stale].sent_ns > ACK_TIMEOUT_NS)
+        stale++;
+    if (stale) {
+        DropInflight(c, stale);
+        c->pressure += 2;
+    }
+    if (c->ninflight >= STREAM_MAX_INFLIGHT ||
+        c->inflight_bytes >= STREAM_MAX_INFLIGHT_BYTES)
+        return -1;
+    int64_t next = c->last_send_ns + NS_PER_SEC / c->cur.fps;
+    return next > now ? next - now : 0;
+}
+
+void StreamClientSent(struct StreamClient *c, uint32_t seq, size_t bytes,
+                      int64_t now, int64_t write_ns) {
+    if (c->ninflight == STREAM_MAX_INFLIGHT) DropInflight(c, 1);
+    c->inflight[c->ninflight].seq = seq;
+    c->inflight[c->ninflight].bytes = (uint32_t)bytes;
+    c->inflight[c->ninflight].sent_ns = now;
+    c->ninflight++;
+    c->inflight_bytes += bytes;
+    c->last_send_ns = now;
+    c->last_frame = seq;
+    c->frames_sent++;
+    c->bytes_sent += bytes;
+    if (write_ns > SLOW_WRITE_NS) c->pressure += 2;
+}
+
+void StreamClientSkipped(struct StreamClient *c, uint32_t frame) {
+    if (c->skip_frame == frame) return;
+    c->skip_frame = frame;
+    c->frames_skipped++;
+    c->pressure++;
+}
+
+void StreamClientAck(struct StreamClient *c, uint32_t seq, int64_t now) {
+    int n = 0;
+    while (n < c->ninflight && (int32_t)(c->inflight[n].seq - seq) <= 0) n++;
+    if (!n) return;
+    double sample = (now - c->inflight[n - 1].sent_ns) / (double)NS_PER_MS;
+    c->frames_acked += n;
+    DropInflight(c, n);
+    if (!c->rtt_ms) {
+        c->rtt_ms = c->rtt_min_ms = sample;
+    } else {
+        c->rtt_ms = c->rtt_ms * 0.8 + sample * 0.2;
+    }
+    /* Let the baseline drift up with the path, not with a queue */
+    if (sample < c->rtt_min_ms || now - c->rtt_min_ns > RTT_BASELINE_NS) {
+        c->rtt_min_ms = sample < c->rtt_ms ? sample : c->rtt_ms;
+        c->rtt_min_ns = now;
+    }
+}
+
+static int StepDown(struct StreamClient *c) {
+    struct StreamSettings *s = &c->cur;
+    if (s->quality > s_limits.quality_min) {
+        s->quality = Clamp(s->quality - 10, s_limits.quality_min, 100);
+    } else if (s->fps > s_limits.fps_min) {
+        s->fps = Clamp(s->fps * 2 / 3, s_limits.fps_min, s->fps);
+    } else if (s->scale < s_limits.scale_max) {
+        s->scale = Clamp(s->scale * 2, 1, s_limits.scale_max);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* Undo degradation in reverse order: resolution, frame rate, quality */
+static int StepUp(struct StreamClient *c) {
+    struct StreamSettings *s = &c->cur;
+    if (s->scale > s_limits.scale_min) {
+        s->scale = Clamp(s->scale / 2, s_limits.scale_min, 8);
+    } else if (s->fps < s_limits.fps_max) {
+        s->fps = Clamp(s->fps * 3 / 2 + 1, 1, s_limits.fps_max);
+    } else if (s->quality < s_limits.quality_max) {
+        s->quality = Clamp(s->quality + 5, 1, s_limits.quality_max);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+void StreamClientAdapt(struct StreamClient *c, int64_t now) {
+    if (now - c->last_adapt_ns < ADAPT_INTERVAL_NS) return;
+    if (c->rtt_ms && c->rtt_ms > c->rtt_min_ms * 2 + 30) c->pressure++;
+    if (c->inflight_bytes >= STREAM_MAX_INFLIGHT_BYTES / 2) c->pressure++;
+    if (c->pressure) {
+        StepDown(c);
+        c->last_pressure_ns = now;
+        c->last_adapt_ns = now;
+    } else if (now - c->last_pressure_ns > RECOVER_AFTER_NS &&
+               now - c->last_adapt_ns > RECOVER_AFTER_NS / 2) {
+        StepUp(c);
+        c->last_adapt_ns = now;
+    }
+    c->pressure = 0;
+}
+
+unsigned char *StreamEncodeFrame(const uint32_t *fb, int w, int h,
+                                 const struct StreamSettings *s,
+                                 int *out_w, int *out_h, size_t *out_len) {
+    int k = s->scale > 1 ? s->scale : 1;
+    int sw = w / k, sh = h / k;
+    if (sw < 1 || sh < 1) k = 1, sw = w, sh = h;
+    *out_w = sw;
+    *out_h = sh;
+    if (k == 1) return JpegEncode(fb, w, h, w, s->quality, out_len);
+
+    /* Box filter: average each k x k block into one pixel */
+    uint32_t *small = (uint32_t *)malloc((size_t)sw * sh * sizeof(uint32_t));
+    if (!small) return NULL;
+    for (int y = 0; y < sh; y++) {
+        for (int x = 0; x < sw; x++) {
+            unsigned r = 0, g = 0, b = 0;
+            for (int j = 0; j < k; j++) {
+                const uint32_t *row = fb + (size_t)(y * k + j) * w + x * k;
+                for (int i = 0; i < k; i++) {
+                    r += (row[i] >> 16) & 255;
+                    g += (row[i] >> 8) & 255;
+                    b += row[i] & 255;
+                }
+            }
+            unsigned n = k * k;
+            small[(size_t)y * sw + x] = (r / n) << 16 | (g / n) << 8 | b / n;
+        }
+    }
+    unsigned char *jpeg = JpegEncode(small, sw, sh, sw, s->quality, out_len);
+    free(small);
+    return jpeg;
+}
+
+int StreamClientJson(const struct StreamClient *c, char *buf, size_t len) {
+    return snprintf(buf, len,
+                    "{\"quality\":%d,\"fps\":%d,\"scale\":%d,"
+                    "\"rtt_ms\":%.1f,\"inflight_frames\":%d,"
+                    "\"inflight_bytes\":%llu,\"frames_sent\":%llu,"
+                    "\"frames_acked\":%llu,\"frames_skipped\":%llu,"
+                    "\"bytes_sent\":%llu}",
+                    c->cur.quality, c->cur.fps, c->cur.scale, c->rtt_ms,
+                    c->ninflight, (unsigned long long)c->inflight_bytes,
+                    (unsigned long long)c->frames_sent,
+                    (unsigned long long)c->frames_acked,
+                    (unsigned long long)c->frames_skipped,
+                    (unsigned long long)c->bytes_sent);
+}
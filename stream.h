@@ -0,0 +1,99 @@
+#ifndef STREAM_H_
+#define STREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Per-client framebuffer stream adaptation.
+
+   Each browser watching a graphical session gets its own JPEG quality,
+   frame rate and downscale factor. Frames are ack-clocked: the browser
+   acknowledges every frame it has drawn, so bytes sent but not yet
+   acknowledged approximate the queue sitting in front of that client.
+   A client whose queue or round-trip time grows is stepped down (quality,
+   then frame rate, then resolution) and stepped back up once it drains.
+   Frames a congested client cannot take are skipped for that client only,
+   so one slow browser never holds back the guest or the other viewers. */
+
+#define STREAM_MAX_INFLIGHT 2          /* unacknowledged frames per client */
+#define STREAM_MAX_INFLIGHT_BYTES (1 << 20)
+
+struct StreamLimits {
+    int quality_min, quality_max;      /* JPEG quality, 1-100 */
+    int fps_min, fps_max;              /* frames per second */
+    int scale_min, scale_max;          /* downscale divisor, 1-8 */
+};
+
+struct StreamSettings {
+    int quality;
+    int fps;
+    int scale;
+};
+
+struct StreamInflight {
+    uint32_t seq;
+    uint32_t bytes;
+    int64_t sent_ns;
+};
+
+struct StreamClient {
+    struct StreamSettings cur;
+    struct StreamInflight inflight[STREAM_MAX_INFLIGHT];
+    int ninflight;
+    uint64_t inflight_bytes;
+    double rtt_ms;                     /* smoothed round-trip time */
+    double rtt_min_ms;                 /* baseline round-trip time */
+    int64_t rtt_min_ns;                /* when the baseline was last reset */
+    int64_t last_send_ns;
+    int64_t last_adapt_ns;
+    int64_t last_pressure_ns;
+    int pressure;                      /* congestion seen since last adapt */
+    uint32_t last_frame;               /* newest guest frame delivered */
+    uint32_t skip_frame;               /* frame last counted as skipped */
+    uint64_t frames_sent, frames_acked, frames_skipped, bytes_sent;
+};
+
+/* Configure the floors and ceilings every client adapts within.
+   Out-of-range values are clamped. */
+void StreamSetLimits(const struct StreamLimits *limits);
+void StreamGetLimits(struct StreamLimits *limits);
+
+/* Parse "MIN-MAX" or "N" into lo/hi. Returns 0 on success, -1 on error. */
+int StreamParseRange(const char *s, int *lo, int *hi);
+
+int64_t StreamNowNs(void);
+
+/* Start a client at the best settings the limits allow. */
+void StreamClientInit(struct StreamClient *c, int64_t now);
+
+/* Returns 0 if a frame may be sent to the client now, the number of
+   nanoseconds until one may be sent at its current frame rate, or -1
+   if its acknowledgement window is full. */
+int64_t StreamClientDue(struct StreamClient *c, int64_t now);
+
+/* Record a frame sent to the client. write_ns is how long the socket
+   write blocked, which grows once the kernel send buffer backs up. */
+void StreamClientSent(struct StreamClient *c, uint32_t seq, size_t bytes,
+                      int64_t now, int64_t write_ns);
+
+/* Record that a new frame could not be sent because the window was full. */
+void StreamClientSkipped(struct StreamClient *c, uint32_t frame);
+
+/* Record an acknowledgement from the browser (cumulative up to seq). */
+void StreamClientAck(struct StreamClient *c, uint32_t seq, int64_t now);
+
+/* Step the client's settings up or down based on recent feedback. */
+void StreamClientAdapt(struct StreamClient *c, int64_t now);
+
+/* Downscale a w x h framebuffer by s->scale and encode it at s->quality.
+   Stores the encoded dimensions in out_w/out_h. Returns a malloc'd JPEG,
+   or NULL if out of memory. Caller must free() the result. */
+unsigned char *StreamEncodeFrame(const uint32_t *fb, int w, int h,
+                                 const struct StreamSettings *s,
+                                 int *out_w, int *out_h, size_t *out_len);
+
+/* Write the client's settings and counters as a JSON object.
+   Returns the length, like snprintf. */
+int StreamClientJson(const struct StreamClient *c, char *buf, size_t len);
+
+#endif /* STREAM_H_ */
@@ -0,0 +1,150 @@
+#include "timepage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static int s_fd = -1;
+static struct TimePage *s_page;
+static int64_t s_start;            /* monotonic time of tick 0 */
+static atomic_int s_adopt;         /* forked; no waiter started yet */
+
+static int64_t Now(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Take the page's write lock. It's a process lock on the memfd, which
+   fork doesn't pass on and exit drops, so it names the one updater. */
+static int LockPage(int cmd) {
+    struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_len = 1 };
+    int rc;
+    while ((rc = fcntl(s_fd, cmd, &fl)) && errno == EINTR) {}
+    return rc;
+}
+
+/* Only the lock holder writes, so the seqlock needs no CAS. An updater
+   killed mid-write leaves seq odd; the next one carries on from it. */
+static void Update(struct TimePage *p) {
+    unsigned seq = atomic_load_explicit(&p->seq, memory_order_relaxed) | 1;
+    int64_t mono = Now(CLOCK_MONOTONIC);
+    atomic_store_explicit(&p->seq, seq, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    p->monotonic_ns = mono;
+    p->realtime_ns = Now(CLOCK_REALTIME);
+    p->tick = (uint64_t)(mono - s_start) * TIMEPAGE_TICK_HZ / 1000000000;
+    atomic_store_explicit(&p->seq, seq + 1, memory_order_release);
+}
+
+static void *Updater(void *arg) {
+    struct timespec next;
+    /* a forked child waits, blocked, for the updater before it to exit */
+    if ((intptr_t)arg) {
+        if (LockPage(F_SETLKW) ||
+            mprotect(s_page, sizeof(struct TimePage), PROT_READ | PROT_WRITE))
+            return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (;;) {
+        Update(s_page);
+        /* absolute deadlines, so the period doesn't drift */
+        next.tv_nsec += TIMEPAGE_PERIOD_US * 1000;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    return NULL;
+}
+
+static int StartUpdater(int wait) {
+    pthread_t th;
+    pthread_attr_t attr;
+    int rc;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rc = pthread_create(&th, &attr, Updater, (void *)(intptr_t)wait);
+    pthread_attr_destroy(&attr);
+    return rc ? -1 : 0;
+}
+
+/* Threads don't survive fork, but the page does, and a forked guest may
+   outlive the process updating it. So a child only reads the page, and
+   once it shows it's running a guest (TimePageUse), keeps a thread
+   waiting on the lock to take over if it's left last. A child that just
+   execs never starts one. */
+static void AfterFork(void) {
+    pthread_mutex_init(&s_lock, NULL);
+    if (s_page) {
+        mprotect(s_page, sizeof(struct TimePage), PROT_READ);
+        atomic_store_explicit(&s_adopt, 1, memory_order_relaxed);
+    }
+}
+
+/* Caller holds s_lock */
+static void Adopt(void) {
+    if (atomic_load_explicit(&s_adopt, memory_order_relaxed)) {
+        atomic_store_explicit(&s_adopt, 0, memory_order_relaxed);
+        StartUpdater(1);
+    }
+}
+
+void TimePageUse(void) {
+    if (!atomic_load_explicit(&s_adopt, memory_order_relaxed)) return;
+    pthread_mutex_lock(&s_lock);
+    Adopt();
+    pthread_mutex_unlock(&s_lock);
+}
+
+int TimePageFd(void) {
+    static int registered;
+    int fd;
+    pthread_mutex_lock(&s_lock);
+    if (s_page) {
+        Adopt();
+        fd = s_fd;
+        goto done;
+    }
+    if ((fd = memfd_create("portator-time", MFD_CLOEXEC | MFD_ALLOW_SEALING)) <
+        0)
+        goto done;
+    s_fd = fd;
+    /* a page that can't shrink can't SIGBUS its readers */
+    if (ftruncate(fd, sysconf(_SC_PAGESIZE)) ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) ||
+        LockPage(F_SETLK) ||
+        (s_page = (struct TimePage *)mmap(NULL, sizeof(struct TimePage),
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        s_page = NULL;
+        close(fd);
+        s_fd = fd = -1;
+        goto done;
+    }
+    s_start = Now(CLOCK_MONOTONIC);
+    s_page->period_us = TIMEPAGE_PERIOD_US;
+    s_page->tick_hz = TIMEPAGE_TICK_HZ;
+    s_page->monotonic_ns = s_start;
+    s_page->realtime_ns = Now(CLOCK_REALTIME);
+    if (StartUpdater(0)) {
+        munmap(s_page, sizeof(struct TimePage));
+        s_page = NULL;
+        close(fd);
+        s_fd = fd = -1;
+        goto done;
+    }
+    if (!registered) {
+        pthread_atfork(NULL, NULL, AfterFork);
+        registered = 1;
+    }
+done:
+    pthread_mutex_unlock(&s_lock);
+    return fd;
+}
@@ -0,0 +1,36 @@
+#ifndef TIMEPAGE_H_
+#define TIMEPAGE_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* A page of clock readings kept current by a host thread, which guests
+   map read-only (PORTATOR_SYS_TIMEPAGE) so that reading the time is a
+   memory load instead of an emulated clock_gettime. */
+
+#define TIMEPAGE_PERIOD_US 1000    /* how often the page is rewritten */
+#define TIMEPAGE_TICK_HZ 60        /* frame ticks per second */
+
+/* Same layout as struct PortatorTimePage in include/portator.h */
+struct TimePage {
+    atomic_uint seq;               /* odd while being written */
+    uint32_t period_us;
+    int64_t monotonic_ns;          /* CLOCK_MONOTONIC */
+    int64_t realtime_ns;           /* CLOCK_REALTIME */
+    uint64_t tick;                 /* frame ticks since the page started */
+    uint32_t tick_hz;
+    uint32_t reserved;
+};
+
+/* Create the time page and start its updater thread, if not yet done.
+   Returns a descriptor of the page for mapping, or -1. Forked children
+   share the page read-only; one of them takes over updating it only
+   once the process updating it has exited. */
+int TimePageFd(void);
+
+/* Note that this process uses the page, so a forked child that inherited
+   it starts waiting to take over updating it. Cheap when there's nothing
+   to do. */
+void TimePageUse(void);
+
+#endif /* TIMEPAGE_H_ */
@@ -1,10 +1,101 @@
 #include "web_server.h"
 #include "civetweb/civetweb.h"
+#include "apps.h"
+#include "assets.h"
+#include "session.h"
+#include "zipstore.h"
+#include "cJSON.h"
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 256
+#define MIN_WS_THREADS 4           /* default floor: viewers plus an
+                                      index page's event stream */
+#define DEFAULT_LISTEN_BACKLOG 200
+#define DEFAULT_KEEP_ALIVE_MS 500
+#define DEFAULT_WS_DEFLATE 15
+#define DEFAULT_WS_MEM_LEVEL 8
+#define PROGRAMS_WATCH_MS 1000     /* how often the app list is rescanned */
+#define EVENTS_PING_MS 15000       /* keeps idle event streams checked */
 
 static struct mg_context *s_ctx;
+static struct WebServerOptions s_opts;  /* threads is 0 until set */
+static int s_reserved;                  /* ws_threads workers in use */
+static int s_streams;                   /* of which event streams */
+
+/* The app list /api/programs serves, kept current by a watcher thread
+   so requests never scan. version counts the changes seen, and delta
+   is the latest one's diff for event streams. boot tells this run's
+   ETags and event ids from an earlier run's. */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;           /* broadcast on a change, and on stop */
+    struct AppList list;
+    char *json;                    /* the full listing */
+    char *delta;
+    uint64_t version;
+    unsigned boot;
+    int running;
+    int stop;
+    pthread_t watcher;
+} s_programs = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                 .cond = PTHREAD_COND_INITIALIZER };
+
+static int Clamp(int v, int lo, int hi) {
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+static void DefaultOptions(void) {
+    long cores;
+    if (s_opts.threads) return;
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+    s_opts.threads = Clamp(cores > 0 ? (int)cores : 1, 1, MAX_THREADS);
+    s_opts.ws_threads = s_opts.threads > MIN_WS_THREADS ? s_opts.threads
+                                                        : MIN_WS_THREADS;
+    s_opts.listen_backlog = DEFAULT_LISTEN_BACKLOG;
+    s_opts.keep_alive_ms = DEFAULT_KEEP_ALIVE_MS;
+    s_opts.http2 = 1;
+    s_opts.ws_deflate = DEFAULT_WS_DEFLATE;
+    s_opts.ws_mem_level = DEFAULT_WS_MEM_LEVEL;
+}
+
+void WebServerSetOptions(const struct WebServerOptions *opts) {
+    struct WebServerOptions o = *opts;
+    o.threads = Clamp(o.threads, 1, MAX_THREADS);
+    o.ws_threads = Clamp(o.ws_threads, 0, MAX_THREADS);
+    o.listen_backlog = Clamp(o.listen_backlog, 1, 65535);
+    o.keep_alive_ms = Clamp(o.keep_alive_ms, 0, 3600000);
+    o.http2 = !!o.http2;
+    o.ws_deflate = o.ws_deflate ? Clamp(o.ws_deflate, 9, 15) : 0;
+    o.ws_mem_level = Clamp(o.ws_mem_level, 1, 9);
+    s_opts = o;
+}
+
+void WebServerGetOptions(struct WebServerOptions *opts) {
+    DefaultOptions();
+    *opts = s_opts;
+}
+
+/* Take one of the ws_threads workers kept for long-lived connections
+   (app viewers and event streams). Returns 0 if they're all in use. */
+static int ReserveWorker(void) {
+    if (__atomic_add_fetch(&s_reserved, 1, __ATOMIC_RELAXED) <=
+        s_opts.ws_threads)
+        return 1;
+    __atomic_sub_fetch(&s_reserved, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void ReleaseWorker(void) {
+    __atomic_sub_fetch(&s_reserved, 1, __ATOMIC_RELAXED);
+}
 
 /* Debug: log all requests */
 static int log_message(const struct mg_connection *conn, const char *message) {
@@ -17,14 +108,520 @@ static int log_access(const struct mg_connection *conn, const char *message) {
     return 0;  /* 0 = let civetweb log it too */
 }
 
+/* Whether an Accept-Encoding value allows gzip: "gzip" or "*" listed
+   without q=0 */
+static int AcceptsGzip(const char *ae) {
+    while (ae && *ae) {
+        const char *end = strchr(ae, ','), *semi, *q;
+        size_t n;
+        while (*ae == ' ' || *ae == '\t') ae++;
+        if (!end) end = ae + strlen(ae);
+        semi = memchr(ae, ';', end - ae);
+        n = (semi ? semi : end) - ae;
+        while (n && ae[n - 1] == ' ') n--;
+        if ((n == 4 && !strncasecmp(ae, "gzip", 4)) ||
+            (n == 1 && *ae == '*')) {
+            q = semi ? strstr(semi, "q=") : NULL;
+            return !(q && q < end && strtod(q + 2, NULL) <= 0);
+        }
+        ae = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+/* A Range header's single byte range within size bytes, as [*lo, *hi].
+   Returns 1 for a range, 0 to send the whole file (no header, or one this
+   doesn't take, such as several ranges), or -1 if it can't be met. */
+static int ParseRange(const char *h, uint64_t size, uint64_t *lo,
+                      uint64_t *hi) {
+    char *end;
+    if (!h || strncmp(h, "bytes=", 6) || strchr(h, ',')) return 0;
+    h += 6;
+    if (*h == '-') {                   /* the last n bytes */
+        uint64_t n = strtoull(h + 1, &end, 10);
+        if (end == h + 1 || *end) return 0;
+        if (!n || !size) return -1;
+        *lo = n < size ? size - n : 0;
+        *hi = size - 1;
+        return 1;
+    }
+    *lo = strtoull(h, &end, 10);
+    if (end == h || *end != '-') return 0;
+    h = end + 1;
+    *hi = *h ? strtoull(h, &end, 10) : size - 1;
+    if (*h && (*end || *hi < *lo)) return 0;
+    if (*lo >= size) return -1;
+    if (*hi >= size) *hi = size - 1;
+    return 1;
+}
+
+/* Send a response head built as HTTP/1.1 text. Over HTTP/2 CivetWeb
+   encodes the headers itself, so they go through its response header
+   calls instead, without the status line. */
+static void SendHead(struct mg_connection *conn, int status, const char *head,
+                     size_t len) {
+    if (strcmp(mg_get_request_info(conn)->http_version, "2")) {
+        mg_write(conn, head, len);
+        return;
+    }
+    mg_response_header_start(conn, status);
+    mg_response_header_add_lines(conn, strchr(head, '\n') + 1);
+    mg_response_header_send(conn);
+}
+
+/* Serve a wwwroot file the cache left out from the zip store's
+   descriptor: for a stored entry that's the executable itself, so the
+   bytes go to the socket by sendfile without passing through here. */
+static int serve_zip_entry(struct mg_connection *conn,
+                           const struct mg_request_info *ri,
+                           const struct ZipEntry *e, int head) {
+    char etag[40], buf[512];
+    const char *inm, *ir;
+    uint64_t lo = 0, hi = e->size - 1;
+    int64_t off;
+    int fd, n, range;
+    if ((fd = ZipStoreContents(e, &off)) == -1) return 0;
+    snprintf(etag, sizeof(etag), "\"%08x-%llx\"", e->crc,
+             (unsigned long long)e->size);
+    if (!strcmp(ri->http_version, "1.0")) mg_disable_connection_keep_alive(conn);
+    if ((inm = mg_get_header(conn, "If-None-Match")) &&
+        (strstr(inm, etag) || !strcmp(inm, "*"))) {
+        n = snprintf(buf, sizeof(buf),
+                     "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n"
+                     "Cache-Control: %s\r\n\r\n",
+                     etag, AssetCacheControl(ri->local_uri));
+        SendHead(conn, 304, buf, n);
+        return 304;
+    }
+    range = ParseRange(mg_get_header(conn, "Range"), e->size, &lo, &hi);
+    /* a range is for the version the client has */
+    if (range && (ir = mg_get_header(conn, "If-Range")) && strcmp(ir, etag)) {
+        range = 0;
+        lo = 0;
+        hi = e->size - 1;
+    }
+    if (range < 0) {
+        n = snprintf(buf, sizeof(buf),
+                     "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                     "Content-Range: bytes */%llu\r\n"
+                     "Content-Length: 0\r\n\r\n",
+                     (unsigned long long)e->size);
+        SendHead(conn, 416, buf, n);
+        return 416;
+    }
+    n = snprintf(buf, sizeof(buf),
+                 "HTTP/1.1 %s\r\nContent-Type: %s\r\n"
+                 "Content-Length: %llu\r\n",
+                 range ? "206 Partial Content" : "200 OK",
+                 mg_get_builtin_mime_type(ri->local_uri),
+                 e->size ? (unsigned long long)(hi - lo + 1) : 0ull);
+    if (range)
+        n += snprintf(buf + n, sizeof(buf) - n,
+                      "Content-Range: bytes %llu-%llu/%llu\r\n",
+                      (unsigned long long)lo, (unsigned long long)hi,
+                      (unsigned long long)e->size);
+    n += snprintf(buf + n, sizeof(buf) - n,
+                  "Accept-Ranges: bytes\r\nETag: %s\r\n"
+                  "Cache-Control: %s\r\n\r\n",
+                  etag, AssetCacheControl(ri->local_uri));
+    SendHead(conn, range ? 206 : 200, buf, n);
+    if (!head && e->size) mg_send_fd(conn, fd, off + lo, hi - lo + 1);
+    return range ? 206 : 200;
+}
+
+/* Serve GET and HEAD for files under wwwroot from the asset cache, with
+   the headers built at load time: the gzip form to clients that take
+   it, else the plain one. Files too big to cache come straight from the
+   zip store. Anything else (the API, WebSockets) is left to CivetWeb. */
+static int begin_request(struct mg_connection *conn) {
+    const struct mg_request_info *ri = mg_get_request_info(conn);
+    const struct ZipEntry *e;
+    const struct Asset *a;
+    const struct AssetBody *b;
+    const char *inm;
+    int head = !strcmp(ri->request_method, "HEAD");
+    if (!head && strcmp(ri->request_method, "GET")) return 0;
+    if (!(a = AssetFind(ri->local_uri)))
+        return (e = AssetZipEntry(ri->local_uri))
+                   ? serve_zip_entry(conn, ri, e, head)
+                   : 0;
+    b = a->gzip.data && AcceptsGzip(mg_get_header(conn, "Accept-Encoding"))
+            ? &a->gzip
+            : &a->plain;
+    /* the headers don't say keep-alive, which a 1.0 client needs told */
+    if (!strcmp(ri->http_version, "1.0")) mg_disable_connection_keep_alive(conn);
+    if ((inm = mg_get_header(conn, "If-None-Match")) &&
+        (strstr(inm, b->etag) || !strcmp(inm, "*"))) {
+        SendHead(conn, 304, b->head304, b->head304_len);
+        return 304;
+    }
+    SendHead(conn, 200, b->head, b->head_len);
+    if (!head) mg_write(conn, b->data, b->size);
+    return 200;
+}
+
+/* Per-connection state for /ws/app. The session is held from the
+   connect handler until the handshake completes and a client attaches. */
+struct AppConn {
+    struct Session *session;
+    struct SessionClient *client;
+};
+
+/* GET /ws/app?name=<app> launches a new session;
+   GET /ws/app?session=<id> joins an existing one as another viewer. */
+static int app_ws_connect(const struct mg_connection *conn, void *cbdata) {
+    const struct mg_request_info *ri = mg_get_request_info(conn);
+    const char *qs = ri->query_string ? ri->query_string : "";
+    size_t qlen = strlen(qs);
+    char name[64], id[16];
+    struct Session *s = NULL;
+
+    /* the viewer keeps this worker until it disconnects */
+    if (!ReserveWorker()) return 1;
+    if (mg_get_var(qs, qlen, "session", id, sizeof(id)) > 0) {
+        s = SessionFind(atoi(id));
+    } else if (mg_get_var(qs, qlen, "name", name, sizeof(name)) > 0) {
+        s = SessionStart(name);
+    }
+    if (!s) {  /* reject the handshake */
+        ReleaseWorker();
+        return 1;
+    }
+
+    struct AppConn *ac = (struct AppConn *)calloc(1, sizeof(*ac));
+    if (!ac) {
+        SessionStopIfIdle(s);
+        SessionRelease(s);
+        ReleaseWorker();
+        return 1;
+    }
+    ac->session = s;
+    mg_set_user_connection_data(conn, ac);
+    return 0;
+}
+
+static void app_ws_ready(struct mg_connection *conn, void *cbdata) {
+    struct AppConn *ac = (struct AppConn *)mg_get_user_connection_data(conn);
+    if (!ac) return;
+    ac->client = SessionAttach(ac->session, conn);
+    if (!ac->client) SessionStopIfIdle(ac->session);
+    SessionRelease(ac->session);
+    ac->session = NULL;
+}
+
+static int app_ws_data(struct mg_connection *conn, int bits, char *data,
+                       size_t len, void *cbdata) {
+    struct AppConn *ac = (struct AppConn *)mg_get_user_connection_data(conn);
+    int opcode = bits & 0x0f;
+    if (opcode == MG_WEBSOCKET_OPCODE_CONNECTION_CLOSE) return 0;
+    if (!ac || !ac->client) return 1;
+    /* binary frames carry the viewer protocol, text frames the guest's */
+    if (opcode == MG_WEBSOCKET_OPCODE_BINARY)
+        SessionClientMessage(ac->client, data, len);
+    else if (opcode == MG_WEBSOCKET_OPCODE_TEXT)
+        SessionClientText(ac->client, data, len);
+    return 1;
+}
+
+static void app_ws_close(const struct mg_connection *conn, void *cbdata) {
+    struct AppConn *ac = (struct AppConn *)mg_get_user_connection_data(conn);
+    if (!ac) return;
+    ReleaseWorker();
+    if (ac->client) SessionDetach(ac->client);
+    if (ac->session) {
+        SessionStopIfIdle(ac->session);
+        SessionRelease(ac->session);
+    }
+    mg_set_user_connection_data(conn, NULL);
+    free(ac);
+}
+
+/* GET /api/sessions -- running sessions and per-client stream settings */
+static int api_sessions(struct mg_connection *conn, void *cbdata) {
+    char *json = SessionListJson();
+    if (!json) {
+        mg_send_http_error(conn, 500, "%s", "out of memory");
+        return 500;
+    }
+    size_t len = strlen(json);
+    mg_send_http_ok(conn, "application/json", len);
+    mg_write(conn, json, len);
+    free(json);
+    return 200;
+}
+
+static int StatInt(const cJSON *root, const char *group, const char *name) {
+    const cJSON *v = cJSON_GetObjectItem(cJSON_GetObjectItem(root, group), name);
+    return cJSON_IsNumber(v) ? v->valueint : 0;
+}
+
+/* GET /api/server -- the worker pool's size and load, for tuning
+   --threads and --ws-threads. busy counts connections holding a worker
+   (viewers, event streams and idle keep-alive connections included);
+   queued is how many accepted connections are waiting for one. */
+static int api_server(struct mg_connection *conn, void *cbdata) {
+    struct mg_context *ctx = mg_get_context(conn);
+    int workers = s_opts.threads + s_opts.ws_threads;
+    int len = mg_get_context_info(ctx, NULL, 0) + 256;
+    char *info = (char *)malloc(len), json[512];
+    cJSON *root = NULL;
+    if (info && mg_get_context_info(ctx, info, len) > 0)
+        root = cJSON_Parse(info);
+    free(info);
+    int busy = StatInt(root, "connections", "active");
+    snprintf(json, sizeof(json),
+             "{\"threads\":%d,\"wsThreads\":%d,\"wsActive\":%d,\"streams\":%d,"
+             "\"listenBacklog\":%d,\"keepAliveMs\":%d,\"busy\":%d,"
+             "\"utilization\":%.3f,\"queued\":%d,\"queueSize\":%d,"
+             "\"queueMaxFilled\":%d,\"requests\":%d,\"wsDeflate\":%d,"
+             "\"wsMemLevel\":%d}",
+             s_opts.threads, s_opts.ws_threads,
+             __atomic_load_n(&s_reserved, __ATOMIC_RELAXED) -
+                 __atomic_load_n(&s_streams, __ATOMIC_RELAXED),
+             __atomic_load_n(&s_streams, __ATOMIC_RELAXED),
+             s_opts.listen_backlog, s_opts.keep_alive_ms, busy,
+             (double)busy / workers, StatInt(root, "queue", "filled"),
+             StatInt(root, "queue", "length"),
+             StatInt(root, "queue", "maxFilled"),
+             StatInt(root, "requests", "total"), s_opts.ws_deflate,
+             s_opts.ws_mem_level);
+    cJSON_Delete(root);
+    size_t n = strlen(json);
+    mg_send_http_ok(conn, "application/json", n);
+    mg_write(conn, json, n);
+    return 200;
+}
+
+/* The time ms from now, for pthread_cond_timedwait */
+static struct timespec Deadline(int ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += ms % 1000 * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
+/* Rescan every PROGRAMS_WATCH_MS, and publish the list if it changed.
+   Only this thread replaces the list, so it reads it without the lock. */
+static void *WatchPrograms(void *arg) {
+    struct AppList next;
+    char *delta, *json;
+    pthread_mutex_lock(&s_programs.lock);
+    while (!s_programs.stop) {
+        struct timespec ts = Deadline(PROGRAMS_WATCH_MS);
+        pthread_cond_timedwait(&s_programs.cond, &s_programs.lock, &ts);
+        if (s_programs.stop) break;
+        pthread_mutex_unlock(&s_programs.lock);
+        delta = json = NULL;
+        if (!AppRescan(&next, &s_programs.list)) {
+            if ((delta = AppListDiffJson(&s_programs.list, &next)) &&
+                !(json = AppListJson(&next, NULL))) {
+                free(delta);
+                delta = NULL;
+            }
+            if (!delta) AppListFree(&next);
+        }
+        pthread_mutex_lock(&s_programs.lock);
+        if (delta) {
+            AppListFree(&s_programs.list);
+            free(s_programs.json);
+            free(s_programs.delta);
+            s_programs.list = next;
+            s_programs.json = json;
+            s_programs.delta = delta;
+            s_programs.version++;
+            pthread_cond_broadcast(&s_programs.cond);
+        }
+    }
+    pthread_mutex_unlock(&s_programs.lock);
+    return NULL;
+}
+
+static int StartPrograms(void) {
+    if (AppScan(&s_programs.list)) return -1;
+    if (!(s_programs.json = AppListJson(&s_programs.list, NULL))) {
+        AppListFree(&s_programs.list);
+        return -1;
+    }
+    s_programs.version = 1;
+    s_programs.boot = (unsigned)time(NULL) ^ ((unsigned)getpid() << 16);
+    s_programs.stop = 0;
+    if (pthread_create(&s_programs.watcher, NULL, WatchPrograms, NULL)) {
+        AppListFree(&s_programs.list);
+        free(s_programs.json);
+        s_programs.json = NULL;
+        return -1;
+    }
+    s_programs.running = 1;
+    return 0;
+}
+
+/* Wake the event streams so they end; the watcher is joined after the
+   workers have stopped */
+static void StopPrograms(void) {
+    pthread_mutex_lock(&s_programs.lock);
+    s_programs.stop = 1;
+    pthread_cond_broadcast(&s_programs.cond);
+    pthread_mutex_unlock(&s_programs.lock);
+}
+
+static void FreePrograms(void) {
+    if (!s_programs.running) return;
+    pthread_join(s_programs.watcher, NULL);
+    AppListFree(&s_programs.list);
+    free(s_programs.json);
+    free(s_programs.delta);
+    s_programs.json = s_programs.delta = NULL;
+    s_programs.running = 0;
+}
+
+static unsigned HashString(const char *s) {
+    unsigned h = 2166136261u;
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+/* GET /api/programs[?prefix=&type=console|gfx|web&offset=&limit=]
+   Served from the watcher's list. The ETag is the list's version and
+   the query, so a client revalidating an unchanged list gets a 304
+   without any listing being built. */
+static int api_programs(struct mg_connection *conn, void *cbdata) {
+    const struct mg_request_info *ri = mg_get_request_info(conn);
+    const char *qs = ri->query_string ? ri->query_string : "";
+    const char *inm = mg_get_header(conn, "If-None-Match");
+    size_t qlen = strlen(qs);
+    char prefix[64], type[16], num[16], etag[48], clen[24];
+    struct AppQuery q = { NULL, -1, 0, 0 };
+    char *json = NULL;
+    if (mg_get_var(qs, qlen, "prefix", prefix, sizeof(prefix)) > 0)
+        q.prefix = prefix;
+    if (mg_get_var(qs, qlen, "type", type, sizeof(type)) > 0) {
+        for (q.type = APP_CONSOLE; q.type <= APP_WEB; q.type++) {
+            if (!strcmp(type, AppTypeName(q.type))) break;
+        }
+        if (q.type > APP_WEB) {
+            mg_send_http_error(conn, 400, "%s", "bad type");
+            return 400;
+        }
+    }
+    if (mg_get_var(qs, qlen, "offset", num, sizeof(num)) > 0)
+        q.offset = (uint32_t)strtoul(num, NULL, 10);
+    if (mg_get_var(qs, qlen, "limit", num, sizeof(num)) > 0)
+        q.limit = (uint32_t)strtoul(num, NULL, 10);
+    pthread_mutex_lock(&s_programs.lock);
+    snprintf(etag, sizeof(etag), "\"%x-%llx-%x\"", s_programs.boot,
+             (unsigned long long)s_programs.version, HashString(qs));
+    int fresh = inm && (strstr(inm, etag) || !strcmp(inm, "*"));
+    if (!fresh)
+        json = *qs ? AppListJson(&s_programs.list, &q)
+                   : strdup(s_programs.json);
+    pthread_mutex_unlock(&s_programs.lock);
+    if (!fresh && !json) {
+        mg_send_http_error(conn, 500, "%s", "out of memory");
+        return 500;
+    }
+    mg_response_header_start(conn, fresh ? 304 : 200);
+    mg_response_header_add(conn, "ETag", etag, -1);
+    mg_response_header_add(conn, "Cache-Control", "no-cache", -1);
+    if (fresh) {
+        mg_response_header_send(conn);
+        return 304;
+    }
+    size_t len = strlen(json);
+    snprintf(clen, sizeof(clen), "%zu", len);
+    mg_response_header_add(conn, "Content-Type", "application/json", -1);
+    mg_response_header_add(conn, "Content-Length", clen, -1);
+    mg_response_header_send(conn);
+    mg_write(conn, json, len);
+    free(json);
+    return 200;
+}
+
+/* GET /api/programs/events -- a Server-Sent Events stream: a "programs"
+   event with the whole list, then a "delta" event (see
+   AppListDiffJson) per change. A client that reconnects having missed
+   more than one change gets the whole list again. Streams hold one of
+   the workers kept for long-lived connections; when none is free the
+   answer is 503, and clients should poll /api/programs instead. */
+static int api_program_events(struct mg_connection *conn, void *cbdata) {
+    const char *last = mg_get_header(conn, "Last-Event-ID");
+    unsigned long long seen = 0;
+    unsigned boot = 0;
+    char head[64], *data;
+    int rc = 1;
+    if (!last || sscanf(last, "%x-%llu", &boot, &seen) != 2) seen = 0;
+    /* HTTP/2 answers a connection's streams one at a time: an endless
+       one would hold up the rest */
+    if (!strcmp(mg_get_request_info(conn)->http_version, "2")) {
+        mg_send_http_error(conn, 505, "%s", "use HTTP/1.1 for event streams");
+        return 505;
+    }
+    if (!ReserveWorker()) {
+        mg_send_http_error(conn, 503, "%s", "too many streams");
+        return 503;
+    }
+    __atomic_add_fetch(&s_streams, 1, __ATOMIC_RELAXED);
+    mg_response_header_start(conn, 200);
+    mg_response_header_add(conn, "Content-Type", "text/event-stream", -1);
+    mg_response_header_add(conn, "Cache-Control", "no-cache", -1);
+    mg_response_header_send(conn);
+    pthread_mutex_lock(&s_programs.lock);
+    if (boot != s_programs.boot) seen = 0;
+    while (rc > 0 && !s_programs.stop) {
+        if (seen == s_programs.version) {
+            struct timespec ts = Deadline(EVENTS_PING_MS);
+            if (pthread_cond_timedwait(&s_programs.cond, &s_programs.lock,
+                                       &ts) != ETIMEDOUT)
+                continue;
+            pthread_mutex_unlock(&s_programs.lock);
+            rc = mg_write(conn, ":\n\n", 3);
+            pthread_mutex_lock(&s_programs.lock);
+            continue;
+        }
+        int delta = seen && seen + 1 == s_programs.version;
+        seen = s_programs.version;
+        snprintf(head, sizeof(head), "id: %x-%llu\nevent: %s\ndata: ",
+                 s_programs.boot, seen, delta ? "delta" : "programs");
+        data = strdup(delta ? s_programs.delta : s_programs.json);
+        pthread_mutex_unlock(&s_programs.lock);
+        rc = data && mg_write(conn, head, strlen(head)) > 0 &&
+             mg_write(conn, data, strlen(data)) > 0 &&
+             mg_write(conn, "\n\n", 2) > 0;
+        free(data);
+        pthread_mutex_lock(&s_programs.lock);
+    }
+    pthread_mutex_unlock(&s_programs.lock);
+    __atomic_sub_fetch(&s_streams, 1, __ATOMIC_RELAXED);
+    ReleaseWorker();
+    return 200;
+}
+
 int WebServerStart(int port, const char *wwwroot) {
-    char portstr[16];
+    char portstr[16], threads[16], backlog[16], keep_alive[16];
+    char deflate[16], mem_level[16];
+    DefaultOptions();
     snprintf(portstr, sizeof(portstr), "%d", port);
+    snprintf(threads, sizeof(threads), "%d",
+             s_opts.threads + s_opts.ws_threads);
+    snprintf(backlog, sizeof(backlog), "%d", s_opts.listen_backlog);
+    snprintf(keep_alive, sizeof(keep_alive), "%d", s_opts.keep_alive_ms);
+    snprintf(deflate, sizeof(deflate), "%d", s_opts.ws_deflate);
+    snprintf(mem_level, sizeof(mem_level), "%d", s_opts.ws_mem_level);
 
     const char *options[] = {
         "listening_ports", portstr,
         "document_root", wwwroot ? wwwroot : "/zip/wwwroot",
-        "num_threads", "1",
+        "num_threads", threads,
+        "listen_backlog", backlog,
+        "enable_keep_alive", s_opts.keep_alive_ms ? "yes" : "no",
+        "keep_alive_timeout_ms", keep_alive,
+        "enable_http2", s_opts.http2 ? "yes" : "no",
+        "websocket_deflate_window_bits", deflate,
+        "websocket_deflate_mem_level", mem_level,
         NULL
     };
 
@@ -32,22 +629,49 @@ int WebServerStart(int port, const char *wwwroot) {
     memset(&callbacks, 0, sizeof(callbacks));
     callbacks.log_message = log_message;
     callbacks.log_access = log_access;
+    callbacks.begin_request = begin_request;
 
     fprintf(stderr, "portator: document_root = %s\n", wwwroot ? wwwroot : "/zip/wwwroot");
 
+    const char *root = wwwroot ? wwwroot : "/zip/wwwroot";
+    int assets = AssetsLoad(root);
+    if (assets < 0)
+        fprintf(stderr, "portator: cannot cache %s, serving from disk\n", root);
+    else
+        fprintf(stderr, "portator: cached %d files from %s\n", assets, root);
+    if (StartPrograms()) {
+        fprintf(stderr, "portator: cannot index apps\n");
+        return -1;
+    }
     s_ctx = mg_start(&callbacks, NULL, options);
     if (!s_ctx) {
+        StopPrograms();
+        FreePrograms();
+        AssetsFree();
         fprintf(stderr, "portator: cannot start web server on port %s\n", portstr);
         return -1;
     }
 
-    fprintf(stderr, "portator: web server listening on http://localhost:%d\n", port);
+    mg_set_websocket_handler(s_ctx, "/ws/app", app_ws_connect, app_ws_ready,
+                             app_ws_data, app_ws_close, NULL);
+    mg_set_request_handler(s_ctx, "/api/sessions", api_sessions, NULL);
+    mg_set_request_handler(s_ctx, "/api/programs", api_programs, NULL);
+    mg_set_request_handler(s_ctx, "/api/programs/events", api_program_events,
+                           NULL);
+    mg_set_request_handler(s_ctx, "/api/server", api_server, NULL);
+
+    fprintf(stderr, "portator: web server listening on http://localhost:%d "
+            "(%d workers + %d for viewers)\n", port, s_opts.threads,
+            s_opts.ws_threads);
     return 0;
 }
 
 void WebServerStop(void) {
     if (s_ctx) {
+        StopPrograms();
         mg_stop(s_ctx);
         s_ctx = NULL;
+        FreePrograms();
+        AssetsFree();
     }
 }
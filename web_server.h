@@ -1,6 +1,31 @@
 #ifndef WEB_SERVER_H_
 #define WEB_SERVER_H_
 
+/* CivetWeb gives every connection a worker thread for as long as it's
+   open, and a WebSocket viewer stays open for the whole session. So the
+   pool is threads workers for ordinary requests plus ws_threads more
+   kept for viewers: a viewer beyond ws_threads is turned away rather
+   than taking a worker that static files and the API need. */
+struct WebServerOptions {
+    int threads;                   /* default: one per core */
+    int ws_threads;                /* default: same as threads, at
+                                      least 4 */
+    int listen_backlog;
+    int keep_alive_ms;             /* 0 turns keep-alive off */
+    int http2;                     /* cleartext HTTP/2 (h2c) for clients
+                                      that ask; 0 turns it off */
+    int ws_deflate;                /* permessage-deflate window, 2^N bytes
+                                      (9-15); 0 turns compression off */
+    int ws_mem_level;              /* zlib memLevel (1-9). A viewer's
+                                      compressor takes 2^(ws_deflate+2) +
+                                      2^(ws_mem_level+9) bytes. */
+};
+
+/* Set the options the next WebServerStart uses. Out-of-range values are
+   clamped. */
+void WebServerSetOptions(const struct WebServerOptions *opts);
+void WebServerGetOptions(struct WebServerOptions *opts);
+
 /* Start the web server on the given port, serving files from wwwroot.
    Returns 0 on success, -1 on error. The server runs in a background thread. */
 int WebServerStart(int port, const char *wwwroot);
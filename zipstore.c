@@ -0,0 +1,498 @@
+#include "zipstore.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define EOCD_SIG      0x06054b50
+#define EOCD64_SIG    0x06064b50
+#define CENTRAL_SIG   0x02014b50
+#define LOCAL_SIG     0x04034b50
+#define EOCD_SIZE     22
+#define EOCD64_SIZE   56
+#define LOCATOR_SIZE  20
+#define CENTRAL_SIZE  46
+#define LOCAL_SIZE    30
+#define TAIL_MAX      (EOCD_SIZE + 65535)  /* EOCD plus the longest comment */
+#define CHUNK         65536
+#define EXTRACT_THREADS 8
+
+struct Cached {
+    const struct ZipEntry *e;
+    int fd;
+};
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static int s_tried;
+static int s_fd = -1;
+static struct ZipEntry *s_entries;
+static size_t s_count;
+static struct Cached *s_cache;
+static size_t s_ncache;
+
+static uint16_t Le16(const unsigned char *p) { return p[0] | p[1] << 8; }
+
+static uint32_t Le32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t Le64(const unsigned char *p) {
+    return Le32(p) | (uint64_t)Le32(p + 4) << 32;
+}
+
+static int ReadAt(int fd, void *buf, size_t n, int64_t off) {
+    size_t got = 0;
+    while (got < n) {
+        ssize_t r = pread(fd, (char *)buf + got, n - got, off + got);
+        if (r <= 0) return -1;
+        got += r;
+    }
+    return 0;
+}
+
+static int64_t DosTime(uint16_t time, uint16_t date) {
+    struct tm tm = { 0 };
+    tm.tm_sec = (time & 31) * 2;
+    tm.tm_min = time >> 5 & 63;
+    tm.tm_hour = time >> 11;
+    tm.tm_mday = date & 31;
+    tm.tm_mon = (date >> 5 & 15) - 1;
+    tm.tm_year = (date >> 9) + 80;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+/* Apply the zip64 (0x0001) and extended timestamp (0x5455) extra fields
+   of a central directory record */
+static void ParseExtra(struct ZipEntry *e, const unsigned char *p, size_t n,
+                       int big_size, int big_csize, int big_header) {
+    while (n >= 4) {
+        uint16_t id = Le16(p), len = Le16(p + 2);
+        const unsigned char *q = p + 4;
+        if (4 + (size_t)len > n) break;
+        if (id == 0x0001) {
+            size_t i = 0;
+            if (big_size && i + 8 <= len) e->size = Le64(q + i), i += 8;
+            if (big_csize && i + 8 <= len) e->csize = Le64(q + i), i += 8;
+            if (big_header && i + 8 <= len) e->header = Le64(q + i), i += 8;
+        } else if (id == 0x5455 && len >= 5 && (q[0] & 1)) {
+            e->mtime = (int32_t)Le32(q + 1);
+        }
+        p += 4 + len;
+        n -= 4 + len;
+    }
+}
+
+static int CompareEntries(const void *a, const void *b) {
+    return strcmp(((const struct ZipEntry *)a)->name,
+                  ((const struct ZipEntry *)b)->name);
+}
+
+static int Index(int fd) {
+    struct stat st;
+    unsigned char *tail, *cd, *p;
+    int64_t tail_off, eocd, cd_end, delta;
+    uint64_t cd_size, cd_off, count;
+    size_t tail_len, i, n;
+    if (fstat(fd, &st) || st.st_size < EOCD_SIZE) return -1;
+    tail_len = st.st_size < TAIL_MAX ? st.st_size : TAIL_MAX;
+    tail_off = st.st_size - tail_len;
+    if (!(tail = (unsigned char *)malloc(tail_len))) return -1;
+    if (ReadAt(fd, tail, tail_len, tail_off)) {
+        free(tail);
+        return -1;
+    }
+    for (eocd = tail_len - EOCD_SIZE; eocd >= 0; eocd--) {
+        if (Le32(tail + eocd) == EOCD_SIG) break;
+    }
+    if (eocd < 0) {
+        free(tail);
+        return -1;
+    }
+    p = tail + eocd;
+    count = Le16(p + 10);
+    cd_size = Le32(p + 12);
+    cd_off = Le32(p + 16);
+    cd_end = tail_off + eocd;
+    /* zip64: the 64-bit record sits just before its locator */
+    if (eocd >= LOCATOR_SIZE + EOCD64_SIZE &&
+        Le32(p - LOCATOR_SIZE) == 0x07064b50 &&
+        Le32(p - LOCATOR_SIZE - EOCD64_SIZE) == EOCD64_SIG) {
+        p -= LOCATOR_SIZE + EOCD64_SIZE;
+        count = Le64(p + 32);
+        cd_size = Le64(p + 40);
+        cd_off = Le64(p + 48);
+        cd_end = tail_off + (p - tail);
+    }
+    free(tail);
+    /* Offsets are relative to where the zip began; the executable in
+       front of it shifts everything by delta */
+    delta = cd_end - (int64_t)(cd_off + cd_size);
+    if (delta < 0 || cd_size > (uint64_t)st.st_size) return -1;
+    if (!(cd = (unsigned char *)malloc(cd_size ? cd_size : 1))) return -1;
+    if (ReadAt(fd, cd, cd_size, cd_off + delta) ||
+        !(s_entries = (struct ZipEntry *)calloc(count ? count : 1,
+                                                sizeof(*s_entries)))) {
+        free(cd);
+        return -1;
+    }
+    for (i = 0, p = cd; i < count; i++) {
+        struct ZipEntry *e = s_entries + s_count;
+        size_t name_len, extra_len, comment_len;
+        char *name;
+        if (p + CENTRAL_SIZE > cd + cd_size || Le32(p) != CENTRAL_SIG) break;
+        name_len = Le16(p + 28);
+        extra_len = Le16(p + 30);
+        comment_len = Le16(p + 32);
+        n = CENTRAL_SIZE + name_len + extra_len + comment_len;
+        if (p + n > cd + cd_size || !(name = (char *)malloc(name_len + 1)))
+            break;
+        memcpy(name, p + CENTRAL_SIZE, name_len);
+        name[name_len] = '\0';
+        e->name = name;
+        e->method = Le16(p + 10);
+        e->mtime = DosTime(Le16(p + 12), Le16(p + 14));
+        e->crc = Le32(p + 16);
+        e->csize = Le32(p + 20);
+        e->size = Le32(p + 24);
+        e->header = Le32(p + 42);
+        if (p[5] == 3) e->mode = Le32(p + 38) >> 16;  /* made on unix */
+        ParseExtra(e, p + CENTRAL_SIZE + name_len, extra_len,
+                   e->size == 0xffffffff, e->csize == 0xffffffff,
+                   e->header == 0xffffffff);
+        e->header += delta;
+        s_count++;
+        p += n;
+    }
+    free(cd);
+    qsort(s_entries, s_count, sizeof(*s_entries), CompareEntries);
+    return 0;
+}
+
+int ZipStoreOpen(const char *path) {
+    int rc;
+    pthread_mutex_lock(&s_lock);
+    if (!s_tried) {
+        s_tried = 1;
+        if ((s_fd = open(path, O_RDONLY | O_CLOEXEC)) != -1 && Index(s_fd)) {
+            close(s_fd);
+            s_fd = -1;
+        }
+    }
+    rc = s_fd == -1 ? -1 : 0;
+    pthread_mutex_unlock(&s_lock);
+    return rc;
+}
+
+const struct ZipEntry *ZipStoreEntries(size_t *count) {
+    *count = s_fd == -1 ? 0 : s_count;
+    return s_entries;
+}
+
+const struct ZipEntry *ZipStoreFind(const char *name) {
+    struct ZipEntry key;
+    if (s_fd == -1) return NULL;
+    key.name = name;
+    return (const struct ZipEntry *)bsearch(&key, s_entries, s_count,
+                                            sizeof(*s_entries),
+                                            CompareEntries);
+}
+
+int ZipStoreFd(void) {
+    return s_fd;
+}
+
+int64_t ZipStoreDataOffset(const struct ZipEntry *e) {
+    unsigned char h[LOCAL_SIZE];
+    if (ReadAt(s_fd, h, LOCAL_SIZE, e->header) || Le32(h) != LOCAL_SIG)
+        return -1;
+    return e->header + LOCAL_SIZE + Le16(h + 26) + Le16(h + 28);
+}
+
+/* An anonymous file to hold decompressed contents */
+static int MemFile(void) {
+    char path[] = "/tmp/portator-zip-XXXXXX";
+    int fd;
+#ifdef MFD_CLOEXEC
+    if ((fd = memfd_create("portator-zip", MFD_CLOEXEC)) != -1) return fd;
+#endif
+    if ((fd = mkstemp(path)) != -1) unlink(path);
+    return fd;
+}
+
+static int Inflate(const struct ZipEntry *e, int64_t off, int out) {
+    unsigned char *in = NULL, *buf = NULL;
+    uint64_t left = e->csize, made = 0;
+    uint32_t crc = crc32(0, NULL, 0);
+    z_stream z;
+    int rc = Z_OK;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, -15) != Z_OK) return -1;
+    if (!(in = (unsigned char *)malloc(CHUNK)) ||
+        !(buf = (unsigned char *)malloc(CHUNK)))
+        goto done;
+    while (rc != Z_STREAM_END) {
+        if (!z.avail_in && left) {
+            size_t n = left < CHUNK ? left : CHUNK;
+            if (ReadAt(s_fd, in, n, off)) break;
+            off += n;
+            left -= n;
+            z.next_in = in;
+            z.avail_in = n;
+        }
+        z.next_out = buf;
+        z.avail_out = CHUNK;
+        rc = inflate(&z, Z_NO_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END) break;
+        size_t n = CHUNK - z.avail_out;
+        if (!n && !z.avail_in && !left) break;   /* truncated */
+        crc = crc32(crc, buf, n);
+        if (write(out, buf, n) != (ssize_t)n) break;
+        made += n;
+    }
+done:
+    inflateEnd(&z);
+    free(in);
+    free(buf);
+    return rc == Z_STREAM_END && made == e->size && crc == e->crc ? 0 : -1;
+}
+
+int ZipStoreContents(const struct ZipEntry *e, int64_t *offset) {
+    struct Cached *tmp;
+    int64_t data;
+    int fd = -1;
+    if (s_fd == -1 || (data = ZipStoreDataOffset(e)) == -1) return -1;
+    if (e->method == ZIP_STORED) {
+        *offset = data;
+        return s_fd;
+    }
+    if (e->method != ZIP_DEFLATED) return -1;
+    pthread_mutex_lock(&s_lock);
+    for (size_t i = 0; i < s_ncache; i++) {
+        if (s_cache[i].e == e) {
+            fd = s_cache[i].fd;
+            goto done;
+        }
+    }
+    if ((fd = MemFile()) == -1) goto done;
+    if (Inflate(e, data, fd) ||
+        !(tmp = (struct Cached *)realloc(s_cache,
+                                         (s_ncache + 1) * sizeof(*tmp)))) {
+        close(fd);
+        fd = -1;
+        goto done;
+    }
+    s_cache = tmp;
+    s_cache[s_ncache].e = e;
+    s_cache[s_ncache].fd = fd;
+    s_ncache++;
+done:
+    pthread_mutex_unlock(&s_lock);
+    *offset = 0;
+    return fd;
+}
+
+/* Extraction: the files are divided among threads, each taking the next
+   one in turn. Directories are made first, in this thread. */
+struct Extract {
+    pthread_mutex_t lock;
+    const struct ZipEntry **files;
+    char *status;                  /* 'w', '=' or '!' per file, 0 to do */
+    size_t count, next, plen;
+    const char *dest;
+};
+
+/* mkdir -p */
+static int MakeDirs(char *path) {
+    for (char *p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        int rc = mkdir(path, 0755);
+        *p = '/';
+        if (rc && errno != EEXIST) return -1;
+    }
+    return mkdir(path, 0755) && errno != EEXIST ? -1 : 0;
+}
+
+/* Whether path already holds e's contents */
+static int Unchanged(const struct ZipEntry *e, const char *path) {
+    unsigned char *buf;
+    uint32_t crc = crc32(0, NULL, 0);
+    uint64_t left = e->size;
+    struct stat st;
+    int fd;
+    if (stat(path, &st) || !S_ISREG(st.st_mode) ||
+        (uint64_t)st.st_size != e->size)
+        return 0;
+    if ((fd = open(path, O_RDONLY)) == -1) return 0;
+    if ((buf = (unsigned char *)malloc(CHUNK))) {
+        while (left) {
+            ssize_t n = read(fd, buf, left < CHUNK ? left : CHUNK);
+            if (n <= 0) break;
+            crc = crc32(crc, buf, n);
+            left -= n;
+        }
+        free(buf);
+    }
+    close(fd);
+    return !left && crc == e->crc;
+}
+
+/* Whether name is relative and has no ".." part, so that it stays
+   inside the directory it's joined to */
+static int IsSafeName(const char *name) {
+    if (*name == '/') return 0;
+    for (const char *p = name;;) {
+        size_t n = strcspn(p, "/");
+        if (n == 2 && p[0] == '.' && p[1] == '.') return 0;
+        if (!p[n]) return 1;
+        p += n + 1;
+    }
+}
+
+/* Copy a stored entry in the kernel where it can, else through a buffer */
+static int CopyStored(int64_t off, uint64_t size, int out) {
+    unsigned char *buf;
+    while (size) {
+        ssize_t n = copy_file_range(s_fd, &off, out, NULL, size, 0);
+        if (n <= 0) break;
+        size -= n;
+    }
+    if (!size) return 0;
+    if (!(buf = (unsigned char *)malloc(CHUNK))) return -1;
+    while (size) {
+        size_t n = size < CHUNK ? size : CHUNK;
+        if (ReadAt(s_fd, buf, n, off) || write(out, buf, n) != (ssize_t)n)
+            break;
+        off += n;
+        size -= n;
+    }
+    free(buf);
+    return size ? -1 : 0;
+}
+
+static int ExtractFile(const struct ZipEntry *e, const char *path) {
+    mode_t mode = e->mode & 0777 ? e->mode & 0777 : 0644;
+    int64_t data;
+    int out, ok;
+    if (Unchanged(e, path)) return '=';
+    if ((data = ZipStoreDataOffset(e)) == -1) return '!';
+    if ((out = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode)) == -1)
+        return '!';
+    if (e->method == ZIP_STORED) ok = !CopyStored(data, e->size, out);
+    else if (e->method == ZIP_DEFLATED) ok = !Inflate(e, data, out);
+    else ok = 0;
+    if (ok && e->mtime) {
+        struct timespec ts[2] = { { e->mtime, 0 }, { e->mtime, 0 } };
+        futimens(out, ts);
+    }
+    if (close(out)) ok = 0;
+    return ok ? 'w' : '!';
+}
+
+static void *ExtractWorker(void *arg) {
+    struct Extract *x = (struct Extract *)arg;
+    char path[PATH_MAX];
+    for (;;) {
+        pthread_mutex_lock(&x->lock);
+        size_t i = x->next++;
+        pthread_mutex_unlock(&x->lock);
+        if (i >= x->count) break;
+        if (x->status[i]) continue;
+        if (snprintf(path, sizeof(path), "%s/%s", x->dest,
+                     x->files[i]->name + x->plen) >= (int)sizeof(path))
+            x->status[i] = '!';
+        else
+            x->status[i] = ExtractFile(x->files[i], path);
+    }
+    return NULL;
+}
+
+/* Make every directory the files under prefix need, dest included, and
+   gather those files into x. A file whose name would land outside dest,
+   or whose directory can't be made, is marked failed. Returns 0, or -1
+   if out of memory. */
+static int PrepareExtract(struct Extract *x, const char *prefix) {
+    char path[PATH_MAX], made[PATH_MAX] = "";
+    if (!(x->files = (const struct ZipEntry **)malloc(
+              (s_count + 1) * sizeof(*x->files))) ||
+        !(x->status = (char *)malloc(s_count + 1)))
+        return -1;
+    for (size_t i = 0; i < s_count; i++) {
+        const char *rest = s_entries[i].name;
+        char *slash;
+        int ok;
+        if (strncmp(rest, prefix, x->plen)) continue;
+        if (!*(rest += x->plen)) continue;
+        ok = IsSafeName(rest) &&
+             snprintf(path, sizeof(path), "%s/%s", x->dest, rest) <
+                 (int)sizeof(path);
+        slash = ok ? strrchr(path, '/') : NULL;
+        if (!ok || slash[1]) {
+            x->status[x->count] = ok ? 0 : '!';
+            x->files[x->count++] = s_entries + i;
+        }
+        if (!ok) continue;
+        *slash = '\0';
+        if (!strcmp(path, made)) continue;   /* the last file's directory */
+        if (MakeDirs(path)) continue;        /* its files fail to open */
+        strcpy(made, path);
+    }
+    return 0;
+}
+
+int ZipStoreExtract(const char *prefix, const char *dest, int threads,
+                    char **manifest, size_t *len) {
+    struct Extract x = { .lock = PTHREAD_MUTEX_INITIALIZER };
+    pthread_t th[EXTRACT_THREADS];
+    char dir[PATH_MAX];
+    size_t n = strlen(prefix), made = 0, size = 0;
+    int spawned = 0, written = 0, failed = 0;
+    if (manifest) *manifest = NULL;
+    if (len) *len = 0;
+    if (s_fd == -1 || n + 2 > sizeof(dir)) return -1;
+    memcpy(dir, prefix, n);
+    while (n && dir[n - 1] == '/') n--;
+    if (n) dir[n++] = '/';
+    dir[n] = '\0';
+    x.plen = n;
+    x.dest = dest;
+    if (PrepareExtract(&x, dir) || !x.count) {
+        free(x.status);
+        free(x.files);
+        return -1;
+    }
+    if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > EXTRACT_THREADS) threads = EXTRACT_THREADS;
+    if ((size_t)threads > x.count) threads = x.count;
+    while (spawned < threads - 1 &&
+           !pthread_create(th + spawned, NULL, ExtractWorker, &x))
+        spawned++;
+    ExtractWorker(&x);
+    while (spawned) pthread_join(th[--spawned], NULL);
+    for (size_t i = 0; i < x.count; i++) {
+        size += 34 + strlen(x.files[i]->name + x.plen);
+        written += x.status[i] == 'w';
+        failed |= x.status[i] == '!';
+    }
+    if (manifest && (*manifest = (char *)malloc(size + 1))) {
+        for (size_t i = 0; i < x.count; i++)
+            made += sprintf(*manifest + made, "%c %08x %llu %s\n", x.status[i],
+                            (unsigned)x.files[i]->crc,
+                            (unsigned long long)x.files[i]->size,
+                            x.files[i]->name + x.plen);
+        if (len) *len = made;
+    }
+    free(x.status);
+    free(x.files);
+    return failed ? -1 : written;
+}
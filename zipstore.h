@@ -0,0 +1,62 @@
+#ifndef ZIPSTORE_H_
+#define ZIPSTORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Direct access to the zip store appended to the portator executable,
+   the same files the guest sees under /zip, without going through
+   Blink's VFS: for mapping stored files straight from the executable
+   and keeping one decompressed copy of deflated ones. */
+
+#define ZIP_STORED   0
+#define ZIP_DEFLATED 8
+
+struct ZipEntry {
+    const char *name;              /* e.g. "apps/snake/bin/snake" */
+    uint64_t size;                 /* uncompressed */
+    uint64_t csize;                /* compressed */
+    uint64_t header;               /* offset of the local file header */
+    uint32_t crc;
+    uint16_t method;               /* ZIP_STORED or ZIP_DEFLATED */
+    uint16_t mode;                 /* unix mode bits, 0 if not recorded */
+    int64_t mtime;                 /* seconds since the epoch */
+};
+
+/* Index the zip at the end of path (the executable). Only the first
+   call does anything. Returns 0, or -1 if there is no readable zip. */
+int ZipStoreOpen(const char *path);
+
+/* All entries sorted by name, directories included (their names end
+   in '/'). Empty until ZipStoreOpen has succeeded. */
+const struct ZipEntry *ZipStoreEntries(size_t *count);
+
+/* The entry with this exact name, or NULL */
+const struct ZipEntry *ZipStoreFind(const char *name);
+
+/* A read-only descriptor of the executable, or -1 */
+int ZipStoreFd(void);
+
+/* Offset of an entry's data in the executable, or -1 */
+int64_t ZipStoreDataOffset(const struct ZipEntry *e);
+
+/* A descriptor to read or map the entry's uncompressed contents from,
+   starting at *offset: the executable itself for stored entries, and
+   for deflated ones a memory file shared by every caller, decompressed
+   on first use. Returns -1 if the entry can't be read or fails its
+   CRC. The descriptor stays open; don't close it. */
+int ZipStoreContents(const struct ZipEntry *e, int64_t *offset);
+
+/* Write the files under prefix ("" for all of them) into dest, making
+   directories as needed, on up to threads threads (0 for one per CPU).
+   A file already holding an entry's contents, by size and CRC, is left
+   alone. If manifest isn't NULL it gets a malloc'd line per file,
+   "<w|=|!> <crc32> <size> <path>\n" (written, unchanged or failed; path
+   relative to dest), and *len its length, whether or not files failed.
+   An entry named with a leading / or a ".." part is never written, only
+   listed as failed. Returns the number of files written, or -1 if
+   prefix names no files or any of them failed. */
+int ZipStoreExtract(const char *prefix, const char *dest, int threads,
+                    char **manifest, size_t *len);
+
+#endif /* ZIPSTORE_H_ */